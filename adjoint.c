@@ -0,0 +1,677 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// The adjoint computes the gradient of a calibration loss with
+// respect to any number of constants in one forward run and one
+// reverse sweep, where forward-mode (see sens.c) costs a lane per
+// constant.
+//
+// The forward run keeps a checkpoint of the row at the start of
+// every SEG steps, with SEG about the square root of the number of
+// steps, and records the derivative of the loss with respect to
+// each observed variable at every step.  The reverse sweep walks
+// the segments backwards: it recomputes a segment's rows from its
+// checkpoint, then walks those steps backwards, carrying the
+// adjoint (the derivative of the loss with respect to each slot)
+// back through the stock updates and then the flows, in reverse
+// runlist order, and finally through the initial values to the
+// constants.  Each equation is evaluated once more onto a tape of
+// its nodes' values, which backprop then reads instead of
+// re-evaluating operands.  Memory grows with the square root of the
+// run's length, and an evaluation costs about four runs: the
+// forward run, the recomputed segments, the taped evaluations and
+// the walks back down the tapes.
+
+// a node's value, and the end of its subtree's entries, which follow
+// it in the order they are evaluated
+typedef struct {
+	double v;
+	size_t end;
+} TapeEntry;
+
+struct SDAdjoint_s {
+	SDSim *sim; // computes initial values
+	char **names;
+	AVar **params;
+	size_t nparams;
+	// flattened runlists, as in component.c
+	Slice flows;
+	Slice stocks;
+	Slice initials;
+	// observations, copied
+	int *offsets;
+	SDObserved *observed;
+	size_t nobserved;
+	SDLoss loss;
+
+	size_t nvars;
+	size_t nsteps;
+	size_t seg; // steps per checkpoint
+	double *checkpoints; // [nsteps/seg][variable]
+	double *rows;        // a recomputed segment, [seg][variable]
+	double *dloss;       // [step][observed series]
+	double *adj;         // the adjoint of the row being walked
+	double *adj_next;    // and of the row after it
+	double *prev;        // each series' value at the last step
+	size_t *cursor;      // and its next observation
+	TapeEntry *tape;     // of the equation being walked
+	size_t tape_len;
+	double tape_time;    // and the time of its row
+	int refcount;
+};
+
+static int initials_flatten(Slice *out, Slice *l);
+static void adjoint_free(SDAdjoint *a);
+static void adjoint_flows(SDAdjoint *a, double *row);
+static void adjoint_stocks(SDAdjoint *a, double *next, const double *curr);
+static double adjoint_sample(SDAdjoint *a, size_t step, const double *row);
+static void adjoint_step(SDAdjoint *a, size_t step, const double *row);
+static void adjoint_calc(SDAdjoint *a, AVar *av, const double *row, double *adj);
+static double tape_visit(SDAdjoint *a, const double *data, Node *n);
+static void backprop(SDAdjoint *a, Node *n, size_t pos, double g, double *adj);
+static size_t node_count(Node *n);
+static size_t max_nodes(Slice *l);
+
+
+SDAdjoint *
+sd_adjoint_new(SDProject *p, const char *model_name, const char **params, size_t nparams, const SDObserved *observed, size_t nobserved, SDLoss loss)
+{
+	SDAdjoint *a;
+	AVar *module;
+	size_t ncheck, ntape;
+
+	if (!p || !params || !nparams || !observed || !nobserved ||
+	    loss < 0 || loss >= SD_LOSS_LEN)
+		return NULL;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	sd_adjoint_ref(a);
+	a->loss = loss;
+
+	a->sim = sd_sim_new(p, model_name);
+	if (!a->sim)
+		goto error;
+	// the reverse sweep follows explicit Euler at the model's dt
+	if (a->sim->method != SIM_EULER || a->sim->substep_levels)
+		goto error;
+	if (sd_sim_set_history(a->sim, 0))
+		goto error;
+	module = a->sim->module;
+	a->nvars = a->sim->nvars;
+	a->nsteps = a->sim->nsteps;
+
+	a->nparams = nparams;
+	a->names = calloc(nparams, sizeof(*a->names));
+	a->params = calloc(nparams, sizeof(*a->params));
+	if (!a->names || !a->params)
+		goto error;
+	for (size_t i = 0; i < nparams; i++) {
+		AVar *av = params[i] ? resolve(module, params[i]) : NULL;
+		while (av && av->src)
+			av = av->src;
+		if (!av || !av->is_const)
+			goto error;
+		a->params[i] = av;
+		a->names[i] = strdup(params[i]);
+		if (!a->names[i])
+			goto error;
+	}
+
+	a->offsets = calloc(nobserved, sizeof(*a->offsets));
+	a->observed = calloc(nobserved, sizeof(*a->observed));
+	if (!a->offsets || !a->observed)
+		goto error;
+	for (size_t i = 0; i < nobserved; i++) {
+		const SDObserved *obs = &observed[i];
+		SDObserved *copy = &a->observed[a->nobserved++];
+		double *times, *values, *weights = NULL;
+
+		a->offsets[i] = observed_offset(a->sim, obs, loss);
+		if (a->offsets[i] < 0)
+			goto error;
+		copy->times = times = calloc(obs->len, sizeof(double));
+		copy->values = values = calloc(obs->len, sizeof(double));
+		if (obs->weights)
+			copy->weights = weights = calloc(obs->len, sizeof(double));
+		if (!times || !values || (obs->weights && !weights))
+			goto error;
+		memcpy(times, obs->times, obs->len*sizeof(double));
+		memcpy(values, obs->values, obs->len*sizeof(double));
+		if (weights)
+			memcpy(weights, obs->weights, obs->len*sizeof(double));
+		copy->len = obs->len;
+	}
+
+	if (runlist_flatten(&a->flows, &module->flows, false) ||
+	    runlist_flatten(&a->stocks, &module->stocks, true) ||
+	    initials_flatten(&a->initials, &module->initials))
+		goto error;
+
+	a->seg = sqrt(a->nsteps);
+	if (a->seg*a->seg < a->nsteps)
+		a->seg++;
+	ncheck = (a->nsteps + a->seg - 1)/a->seg;
+	a->checkpoints = calloc(ncheck*a->nvars, sizeof(double));
+	a->rows = calloc(a->seg*a->nvars, sizeof(double));
+	a->dloss = calloc(a->nsteps*nobserved, sizeof(double));
+	a->adj = calloc(a->nvars, sizeof(double));
+	a->adj_next = calloc(a->nvars, sizeof(double));
+	a->prev = calloc(nobserved, sizeof(double));
+	a->cursor = calloc(nobserved, sizeof(size_t));
+	ntape = max_nodes(&a->flows);
+	if (max_nodes(&a->initials) > ntape)
+		ntape = max_nodes(&a->initials);
+	a->tape = calloc(ntape + 1, sizeof(*a->tape));
+	if (!a->checkpoints || !a->rows || !a->dloss || !a->adj ||
+	    !a->adj_next || !a->prev || !a->cursor || !a->tape)
+		goto error;
+
+	return a;
+error:
+	sd_adjoint_unref(a);
+	return NULL;
+}
+
+// initials_flatten is runlist_flatten for initials runlists.
+int
+initials_flatten(Slice *out, Slice *l)
+{
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		int err;
+		if (av->v->type == VAR_MODULE)
+			err = initials_flatten(out, &av->initials);
+		else if (av->node)
+			err = slice_append(out, av);
+		else
+			err = 0;
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+void
+sd_adjoint_ref(SDAdjoint *a)
+{
+	if (!a)
+		return;
+	__sync_fetch_and_add(&a->refcount, 1);
+}
+
+void
+sd_adjoint_unref(SDAdjoint *a)
+{
+	if (!a)
+		return;
+	if (__sync_sub_and_fetch(&a->refcount, 1) == 0)
+		adjoint_free(a);
+}
+
+void
+adjoint_free(SDAdjoint *a)
+{
+	sd_sim_unref(a->sim);
+	for (size_t i = 0; a->names && i < a->nparams; i++)
+		free(a->names[i]);
+	free(a->names);
+	free(a->params);
+	free(a->flows.elems);
+	free(a->stocks.elems);
+	free(a->initials.elems);
+	free(a->offsets);
+	for (size_t i = 0; i < a->nobserved; i++) {
+		free((double *)a->observed[i].times);
+		free((double *)a->observed[i].values);
+		free((double *)a->observed[i].weights);
+	}
+	free(a->observed);
+	free(a->checkpoints);
+	free(a->rows);
+	free(a->dloss);
+	free(a->adj);
+	free(a->adj_next);
+	free(a->prev);
+	free(a->cursor);
+	free(a->tape);
+	free(a);
+}
+
+int
+sd_adjoint_eval(SDAdjoint *a, const double *values, double *objective, double *gradient)
+{
+	size_t nvars, nsteps, seg;
+	double *curr, *next, *tmp, loss = 0;
+	int err = 0;
+
+	if (!a || !objective || !gradient)
+		return SD_ERR_UNSPECIFIED;
+	nvars = a->nvars;
+	nsteps = a->nsteps;
+	seg = a->seg;
+
+	for (size_t i = 0; values && i < a->nparams && !err; i++)
+		err = sd_sim_set_value(a->sim, a->names[i], values[i]);
+	if (err)
+		return err;
+	err = sd_sim_reset(a->sim);
+	if (err)
+		return err;
+
+	// forward, keeping checkpoints
+	memset(a->dloss, 0, nsteps*a->nobserved*sizeof(double));
+	memset(a->cursor, 0, a->nobserved*sizeof(size_t));
+	curr = a->adj;
+	next = a->adj_next;
+	memcpy(curr, a->sim->curr, nvars*sizeof(double));
+	for (size_t step = 0; step < nsteps; step++) {
+		if (step % seg == 0)
+			memcpy(&a->checkpoints[step/seg*nvars], curr, nvars*sizeof(double));
+		adjoint_flows(a, curr);
+		loss += adjoint_sample(a, step, curr);
+		if (step + 1 == nsteps)
+			break;
+		adjoint_stocks(a, next, curr);
+		next[TIME] = a->sim->spec.start + (step+1)*a->sim->spec.dt;
+		tmp = curr;
+		curr = next;
+		next = tmp;
+	}
+	*objective = loss;
+
+	// backward, a segment at a time
+	memset(a->adj_next, 0, nvars*sizeof(double));
+	memset(gradient, 0, a->nparams*sizeof(double));
+	for (size_t c = (nsteps - 1)/seg + 1; c-- > 0;) {
+		size_t first = c*seg, last = first + seg < nsteps ? first + seg : nsteps;
+
+		memcpy(a->rows, &a->checkpoints[c*nvars], nvars*sizeof(double));
+		for (size_t step = first; step < last; step++) {
+			double *row = &a->rows[(step - first)*nvars];
+			adjoint_flows(a, row);
+			if (step + 1 < last) {
+				adjoint_stocks(a, row + nvars, row);
+				row[nvars + TIME] = a->sim->spec.start + (step+1)*a->sim->spec.dt;
+			}
+		}
+		for (size_t step = last; step-- > first;)
+			adjoint_step(a, step, &a->rows[(step - first)*nvars]);
+	}
+
+	// through the initial values, to the constants
+	for (size_t i = a->initials.len; i-- > 0;) {
+		AVar *av = a->initials.elems[i];
+		double g = a->adj_next[av->offset];
+		if (av->is_const) {
+			for (size_t j = 0; j < a->nparams; j++) {
+				if (a->params[j] == av)
+					gradient[j] += g;
+			}
+			continue;
+		}
+		adjoint_calc(a, av, a->sim->curr, a->adj_next);
+	}
+
+	return isfinite(loss) ? 0 : SD_ERR_DIVERGED;
+}
+
+// adjoint_flows and adjoint_stocks mirror component_run.
+void
+adjoint_flows(SDAdjoint *a, double *row)
+{
+	for (size_t i = 0; i < a->flows.len; i++) {
+		AVar *av = a->flows.elems[i];
+		double v = svisit(a->sim, row, av->node, a->sim->spec.dt, row[TIME]);
+		if (av->v->gf)
+			v = lookup(av->v->gf, v);
+		row[av->offset] = v;
+	}
+}
+
+void
+adjoint_stocks(SDAdjoint *a, double *next, const double *curr)
+{
+	for (size_t i = 0; i < a->stocks.len; i++) {
+		AVar *av = a->stocks.elems[i];
+		if (av->v->type == VAR_STOCK)
+			next[av->offset] = curr[av->offset] + stock_net_flow(av, curr)*a->sim->spec.dt;
+		else
+			next[av->offset] = curr[av->offset];
+	}
+}
+
+// adjoint_sample returns the loss of the observations up to the
+// time of row, as calib_sample does, and records its derivative
+// with respect to each observed variable at this step and the last.
+double
+adjoint_sample(SDAdjoint *a, size_t step, const double *row)
+{
+	double t = row[TIME], dt = a->sim->spec.dt, eps = 1e-9*dt;
+	double prev_t = t - dt, loss = 0;
+
+	for (size_t j = 0; j < a->nobserved; j++) {
+		const SDObserved *obs = &a->observed[j];
+		double v = row[a->offsets[j]];
+		size_t k;
+
+		for (k = a->cursor[j]; k < obs->len && obs->times[k] <= t + eps; k++) {
+			double sim = v, alpha = 1, w = 1, term, dterm;
+			if (step) {
+				alpha = (obs->times[k] - prev_t)/dt;
+				sim = a->prev[j] + (v - a->prev[j])*alpha;
+			}
+			if (obs->weights && a->loss != SD_LOSS_SSE)
+				w = obs->weights[k];
+			if (a->loss == SD_LOSS_LOG) {
+				term = sim > 0 ? log(sim) - log(obs->values[k]) : INFINITY;
+				dterm = sim > 0 ? 2*w*term/sim : 0;
+			} else {
+				term = sim - obs->values[k];
+				dterm = 2*w*term;
+			}
+			loss += w*term*term;
+			a->dloss[step*a->nobserved + j] += dterm*alpha;
+			if (step)
+				a->dloss[(step-1)*a->nobserved + j] += dterm*(1 - alpha);
+		}
+		a->cursor[j] = k;
+		a->prev[j] = v;
+	}
+	return loss;
+}
+
+// adjoint_step takes adj_next, the adjoint of the step after row
+// (its stocks and constants), back to the start of row's step.
+void
+adjoint_step(SDAdjoint *a, size_t step, const double *row)
+{
+	double *adj = a->adj, *next = a->adj_next, dt = a->sim->spec.dt;
+
+	memset(adj, 0, a->nvars*sizeof(double));
+	if (step + 1 < a->nsteps) {
+		for (size_t i = 0; i < a->stocks.len; i++) {
+			AVar *av = a->stocks.elems[i];
+			double g = next[av->offset];
+			adj[av->offset] += g;
+			if (av->v->type != VAR_STOCK || g == 0)
+				continue;
+			for (size_t k = 0; k < av->inflows.len; k++) {
+				AVar *in = av->inflows.elems[k];
+				adj[in->offset] += g*dt;
+			}
+			for (size_t k = 0; k < av->outflows.len; k++) {
+				AVar *out = av->outflows.elems[k];
+				adj[out->offset] -= g*dt;
+			}
+		}
+	}
+	for (size_t j = 0; j < a->nobserved; j++)
+		adj[a->offsets[j]] += a->dloss[step*a->nobserved + j];
+
+	for (size_t i = a->flows.len; i-- > 0;)
+		adjoint_calc(a, a->flows.elems[i], row, adj);
+
+	a->adj = next;
+	a->adj_next = adj;
+}
+
+// adjoint_calc moves av's adjoint onto the variables its equation
+// reads: the value it had before being calculated didn't matter.
+void
+adjoint_calc(SDAdjoint *a, AVar *av, const double *row, double *adj)
+{
+	double g = adj[av->offset], v;
+
+	adj[av->offset] = 0;
+	if (g == 0)
+		return;
+	a->tape_len = 0;
+	a->tape_time = row[TIME];
+	v = tape_visit(a, row, av->node);
+	if (av->v->gf)
+		g *= lookup_slope(av->v->gf, v);
+	backprop(a, av->node, 0, g, adj);
+}
+
+// tape_visit is svisit, recording the value of every node it
+// evaluates on the tape.
+double
+tape_visit(SDAdjoint *a, const double *data, Node *n)
+{
+	SDSim *s = a->sim;
+	const double dt = s->spec.dt, time = data[TIME];
+	size_t pos = a->tape_len++;
+	double v = NAN, l, r, args[6];
+	int off;
+
+	switch (n->type) {
+	case N_PAREN:
+		v = tape_visit(a, data, n->left);
+		break;
+	case N_FLOATLIT:
+		v = n->fval;
+		break;
+	case N_IDENT:
+		if (n->av->src)
+			off = n->av->src->offset;
+		else
+			off = n->av->offset;
+		v = data[off];
+		break;
+	case N_CALL:
+		memset(args, 0, sizeof(args));
+		for (size_t i = 0; i < n->args.len; i++)
+			args[i] = tape_visit(a, data, n->args.elems[i]);
+		v = n->fn(s, n, dt, time, n->args.len, args);
+		break;
+	case N_IF:
+		if (tape_visit(a, data, n->cond) != 0)
+			v = tape_visit(a, data, n->left);
+		else
+			v = tape_visit(a, data, n->right);
+		break;
+	case N_UNARY:
+		l = tape_visit(a, data, n->left);
+		if (n->op == '+')
+			v = l;
+		else if (n->op == '-')
+			v = -l;
+		else if (n->op == '!')
+			v = l == 0 ? 1 : 0;
+		break;
+	case N_BINARY:
+		l = tape_visit(a, data, n->left);
+		r = tape_visit(a, data, n->right);
+		switch (n->op) {
+		case '+':
+			v = l + r;
+			break;
+		case '-':
+			v = l - r;
+			break;
+		case '*':
+			v = l * r;
+			break;
+		case '/':
+			v = l / r;
+			break;
+		case '^':
+			v = pow(l, r);
+			break;
+		case '<':
+			v = l < r ? 1 : 0;
+			break;
+		case '>':
+			v = l > r ? 1 : 0;
+			break;
+		case '&':
+			v = l == 1 && r == 1 ? 1 : 0;
+			break;
+		case '|':
+			v = l == 1 || r == 1 ? 1 : 0;
+			break;
+		case '=':
+			v = l == r;
+			break;
+		case u'≠':
+			v = l != r;
+			break;
+		case u'≤':
+			v = l <= r ? 1 : 0;
+			break;
+		case u'≥':
+			v = l >= r ? 1 : 0;
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	a->tape[pos].v = v;
+	a->tape[pos].end = a->tape_len;
+	return v;
+}
+
+// backprop adds g times the derivative of n, whose value is at pos
+// on the tape, with respect to each variable it reads to that
+// variable's adjoint.
+void
+backprop(SDAdjoint *a, Node *n, size_t pos, double g, double *adj)
+{
+	SDSim *s = a->sim;
+	const TapeEntry *tape = a->tape;
+	double args[6], partials[6], l, r;
+	size_t nargs, at[6], left = pos + 1, right;
+	int off;
+
+	if (g == 0)
+		return;
+
+	switch (n->type) {
+	case N_PAREN:
+		backprop(a, n->left, left, g, adj);
+		break;
+	case N_IDENT:
+		if (n->av->src)
+			off = n->av->src->offset;
+		else
+			off = n->av->offset;
+		adj[off] += g;
+		break;
+	case N_CALL:
+		if (!n->dfn)
+			break;
+		memset(args, 0, sizeof(args));
+		nargs = n->args.len < 6 ? n->args.len : 6;
+		for (size_t i = 0; i < nargs; i++) {
+			at[i] = i ? tape[at[i-1]].end : left;
+			args[i] = tape[at[i]].v;
+		}
+		n->dfn(s, n, s->spec.dt, a->tape_time, nargs, args, partials);
+		for (size_t i = 0; i < nargs; i++)
+			backprop(a, n->args.elems[i], at[i], g*partials[i], adj);
+		break;
+	case N_IF:
+		// only the branch taken follows the condition
+		right = tape[left].end;
+		if (tape[left].v != 0)
+			backprop(a, n->left, right, g, adj);
+		else
+			backprop(a, n->right, right, g, adj);
+		break;
+	case N_UNARY:
+		if (n->op == '+')
+			backprop(a, n->left, left, g, adj);
+		else if (n->op == '-')
+			backprop(a, n->left, left, -g, adj);
+		break;
+	case N_BINARY:
+		right = tape[left].end;
+		l = tape[left].v;
+		r = tape[right].v;
+		switch (n->op) {
+		case '+':
+			backprop(a, n->left, left, g, adj);
+			backprop(a, n->right, right, g, adj);
+			break;
+		case '-':
+			backprop(a, n->left, left, g, adj);
+			backprop(a, n->right, right, -g, adj);
+			break;
+		case '*':
+			backprop(a, n->left, left, g*r, adj);
+			backprop(a, n->right, right, g*l, adj);
+			break;
+		case '/':
+			backprop(a, n->left, left, g/r, adj);
+			backprop(a, n->right, right, -g*l/(r*r), adj);
+			break;
+		case '^':
+			if (r != 0)
+				backprop(a, n->left, left, g*r*pow(l, r - 1), adj);
+			if (l > 0)
+				backprop(a, n->right, right, g*pow(l, r)*log(l), adj);
+			break;
+		default:
+			// comparisons and logic are piecewise constant
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// node_count returns the most entries n's evaluation can put on the
+// tape.
+size_t
+node_count(Node *n)
+{
+	size_t count = 1;
+
+	switch (n->type) {
+	case N_PAREN:
+	case N_UNARY:
+		count += node_count(n->left);
+		break;
+	case N_CALL:
+		for (size_t i = 0; i < n->args.len; i++)
+			count += node_count(n->args.elems[i]);
+		break;
+	case N_IF:
+		count += node_count(n->cond) + node_count(n->left) + node_count(n->right);
+		break;
+	case N_BINARY:
+		count += node_count(n->left) + node_count(n->right);
+		break;
+	default:
+		break;
+	}
+	return count;
+}
+
+size_t
+max_nodes(Slice *l)
+{
+	size_t max = 0;
+
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		size_t n = av->node ? node_count(av->node) : 0;
+		if (n > max)
+			max = n;
+	}
+	return max;
+}
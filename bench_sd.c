@@ -0,0 +1,134 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// sd.bench times sd_sim_new on a large generated model with 1, 2, 4,
+// ... executor threads, up to the number of CPUs, to show how
+// equation compilation scales with cores.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sd.h"
+
+#define RUNS 3
+
+static void die(const char *, ...);
+static void write_model(FILE *f, int nsectors);
+static double now(void);
+
+
+void __attribute__((noreturn))
+die(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	exit(EXIT_FAILURE);
+}
+
+// write_model writes a model of nsectors stock-and-flow sectors of
+// five variables each, all reading one shared total.
+void
+write_model(FILE *f, int nsectors)
+{
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<xmile version=\"1.0\" level=\"3\" xmlns=\"http://www.systemdynamics.org/XMILE\">\n"
+		"<header><smile version=\"1.0\" namespace=\"std\"/><name>bench</name></header>\n"
+		"<sim_specs method=\"Euler\" time_units=\"Time\">"
+		"<start>0</start><stop>10</stop><dt>1</dt></sim_specs>\n"
+		"<model><variables>\n"
+		"<aux name=\"capacity\"><eqn>1e9</eqn></aux>\n"
+		"<aux name=\"total\"><eqn>s1");
+	for (int i = 2; i <= nsectors; i++)
+		fprintf(f, " + s%d", i);
+	fprintf(f, "</eqn></aux>\n");
+	for (int i = 1; i <= nsectors; i++) {
+		fprintf(f, "<stock name=\"s%d\"><eqn>1</eqn><inflow>g%d</inflow><outflow>l%d</outflow></stock>\n", i, i, i);
+		fprintf(f, "<aux name=\"k%d\"><eqn>0.01 * (1 + %d / %d)</eqn></aux>\n", i, i, nsectors);
+		fprintf(f, "<aux name=\"a%d\"><eqn>s%d * k%d</eqn></aux>\n", i, i, i);
+		fprintf(f, "<flow name=\"g%d\"><eqn>a%d * (1 - total / capacity)</eqn></flow>\n", i, i);
+		fprintf(f, "<flow name=\"l%d\"><eqn>s%d * 0.01</eqn></flow>\n", i, i);
+	}
+	fprintf(f, "</variables></model>\n</xmile>\n");
+}
+
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int
+main(int argc, char *const argv[])
+{
+	char path[] = "/tmp/sd-bench-XXXXXX";
+	int fd, err = 0, nsectors = 4000;
+	long ncpus;
+	double base = 0;
+	SDProject *p;
+	FILE *f;
+
+	if (argc > 1)
+		nsectors = atoi(argv[1]);
+	if (nsectors < 1)
+		die("usage: %s [NSECTORS]\n", argv[0]);
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(f = fdopen(fd, "w")))
+		die("couldn't create temporary model\n");
+	write_model(f, nsectors);
+	fclose(f);
+
+	p = sd_project_open(path, &err);
+	unlink(path);
+	if (!p)
+		die("couldn't open model: %s\n", sd_error_str(err));
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	printf("%d variables\n", nsectors*5 + 2);
+	printf("threads\tsd_sim_new (s)\tspeedup\n");
+	for (long n = 1;; n *= 2) {
+		SDExecutor *ex;
+		double best = 0;
+
+		if (n > ncpus)
+			n = ncpus;
+		ex = sd_executor_new(n);
+		if (!ex)
+			die("couldn't start %ld threads\n", n);
+		sd_project_set_executor(p, ex);
+		for (int r = 0; r < RUNS; r++) {
+			double start = now(), t;
+			SDSim *s = sd_sim_new(p, NULL);
+			t = now() - start;
+			if (!s)
+				die("sd_sim_new failed\n");
+			sd_sim_unref(s);
+			if (!r || t < best)
+				best = t;
+		}
+		if (n == 1)
+			base = best;
+		printf("%ld\t%.3f\t%.2fx\n", n, best, base/best);
+		sd_project_set_executor(p, NULL);
+		sd_executor_free(ex);
+		if (n == ncpus)
+			break;
+	}
+
+	sd_project_unref(p);
+	return 0;
+}
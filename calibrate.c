@@ -0,0 +1,821 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// Calibration searches the box given by each parameter's bounds for
+// the values minimizing the loss between simulated and observed
+// series.  The optimizers work in the unit cube, which is mapped
+// onto the box, and hand every batch of points they can evaluate
+// independently (a simplex, the candidate moves of a Nelder-Mead
+// step, the points of a line search, a generation of differential
+// evolution) to the executor at once.
+//
+// Runs are pruned to what the loss needs.  Only flows and stocks the
+// observed variables depend on are stepped, on private rows, in the
+// same way as a component (see component.c); the sim itself is only
+// used to compute initial values.  Runs stop after the last observed
+// time, as soon as a stock becomes NaN or infinite, and, where the
+// optimizer only needs to know whether a point beats some loss, as
+// soon as its loss exceeds it.  Models that can't be stepped this
+// way (backward Euler, or modules with their own dt) are run in full
+// and sampled at save steps.
+
+// defaults for fields of SDCalibration left 0
+#define DEFAULT_EVALS_PER_PARAM 500
+#define DEFAULT_TOL 1e-8
+
+// Powell's line searches evaluate LINE_POINTS points along the line
+// at once, then repeat around the best one, LINE_ROUNDS times.
+#define LINE_POINTS 8
+#define LINE_ROUNDS 4
+
+// differential evolution's mutation and crossover rates
+#define DE_F 0.8
+#define DE_CR 0.9
+
+typedef struct {
+	SDSim *s; // from Calib's sims
+	double *curr, *next;
+	double *x;      // the parameters being evaluated
+	size_t *cursor; // next observation of each series
+	double *prev;   // each series' value at the last step
+	double prev_t;
+	double loss;
+} Worker;
+
+typedef struct {
+	const SDCalibration *cal;
+	SDCompiledModel *cm;
+	SDExecutor *ex;
+	size_t nworkers;
+	WorkerSims sims;
+	Worker *workers;
+	size_t n; // nparams
+	int *offsets; // of each observed variable
+	// runlists pruned to what the observed variables depend on;
+	// if not pruned, sims run in full.
+	bool pruned;
+	AVar **flows;
+	size_t nflows;
+	AVar **stocks;
+	size_t nstocks;
+
+	size_t max_evals;
+	double tol;
+	uint64_t rng;
+
+	double *best; // in the unit cube
+	SDCalibrationStats *stats;
+	size_t ndiverged;
+} Calib;
+
+typedef struct {
+	Calib *c;
+	const double *us; // [point][param], in the unit cube
+	double *losses;
+	const double *bounds; // loss past which to stop, or NULL
+} Eval;
+
+static int calib_prune(Calib *c, SDSim *base);
+static void calib_mark(bool *needed, AVar *av);
+static Worker *calib_worker(Calib *c, size_t worker);
+static int calib_setup(SDSim *s, void *data);
+static void calib_eval(Calib *c, const double *us, double *losses, size_t npoints, const double *bounds);
+static void calib_eval_point(void *data, size_t i, size_t worker);
+static double calib_run(Calib *c, Worker *w, const double *u, double bound);
+static double calib_run_pruned(Calib *c, Worker *w, double bound);
+static double calib_run_full(Calib *c, Worker *w);
+static void calib_sample(Calib *c, Worker *w, double t, const double *row, bool first);
+static bool calib_sampled(Calib *c, Worker *w);
+static void calib_iter(Calib *c);
+
+static void nelder_mead(Calib *c, const double *u0);
+static void powell(Calib *c, const double *u0);
+static double line_min(Calib *c, double *u, double fu, const double *d);
+static void differential_evolution(Calib *c, const double *u0);
+
+
+int
+sd_calibrate(SDProject *p, const char *model_name, const SDCalibration *cal, double *best, SDCalibrationStats *stats, int nthreads)
+{
+	SDCalibrationStats local;
+	Calib c;
+	SDSim *base;
+	double *u0 = NULL;
+	int err;
+
+	if (!p || !cal || !best || nthreads < 0 || !cal->nparams ||
+	    !cal->params || !cal->lower || !cal->upper ||
+	    !cal->nobserved || !cal->observed ||
+	    cal->loss < 0 || cal->loss >= SD_LOSS_LEN ||
+	    cal->method < 0 || cal->method >= SD_CALIBRATE_LEN)
+		return SD_ERR_UNSPECIFIED;
+
+	if (!stats) {
+		memset(&local, 0, sizeof(local));
+		stats = &local;
+	}
+	stats->loss = INFINITY;
+	stats->nevals = 0;
+	stats->niters = 0;
+	stats->ndiverged = 0;
+	stats->converged = 0;
+	stats->trace_len = 0;
+
+	base = sd_sim_new(p, model_name);
+	if (!base)
+		return SD_ERR_UNSPECIFIED;
+
+	memset(&c, 0, sizeof(c));
+	c.cal = cal;
+	c.cm = base->compiled;
+	c.n = cal->nparams;
+	c.stats = stats;
+	c.max_evals = cal->max_evals ? cal->max_evals : DEFAULT_EVALS_PER_PARAM*c.n;
+	c.tol = cal->tol > 0 ? cal->tol : DEFAULT_TOL;
+	c.rng = cal->seed;
+
+	// check everything once here, rather than failing every run
+	err = SD_ERR_UNSPECIFIED;
+	for (size_t i = 0; i < c.n; i++) {
+		if (!(cal->lower[i] <= cal->upper[i]) ||
+		    sd_sim_set_value(base, cal->params[i], cal->lower[i]))
+			goto out;
+		if (cal->initial && !(cal->initial[i] >= cal->lower[i] &&
+		    cal->initial[i] <= cal->upper[i]))
+			goto out;
+	}
+	c.offsets = calloc(cal->nobserved, sizeof(*c.offsets));
+	if (!c.offsets) {
+		err = SD_ERR_NOMEM;
+		goto out;
+	}
+	for (size_t i = 0; i < cal->nobserved; i++) {
+		c.offsets[i] = observed_offset(base, &cal->observed[i], cal->loss);
+		if (c.offsets[i] < 0)
+			goto out;
+	}
+
+	err = SD_ERR_NOMEM;
+	if (calib_prune(&c, base))
+		goto out;
+
+	c.ex = executor_get(p);
+	c.nworkers = nthreads ? (size_t)nthreads : sd_executor_concurrency(c.ex);
+	c.workers = calloc(c.nworkers, sizeof(*c.workers));
+	c.best = calloc(c.n, sizeof(*c.best));
+	u0 = calloc(c.n, sizeof(*u0));
+	if (!c.workers || !c.best || !u0 ||
+	    worker_sims_init(&c.sims, c.cm, c.ex, c.nworkers))
+		goto out;
+	for (size_t i = 0; i < c.n; i++) {
+		double range = cal->upper[i] - cal->lower[i];
+		if (!cal->initial || range == 0)
+			u0[i] = .5;
+		else
+			u0[i] = (cal->initial[i] - cal->lower[i])/range;
+	}
+
+	switch (cal->method) {
+	case SD_CALIBRATE_NELDER_MEAD:
+		nelder_mead(&c, u0);
+		break;
+	case SD_CALIBRATE_POWELL:
+		powell(&c, u0);
+		break;
+	default:
+		differential_evolution(&c, u0);
+		break;
+	}
+
+	for (size_t i = 0; i < c.n; i++)
+		best[i] = cal->lower[i] + c.best[i]*(cal->upper[i] - cal->lower[i]);
+	stats->ndiverged = c.ndiverged;
+	err = 0;
+out:
+	for (size_t i = 0; c.workers && i < c.nworkers; i++) {
+		Worker *w = &c.workers[i];
+		free(w->curr);
+		free(w->next);
+		free(w->x);
+		free(w->cursor);
+		free(w->prev);
+	}
+	free(c.workers);
+	worker_sims_free(&c.sims);
+	free(c.offsets);
+	free(c.flows);
+	free(c.stocks);
+	free(c.best);
+	free(u0);
+	sd_sim_unref(base);
+	return err;
+}
+
+// observed_offset returns the offset in s of obs's variable, or -1 if
+// obs isn't a valid series for loss within s's run.
+int
+observed_offset(SDSim *s, const SDObserved *obs, SDLoss loss)
+{
+	int off = sd_sim_get_offset(s, obs->name);
+
+	if (off < 0 || !obs->len || !obs->times || !obs->values)
+		return -1;
+	if (loss == SD_LOSS_WEIGHTED && !obs->weights)
+		return -1;
+	for (size_t k = 0; k < obs->len; k++) {
+		if (obs->times[k] < s->spec.start || obs->times[k] > s->spec.stop ||
+		    (k && obs->times[k] < obs->times[k-1]) ||
+		    !isfinite(obs->values[k]) ||
+		    (loss == SD_LOSS_LOG && obs->values[k] <= 0))
+			return -1;
+	}
+	return off;
+}
+
+// calib_prune works out which flows and stocks the observed variables
+// depend on, directly or through other variables or stocks' flows.
+int
+calib_prune(Calib *c, SDSim *base)
+{
+	AVar *module = c->cm->module;
+	Slice flows, stocks;
+	bool *needed;
+	int err = SD_ERR_NOMEM;
+
+	if (base->method != SIM_EULER || base->substep_levels)
+		return 0;
+
+	memset(&flows, 0, sizeof(flows));
+	memset(&stocks, 0, sizeof(stocks));
+	needed = calloc(c->cm->nvars, sizeof(*needed));
+	if (!needed)
+		return SD_ERR_NOMEM;
+
+	needed[TIME] = true;
+	for (size_t i = 0; i < c->cal->nobserved; i++) {
+		AVar *av = resolve(module, c->cal->observed[i].name);
+		if (av)
+			calib_mark(needed, av);
+	}
+
+	if (runlist_flatten(&flows, &module->flows, false) ||
+	    runlist_flatten(&stocks, &module->stocks, true))
+		goto out;
+	c->flows = calloc(flows.len + 1, sizeof(*c->flows));
+	c->stocks = calloc(stocks.len + 1, sizeof(*c->stocks));
+	if (!c->flows || !c->stocks)
+		goto out;
+	for (size_t i = 0; i < flows.len; i++) {
+		AVar *av = flows.elems[i];
+		if (needed[av->offset])
+			c->flows[c->nflows++] = av;
+	}
+	for (size_t i = 0; i < stocks.len; i++) {
+		AVar *av = stocks.elems[i];
+		if (needed[av->offset])
+			c->stocks[c->nstocks++] = av;
+	}
+	c->pruned = true;
+	err = 0;
+out:
+	free(flows.elems);
+	free(stocks.elems);
+	free(needed);
+	return err;
+}
+
+void
+calib_mark(bool *needed, AVar *av)
+{
+	while (av->src)
+		av = av->src;
+	if (av->model || needed[av->offset])
+		return;
+	needed[av->offset] = true;
+	for (size_t i = 0; i < av->direct_deps.len; i++)
+		calib_mark(needed, av->direct_deps.elems[i]);
+	for (size_t i = 0; i < av->inflows.len; i++)
+		calib_mark(needed, av->inflows.elems[i]);
+	for (size_t i = 0; i < av->outflows.len; i++)
+		calib_mark(needed, av->outflows.elems[i]);
+}
+
+// calib_worker returns the worker's state, creating it on first use
+// so that its memory is touched first by the thread that uses it.
+Worker *
+calib_worker(Calib *c, size_t worker)
+{
+	Worker *w = &c->workers[worker];
+	size_t nvars = c->cm->nvars;
+
+	if (w->s)
+		return w;
+	if (!w->curr) {
+		w->curr = calloc(nvars, sizeof(*w->curr));
+		w->next = calloc(nvars, sizeof(*w->next));
+		w->x = calloc(c->n, sizeof(*w->x));
+		w->cursor = calloc(c->cal->nobserved, sizeof(*w->cursor));
+		w->prev = calloc(c->cal->nobserved, sizeof(*w->prev));
+	}
+	if (!w->curr || !w->next || !w->x || !w->cursor || !w->prev)
+		return NULL;
+	w->s = worker_sim(&c->sims, worker, calib_setup, c);
+	return w->s ? w : NULL;
+}
+
+int
+calib_setup(SDSim *s, void *data)
+{
+	Calib *c = data;
+
+	// pruned runs only need the sim's initial row
+	return c->pruned ? sd_sim_set_history(s, 0) : sd_sim_set_finite_check(s, 1);
+}
+
+void
+calib_eval(Calib *c, const double *us, double *losses, size_t npoints, const double *bounds)
+{
+	SDCalibrationStats *stats = c->stats;
+	Eval e;
+
+	e.c = c;
+	e.us = us;
+	e.losses = losses;
+	e.bounds = bounds;
+	if (sd_executor_parallel_for(c->ex, npoints, c->nworkers, calib_eval_point, &e)) {
+		for (size_t i = 0; i < npoints; i++)
+			losses[i] = INFINITY;
+	}
+	stats->nevals += npoints;
+
+	for (size_t i = 0; i < npoints; i++) {
+		if (losses[i] < stats->loss) {
+			stats->loss = losses[i];
+			memcpy(c->best, &us[i*c->n], c->n*sizeof(double));
+		}
+	}
+}
+
+void
+calib_eval_point(void *data, size_t i, size_t worker)
+{
+	Eval *e = data;
+	Calib *c = e->c;
+	Worker *w = calib_worker(c, worker);
+
+	if (!w) {
+		e->losses[i] = INFINITY;
+		return;
+	}
+	e->losses[i] = calib_run(c, w, &e->us[i*c->n], e->bounds ? e->bounds[i] : INFINITY);
+}
+
+// calib_run returns the loss at u, or some loss greater than bound.
+double
+calib_run(Calib *c, Worker *w, const double *u, double bound)
+{
+	const SDCalibration *cal = c->cal;
+
+	for (size_t i = 0; i < c->n; i++)
+		w->x[i] = cal->lower[i] + u[i]*(cal->upper[i] - cal->lower[i]);
+	if (sim_set_point(w->s, cal->params, w->x, c->n))
+		return INFINITY;
+
+	memset(w->cursor, 0, cal->nobserved*sizeof(*w->cursor));
+	w->loss = 0;
+
+	return c->pruned ? calib_run_pruned(c, w, bound) : calib_run_full(c, w);
+}
+
+// calib_run_pruned mirrors sim_run_steps for the pruned runlists.
+double
+calib_run_pruned(Calib *c, Worker *w, double bound)
+{
+	SDSim *s = w->s;
+	double *curr = w->curr, *next = w->next, *tmp;
+	double dt = s->spec.dt;
+
+	memcpy(curr, s->curr, s->nvars*sizeof(double));
+	memcpy(next, s->curr, s->nvars*sizeof(double));
+
+	for (size_t step = 0; step < s->nsteps; step++) {
+		for (size_t i = 0; i < c->nflows; i++) {
+			AVar *av = c->flows[i];
+			double v = svisit(s, curr, av->node, dt, curr[TIME]);
+			if (av->v->gf)
+				v = lookup(av->v->gf, v);
+			curr[av->offset] = v;
+		}
+
+		calib_sample(c, w, curr[TIME], curr, step == 0);
+		if (w->loss > bound || calib_sampled(c, w) || step + 1 == s->nsteps)
+			break;
+
+		for (size_t i = 0; i < c->nstocks; i++) {
+			AVar *av = c->stocks[i];
+			if (av->v->type != VAR_STOCK) {
+				next[av->offset] = curr[av->offset];
+				continue;
+			}
+			next[av->offset] = curr[av->offset] + stock_net_flow(av, curr)*dt;
+			if (unlikely(!isfinite(next[av->offset]))) {
+				__sync_fetch_and_add(&c->ndiverged, 1);
+				return INFINITY;
+			}
+		}
+		next[TIME] = s->spec.start + (step+1)*dt;
+
+		tmp = curr;
+		curr = next;
+		next = tmp;
+	}
+
+	return w->loss;
+}
+
+double
+calib_run_full(Calib *c, Worker *w)
+{
+	SDSim *s = w->s;
+	int err;
+
+	err = sd_sim_run_to_end(s);
+	if (err == SD_ERR_DIVERGED)
+		__sync_fetch_and_add(&c->ndiverged, 1);
+	if (err)
+		return INFINITY;
+
+	for (size_t i = 0; i < s->nsaves && !calib_sampled(c, w); i++) {
+		const double *row = &s->slab[i*s->nvars];
+		calib_sample(c, w, row[TIME], row, i == 0);
+	}
+	return w->loss;
+}
+
+// calib_sample adds the loss of every observation up to time t, given
+// the row at t and each series' value at the last step, interpolating
+// linearly between the two.
+void
+calib_sample(Calib *c, Worker *w, double t, const double *row, bool first)
+{
+	const SDCalibration *cal = c->cal;
+	double eps = 1e-9*w->s->spec.dt;
+
+	for (size_t j = 0; j < cal->nobserved; j++) {
+		const SDObserved *obs = &cal->observed[j];
+		double v = row[c->offsets[j]];
+		size_t k;
+
+		for (k = w->cursor[j]; k < obs->len && obs->times[k] <= t + eps; k++) {
+			double sim = v, term;
+			if (!first && t - w->prev_t > eps)
+				sim = w->prev[j] + (v - w->prev[j])*(obs->times[k] - w->prev_t)/(t - w->prev_t);
+			if (cal->loss == SD_LOSS_LOG)
+				term = sim > 0 ? log(sim) - log(obs->values[k]) : INFINITY;
+			else
+				term = sim - obs->values[k];
+			term *= term;
+			if (obs->weights && cal->loss != SD_LOSS_SSE)
+				term *= obs->weights[k];
+			w->loss += term;
+		}
+		w->cursor[j] = k;
+		w->prev[j] = v;
+	}
+	if (isnan(w->loss))
+		w->loss = INFINITY;
+	w->prev_t = t;
+}
+
+bool
+calib_sampled(Calib *c, Worker *w)
+{
+	for (size_t j = 0; j < c->cal->nobserved; j++) {
+		if (w->cursor[j] < c->cal->observed[j].len)
+			return false;
+	}
+	return true;
+}
+
+// calib_iter records the end of an iteration in the trace.
+void
+calib_iter(Calib *c)
+{
+	SDCalibrationStats *stats = c->stats;
+
+	if (stats->trace && stats->trace_len < stats->trace_cap)
+		stats->trace[stats->trace_len++] = stats->loss;
+	stats->niters++;
+}
+
+static double
+clamp01(double u)
+{
+	return u < 0 ? 0 : u > 1 ? 1 : u;
+}
+
+// nelder_mead keeps a simplex of n+1 points, clamped to the unit
+// cube.  With more than one worker, each step's reflection,
+// expansion and both contractions are evaluated together, and the
+// step then takes whichever the usual rules choose; the search is
+// the same either way.
+void
+nelder_mead(Calib *c, const double *u0)
+{
+	size_t n = c->n, npts = n + 1;
+	double *simplex, *f, *centroid, *cand, fc[4];
+	bool speculate = c->nworkers > 1;
+
+	simplex = calloc(npts*n, sizeof(*simplex));
+	f = calloc(npts, sizeof(*f));
+	centroid = calloc(n, sizeof(*centroid));
+	cand = calloc(4*n, sizeof(*cand));
+	if (!simplex || !f || !centroid || !cand)
+		goto out;
+
+	for (size_t i = 0; i < npts; i++) {
+		memcpy(&simplex[i*n], u0, n*sizeof(double));
+		if (i) {
+			double *u = &simplex[i*n + i - 1];
+			*u += *u <= .75 ? .25 : -.25;
+		}
+	}
+	calib_eval(c, simplex, f, npts, NULL);
+
+	while (c->stats->nevals < c->max_evals) {
+		double *worst, fr;
+		size_t ncand;
+		bool shrink = false;
+
+		// insertion sort by loss; the simplex is small
+		for (size_t i = 1; i < npts; i++) {
+			for (size_t j = i; j > 0 && f[j] < f[j-1]; j--) {
+				double tmp = f[j];
+				f[j] = f[j-1];
+				f[j-1] = tmp;
+				for (size_t k = 0; k < n; k++) {
+					tmp = simplex[j*n + k];
+					simplex[j*n + k] = simplex[(j-1)*n + k];
+					simplex[(j-1)*n + k] = tmp;
+				}
+			}
+		}
+		if (f[n] - f[0] <= c->tol*(fabs(f[0]) + c->tol)) {
+			c->stats->converged = 1;
+			break;
+		}
+
+		memset(centroid, 0, n*sizeof(double));
+		for (size_t i = 0; i < n; i++) {
+			for (size_t k = 0; k < n; k++)
+				centroid[k] += simplex[i*n + k]/n;
+		}
+		worst = &simplex[n*n];
+		// reflection, expansion, outside and inside contraction
+		for (size_t k = 0; k < n; k++) {
+			double d = centroid[k] - worst[k];
+			cand[k] = clamp01(centroid[k] + d);
+			cand[n + k] = clamp01(centroid[k] + 2*d);
+			cand[2*n + k] = clamp01(centroid[k] + .5*d);
+			cand[3*n + k] = clamp01(centroid[k] - .5*d);
+		}
+
+		ncand = speculate ? 4 : 1;
+		calib_eval(c, cand, fc, ncand, NULL);
+		fr = fc[0];
+		if (fr < f[0]) {
+			if (!speculate)
+				calib_eval(c, &cand[n], &fc[1], 1, NULL);
+			if (fc[1] < fr) {
+				memcpy(worst, &cand[n], n*sizeof(double));
+				f[n] = fc[1];
+			} else {
+				memcpy(worst, cand, n*sizeof(double));
+				f[n] = fr;
+			}
+		} else if (fr < f[n-1]) {
+			memcpy(worst, cand, n*sizeof(double));
+			f[n] = fr;
+		} else if (fr < f[n]) {
+			if (!speculate)
+				calib_eval(c, &cand[2*n], &fc[2], 1, NULL);
+			if (fc[2] <= fr) {
+				memcpy(worst, &cand[2*n], n*sizeof(double));
+				f[n] = fc[2];
+			} else {
+				shrink = true;
+			}
+		} else {
+			if (!speculate)
+				calib_eval(c, &cand[3*n], &fc[3], 1, NULL);
+			if (fc[3] < f[n]) {
+				memcpy(worst, &cand[3*n], n*sizeof(double));
+				f[n] = fc[3];
+			} else {
+				shrink = true;
+			}
+		}
+
+		if (shrink) {
+			for (size_t i = 1; i < npts; i++) {
+				for (size_t k = 0; k < n; k++)
+					simplex[i*n + k] = simplex[k] + .5*(simplex[i*n + k] - simplex[k]);
+			}
+			calib_eval(c, &simplex[n], &f[1], n, NULL);
+		}
+		calib_iter(c);
+	}
+out:
+	free(simplex);
+	free(f);
+	free(centroid);
+	free(cand);
+}
+
+// powell minimizes along each of n directions in turn, then along
+// the overall direction moved in, which replaces the direction that
+// gave the largest decrease.
+void
+powell(Calib *c, const double *u0)
+{
+	size_t n = c->n;
+	double *dirs, *u, *start, *d, fu;
+
+	dirs = calloc(n*n, sizeof(*dirs));
+	u = calloc(n, sizeof(*u));
+	start = calloc(n, sizeof(*start));
+	d = calloc(n, sizeof(*d));
+	if (!dirs || !u || !start || !d)
+		goto out;
+
+	for (size_t i = 0; i < n; i++)
+		dirs[i*n + i] = 1;
+	memcpy(u, u0, n*sizeof(double));
+	calib_eval(c, u, &fu, 1, NULL);
+
+	while (c->stats->nevals < c->max_evals) {
+		double fstart = fu, biggest = 0, len = 0;
+		size_t ibig = 0;
+
+		memcpy(start, u, n*sizeof(double));
+		for (size_t i = 0; i < n && c->stats->nevals < c->max_evals; i++) {
+			double prev = fu;
+			fu = line_min(c, u, fu, &dirs[i*n]);
+			if (prev - fu > biggest) {
+				biggest = prev - fu;
+				ibig = i;
+			}
+		}
+		for (size_t k = 0; k < n; k++) {
+			d[k] = u[k] - start[k];
+			len += d[k]*d[k];
+		}
+		if (len > 0 && c->stats->nevals < c->max_evals) {
+			len = sqrt(len);
+			for (size_t k = 0; k < n; k++)
+				d[k] /= len;
+			fu = line_min(c, u, fu, d);
+			memcpy(&dirs[ibig*n], d, n*sizeof(double));
+		}
+
+		calib_iter(c);
+		if (2*(fstart - fu) <= c->tol*(fabs(fstart) + fabs(fu)) + DBL_MIN) {
+			c->stats->converged = 1;
+			break;
+		}
+	}
+out:
+	free(dirs);
+	free(u);
+	free(start);
+	free(d);
+}
+
+// line_min moves u along d, within the unit cube, to the lowest loss
+// it finds, returning that loss.
+double
+line_min(Calib *c, double *u, double fu, const double *d)
+{
+	size_t n = c->n;
+	double lo = -INFINITY, hi = INFINITY, best = 0;
+	double *pts, f[LINE_POINTS], ts[LINE_POINTS];
+
+	for (size_t k = 0; k < n; k++) {
+		double a, b;
+		if (d[k] == 0)
+			continue;
+		a = -u[k]/d[k];
+		b = (1 - u[k])/d[k];
+		lo = fmax(lo, fmin(a, b));
+		hi = fmin(hi, fmax(a, b));
+	}
+	if (!(lo < hi) || !isfinite(lo) || !isfinite(hi))
+		return fu;
+	pts = calloc(LINE_POINTS*n, sizeof(*pts));
+	if (!pts)
+		return fu;
+
+	for (int round = 0; round < LINE_ROUNDS; round++) {
+		double step = (hi - lo)/(LINE_POINTS - 1);
+		for (size_t i = 0; i < LINE_POINTS; i++) {
+			ts[i] = lo + i*step;
+			for (size_t k = 0; k < n; k++)
+				pts[i*n + k] = clamp01(u[k] + ts[i]*d[k]);
+		}
+		calib_eval(c, pts, f, LINE_POINTS, NULL);
+		for (size_t i = 0; i < LINE_POINTS; i++) {
+			if (f[i] < fu) {
+				fu = f[i];
+				best = ts[i];
+			}
+		}
+		lo = fmax(lo, best - step);
+		hi = fmin(hi, best + step);
+	}
+	free(pts);
+
+	for (size_t k = 0; k < n; k++)
+		u[k] = clamp01(u[k] + best*d[k]);
+	return fu;
+}
+
+// differential_evolution is DE/rand/1/bin.  Each generation's trials
+// are evaluated together, each stopping early once it is clearly no
+// better than the member it would replace.
+void
+differential_evolution(Calib *c, const double *u0)
+{
+	size_t n = c->n, np;
+	double *pop, *f, *trials, *ft;
+
+	np = c->cal->population > 0 ? (size_t)c->cal->population : 10*n;
+	if (np < 4)
+		np = 4;
+
+	pop = calloc(np*n, sizeof(*pop));
+	f = calloc(np, sizeof(*f));
+	trials = calloc(np*n, sizeof(*trials));
+	ft = calloc(np, sizeof(*ft));
+	if (!pop || !f || !trials || !ft)
+		goto out;
+
+	memcpy(pop, u0, n*sizeof(double));
+	for (size_t i = n; i < np*n; i++)
+		pop[i] = rng_uniform(&c->rng);
+	calib_eval(c, pop, f, np, NULL);
+
+	while (c->stats->nevals + np <= c->max_evals) {
+		double lo = INFINITY, hi = -INFINITY;
+
+		for (size_t i = 0; i < np; i++) {
+			size_t a, b, r, jrand = rng_uniform(&c->rng)*n;
+			do a = rng_uniform(&c->rng)*np; while (a == i);
+			do b = rng_uniform(&c->rng)*np; while (b == i || b == a);
+			do r = rng_uniform(&c->rng)*np; while (r == i || r == a || r == b);
+			for (size_t k = 0; k < n; k++) {
+				double x = pop[i*n + k];
+				double v = pop[a*n + k] + DE_F*(pop[b*n + k] - pop[r*n + k]);
+				if (k != jrand && rng_uniform(&c->rng) >= DE_CR)
+					v = x;
+				// bounce back between the parent and the bound
+				else if (v < 0)
+					v = rng_uniform(&c->rng)*x;
+				else if (v > 1)
+					v = x + rng_uniform(&c->rng)*(1 - x);
+				trials[i*n + k] = v;
+			}
+		}
+		calib_eval(c, trials, ft, np, f);
+
+		for (size_t i = 0; i < np; i++) {
+			if (ft[i] <= f[i]) {
+				memcpy(&pop[i*n], &trials[i*n], n*sizeof(double));
+				f[i] = ft[i];
+			}
+			lo = fmin(lo, f[i]);
+			hi = fmax(hi, f[i]);
+		}
+
+		calib_iter(c);
+		if (hi - lo <= c->tol*(fabs(lo) + c->tol)) {
+			c->stats->converged = 1;
+			break;
+		}
+	}
+out:
+	free(pop);
+	free(f);
+	free(trials);
+	free(ft);
+}
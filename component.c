@@ -0,0 +1,329 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// Models often bundle sectors that never read each other's
+// variables.  Each connected component of the dependency graph
+// (equation references, plus the edges between a stock and its
+// flows) can be simulated over the whole run without ever waiting
+// on the others.  Each component steps its own private rows and
+// copies its columns into the slab at save steps, so threads only
+// ever write disjoint parts of the slab.
+//
+// Time is the one thing every component reads; each keeps its own
+// copy, and the first component writes it to the slab.  Components
+// made up of nothing but constants are folded into the first one.
+
+typedef struct {
+	// subsequences of the flattened runlists, in runlist order
+	AVar **flows;
+	size_t nflows;
+	AVar **stocks; // stocks and constants
+	size_t nstocks;
+	// the slab columns this component owns
+	int *cols;
+	size_t ncols;
+} Component;
+
+struct Components_s {
+	Component *comps;
+	size_t n;
+};
+
+typedef struct {
+	SDSim *s;
+	double end;
+	// the position the first component finished at, which is
+	// the same for all of them
+	size_t step;
+	size_t save_step;
+	// the row the run starts from; the slab's copy gets
+	// overwritten as components save
+	double *start;
+	int err;
+} ComponentRun;
+
+static int uf_find(int *parent, int i);
+static void uf_union(int *parent, int a, int b);
+static void uf_union_dep(int *parent, AVar *av, AVar *dep);
+
+static void component_run(void *data, size_t i, size_t worker);
+static void component_save(Component *c, double *row, const double *curr);
+
+
+int
+components_new(AVar *module, size_t nvars, Components **result)
+{
+	Components *cs;
+	Slice flows, stocks;
+	int *parent = NULL, *id = NULL;
+	size_t *nflows = NULL, *nstocks = NULL;
+	size_t n = 0;
+	int err = SD_ERR_NOMEM;
+
+	memset(&flows, 0, sizeof(flows));
+	memset(&stocks, 0, sizeof(stocks));
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs)
+		return SD_ERR_NOMEM;
+
+	if (runlist_flatten(&flows, &module->flows, false) ||
+	    runlist_flatten(&stocks, &module->stocks, true))
+		goto error;
+
+	parent = malloc((nvars + 1)*sizeof(*parent));
+	id = malloc((nvars + 1)*sizeof(*id));
+	if (!parent || !id)
+		goto error;
+	for (size_t i = 0; i < nvars; i++) {
+		parent[i] = i;
+		id[i] = -1;
+	}
+
+	for (size_t k = 0; k < 2; k++) {
+		Slice *l = k ? &stocks : &flows;
+		for (size_t i = 0; i < l->len; i++) {
+			AVar *av = l->elems[i];
+			for (size_t j = 0; j < av->direct_deps.len; j++)
+				uf_union_dep(parent, av, av->direct_deps.elems[j]);
+			for (size_t j = 0; j < av->inflows.len; j++)
+				uf_union_dep(parent, av, av->inflows.elems[j]);
+			for (size_t j = 0; j < av->outflows.len; j++)
+				uf_union_dep(parent, av, av->outflows.elems[j]);
+		}
+	}
+
+	// number components in the order they first appear, with
+	// anything that has a flow or stock counting; constant-only
+	// components are placed afterwards and folded into 0.
+	for (size_t k = 0; k < 2; k++) {
+		Slice *l = k ? &stocks : &flows;
+		for (size_t i = 0; i < l->len; i++) {
+			AVar *av = l->elems[i];
+			int root = uf_find(parent, av->offset);
+			if (id[root] < 0 && (!av->is_const || av->v->type == VAR_STOCK))
+				id[root] = n++;
+		}
+	}
+	if (!n)
+		n = 1;
+
+	cs->n = n;
+	cs->comps = calloc(n, sizeof(*cs->comps));
+	nflows = calloc(n, sizeof(*nflows));
+	nstocks = calloc(n, sizeof(*nstocks));
+	if (!cs->comps || !nflows || !nstocks)
+		goto error;
+
+	for (size_t i = 0; i < flows.len; i++) {
+		AVar *av = flows.elems[i];
+		int c = id[uf_find(parent, av->offset)];
+		nflows[c < 0 ? 0 : c]++;
+	}
+	for (size_t i = 0; i < stocks.len; i++) {
+		AVar *av = stocks.elems[i];
+		int c = id[uf_find(parent, av->offset)];
+		nstocks[c < 0 ? 0 : c]++;
+	}
+	for (size_t c = 0; c < n; c++) {
+		Component *comp = &cs->comps[c];
+		comp->flows = calloc(nflows[c] + 1, sizeof(*comp->flows));
+		comp->stocks = calloc(nstocks[c] + 1, sizeof(*comp->stocks));
+		comp->cols = calloc(nflows[c] + nstocks[c] + 1, sizeof(*comp->cols));
+		if (!comp->flows || !comp->stocks || !comp->cols)
+			goto error;
+	}
+	cs->comps[0].cols[cs->comps[0].ncols++] = TIME;
+
+	for (size_t k = 0; k < 2; k++) {
+		Slice *l = k ? &stocks : &flows;
+		for (size_t i = 0; i < l->len; i++) {
+			AVar *av = l->elems[i];
+			int c = id[uf_find(parent, av->offset)];
+			Component *comp = &cs->comps[c < 0 ? 0 : c];
+			if (k)
+				comp->stocks[comp->nstocks++] = av;
+			else
+				comp->flows[comp->nflows++] = av;
+			comp->cols[comp->ncols++] = av->offset;
+		}
+	}
+
+	free(parent);
+	free(id);
+	free(nflows);
+	free(nstocks);
+	free(flows.elems);
+	free(stocks.elems);
+	*result = cs;
+	return 0;
+error:
+	free(parent);
+	free(id);
+	free(nflows);
+	free(nstocks);
+	free(flows.elems);
+	free(stocks.elems);
+	components_free(cs);
+	return err;
+}
+
+void
+components_free(Components *cs)
+{
+	if (!cs)
+		return;
+	for (size_t i = 0; cs->comps && i < cs->n; i++) {
+		free(cs->comps[i].flows);
+		free(cs->comps[i].stocks);
+		free(cs->comps[i].cols);
+	}
+	free(cs->comps);
+	free(cs);
+}
+
+size_t
+components_len(Components *cs)
+{
+	return cs ? cs->n : 0;
+}
+
+int
+uf_find(int *parent, int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+void
+uf_union(int *parent, int a, int b)
+{
+	a = uf_find(parent, a);
+	b = uf_find(parent, b);
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
+
+void
+uf_union_dep(int *parent, AVar *av, AVar *dep)
+{
+	while (dep->src)
+		dep = dep->src;
+	// everything reads time, which doesn't make it coupled
+	if (dep->model || dep->offset == TIME)
+		return;
+	uf_union(parent, av->offset, dep->offset);
+}
+
+int
+components_run_to(SDSim *s, double end)
+{
+	ComponentRun run;
+	int err;
+
+	memset(&run, 0, sizeof(run));
+	run.s = s;
+	run.end = end;
+	run.step = s->step;
+	run.save_step = s->save_step;
+
+	// the slab's current row holds the latest values, including
+	// any set with sd_sim_set_value.
+	s->curr = sim_curr(s);
+	run.start = malloc(s->nvars*sizeof(double));
+	if (!run.start)
+		return SD_ERR_NOMEM;
+	memcpy(run.start, s->curr, s->nvars*sizeof(double));
+
+	err = sd_executor_parallel_for(executor_get(s->project), s->components->n, s->nthreads, component_run, &run);
+	if (!err)
+		err = run.err;
+	free(run.start);
+
+	s->step = run.step;
+	s->save_step = run.save_step;
+	s->curr = sim_curr(s);
+	s->next = sim_next(s);
+
+	return err;
+}
+
+// component_run mirrors sd_sim_run_to for the variables of a single
+// component.
+void
+component_run(void *data, size_t i, size_t worker)
+{
+	ComponentRun *run = data;
+	SDSim *s = run->s;
+	Component *c = &s->components->comps[i];
+	double *curr, *next, *tmp;
+	size_t step = s->step, save_step = s->save_step;
+	double dt = s->spec.dt;
+
+	curr = malloc(s->nvars*sizeof(double));
+	next = malloc(s->nvars*sizeof(double));
+	if (!curr || !next) {
+		__sync_val_compare_and_swap(&run->err, 0, SD_ERR_NOMEM);
+		goto out;
+	}
+	memcpy(curr, run->start, s->nvars*sizeof(double));
+	memcpy(next, run->start, s->nvars*sizeof(double));
+
+	while (step < s->nsteps && curr[TIME] <= run->end) {
+		for (size_t k = 0; k < c->nflows; k++) {
+			AVar *av = c->flows[k];
+			double v = svisit(s, curr, av->node, dt, curr[TIME]);
+			if (av->v->gf)
+				v = lookup(av->v->gf, v);
+			curr[av->offset] = v;
+		}
+		for (size_t k = 0; k < c->nstocks; k++) {
+			AVar *av = c->stocks[k];
+			if (av->v->type == VAR_STOCK)
+				next[av->offset] = curr[av->offset] + stock_net_flow(av, curr)*dt;
+			else
+				next[av->offset] = curr[av->offset];
+		}
+
+		if (step + 1 == s->nsteps)
+			break;
+
+		next[TIME] = s->spec.start + (step+1)*dt;
+
+		if (step++ % s->save_every == 0)
+			component_save(c, &s->slab[save_step++*s->nvars], curr);
+
+		tmp = curr;
+		curr = next;
+		next = tmp;
+	}
+	component_save(c, &s->slab[save_step*s->nvars], curr);
+
+	if (i == 0) {
+		run->step = step;
+		run->save_step = save_step;
+	}
+out:
+	free(curr);
+	free(next);
+}
+
+void
+component_save(Component *c, double *row, const double *curr)
+{
+	for (size_t i = 0; i < c->ncols; i++)
+		row[c->cols[i]] = curr[c->cols[i]];
+}
@@ -38,7 +38,11 @@ CFLAGS   += -fPIC
 #CFLAGS  += -Wunsafe-loop-optimizations
 CFLAGS   += $(COVFLAGS)
 
-LDFLAGS  += $(STATIC) -g $(OPT) -lm $(COVFLAGS)
+LDFLAGS  += $(STATIC) -g $(OPT) -pthread -lm $(COVFLAGS)
+# shm_open is in librt on Linux, and in libc elsewhere
+ifeq ($(shell uname),Linux)
+LDFLAGS  += -lrt
+endif
 #LDFLAGS  += -fsanitize=address -lunwind
 LDFLAGS  += -Wl,-z,now,-z,relro
 
@@ -0,0 +1,685 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// An ensemble simulates many copies of a model that differ only in
+// the values of their constants.  Every slot in the slab holds a
+// vector of LANES doubles, one per copy, and each pass over the
+// runlists advances all of them: the arithmetic in evisit is written
+// as fixed-length loops over a lane vector, which the compiler turns
+// into SIMD instructions for whatever vector width the target has.
+//
+// Lanes are grouped into blocks of LANES; the slab is laid out as
+// [save step][variable][block][lane].
+
+#define LANES 8
+
+struct SDEnsemble_s {
+	SDSim *sim; // owns the compiled model: runlists and offsets
+	SimSpec spec;
+	size_t nlanes;
+	size_t nblocks;
+	size_t width; // nblocks*LANES, the stride between variables
+	double *slab;
+	double *curr;
+	double *next;
+	double *override;  // [variable][block][lane]
+	bool *is_override; // [variable][block][lane]
+	size_t nvars;
+	size_t nsaves;
+	size_t nsteps;
+	size_t step;
+	size_t save_step;
+	size_t save_every;
+	int refcount;
+};
+
+static double *ens_curr(SDEnsemble *e);
+static double *ens_next(SDEnsemble *e);
+
+static void ens_calc(SDEnsemble *e, double *data, size_t block, Slice *l, bool initial);
+static void ens_calc_stocks(SDEnsemble *e, double *data, size_t block, Slice *l);
+static void evisit(SDEnsemble *e, const double *data, Node *n, double *out);
+
+// state shared by the workers of sd_ensemble_run
+typedef struct {
+	const SDEnsembleRuns *runs;
+	WorkerSims sims;
+	size_t len;   // stepcount
+	int *status;
+} Batch;
+
+static void batch_run(void *data, size_t i, size_t worker);
+static int batch_setup(SDSim *s, void *data);
+
+
+SDEnsemble *
+sd_ensemble_new(SDProject *p, const char *model_name, size_t nlanes)
+{
+	SDEnsemble *e;
+	size_t n;
+
+	if (!p || !nlanes)
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	sd_ensemble_ref(e);
+
+	e->sim = sd_sim_new(p, model_name);
+	if (!e->sim)
+		goto error;
+	// lanes are integrated with explicit Euler at the model's dt
+	if (e->sim->method != SIM_EULER || e->sim->substep_levels)
+		goto error;
+
+	e->nlanes = nlanes;
+	e->nblocks = (nlanes + LANES - 1)/LANES;
+	e->width = e->nblocks*LANES;
+	e->nvars = e->sim->nvars;
+
+	n = e->nvars*e->width;
+	e->override = calloc(n, sizeof(*e->override));
+	e->is_override = calloc(n, sizeof(*e->is_override));
+	if (!e->override || !e->is_override)
+		goto error;
+
+	if (sd_ensemble_reset(e))
+		goto error;
+
+	return e;
+error:
+	sd_ensemble_unref(e);
+	return NULL;
+}
+
+void
+sd_ensemble_ref(SDEnsemble *e)
+{
+	if (!e)
+		return;
+	__sync_fetch_and_add(&e->refcount, 1);
+}
+
+void
+sd_ensemble_unref(SDEnsemble *e)
+{
+	if (!e)
+		return;
+	if (__sync_sub_and_fetch(&e->refcount, 1) == 0) {
+		sd_sim_unref(e->sim);
+		free(e->override);
+		free(e->is_override);
+		free(e->slab);
+		free(e);
+	}
+}
+
+int
+sd_ensemble_reset(SDEnsemble *e)
+{
+	size_t save_every, nvars;
+
+	if (!e)
+		return SD_ERR_UNSPECIFIED;
+
+	e->spec = e->sim->spec;
+	e->step = 0;
+	e->save_step = 0;
+	e->nsteps = e->sim->nsteps;
+	save_every = e->spec.savestep/e->spec.dt+.5;
+	e->save_every = save_every > 1 ? save_every : 1;
+	e->nsaves = e->sim->nsaves;
+
+	free(e->slab);
+	nvars = e->nvars ? e->nvars : 1;
+	// XXX: 1 extra step to simplify run_to, as in sd_sim_reset
+	e->slab = calloc(nvars*e->width*(e->nsaves + 1), sizeof(double));
+	if (!e->slab)
+		return SD_ERR_NOMEM;
+	e->curr = e->slab;
+	e->next = NULL;
+
+	for (size_t l = 0; l < e->width; l++)
+		e->curr[TIME*e->width + l] = e->spec.start;
+	for (size_t b = 0; b < e->nblocks; b++)
+		ens_calc(e, e->curr, b, &e->sim->module->initials, true);
+
+	return 0;
+}
+
+int
+sd_ensemble_set_value(SDEnsemble *e, size_t lane, const char *name, double val)
+{
+	AVar *av;
+	size_t i;
+
+	if (!e || !name || lane >= e->nlanes)
+		return SD_ERR_UNSPECIFIED;
+
+	av = resolve(e->sim->module, name);
+	while (av && av->src)
+		av = av->src;
+	if (!av || !av->is_const)
+		return SD_ERR_UNSPECIFIED;
+
+	i = av->offset*e->width + lane;
+	e->override[i] = val;
+	e->is_override[i] = true;
+
+	// as with sd_sim_set_value, recalculate initial values if the
+	// run hasn't started.
+	if (e->step == 0 && e->save_step == 0)
+		ens_calc(e, e->curr, lane/LANES, &e->sim->module->initials, true);
+	else
+		e->curr[i] = val;
+
+	return 0;
+}
+
+double *
+ens_curr(SDEnsemble *e)
+{
+	return &e->slab[e->save_step*e->nvars*e->width];
+}
+
+double *
+ens_next(SDEnsemble *e)
+{
+	return &e->slab[(e->save_step+1)*e->nvars*e->width];
+}
+
+int
+sd_ensemble_run_to(SDEnsemble *e, double end)
+{
+	double dt, time;
+	Slice *flows, *stocks;
+
+	if (!e)
+		return SD_ERR_UNSPECIFIED;
+
+	dt = e->spec.dt;
+	flows = &e->sim->module->flows;
+	stocks = &e->sim->module->stocks;
+	e->curr = ens_curr(e);
+	e->next = ens_next(e);
+
+	while (e->step < e->nsteps && e->curr[TIME*e->width] <= end) {
+		for (size_t b = 0; b < e->nblocks; b++) {
+			ens_calc(e, e->curr, b, flows, false);
+			ens_calc_stocks(e, e->next, b, stocks);
+		}
+
+		if (e->step + 1 == e->nsteps)
+			break;
+
+		time = e->spec.start + (e->step+1)*dt;
+		for (size_t l = 0; l < e->width; l++)
+			e->next[TIME*e->width + l] = time;
+
+		if (e->step++ % e->save_every != 0) {
+			memcpy(e->curr, e->next, e->nvars*e->width*sizeof(double));
+		} else {
+			e->save_step++;
+			e->curr = ens_curr(e);
+			e->next = ens_next(e);
+		}
+	}
+
+	return 0;
+}
+
+int
+sd_ensemble_run_to_end(SDEnsemble *e)
+{
+	if (!e)
+		return SD_ERR_UNSPECIFIED;
+	return sd_ensemble_run_to(e, e->spec.stop + 1);
+}
+
+int
+sd_ensemble_get_stepcount(SDEnsemble *e)
+{
+	if (!e)
+		return -1;
+	return e->nsaves;
+}
+
+int
+sd_ensemble_get_lanecount(SDEnsemble *e)
+{
+	if (!e)
+		return -1;
+	return e->nlanes;
+}
+
+int
+sd_ensemble_get_series(SDEnsemble *e, size_t lane, const char *name, double *results, size_t len)
+{
+	size_t i, off, row;
+
+	if (!e || !name || !results || lane >= e->nlanes)
+		return -1;
+
+	if (strcmp(name, "time") == 0) {
+		off = TIME;
+	} else {
+		AVar *av = resolve(e->sim->module, name);
+		if (!av)
+			return -1;
+		while (av->src)
+			av = av->src;
+		off = av->offset;
+	}
+
+	row = e->nvars*e->width;
+	for (i = 0; i <= e->nsaves && i < len; i++)
+		results[i] = e->slab[i*row + off*e->width + lane];
+
+	return i;
+}
+
+void
+ens_calc(SDEnsemble *e, double *data, size_t block, Slice *l, bool initial)
+{
+	double *base = data + block*LANES;
+	double v[LANES];
+
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		double *out;
+		if (!av->node) {
+			if (initial)
+				ens_calc(e, data, block, &av->initials, true);
+			else
+				ens_calc(e, data, block, &av->flows, false);
+			continue;
+		}
+		evisit(e, base, av->node, v);
+		if (av->v->gf) {
+			for (size_t j = 0; j < LANES; j++)
+				v[j] = lookup(av->v->gf, v[j]);
+		}
+		out = base + av->offset*e->width;
+		if (initial && av->is_const) {
+			const double *ov = e->override + av->offset*e->width + block*LANES;
+			const bool *is = e->is_override + av->offset*e->width + block*LANES;
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = is[j] ? ov[j] : v[j];
+		} else {
+			memcpy(out, v, sizeof(v));
+		}
+	}
+}
+
+void
+ens_calc_stocks(SDEnsemble *e, double *data, size_t block, Slice *l)
+{
+	const double dt = e->spec.dt;
+	const double *curr = e->curr + block*LANES;
+	double *base = data + block*LANES;
+	double v[LANES];
+
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		double *out = base + av->offset*e->width;
+		const double *prev = curr + av->offset*e->width;
+
+		switch (av->v->type) {
+		case VAR_STOCK:
+			memset(v, 0, sizeof(v));
+			for (size_t k = 0; k < av->inflows.len; k++) {
+				AVar *in = av->inflows.elems[k];
+				const double *flow = curr + in->offset*e->width;
+				for (size_t j = 0; j < LANES; j++)
+					v[j] += flow[j];
+			}
+			for (size_t k = 0; k < av->outflows.len; k++) {
+				AVar *out = av->outflows.elems[k];
+				const double *flow = curr + out->offset*e->width;
+				for (size_t j = 0; j < LANES; j++)
+					v[j] -= flow[j];
+			}
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = prev[j] + v[j]*dt;
+			break;
+		case VAR_MODULE:
+			ens_calc_stocks(e, data, block, &av->stocks);
+			break;
+		default:
+			memcpy(out, prev, sizeof(v));
+			break;
+		}
+	}
+}
+
+// evisit is the lane-vector counterpart of svisit: it evaluates n
+// for the LANES copies whose values start at data, writing the
+// results to out.  Both arms of an IF are evaluated and the result
+// chosen per lane with a branch-free select.
+void
+evisit(SDEnsemble *e, const double *data, Node *n, double *out)
+{
+	double cond[LANES], l[LANES], r[LANES];
+	double args[6][LANES];
+	double lane_args[6];
+	const double *src;
+	const double time = data[TIME*e->width];
+	const double dt = e->spec.dt;
+	size_t nargs;
+	int off;
+
+	switch (n->type) {
+	case N_PAREN:
+		evisit(e, data, n->left, out);
+		break;
+	case N_FLOATLIT:
+		for (size_t j = 0; j < LANES; j++)
+			out[j] = n->fval;
+		break;
+	case N_IDENT:
+		if (n->av->src)
+			off = n->av->src->offset;
+		else
+			off = n->av->offset;
+		src = data + off*e->width;
+		memcpy(out, src, LANES*sizeof(double));
+		break;
+	case N_CALL:
+		memset(args, 0, sizeof(args));
+		nargs = n->args.len < 6 ? n->args.len : 6;
+		for (size_t i = 0; i < nargs; i++)
+			evisit(e, data, n->args.elems[i], args[i]);
+		for (size_t j = 0; j < LANES; j++) {
+			for (size_t i = 0; i < 6; i++)
+				lane_args[i] = args[i][j];
+			out[j] = n->fn(e->sim, n, dt, time, n->args.len, lane_args);
+		}
+		break;
+	case N_IF:
+		evisit(e, data, n->cond, cond);
+		evisit(e, data, n->left, l);
+		evisit(e, data, n->right, r);
+		for (size_t j = 0; j < LANES; j++)
+			out[j] = cond[j] != 0 ? l[j] : r[j];
+		break;
+	case N_UNARY:
+		evisit(e, data, n->left, l);
+		switch (n->op) {
+		case '+':
+			memcpy(out, l, sizeof(l));
+			break;
+		case '-':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = -l[j];
+			break;
+		case '!':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] == 0 ? 1 : 0;
+			break;
+		default:
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = NAN;
+		}
+		break;
+	case N_BINARY:
+		evisit(e, data, n->left, l);
+		evisit(e, data, n->right, r);
+		switch (n->op) {
+		case '+':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] + r[j];
+			break;
+		case '-':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] - r[j];
+			break;
+		case '*':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] * r[j];
+			break;
+		case '/':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] / r[j];
+			break;
+		case '<':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] < r[j] ? 1 : 0;
+			break;
+		case '>':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] > r[j] ? 1 : 0;
+			break;
+		case '&':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] == 1 && r[j] == 1 ? 1 : 0;
+			break;
+		case '|':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] == 1 || r[j] == 1 ? 1 : 0;
+			break;
+		case '=':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] == r[j];
+			break;
+		case u'≠':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] != r[j];
+			break;
+		case u'≤':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] <= r[j] ? 1 : 0;
+			break;
+		case u'≥':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = l[j] >= r[j] ? 1 : 0;
+			break;
+		case '^':
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = pow(l[j], r[j]);
+			break;
+		default:
+			printf("unknown binary op (%c) encountered\n", n->op);
+			for (size_t j = 0; j < LANES; j++)
+				out[j] = NAN;
+		}
+		break;
+	case N_UNKNOWN:
+	default:
+		printf("unknown node encountered\n");
+		for (size_t j = 0; j < LANES; j++)
+			out[j] = NAN;
+		break;
+	}
+}
+
+int
+sd_ensemble_run(SDProject *p, const char *model_name, const SDEnsembleRuns *runs, size_t nruns, int nthreads)
+{
+	Batch b;
+	SDExecutor *ex;
+	SDSim *base;
+	size_t nsims = 0;
+	int err;
+
+	if (!p || !runs || nthreads < 0)
+		return SD_ERR_UNSPECIFIED;
+	if (!nruns)
+		return 0;
+
+	memset(&b, 0, sizeof(b));
+	b.runs = runs;
+
+	base = sd_sim_new(p, model_name);
+	if (!base)
+		return SD_ERR_UNSPECIFIED;
+	b.len = base->nsaves;
+
+	// check names once here, rather than failing every run
+	err = ensemble_runs_check(base, runs);
+	if (err)
+		goto out;
+
+	ex = executor_get(p);
+	nsims = nthreads ? (size_t)nthreads : sd_executor_concurrency(ex);
+	if (nsims > nruns)
+		nsims = nruns;
+
+	b.status = runs->status ? runs->status : calloc(nruns, sizeof(*b.status));
+	err = b.status ? worker_sims_init(&b.sims, base->compiled, ex, nsims) : SD_ERR_NOMEM;
+	if (err)
+		goto out;
+
+	err = sd_executor_parallel_for(ex, nruns, nsims, batch_run, &b);
+	if (err)
+		goto out;
+
+	for (size_t i = 0; i < nruns && !err; i++)
+		err = b.status[i];
+out:
+	worker_sims_free(&b.sims);
+	if (b.status != runs->status)
+		free(b.status);
+	sd_sim_unref(base);
+	return err;
+}
+
+void
+batch_run(void *data, size_t i, size_t worker)
+{
+	Batch *b = data;
+	const SDEnsembleRuns *runs = b->runs;
+	SDSim *s = worker_sim(&b->sims, worker, batch_setup, (void *)runs);
+	int err;
+
+	if (!s) {
+		b->status[i] = SD_ERR_NOMEM;
+		return;
+	}
+	err = ensemble_runs_sim(s, runs, i);
+	// a diverged run still reports the steps it completed
+	for (size_t j = 0; j < runs->noutputs; j++)
+		sd_sim_get_series(s, runs->outputs[j], &runs->results[i][j*b->len], b->len);
+
+	b->status[i] = err;
+}
+
+int
+batch_setup(SDSim *s, void *data)
+{
+	const SDEnsembleRuns *runs = data;
+
+	sd_sim_set_steady_state(s, runs->steady_tol, runs->steady_window);
+	sd_sim_set_finite_check(s, runs->finite_every);
+	return 0;
+}
+
+int
+worker_sims_init(WorkerSims *ws, SDCompiledModel *cm, SDExecutor *ex, size_t nworkers)
+{
+	memset(ws, 0, sizeof(*ws));
+	ws->cm = cm;
+	ws->topo = executor_topology(ex);
+	ws->narenas = topology_len(ws->topo);
+	ws->nsims = nworkers;
+	ws->sims = calloc(nworkers ? nworkers : 1, sizeof(*ws->sims));
+	ws->arenas = calloc(ws->narenas, sizeof(*ws->arenas));
+	if (!ws->sims || !ws->arenas)
+		return SD_ERR_NOMEM;
+	for (size_t i = 0; i < ws->narenas; i++) {
+		ws->arenas[i] = arena_new();
+		if (!ws->arenas[i])
+			return SD_ERR_NOMEM;
+	}
+	return 0;
+}
+
+// worker_sims_free releases ws, which may be only partly initialized
+// or zeroed.
+void
+worker_sims_free(WorkerSims *ws)
+{
+	for (size_t i = 0; ws->sims && i < ws->nsims; i++)
+		sd_sim_unref(ws->sims[i]);
+	free(ws->sims);
+	for (size_t i = 0; ws->arenas && i < ws->narenas; i++)
+		arena_free(ws->arenas[i]);
+	free(ws->arenas);
+	memset(ws, 0, sizeof(*ws));
+}
+
+SDSim *
+worker_sim(WorkerSims *ws, size_t worker, int (*setup)(SDSim *s, void *data), void *data)
+{
+	SDSim *s = ws->sims[worker];
+
+	if (s)
+		return s;
+	s = sim_new_in(ws->cm, ws->arenas[topology_current_node(ws->topo)]);
+	if (!s)
+		return NULL;
+	if (setup && setup(s, data)) {
+		sd_sim_unref(s);
+		return NULL;
+	}
+	ws->sims[worker] = s;
+	return s;
+}
+
+int
+sim_set_point(SDSim *s, const char *const *names, const double *values, size_t n)
+{
+	int err = 0;
+
+	// overrides persist across reset, so each point replaces the
+	// previous point's values before recomputing initial values.
+	for (size_t i = 0; i < n && !err; i++)
+		err = sd_sim_set_value(s, names[i], values[i]);
+	if (!err)
+		err = sd_sim_reset(s);
+	return err;
+}
+
+int
+sim_run_point(SDSim *s, const char *const *names, const double *values, size_t n)
+{
+	int err = sim_set_point(s, names, values, n);
+
+	if (!err)
+		err = sd_sim_run_to_end(s);
+	return err;
+}
+
+int
+ensemble_runs_check(SDSim *base, const SDEnsembleRuns *runs)
+{
+	if ((runs->nparams && (!runs->params || !runs->values)) ||
+	    (runs->noutputs && (!runs->outputs || !runs->results)))
+		return SD_ERR_UNSPECIFIED;
+	for (size_t i = 0; i < runs->nparams; i++) {
+		if (sd_sim_set_value(base, runs->params[i], 0))
+			return SD_ERR_UNSPECIFIED;
+	}
+	for (size_t i = 0; i < runs->noutputs; i++) {
+		if (strcmp(runs->outputs[i], "time") != 0 &&
+		    !resolve(base->module, runs->outputs[i]))
+			return SD_ERR_UNSPECIFIED;
+	}
+	return 0;
+}
+
+// ensemble_runs_sim simulates run i of runs from the start on s.
+int
+ensemble_runs_sim(SDSim *s, const SDEnsembleRuns *runs, size_t i)
+{
+	return sim_run_point(s, runs->params, &runs->values[i*runs->nparams], runs->nparams);
+}
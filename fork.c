@@ -0,0 +1,348 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// sd_ensemble_fork runs a batch in worker processes rather than
+// threads.  The model is compiled in the parent before forking, so
+// workers start with it already in (copy-on-write) memory.  Workers
+// take run indices from a counter in a shared anonymous mapping, and
+// simulate each run straight into its place in the same mapping,
+// which the parent keeps as the results.
+//
+// The segment starts with a Segment struct and the status of every
+// run, followed by each run's rows, laid out as a sim's slab is:
+// [run][save step][variable], with the extra row a sim's slab has
+// after its saved rows.
+//
+// A run's status is RUN_PENDING until a worker takes it, and
+// RUN_STARTED until it finishes.  A worker that dies leaves the run
+// it was on as RUN_STARTED, which the parent reports as
+// SD_ERR_WORKER; if runs remain, it forks a replacement.
+//
+// Windows has no fork, so there sd_ensemble_fork fails with
+// SD_ERR_WORKER, as it would if no worker could be started.
+
+// statuses are otherwise SD_ERR values, which are never positive
+#define RUN_PENDING 1
+#define RUN_STARTED 2
+
+// a worker that couldn't set up exits with this; its replacement
+// would only fail the same way.
+#define WORKER_SETUP_FAILED 2
+
+typedef struct {
+	size_t next; // the next run to hand out
+	size_t nruns;
+	size_t nsaves;
+	size_t nvars;
+	size_t runlen; // doubles per run
+} Segment;
+
+struct SDResults_s {
+	SDSim *base; // for resolving names
+	void *seg;
+	size_t seglen;
+	Segment *hdr;
+	int *status;
+	double *rows;
+	int refcount;
+};
+
+#ifndef _WIN32
+static pid_t fork_worker(SDResults *r, const SDEnsembleRuns *runs);
+static void worker_main(SDResults *r, const SDEnsembleRuns *runs);
+#endif
+static double *results_run(SDResults *r, size_t run);
+
+
+#ifndef _WIN32
+SDResults *
+sd_ensemble_fork(SDProject *p, const char *model_name, const SDEnsembleRuns *runs, size_t nruns, int nprocs, int *err)
+{
+	SDResults *r;
+	pid_t *pids = NULL;
+	size_t npids = 0, cap;
+	size_t status_off, rows_off, runlen;
+	int ret = SD_ERR_UNSPECIFIED;
+
+	if (!p || !runs || !nruns || nprocs < 0)
+		goto fail;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		ret = SD_ERR_NOMEM;
+		goto fail;
+	}
+	sd_results_ref(r);
+
+	r->base = sd_sim_new(p, model_name);
+	if (!r->base)
+		goto error;
+	ret = ensemble_runs_check(r->base, runs);
+	if (ret)
+		goto error;
+
+	if (!nprocs)
+		nprocs = pool_default_threads();
+	if ((size_t)nprocs > nruns)
+		nprocs = nruns;
+
+	// as in sd_sim_reset, a run needs a row after its last save
+	runlen = (r->base->nsaves + 1)*r->base->nvars;
+	status_off = sizeof(Segment);
+	rows_off = round_up(status_off + nruns*sizeof(int), 64);
+	r->seglen = rows_off + nruns*runlen*sizeof(double);
+	r->seg = mmap(NULL, r->seglen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (r->seg == MAP_FAILED) {
+		r->seg = NULL;
+		ret = SD_ERR_NOMEM;
+		goto error;
+	}
+	r->hdr = r->seg;
+	r->status = (int *)((char *)r->seg + status_off);
+	r->rows = (double *)((char *)r->seg + rows_off);
+	r->hdr->nruns = nruns;
+	r->hdr->nsaves = r->base->nsaves;
+	r->hdr->nvars = r->base->nvars;
+	r->hdr->runlen = runlen;
+	for (size_t i = 0; i < nruns; i++)
+		r->status[i] = RUN_PENDING;
+
+	// every run could take a worker down with it
+	cap = nprocs + nruns;
+	pids = calloc(cap, sizeof(*pids));
+	if (!pids) {
+		ret = SD_ERR_NOMEM;
+		goto error;
+	}
+	for (int i = 0; i < nprocs; i++) {
+		pid_t pid = fork_worker(r, runs);
+		if (pid < 0)
+			break;
+		pids[npids++] = pid;
+	}
+	if (!npids) {
+		ret = SD_ERR_WORKER;
+		goto error;
+	}
+
+	// workers are reaped in the order they were started; any that
+	// died while runs remain are replaced at the end of the list.
+	for (size_t i = 0; i < npids; i++) {
+		int wstatus;
+		pid_t pid;
+
+		while ((pid = waitpid(pids[i], &wstatus, 0)) < 0 && errno == EINTR)
+			;
+		if (pid < 0 || (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == WORKER_SETUP_FAILED))
+			continue;
+		if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+			continue;
+		if (r->hdr->next >= nruns || npids == cap)
+			continue;
+		pid = fork_worker(r, runs);
+		if (pid > 0)
+			pids[npids++] = pid;
+	}
+
+	ret = 0;
+	for (size_t i = 0; i < nruns; i++) {
+		if (r->status[i] > 0)
+			r->status[i] = SD_ERR_WORKER;
+		if (!ret)
+			ret = r->status[i];
+		if (runs->status)
+			runs->status[i] = r->status[i];
+		for (size_t j = 0; j < runs->noutputs; j++)
+			sd_results_get_series(r, i, runs->outputs[j], &runs->results[i][j*r->hdr->nsaves], r->hdr->nsaves);
+	}
+
+	free(pids);
+	if (err)
+		*err = ret;
+	return r;
+error:
+	free(pids);
+	sd_results_unref(r);
+fail:
+	if (err)
+		*err = ret;
+	return NULL;
+}
+
+pid_t
+fork_worker(SDResults *r, const SDEnsembleRuns *runs)
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+		worker_main(r, runs);
+	return pid;
+}
+
+// worker_main runs in the child, and never returns.  It exits with
+// _exit so that none of the parent's atexit handlers or buffered
+// output get run a second time.
+void
+worker_main(SDResults *r, const SDEnsembleRuns *runs)
+{
+	Segment *hdr = r->hdr;
+	SDSim *s = NULL;
+
+	for (;;) {
+		size_t i = __sync_fetch_and_add(&hdr->next, 1);
+		double *rows;
+		int err;
+
+		if (i >= hdr->nruns)
+			break;
+		r->status[i] = RUN_STARTED;
+		rows = results_run(r, i);
+		// the sim is created on the first run it takes, as other
+		// workers are writing to every other run's rows.  The
+		// parent's executor threads don't exist here, so runs are
+		// single threaded.
+		if (!s) {
+			s = sim_new_on(r->base->compiled, rows, hdr->runlen);
+			if (!s) {
+				r->status[i] = SD_ERR_NOMEM;
+				_exit(WORKER_SETUP_FAILED);
+			}
+			sd_sim_set_steady_state(s, runs->steady_tol, runs->steady_window);
+			sd_sim_set_finite_check(s, runs->finite_every);
+		} else {
+			sim_use_slab(s, rows, hdr->runlen);
+		}
+		err = ensemble_runs_sim(s, runs, i);
+		r->status[i] = err;
+	}
+
+	_exit(0);
+}
+#else
+SDResults *
+sd_ensemble_fork(SDProject *p, const char *model_name, const SDEnsembleRuns *runs, size_t nruns, int nprocs, int *err)
+{
+	if (err)
+		*err = SD_ERR_WORKER;
+	return NULL;
+}
+#endif
+
+void
+sd_results_ref(SDResults *r)
+{
+	if (!r)
+		return;
+	__sync_fetch_and_add(&r->refcount, 1);
+}
+
+void
+sd_results_unref(SDResults *r)
+{
+	if (!r)
+		return;
+	if (__sync_sub_and_fetch(&r->refcount, 1) == 0) {
+#ifndef _WIN32
+		if (r->seg)
+			munmap(r->seg, r->seglen);
+#endif
+		sd_sim_unref(r->base);
+		free(r);
+	}
+}
+
+int
+sd_results_get_runcount(SDResults *r)
+{
+	if (!r)
+		return -1;
+	return r->hdr->nruns;
+}
+
+int
+sd_results_get_stepcount(SDResults *r)
+{
+	if (!r)
+		return -1;
+	return r->hdr->nsaves;
+}
+
+int
+sd_results_get_varcount(SDResults *r)
+{
+	if (!r)
+		return -1;
+	return r->hdr->nvars;
+}
+
+int
+sd_results_get_status(SDResults *r, size_t run)
+{
+	if (!r || run >= r->hdr->nruns)
+		return SD_ERR_UNSPECIFIED;
+	return r->status[run];
+}
+
+int
+sd_results_get_offset(SDResults *r, const char *name)
+{
+	AVar *av;
+
+	if (!r || !name)
+		return -1;
+	if (strcmp(name, "time") == 0)
+		return TIME;
+	av = resolve(r->base->module, name);
+	if (!av)
+		return -1;
+	return av->offset;
+}
+
+const double *
+sd_results_get_rows(SDResults *r, size_t run)
+{
+	if (!r || run >= r->hdr->nruns)
+		return NULL;
+	return results_run(r, run);
+}
+
+int
+sd_results_get_series(SDResults *r, size_t run, const char *name, double *out, size_t len)
+{
+	const double *rows;
+	size_t nvars, i;
+	int off;
+
+	if (!r || !out || run >= r->hdr->nruns)
+		return -1;
+	off = sd_results_get_offset(r, name);
+	if (off < 0)
+		return -1;
+
+	rows = results_run(r, run);
+	nvars = r->hdr->nvars;
+	for (i = 0; i < r->hdr->nsaves && i < len; i++)
+		out[i] = rows[i*nvars + off];
+
+	return i;
+}
+
+double *
+results_run(SDResults *r, size_t run)
+{
+	return &r->rows[run*r->hdr->runlen];
+}
@@ -0,0 +1,460 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// Global sensitivity analysis runs a model at many points spread
+// over the box given by each constant's bounds, and summarizes how
+// much each constant moves each output at each chosen time.
+//
+// Morris screening follows trajectories through a grid of levels in
+// the unit cube, each of nparams+1 runs that move one constant at a
+// time, and averages the resulting elementary effects.  Sobol indices
+// use Saltelli's scheme: for each base sample, runs at two random
+// points A and B and at each AB_i, which is A with constant i taken
+// from B, estimating first-order indices as in Saltelli (2010) and
+// total-order indices as in Jansen (1999).
+//
+// Points are never stored: every run's point is derived from the
+// seed and the index of its sample, so runs are handed to the
+// executor a chunk at a time, and each chunk's outputs are folded
+// into running sums before the next chunk runs.  Memory doesn't
+// grow with the number of samples, and results are the same for
+// any number of threads.  As in a sweep, the model is compiled
+// once, and each worker thread reuses one sim without history.
+
+// about this many runs are handed to the executor at once
+#define CHUNK_RUNS 1024
+
+#define DEFAULT_LEVELS 4
+
+typedef struct GsaRun_s GsaRun;
+
+typedef struct {
+	GsaRun *run;
+	SDSim *s;     // from run's sims
+	double *u;    // a point in the unit cube, and for Sobol, B's
+	double *x;    // the values of the constants at u
+	size_t *perm; // a Morris trajectory's order of constants
+	double *out;  // the features of the run in progress
+	double *prev; // each output's value at the last save step
+	double prev_t;
+	size_t cursor; // next time to sample
+} GsaWorker;
+
+struct GsaRun_s {
+	const SDGsa *gsa;
+	WorkerSims sims;
+	GsaWorker *workers;
+	int *offsets; // of each output
+	size_t nfeat; // noutputs*ntimes
+	size_t runs_per_sample;
+	size_t first; // the first sample of the chunk
+	double *outs; // the chunk's features, [run][feature]
+	// gsa_fold's copy of a trajectory
+	double *u;
+	size_t *perm;
+	double delta; // Morris step
+	int levels;
+	int err;
+};
+
+// running sums, per feature (Sobol's variance) or per constant and
+// feature
+typedef struct {
+	double *n;
+	double *mean;
+	double *m2;
+	double *abs;   // Morris: sum of |EE|
+	double *first; // Sobol: sum of (fB - shift)*(fABi - fA)
+	double *total; // Sobol: sum of (fA - fABi)^2
+	// the first sample's fA; this doesn't change the expected
+	// value of first's terms, but keeps a large mean from swamping
+	// their variance.
+	double *shift;
+	size_t nsamples;
+} Sums;
+
+static int gsa_check(const SDGsa *gsa, SDSim *base, int *offsets);
+static GsaWorker *gsa_worker(GsaRun *run, size_t worker);
+static int gsa_setup(SDSim *s, void *data);
+static void gsa_point(void *data, size_t i, size_t worker);
+static void gsa_row(SDSim *s, int row, const double *values, void *data);
+static void gsa_fold(GsaRun *run, Sums *sums, size_t nsamples);
+static void gsa_results(GsaRun *run, Sums *sums, double *results);
+static void welford(double *n, double *mean, double *m2, double x);
+static void morris_point(GsaRun *run, size_t traj, size_t step, double *u, size_t *perm);
+static void sobol_point(GsaRun *run, size_t sample, size_t role, double *u);
+
+
+int
+sd_gsa_run(SDProject *p, const char *model_name, const SDGsa *gsa, double *results, int nthreads)
+{
+	GsaRun run;
+	Sums sums;
+	SDSim *base;
+	SDExecutor *ex;
+	size_t k, nsum, chunk, nworkers = 0;
+	int err;
+
+	if (!p || !gsa || !results || nthreads < 0 || !gsa->nparams ||
+	    !gsa->params || !gsa->lower || !gsa->upper ||
+	    !gsa->noutputs || !gsa->outputs || !gsa->ntimes || !gsa->times ||
+	    gsa->method < 0 || gsa->method >= SD_GSA_LEN || !gsa->samples ||
+	    (gsa->method == SD_GSA_MORRIS && gsa->levels%2) || gsa->levels < 0)
+		return SD_ERR_UNSPECIFIED;
+
+	base = sd_sim_new(p, model_name);
+	if (!base)
+		return SD_ERR_UNSPECIFIED;
+
+	memset(&run, 0, sizeof(run));
+	memset(&sums, 0, sizeof(sums));
+	k = gsa->nparams;
+	run.gsa = gsa;
+	run.nfeat = gsa->noutputs*gsa->ntimes;
+	run.runs_per_sample = gsa->method == SD_GSA_MORRIS ? k + 1 : k + 2;
+	run.levels = gsa->levels ? gsa->levels : DEFAULT_LEVELS;
+	// with an even number of levels, a step of delta from any
+	// level lands on another, up from the lower half of the grid
+	// and down from the upper half
+	run.delta = run.levels/(2.0*(run.levels - 1));
+
+	run.offsets = calloc(gsa->noutputs, sizeof(*run.offsets));
+	if (!run.offsets) {
+		err = SD_ERR_NOMEM;
+		goto out;
+	}
+	err = gsa_check(gsa, base, run.offsets);
+	if (err)
+		goto out;
+
+	chunk = CHUNK_RUNS/run.runs_per_sample;
+	if (!chunk)
+		chunk = 1;
+	nsum = (k + 1)*run.nfeat;
+	err = SD_ERR_NOMEM;
+	run.outs = calloc(chunk*run.runs_per_sample*run.nfeat, sizeof(*run.outs));
+	run.u = calloc(2*k, sizeof(*run.u));
+	run.perm = calloc(k, sizeof(*run.perm));
+	sums.n = calloc(nsum, sizeof(double));
+	sums.mean = calloc(nsum, sizeof(double));
+	sums.m2 = calloc(nsum, sizeof(double));
+	sums.abs = calloc(nsum, sizeof(double));
+	sums.first = calloc(nsum, sizeof(double));
+	sums.total = calloc(nsum, sizeof(double));
+	sums.shift = calloc(run.nfeat, sizeof(double));
+	if (!run.outs || !run.u || !run.perm || !sums.n || !sums.mean ||
+	    !sums.m2 || !sums.abs || !sums.first || !sums.total || !sums.shift)
+		goto out;
+
+	ex = executor_get(p);
+	nworkers = nthreads ? (size_t)nthreads : sd_executor_concurrency(ex);
+	run.workers = calloc(nworkers, sizeof(*run.workers));
+	if (!run.workers || worker_sims_init(&run.sims, base->compiled, ex, nworkers))
+		goto out;
+
+	err = 0;
+	for (run.first = 0; run.first < gsa->samples; run.first += chunk) {
+		size_t n = gsa->samples - run.first < chunk ? gsa->samples - run.first : chunk;
+		err = sd_executor_parallel_for(ex, n*run.runs_per_sample, nworkers, gsa_point, &run);
+		if (err)
+			break;
+		gsa_fold(&run, &sums, n);
+		if (gsa->progress) {
+			gsa_results(&run, &sums, results);
+			gsa->progress(gsa->progress_data, run.first + n, results);
+		}
+	}
+	if (!err) {
+		gsa_results(&run, &sums, results);
+		err = run.err;
+	}
+out:
+	for (size_t i = 0; run.workers && i < nworkers; i++) {
+		GsaWorker *w = &run.workers[i];
+		free(w->u);
+		free(w->x);
+		free(w->perm);
+		free(w->prev);
+	}
+	free(run.workers);
+	worker_sims_free(&run.sims);
+	free(run.offsets);
+	free(run.outs);
+	free(run.u);
+	free(run.perm);
+	free(sums.n);
+	free(sums.mean);
+	free(sums.m2);
+	free(sums.abs);
+	free(sums.first);
+	free(sums.total);
+	free(sums.shift);
+	sd_sim_unref(base);
+	return err;
+}
+
+// gsa_check looks up every name before anything runs.
+int
+gsa_check(const SDGsa *gsa, SDSim *base, int *offsets)
+{
+	for (size_t i = 0; i < gsa->nparams; i++) {
+		if (!(gsa->lower[i] <= gsa->upper[i]) ||
+		    sd_sim_set_value(base, gsa->params[i], gsa->lower[i]))
+			return SD_ERR_UNSPECIFIED;
+	}
+	for (size_t i = 0; i < gsa->noutputs; i++) {
+		offsets[i] = sd_sim_get_offset(base, gsa->outputs[i]);
+		if (offsets[i] < 0)
+			return SD_ERR_UNSPECIFIED;
+	}
+	for (size_t i = 0; i < gsa->ntimes; i++) {
+		if (gsa->times[i] < base->spec.start || gsa->times[i] > base->spec.stop ||
+		    (i && gsa->times[i] < gsa->times[i-1]))
+			return SD_ERR_UNSPECIFIED;
+	}
+	return 0;
+}
+
+// gsa_worker returns the worker's state, creating it on first use,
+// as sweep_worker does.
+GsaWorker *
+gsa_worker(GsaRun *run, size_t worker)
+{
+	GsaWorker *w = &run->workers[worker];
+	size_t k = run->gsa->nparams;
+
+	if (w->s)
+		return w;
+	w->run = run;
+	if (!w->u) {
+		w->u = calloc(2*k, sizeof(*w->u));
+		w->x = calloc(k, sizeof(*w->x));
+		w->perm = calloc(k, sizeof(*w->perm));
+		w->prev = calloc(run->gsa->noutputs, sizeof(*w->prev));
+	}
+	if (!w->u || !w->x || !w->perm || !w->prev)
+		return NULL;
+	w->s = worker_sim(&run->sims, worker, gsa_setup, w);
+	return w->s ? w : NULL;
+}
+
+int
+gsa_setup(SDSim *s, void *data)
+{
+	int err;
+
+	err = sd_sim_set_history(s, 0);
+	if (!err)
+		err = sd_sim_set_row_callback(s, gsa_row, data);
+	return err;
+}
+
+// gsa_point simulates run i of the chunk: role i%runs_per_sample of
+// sample first + i/runs_per_sample.
+void
+gsa_point(void *data, size_t i, size_t worker)
+{
+	GsaRun *run = data;
+	const SDGsa *gsa = run->gsa;
+	size_t sample = run->first + i/run->runs_per_sample;
+	size_t role = i%run->runs_per_sample;
+	GsaWorker *w;
+	int err = SD_ERR_NOMEM;
+
+	w = gsa_worker(run, worker);
+	if (w) {
+		if (gsa->method == SD_GSA_MORRIS)
+			morris_point(run, sample, role, w->u, w->perm);
+		else
+			sobol_point(run, sample, role, w->u);
+		w->out = &run->outs[i*run->nfeat];
+		w->cursor = 0;
+		for (size_t j = 0; j < gsa->nparams; j++)
+			w->x[j] = gsa->lower[j] + w->u[j]*(gsa->upper[j] - gsa->lower[j]);
+		err = sim_run_point(w->s, gsa->params, w->x, gsa->nparams);
+	}
+	if (err) {
+		for (size_t j = 0; j < run->nfeat; j++)
+			run->outs[i*run->nfeat + j] = NAN;
+		__sync_val_compare_and_swap(&run->err, 0, err);
+	}
+}
+
+// gsa_row samples each output at the chosen times, interpolating
+// linearly between save steps.
+void
+gsa_row(SDSim *s, int row, const double *values, void *data)
+{
+	GsaWorker *w = data;
+	GsaRun *run = w->run;
+	const SDGsa *gsa = run->gsa;
+	double t = values[TIME], eps = 1e-9*s->spec.dt;
+
+	for (; w->cursor < gsa->ntimes && gsa->times[w->cursor] <= t + eps; w->cursor++) {
+		double alpha = 1;
+		if (row && t - w->prev_t > eps)
+			alpha = (gsa->times[w->cursor] - w->prev_t)/(t - w->prev_t);
+		for (size_t j = 0; j < gsa->noutputs; j++) {
+			double v = values[run->offsets[j]];
+			if (alpha != 1)
+				v = w->prev[j] + (v - w->prev[j])*alpha;
+			w->out[j*gsa->ntimes + w->cursor] = v;
+		}
+	}
+	for (size_t j = 0; j < gsa->noutputs; j++)
+		w->prev[j] = values[run->offsets[j]];
+	w->prev_t = t;
+}
+
+// gsa_fold adds the chunk's samples to the running sums, in sample
+// order.  A sample with a failed run is left out.
+void
+gsa_fold(GsaRun *run, Sums *sums, size_t nsamples)
+{
+	const SDGsa *gsa = run->gsa;
+	size_t k = gsa->nparams, nfeat = run->nfeat;
+	double *u = run->u;
+	size_t *perm = run->perm;
+
+	for (size_t s = 0; s < nsamples; s++) {
+		const double *outs = &run->outs[s*run->runs_per_sample*nfeat];
+		bool ok = true;
+
+		for (size_t i = 0; i < run->runs_per_sample*nfeat && ok; i++)
+			ok = !isnan(outs[i]);
+		if (!ok)
+			continue;
+		sums->nsamples++;
+
+		if (gsa->method == SD_GSA_MORRIS) {
+			// each step of the trajectory moves one constant
+			morris_point(run, run->first + s, 0, u, perm);
+			for (size_t step = 1; step <= k; step++) {
+				size_t i = perm[step-1];
+				double d = u[i] + run->delta <= 1 ? run->delta : -run->delta;
+				const double *y0 = &outs[(step-1)*nfeat], *y1 = &outs[step*nfeat];
+				for (size_t f = 0; f < nfeat; f++) {
+					double ee = (y1[f] - y0[f])/d;
+					size_t at = i*nfeat + f;
+					welford(&sums->n[at], &sums->mean[at], &sums->m2[at], ee);
+					sums->abs[at] += fabs(ee);
+				}
+			}
+			continue;
+		}
+
+		// Sobol: A, B, then AB_i; the variance of the output is
+		// estimated from both A and B, in the last row of sums.
+		for (size_t f = 0; f < nfeat; f++) {
+			double fa = outs[f], fb = outs[nfeat + f];
+			size_t at = k*nfeat + f;
+			if (sums->nsamples == 1)
+				sums->shift[f] = fa;
+			welford(&sums->n[at], &sums->mean[at], &sums->m2[at], fa);
+			welford(&sums->n[at], &sums->mean[at], &sums->m2[at], fb);
+			for (size_t i = 0; i < k; i++) {
+				double fab = outs[(2 + i)*nfeat + f];
+				sums->first[i*nfeat + f] += (fb - sums->shift[f])*(fab - fa);
+				sums->total[i*nfeat + f] += (fa - fab)*(fa - fab);
+			}
+		}
+	}
+}
+
+void
+gsa_results(GsaRun *run, Sums *sums, double *results)
+{
+	const SDGsa *gsa = run->gsa;
+	size_t k = gsa->nparams, nfeat = run->nfeat;
+	double n = sums->nsamples;
+
+	for (size_t i = 0; i < k; i++) {
+		for (size_t f = 0; f < nfeat; f++) {
+			double *r = &results[(i*nfeat + f)*SD_GSA_STAT_LEN];
+			size_t at = i*nfeat + f;
+			for (size_t j = 0; j < SD_GSA_STAT_LEN; j++)
+				r[j] = NAN;
+			if (!sums->nsamples)
+				continue;
+			if (gsa->method == SD_GSA_MORRIS) {
+				r[SD_GSA_MU] = sums->mean[at];
+				r[SD_GSA_MU_STAR] = sums->abs[at]/n;
+				if (sums->n[at] > 1)
+					r[SD_GSA_SIGMA] = sqrt(sums->m2[at]/(sums->n[at] - 1));
+			} else {
+				double var = 0;
+				at = k*nfeat + f;
+				if (sums->n[at] > 1)
+					var = sums->m2[at]/(sums->n[at] - 1);
+				// a constant output has nothing to attribute
+				if (var == 0)
+					continue;
+				r[SD_GSA_FIRST] = sums->first[i*nfeat + f]/n/var;
+				r[SD_GSA_TOTAL] = sums->total[i*nfeat + f]/(2*n)/var;
+			}
+		}
+	}
+}
+
+void
+welford(double *n, double *mean, double *m2, double x)
+{
+	double d = x - *mean;
+
+	*n += 1;
+	*mean += d / *n;
+	*m2 += d*(x - *mean);
+}
+
+// morris_point stores the point at step of trajectory traj in u,
+// and the order its constants move in in perm.  The trajectory
+// starts at a random level of each constant, and moves each by
+// delta, up if there's room and otherwise down.
+void
+morris_point(GsaRun *run, size_t traj, size_t step, double *u, size_t *perm)
+{
+	size_t k = run->gsa->nparams;
+	uint64_t state = run->gsa->seed ^ (traj*0x9e3779b97f4a7c15ULL);
+
+	for (size_t i = 0; i < k; i++) {
+		size_t level = rng_uniform(&state)*run->levels;
+		u[i] = (double)level/(run->levels - 1);
+		perm[i] = i;
+	}
+	for (size_t i = k - 1; i > 0; i--) {
+		size_t j = rng_next(&state)%(i + 1), tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	for (size_t s = 0; s < step; s++) {
+		size_t i = perm[s];
+		u[i] += u[i] + run->delta <= 1 ? run->delta : -run->delta;
+	}
+}
+
+// sobol_point stores the point of role (0 for A, 1 for B, 2+i for
+// AB_i) of sample in u, with B's point after it.
+void
+sobol_point(GsaRun *run, size_t sample, size_t role, double *u)
+{
+	size_t k = run->gsa->nparams;
+	uint64_t state = run->gsa->seed ^ (sample*0x9e3779b97f4a7c15ULL);
+	double *b = u + k;
+
+	for (size_t i = 0; i < 2*k; i++)
+		u[i] = rng_uniform(&state);
+	if (role == 1)
+		memcpy(u, b, k*sizeof(double));
+	else if (role > 1)
+		u[role - 2] = b[role - 2];
+}
@@ -0,0 +1,377 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// Flows in the same level don't depend on each other, only on
+// stocks, constants and flows in earlier levels, so a level can be
+// evaluated in any order -- including in parallel.  A flow's level
+// is one more than the highest level among its dependencies.
+//
+// Levels are grouped into stages.  A level wide enough to keep
+// every thread busy is a stage of its own, split into a chunk per
+// thread; runs of narrower levels are merged into a single stage
+// evaluated, in level order, by the stepping thread, so that they
+// don't pay for a fork and join.
+//
+// A stage is forked and joined many times a second, too often for
+// a task per chunk.  Instead, levels_start submits nthreads-1 helper
+// tasks to the executor once per run, which wait for stages for as
+// long as the run lasts.  The stepping thread publishes a stage by
+// storing its generation and chunk count in ticket, claims chunks
+// alongside the helpers, and waits until every claimed chunk is
+// done.  Claimed chunks are always being worked on, so a helper the
+// executor is slow to start (or never starts) costs nothing but its
+// share of the work, which the others pick up.
+
+// the narrowest level worth splitting, per thread
+#define LEVEL_MIN_PER_THREAD 16
+// how many times a helper checks for a new stage before sleeping
+#define LEVEL_SPIN 4096
+
+typedef struct {
+	size_t lo;
+	size_t hi;
+	bool parallel;
+} Stage;
+
+struct Levels_s {
+	size_t nthreads;
+	SDExecutor *ex;
+	void **tasks; // the run's helpers
+	// the flows runlists of every module, ordered by level
+	AVar **flows;
+	size_t nflows;
+	Stage *stages;
+	size_t nstages;
+	// the stocks runlists of every module: stocks and constants
+	AVar **stocks;
+	size_t nstocks;
+
+	// the stage in progress, written before ticket is published
+	SDRangeFn fn;
+	SDSim *s;
+	double dt;
+	Stage *stage; // for flows
+	// the stage's generation << 32 | the chunks left to claim
+	uint64_t ticket;
+	size_t done; // chunks finished
+	// helpers that have stopped spinning wait on wake
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t sleeping;
+	bool quit;
+};
+
+static void levels_split(size_t lo, size_t hi, size_t id, size_t n, size_t *start, size_t *end);
+static void levels_eval(SDSim *s, double dt, size_t lo, size_t hi);
+static void levels_run(Levels *l, SDRangeFn fn, SDSim *s, double dt, Stage *stage);
+static bool levels_claim(Levels *l, size_t worker);
+static void levels_helper(void *data);
+static void levels_flows_chunk(void *data, size_t i, size_t worker);
+static void levels_stocks_chunk(void *data, size_t i, size_t worker);
+
+
+int
+levels_new(SDSim *s, size_t nthreads, Levels **result)
+{
+	Levels *l;
+	Slice flows, stocks;
+	int *level = NULL;
+	size_t *start = NULL;
+	size_t nlevels = 0;
+	int err = SD_ERR_NOMEM;
+
+	memset(&flows, 0, sizeof(flows));
+	memset(&stocks, 0, sizeof(stocks));
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return SD_ERR_NOMEM;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->wake, NULL);
+
+	if (runlist_flatten(&flows, &s->module->flows, false) ||
+	    runlist_flatten(&stocks, &s->module->stocks, true))
+		goto error;
+	l->nflows = flows.len;
+	l->nstocks = stocks.len;
+	l->stocks = (AVar **)stocks.elems;
+	stocks.elems = NULL;
+
+	level = malloc((s->nvars + 1)*sizeof(*level));
+	l->flows = calloc(l->nflows + 1, sizeof(*l->flows));
+	l->tasks = calloc(nthreads, sizeof(*l->tasks));
+	if (!level || !l->flows || !l->tasks)
+		goto error;
+	for (size_t i = 0; i < s->nvars; i++)
+		level[i] = -1;
+
+	// the runlist is in dependency order, so every dependency's
+	// level is known by the time we need it.
+	for (size_t i = 0; i < flows.len; i++) {
+		AVar *av = flows.elems[i];
+		int lv = 0;
+		for (size_t j = 0; j < av->direct_deps.len; j++) {
+			AVar *dep = av->direct_deps.elems[j];
+			while (dep->src)
+				dep = dep->src;
+			if (dep->model)
+				continue;
+			if (level[dep->offset] >= lv)
+				lv = level[dep->offset] + 1;
+		}
+		level[av->offset] = lv;
+		if ((size_t)lv + 1 > nlevels)
+			nlevels = lv + 1;
+	}
+
+	// counting sort by level
+	start = calloc(nlevels + 1, sizeof(*start));
+	l->stages = calloc(nlevels + 1, sizeof(*l->stages));
+	if (!start || !l->stages)
+		goto error;
+	for (size_t i = 0; i < flows.len; i++) {
+		AVar *av = flows.elems[i];
+		start[level[av->offset] + 1]++;
+	}
+	for (size_t k = 0; k < nlevels; k++)
+		start[k+1] += start[k];
+	for (size_t k = 0; k < nlevels; k++) {
+		Stage *prev = l->nstages ? &l->stages[l->nstages-1] : NULL;
+		size_t lo = start[k], hi = start[k+1];
+		bool parallel = hi - lo >= LEVEL_MIN_PER_THREAD*nthreads;
+		if (!parallel && prev && !prev->parallel) {
+			prev->hi = hi;
+		} else {
+			l->stages[l->nstages].lo = lo;
+			l->stages[l->nstages].hi = hi;
+			l->stages[l->nstages].parallel = parallel;
+			l->nstages++;
+		}
+	}
+	for (size_t i = 0; i < flows.len; i++) {
+		AVar *av = flows.elems[i];
+		l->flows[start[level[av->offset]]++] = av;
+	}
+
+	l->nthreads = nthreads;
+
+	free(level);
+	free(start);
+	free(flows.elems);
+	*result = l;
+	return 0;
+error:
+	free(level);
+	free(start);
+	free(flows.elems);
+	free(stocks.elems);
+	levels_free(l);
+	return err;
+}
+
+void
+levels_free(Levels *l)
+{
+	if (!l)
+		return;
+	free(l->flows);
+	free(l->stages);
+	free(l->stocks);
+	free(l->tasks);
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->wake);
+	free(l);
+}
+
+void
+levels_start(SDSim *s)
+{
+	Levels *l = s->levels;
+
+	l->ex = executor_get(s->project);
+	l->quit = false;
+	// a helper that can't be submitted leaves its share to the
+	// others
+	for (size_t i = 1; i < l->nthreads; i++)
+		l->tasks[i] = l->ex->ops->submit(l->ex, levels_helper, l);
+}
+
+void
+levels_stop(SDSim *s)
+{
+	Levels *l = s->levels;
+
+	pthread_mutex_lock(&l->lock);
+	__atomic_store_n(&l->quit, true, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&l->wake);
+	pthread_mutex_unlock(&l->lock);
+	for (size_t i = 1; i < l->nthreads; i++) {
+		if (l->tasks[i])
+			l->ex->ops->wait(l->ex, l->tasks[i]);
+		l->tasks[i] = NULL;
+	}
+}
+
+void
+levels_calc(SDSim *s, double dt)
+{
+	Levels *l = s->levels;
+
+	for (size_t i = 0; i < l->nstages; i++) {
+		Stage *stage = &l->stages[i];
+		if (stage->parallel)
+			levels_run(l, levels_flows_chunk, s, dt, stage);
+		else
+			levels_eval(s, dt, stage->lo, stage->hi);
+	}
+}
+
+void
+levels_calc_stocks(SDSim *s, double dt)
+{
+	levels_run(s->levels, levels_stocks_chunk, s, dt, NULL);
+}
+
+// levels_run splits a stage into a chunk per thread, returning once
+// every chunk is done.
+void
+levels_run(Levels *l, SDRangeFn fn, SDSim *s, double dt, Stage *stage)
+{
+	uint64_t gen = (__atomic_load_n(&l->ticket, __ATOMIC_RELAXED) >> 32) + 1;
+
+	l->fn = fn;
+	l->s = s;
+	l->dt = dt;
+	l->stage = stage;
+	__atomic_store_n(&l->done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->ticket, gen << 32 | l->nthreads, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&l->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&l->lock);
+		pthread_cond_broadcast(&l->wake);
+		pthread_mutex_unlock(&l->lock);
+	}
+
+	while (levels_claim(l, 0))
+		;
+	// the rest are claimed, and about to finish
+	while (__atomic_load_n(&l->done, __ATOMIC_ACQUIRE) < l->nthreads)
+		sched_yield();
+}
+
+// levels_claim runs a chunk of the stage in progress, returning
+// false if there are none left.
+bool
+levels_claim(Levels *l, size_t worker)
+{
+	uint64_t t = __atomic_load_n(&l->ticket, __ATOMIC_ACQUIRE);
+
+	while (t & 0xffffffff) {
+		// the generation keeps a ticket read before the last
+		// stage ended from claiming a chunk of this one
+		if (__atomic_compare_exchange_n(&l->ticket, &t, t - 1, false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			// the stage can't change until this chunk is done
+			l->fn(l, (t & 0xffffffff) - 1, worker);
+			__atomic_add_fetch(&l->done, 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+levels_helper(void *data)
+{
+	Levels *l = data;
+
+	for (;;) {
+		uint64_t t;
+		size_t spins = 0;
+
+		while (levels_claim(l, 1))
+			;
+		// wait for a stage with chunks left, or the end of the run
+		for (;;) {
+			t = __atomic_load_n(&l->ticket, __ATOMIC_SEQ_CST);
+			if ((t & 0xffffffff) || __atomic_load_n(&l->quit, __ATOMIC_SEQ_CST))
+				break;
+			if (++spins < LEVEL_SPIN)
+				continue;
+			pthread_mutex_lock(&l->lock);
+			__atomic_add_fetch(&l->sleeping, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&l->ticket, __ATOMIC_SEQ_CST) == t &&
+			       !__atomic_load_n(&l->quit, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&l->wake, &l->lock);
+			__atomic_sub_fetch(&l->sleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&l->lock);
+			spins = 0;
+		}
+		if (__atomic_load_n(&l->quit, __ATOMIC_SEQ_CST))
+			break;
+	}
+}
+
+void
+levels_split(size_t lo, size_t hi, size_t id, size_t n, size_t *start, size_t *end)
+{
+	size_t len = hi - lo;
+
+	*start = lo + id*len/n;
+	*end = lo + (id+1)*len/n;
+}
+
+void
+levels_eval(SDSim *s, double dt, size_t lo, size_t hi)
+{
+	Levels *l = s->levels;
+	double *curr = s->curr;
+
+	for (size_t k = lo; k < hi; k++) {
+		AVar *av = l->flows[k];
+		double v = svisit(s, curr, av->node, dt, curr[TIME]);
+		if (av->v->gf)
+			v = lookup(av->v->gf, v);
+		curr[av->offset] = v;
+	}
+}
+
+void
+levels_flows_chunk(void *data, size_t i, size_t worker)
+{
+	Levels *l = data;
+	size_t lo, hi;
+
+	levels_split(l->stage->lo, l->stage->hi, i, l->nthreads, &lo, &hi);
+	levels_eval(l->s, l->dt, lo, hi);
+}
+
+void
+levels_stocks_chunk(void *data, size_t i, size_t worker)
+{
+	Levels *l = data;
+	SDSim *s = l->s;
+	const double *curr = s->curr;
+	double *next = s->next;
+	size_t lo, hi;
+
+	levels_split(0, l->nstocks, i, l->nthreads, &lo, &hi);
+
+	for (size_t k = lo; k < hi; k++) {
+		AVar *av = l->stocks[k];
+		if (av->v->type == VAR_STOCK)
+			next[av->offset] = curr[av->offset] + stock_net_flow(av, curr)*l->dt;
+		else
+			next[av->offset] = curr[av->offset];
+	}
+}
@@ -2,21 +2,60 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "sd.h"
 
+// rows of results buffered between the simulating thread and the
+// writer with -stream
+#define RING_ROWS 1024
+// times a side yields on an empty or full ring before it parks
+#define RING_SPINS 64
+
 
 typedef struct {
 	double *series;
 } Result;
 
+// Ring is a single-producer, single-consumer queue of result rows.
+// head is only advanced by the simulating thread, and tail by the
+// writer, so rows move without locks.  A side that still finds the
+// ring empty (the writer) or full (the pusher) after RING_SPINS
+// yields parks on a condition variable, and the other side only
+// takes the lock to wake it when it sees the parked flag set.
+typedef struct {
+	double *rows; // RING_ROWS rows of nvars doubles
+	size_t nvars;
+	size_t head;
+	size_t tail;
+	bool done;
+	// column of each output variable in a row
+	int *offsets;
+	int noffsets;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+	bool writer_parked;
+	bool pusher_parked;
+} Ring;
+
 
 static void die(const char *, ...);
 static void usage(void);
+static void print_header(const char **names, int nvars);
+static int stream(SDSim *s, const char **names, int nvars);
+static int sweep(SDProject *p, const char *spec);
+static void ring_push(SDSim *s, int row, const double *values, void *data);
+static void *ring_writer(void *data);
+static bool ring_full(Ring *ring, size_t head);
+static bool ring_empty(Ring *ring, size_t tail);
+static void ring_wake(Ring *ring, pthread_cond_t *cond);
 
 static const char *argv0;
 
@@ -39,7 +78,11 @@ usage(void)
 	die("Usage: %s [OPTION...] PATH\n" \
 	    "Simulate system dynamics models.\n\n" \
 	    "Options:\n" \
-	    "  -help:\tshow this message\n",
+	    "  -help:\tshow this message\n" \
+	    "  -stream:\twrite results as they're simulated, in bounded memory\n" \
+	    "  -shm NAME:\tpublish live values in the shared memory object NAME\n" \
+	    "  -sweep SPEC:\tsimulate every point of the sweep in the CSV file SPEC\n" \
+	    "\t\tand print each point's summaries\n",
 	    argv0);
 }
 
@@ -54,11 +97,26 @@ main(int argc, char *const argv[])
 	const char *fmt;
 	const char **names = NULL;
 	const char *path = NULL;
+	const char *shm = NULL;
+	const char *spec = NULL;
+	bool streaming = false;
 
 	for (argv0 = argv[0], argv++, argc--; argc > 0; argv++, argc--) {
 		char const* arg = argv[0];
 		if (strcmp("-help", arg) == 0) {
 			usage();
+		} else if (strcmp("-stream", arg) == 0) {
+			streaming = true;
+		} else if (strcmp("-sweep", arg) == 0) {
+			if (argc < 2)
+				usage();
+			spec = argv[1];
+			argv++, argc--;
+		} else if (strcmp("-shm", arg) == 0) {
+			if (argc < 2)
+				usage();
+			shm = argv[1];
+			argv++, argc--;
 		} else if (arg[0] == '-') {
 			fprintf(stderr, "unknown arg '%s'\n", arg);
 			usage();
@@ -81,31 +139,55 @@ main(int argc, char *const argv[])
 	if (err)
 		die("error opening project: %s\n", sd_error_str(err));
 
+	if (spec) {
+		err = sweep(p, spec);
+		if (err)
+			die("error sweeping: %s\n", sd_error_str(err));
+		sd_project_unref(p);
+		fflush(stdout);
+		return 0;
+	}
+
 	s = sd_sim_new(p, NULL);
 	if (!s)
 		die("couldn't create simulation context\n");
 
-	sd_sim_run_to_end(s);
-
-	nsteps = sd_sim_get_stepcount(s);
 	nvars = sd_sim_get_varcount(s);
 	names = calloc(nvars, sizeof(*names));
-	results = calloc(nvars, sizeof(*results));
-	if (!names || !results)
+	if (!names)
 		die("out of memory\n");
-
 	if (sd_sim_get_varnames(s, names, nvars) != nvars)
 		die("get_varnames unexpected result != %d\n", nvars);
 
+	if (shm && sd_sim_set_snapshot_shm(s, shm, 1))
+		die("couldn't create shared memory object '%s'\n", shm);
+
+	if (streaming) {
+		err = stream(s, names, nvars);
+		if (err)
+			die("error simulating: %s\n", sd_error_str(err));
+		free(names);
+		sd_sim_unref(s);
+		sd_project_unref(p);
+		fflush(stdout);
+		return 0;
+	}
+
+	sd_sim_run_to_end(s);
+
+	nsteps = sd_sim_get_stepcount(s);
+	results = calloc(nvars, sizeof(*results));
+	if (!results)
+		die("out of memory\n");
+
 	for (int v = 0; v < nvars; v++) {
 		Result *result = results + v;
 		result->series = calloc(nsteps, sizeof(double));
 		n = sd_sim_get_series(s, names[v], result->series, nsteps);
 		if (n != nsteps)
 			die("short series read of %d for '%s' (%d/%d)\n", n, names[v], v, nvars);
-		fmt = v == nvars-1 ? "%s\n" : "%s\t";
-		printf(fmt, names[v]);
 	}
+	print_header(names, nvars);
 
 	for (int i = 0; i < nsteps; i++) {
 		for (int v = 0; v < nvars; v++) {
@@ -129,3 +211,193 @@ main(int argc, char *const argv[])
 
 	return 0;
 }
+
+void
+print_header(const char **names, int nvars)
+{
+	for (int v = 0; v < nvars; v++)
+		printf(v == nvars-1 ? "%s\n" : "%s\t", names[v]);
+}
+
+// sweep prints a row for each point of the sweep in spec: the
+// values of its constants, then each output's summary.
+int
+sweep(SDProject *p, const char *spec)
+{
+	SDSweep *sw;
+	double *results, *point;
+	size_t npoints;
+	int err, nparams, noutputs;
+
+	sw = sd_sweep_open(spec, &err);
+	if (!sw)
+		die("couldn't read sweep '%s': %s\n", spec, sd_error_str(err));
+	npoints = sd_sweep_get_pointcount(sw);
+	nparams = sd_sweep_get_paramcount(sw);
+	noutputs = sd_sweep_get_outputcount(sw);
+	results = calloc(npoints*noutputs, sizeof(double));
+	point = calloc(nparams, sizeof(double));
+	if (!results || !point)
+		die("out of memory\n");
+
+	err = sd_sweep_run(p, NULL, sw, results, 0);
+	if (err)
+		goto out;
+
+	for (int i = 0; i < nparams; i++)
+		printf("%s\t", sd_sweep_get_param(sw, i));
+	for (int i = 0; i < noutputs; i++) {
+		const char *name;
+		SDSummary kind;
+		sd_sweep_get_output(sw, i, &name, &kind);
+		printf(i == noutputs-1 ? "%s:%s\n" : "%s:%s\t", name, sd_summary_name(kind));
+	}
+	for (size_t j = 0; j < npoints; j++) {
+		sd_sweep_get_point(sw, j, point);
+		for (int i = 0; i < nparams; i++)
+			printf("%f\t", point[i]);
+		for (int i = 0; i < noutputs; i++)
+			printf(i == noutputs-1 ? "%f\n" : "%f\t", results[j*noutputs + i]);
+	}
+out:
+	free(point);
+	free(results);
+	sd_sweep_unref(sw);
+	return err;
+}
+
+// stream runs s to the end without keeping its history, while a
+// second thread prints each row as soon as it's been simulated.
+int
+stream(SDSim *s, const char **names, int nvars)
+{
+	Ring ring;
+	pthread_t writer;
+	int err;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.nvars = sd_sim_get_varcount(s);
+	ring.rows = calloc(RING_ROWS*ring.nvars, sizeof(double));
+	ring.offsets = calloc(nvars, sizeof(*ring.offsets));
+	if (!ring.rows || !ring.offsets)
+		die("out of memory\n");
+	ring.noffsets = nvars;
+	for (int v = 0; v < nvars; v++)
+		ring.offsets[v] = sd_sim_get_offset(s, names[v]);
+	if (pthread_mutex_init(&ring.lock, NULL) ||
+	    pthread_cond_init(&ring.nonempty, NULL) ||
+	    pthread_cond_init(&ring.nonfull, NULL))
+		die("couldn't set up streaming\n");
+
+	if (sd_sim_set_history(s, 0) || sd_sim_set_row_callback(s, ring_push, &ring))
+		die("couldn't set up streaming\n");
+
+	print_header(names, nvars);
+	if (pthread_create(&writer, NULL, ring_writer, &ring))
+		die("couldn't start writer thread\n");
+
+	err = sd_sim_run_to_end(s);
+
+	__atomic_store_n(&ring.done, true, __ATOMIC_SEQ_CST);
+	ring_wake(&ring, &ring.nonempty);
+	pthread_join(writer, NULL);
+
+	pthread_cond_destroy(&ring.nonfull);
+	pthread_cond_destroy(&ring.nonempty);
+	pthread_mutex_destroy(&ring.lock);
+	free(ring.rows);
+	free(ring.offsets);
+	return err;
+}
+
+void
+ring_push(SDSim *s, int row, const double *values, void *data)
+{
+	Ring *ring = data;
+	size_t head = ring->head;
+
+	for (int spins = 0; ring_full(ring, head); spins++) {
+		if (spins < RING_SPINS) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&ring->lock);
+		__atomic_store_n(&ring->pusher_parked, true, __ATOMIC_SEQ_CST);
+		while (ring_full(ring, head))
+			pthread_cond_wait(&ring->nonfull, &ring->lock);
+		__atomic_store_n(&ring->pusher_parked, false, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	memcpy(&ring->rows[(head % RING_ROWS)*ring->nvars], values, ring->nvars*sizeof(double));
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->writer_parked, __ATOMIC_SEQ_CST))
+		ring_wake(ring, &ring->nonempty);
+}
+
+void *
+ring_writer(void *data)
+{
+	Ring *ring = data;
+	size_t tail = ring->tail;
+	int spins = 0;
+
+	for (;;) {
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		if (tail == head) {
+			// done is set after the last push, so check the
+			// ring once more after seeing it
+			if (__atomic_load_n(&ring->done, __ATOMIC_SEQ_CST) &&
+			    ring_empty(ring, tail))
+				break;
+			if (spins++ < RING_SPINS) {
+				sched_yield();
+				continue;
+			}
+			pthread_mutex_lock(&ring->lock);
+			__atomic_store_n(&ring->writer_parked, true, __ATOMIC_SEQ_CST);
+			while (ring_empty(ring, tail) &&
+			       !__atomic_load_n(&ring->done, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&ring->nonempty, &ring->lock);
+			__atomic_store_n(&ring->writer_parked, false, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&ring->lock);
+			continue;
+		}
+		spins = 0;
+		for (; tail != head; tail++) {
+			const double *row = &ring->rows[(tail % RING_ROWS)*ring->nvars];
+			for (int v = 0; v < ring->noffsets; v++)
+				printf(v == ring->noffsets-1 ? "%f\n" : "%f\t", row[ring->offsets[v]]);
+			__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->pusher_parked, __ATOMIC_SEQ_CST))
+				ring_wake(ring, &ring->nonfull);
+		}
+	}
+
+	return NULL;
+}
+
+// the parked flags are stored before these are checked, and head
+// and tail before the flags are loaded, all sequentially
+// consistent, so either the parking side sees the other's progress
+// or the other side sees it parked and wakes it.
+bool
+ring_full(Ring *ring, size_t head)
+{
+	return head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == RING_ROWS;
+}
+
+bool
+ring_empty(Ring *ring, size_t tail)
+{
+	return tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+}
+
+// ring_wake signals cond under the lock, so it can't slip in
+// between a parking side's last check and its wait.
+void
+ring_wake(Ring *ring, pthread_cond_t *cond)
+{
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&ring->lock);
+}
@@ -0,0 +1,396 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifdef __linux__
+#define _GNU_SOURCE // sched_getcpu, CPU_SET and thread affinity
+#endif
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// On machines with more than one memory node (socket), memory is
+// placed on the node of the CPU that first touches it, and reaching
+// another node's memory is slower.  Pinned executors keep each
+// thread on one CPU, spreading threads across nodes, and batch runs
+// give every node its own arena, so a worker's sim lives on the
+// worker's node.
+//
+// The topology comes from /sys/devices/system/node, or from the
+// SD_TOPOLOGY environment variable or a string passed to
+// sd_executor_new_pinned: the CPU list of each node, separated by
+// semicolons, e.g. "0-3,8;4-7".
+//
+// Threads are only pinned, and the node a thread runs on only known,
+// on Linux.  Elsewhere sd_executor_new_pinned starts an unpinned
+// executor, and batch runs use a single arena.
+
+// arenas map memory this much at a time
+#define ARENA_CHUNK (4<<20)
+
+#define MAX_CPUS 4096
+
+struct Topology_s {
+	size_t nnodes;
+	int **cpus;     // the CPUs of each node, -1 terminated
+	size_t *ncpus;  // per node
+	int node_of[MAX_CPUS];
+};
+
+typedef struct ArenaChunk_s ArenaChunk;
+
+struct ArenaChunk_s {
+	ArenaChunk *next;
+	size_t len;
+	size_t used;
+};
+
+struct Arena_s {
+	pthread_mutex_t lock;
+	ArenaChunk *chunks;
+};
+
+static Topology *topology_alloc(void);
+static int topology_add_node(Topology *t, const char *cpulist, size_t len);
+static int topology_read_sys(Topology *t);
+static ArenaChunk *chunk_map(size_t len);
+static void chunk_unmap(ArenaChunk *c);
+
+
+Topology *
+topology_alloc(void)
+{
+	Topology *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+	for (size_t i = 0; i < MAX_CPUS; i++)
+		t->node_of[i] = -1;
+	return t;
+}
+
+int
+topology_parse(const char *spec, Topology **result)
+{
+	Topology *t;
+	int err;
+
+	t = topology_alloc();
+	if (!t)
+		return SD_ERR_NOMEM;
+
+	for (const char *s = spec; s && *s;) {
+		const char *end = strchr(s, ';');
+		size_t len = end ? (size_t)(end - s) : strlen(s);
+		err = topology_add_node(t, s, len);
+		if (err)
+			goto error;
+		s += len + (end ? 1 : 0);
+	}
+	if (!t->nnodes) {
+		err = SD_ERR_UNSPECIFIED;
+		goto error;
+	}
+
+	*result = t;
+	return 0;
+error:
+	topology_free(t);
+	return err;
+}
+
+int
+topology_detect(Topology **result)
+{
+	const char *spec = getenv("SD_TOPOLOGY");
+	Topology *t;
+	char cpus[32];
+	int err;
+
+	if (spec && *spec)
+		return topology_parse(spec, result);
+
+	t = topology_alloc();
+	if (!t)
+		return SD_ERR_NOMEM;
+	err = topology_read_sys(t);
+	if (err == SD_ERR_NOMEM) {
+		topology_free(t);
+		return err;
+	}
+	if (!err && t->nnodes) {
+		*result = t;
+		return 0;
+	}
+	topology_free(t);
+
+	// one node with every CPU
+	snprintf(cpus, sizeof(cpus), "0-%zu", pool_default_threads() - 1);
+	return topology_parse(cpus, result);
+}
+
+void
+topology_free(Topology *t)
+{
+	if (!t)
+		return;
+	for (size_t i = 0; i < t->nnodes; i++)
+		free(t->cpus[i]);
+	free(t->cpus);
+	free(t->ncpus);
+	free(t);
+}
+
+size_t
+topology_len(Topology *t)
+{
+	return t ? t->nnodes : 1;
+}
+
+size_t
+topology_ncpus(Topology *t)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; t && i < t->nnodes; i++)
+		n += t->ncpus[i];
+	return n;
+}
+
+int
+topology_node_of(Topology *t, int cpu)
+{
+	if (!t || cpu < 0 || cpu >= MAX_CPUS || t->node_of[cpu] < 0)
+		return 0;
+	return t->node_of[cpu];
+}
+
+// topology_cpu returns the CPU the i'th pinned thread runs on.
+// Threads are dealt out to nodes in turn, so a few threads are
+// spread across every node's memory bandwidth.
+int
+topology_cpu(Topology *t, size_t i)
+{
+	size_t node = i % t->nnodes;
+	return t->cpus[node][(i / t->nnodes) % t->ncpus[node]];
+}
+
+// topology_current_node returns the node of the CPU the calling
+// thread is running on.
+int
+topology_current_node(Topology *t)
+{
+#ifdef __linux__
+	return topology_node_of(t, sched_getcpu());
+#else
+	return 0;
+#endif
+}
+
+// topology_pin restricts thread to cpu, on a best-effort basis.
+int
+topology_pin(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return SD_ERR_UNSPECIFIED;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set) ? SD_ERR_UNSPECIFIED : 0;
+#else
+	return SD_ERR_UNSPECIFIED;
+#endif
+}
+
+// topology_add_node parses a Linux CPU list like "0-3,8,10-11".
+int
+topology_add_node(Topology *t, const char *cpulist, size_t len)
+{
+	int *cpus = NULL, **all;
+	size_t n = 0, *ncpus;
+	const char *s = cpulist, *end = cpulist + len;
+
+	while (s < end) {
+		char *next;
+		long lo, hi;
+
+		while (s < end && isspace((unsigned char)*s))
+			s++;
+		if (s == end)
+			break;
+		lo = strtol(s, &next, 10);
+		if (next == s || lo < 0 || lo >= MAX_CPUS)
+			goto error;
+		hi = lo;
+		s = next;
+		if (s < end && *s == '-') {
+			s++;
+			hi = strtol(s, &next, 10);
+			if (next == s || hi < lo || hi >= MAX_CPUS)
+				goto error;
+			s = next;
+		}
+		for (long cpu = lo; cpu <= hi; cpu++) {
+			int *grown = realloc(cpus, (n + 2)*sizeof(*cpus));
+			if (!grown) {
+				free(cpus);
+				return SD_ERR_NOMEM;
+			}
+			cpus = grown;
+			cpus[n++] = cpu;
+			cpus[n] = -1;
+		}
+		while (s < end && isspace((unsigned char)*s))
+			s++;
+		if (s < end && *s != ',')
+			goto error;
+		if (s < end)
+			s++;
+	}
+	if (!n)
+		goto error;
+
+	all = realloc(t->cpus, (t->nnodes + 1)*sizeof(*all));
+	if (!all) {
+		free(cpus);
+		return SD_ERR_NOMEM;
+	}
+	t->cpus = all;
+	ncpus = realloc(t->ncpus, (t->nnodes + 1)*sizeof(*ncpus));
+	if (!ncpus) {
+		free(cpus);
+		return SD_ERR_NOMEM;
+	}
+	t->ncpus = ncpus;
+
+	for (size_t i = 0; i < n; i++)
+		t->node_of[cpus[i]] = t->nnodes;
+	t->cpus[t->nnodes] = cpus;
+	t->ncpus[t->nnodes] = n;
+	t->nnodes++;
+	return 0;
+error:
+	free(cpus);
+	return SD_ERR_UNSPECIFIED;
+}
+
+int
+topology_read_sys(Topology *t)
+{
+	char path[64], buf[1024];
+
+	for (int node = 0; node < MAX_CPUS; node++) {
+		FILE *f;
+		size_t len;
+		int err;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		f = fopen(path, "r");
+		if (!f)
+			break;
+		len = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		buf[len] = '\0';
+		// nodes with memory but no CPUs have nothing to pin to
+		if (strspn(buf, " \n") == len)
+			continue;
+		err = topology_add_node(t, buf, len);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+Arena *
+arena_new(void)
+{
+	Arena *a = calloc(1, sizeof(*a));
+
+	if (!a)
+		return NULL;
+	pthread_mutex_init(&a->lock, NULL);
+	return a;
+}
+
+void
+arena_free(Arena *a)
+{
+	if (!a)
+		return;
+	for (ArenaChunk *c = a->chunks, *next; c; c = next) {
+		next = c->next;
+		chunk_unmap(c);
+	}
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+// arena_alloc returns len zeroed bytes, which nothing has touched
+// if they come from a new chunk: the first thread to write to them
+// decides which node they live on.
+void *
+arena_alloc(Arena *a, size_t len)
+{
+	ArenaChunk *c;
+	void *p = NULL;
+
+	len = round_up(len, 64);
+
+	pthread_mutex_lock(&a->lock);
+	c = a->chunks;
+	if (!c || c->len - c->used < len) {
+		size_t clen = round_up(len + round_up(sizeof(*c), 64), ARENA_CHUNK);
+		c = chunk_map(clen);
+		if (!c)
+			goto out;
+		c->len = clen;
+		c->used = round_up(sizeof(*c), 64);
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+	p = (char *)c + c->used;
+	c->used += len;
+out:
+	pthread_mutex_unlock(&a->lock);
+	return p;
+}
+
+// chunk_map returns len zeroed bytes; mapped fresh where mmap is
+// available, so that no page is touched until the arena's user
+// writes to it.
+ArenaChunk *
+chunk_map(size_t len)
+{
+	ArenaChunk *c;
+
+#ifdef _WIN32
+	c = calloc(1, len);
+#else
+	c = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+		c = NULL;
+#endif
+	return c;
+}
+
+void
+chunk_unmap(ArenaChunk *c)
+{
+#ifdef _WIN32
+	free(c);
+#else
+	munmap(c, c->len);
+#endif
+}
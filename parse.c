@@ -60,6 +60,15 @@ static const char *const BINARY[] = {
 };
 static const int MAX_BINARY = sizeof(BINARY)/sizeof(BINARY[0]);
 
+// deep enough for any hand-written equation; node_walk moves to the
+// heap for deeper, generated ones.
+#define WALK_STACK_LEN 64
+
+typedef struct {
+	Node *n;
+	size_t next; // index of the next child to visit
+} WalkFrame;
+
 static void parser_errorf(Parser *p, const char *s, ...);
 static bool consume_tok(Parser *p, Rune r);
 static bool consume_any(Parser *p, const char *ops, Rune *op);
@@ -70,7 +79,7 @@ static bool call(Parser *p, Node **n, Node *fn);
 static bool ident(Parser *p, Node **n);
 static bool num(Parser *p, Node **n);
 
-static bool visit(Walker *w, Node *n);
+static Node *node_child(Node *n, size_t i);
 
 int
 avar_eqn_parse(AVar *v)
@@ -825,100 +834,94 @@ node_free(Node *n)
 	free(n);
 }
 
-bool
-visit(Walker *w, Node *n)
+// node_child returns the i-th child of n in evaluation order, or
+// NULL once n's children are exhausted.
+Node *
+node_child(Node *n, size_t i)
 {
-	Walker *wc = NULL;
-	bool ok = true;
-
-	w->ops->start(w, n);
-
 	switch (n->type) {
 	case N_PAREN:
-		wc = w->ops->start_child(w, n->left);
-		ok = visit(wc, n->left);
-		wc->ops->unref(wc);
-		w->ops->end_child(w, n->left);
-		break;
-	case N_FLOATLIT:
-	case N_IDENT:
-		break;
-	case N_CALL:
-		wc = w->ops->start_child(w, n->left);
-		if (wc) {
-			ok = visit(wc, n->left);
-			wc->ops->unref(wc);
-			w->ops->end_child(w, n->left);
-		}
-		if (!ok)
-			break;
-		for (size_t i = 0; i < n->args.len; i++) {
-			Node *nc = n->args.elems[i];
-			wc = w->ops->start_child(w, nc);
-			ok = visit(wc, nc);
-			wc->ops->unref(wc);
-			w->ops->end_child(w, nc);
-			if (!ok)
-				break;
-		}
-		break;
 	case N_UNARY:
-		wc = w->ops->start_child(w, n->left);
-		ok = visit(wc, n->left);
-		wc->ops->unref(wc);
-		w->ops->end_child(w, n->left);
-		if (!ok)
-			break;
-		break;
+		return i == 0 ? n->left : NULL;
+	case N_CALL:
+		if (i == 0)
+			return n->left;
+		return i - 1 < n->args.len ? n->args.elems[i - 1] : NULL;
 	case N_IF:
-		wc = w->ops->start_child(w, n->cond);
-		ok = visit(wc, n->cond);
-		wc->ops->unref(wc);
-		w->ops->end_child(w, n->cond);
-		if (!ok)
-			break;
+		if (i == 0)
+			return n->cond;
+		i--;
 		// fallthrough
 	case N_BINARY:
-		wc = w->ops->start_child(w, n->left);
-		ok = visit(wc, n->left);
-		wc->ops->unref(wc);
-		w->ops->end_child(w, n->left);
-		if (!ok)
-			break;
-		wc = w->ops->start_child(w, n->right);
-		ok = visit(wc, n->right);
-		wc->ops->unref(wc);
-		w->ops->end_child(w, n->right);
-		if (!ok)
-			break;
-		break;
-	case N_UNKNOWN:
+		if (i == 0)
+			return n->left;
+		return i == 1 ? n->right : NULL;
 	default:
-		// TODO: error
-		ok = false;
-		break;
+		return NULL;
 	}
-
-	if (w->ops->end)
-		w->ops->end(w);
-
-	return ok;
 }
 
 bool
 node_walk(Walker *w, Node *n)
 {
-	bool ok;
+	WalkFrame inline_stack[WALK_STACK_LEN];
+	WalkFrame *stack = inline_stack;
+	size_t cap = WALK_STACK_LEN;
+	size_t top = 0;
+	bool ok = true;
 
 	if (!w || !n)
 		return false;
 
-	// XXX: not necessary prob
-	w->ops->ref(w);
+	w->ops->start(w, n);
+	if (n->type == N_UNKNOWN || n->type > N_IF)
+		return false;
+	stack[0].n = n;
+	stack[0].next = 0;
+	top = 1;
+
+	while (top) {
+		WalkFrame *f = &stack[top - 1];
+		Node *child = node_child(f->n, f->next++);
+
+		if (!child) {
+			Node *done = f->n;
+			if (w->ops->end)
+				w->ops->end(w, done);
+			if (--top && w->ops->end_child)
+				w->ops->end_child(w, stack[top - 1].n, done);
+			continue;
+		}
+
+		if (w->ops->start_child && !w->ops->start_child(w, f->n, child))
+			continue;
+
+		w->ops->start(w, child);
+		if (child->type == N_UNKNOWN || child->type > N_IF) {
+			// TODO: error
+			ok = false;
+			break;
+		}
 
-	ok = visit(w, n);
+		if (top == cap) {
+			WalkFrame *bigger = malloc(2*cap*sizeof(*bigger));
+			if (!bigger) {
+				ok = false;
+				break;
+			}
+			memcpy(bigger, stack, cap*sizeof(*stack));
+			if (stack != inline_stack)
+				free(stack);
+			stack = bigger;
+			cap *= 2;
+		}
+		stack[top].n = child;
+		stack[top].next = 0;
+		top++;
+	}
 
-	w->ops->unref(w);
+	if (stack != inline_stack)
+		free(stack);
 
 	return ok;
 }
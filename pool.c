@@ -0,0 +1,457 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// All of libsd's threads come from an SDExecutor: the project's, if
+// the host application has set one, or else a process-wide pool of
+// one thread per CPU created on first use.
+//
+// sd_executor_parallel_for hands out the indices [0, n) to
+// nworkers workers.  Each worker starts with an equal, contiguous
+// share and takes indices from the front of it.  A worker that runs
+// out steals the back half of another worker's remaining share, so
+// a few long-running items don't leave the rest of the threads idle.
+//
+// Work is only ever moved between shares, never created, and every
+// worker drains its own share before looking elsewhere, so a worker
+// can stop as soon as a pass over the others finds nothing to steal.
+// The caller is worker 0, so everything gets done even if the
+// executor is slow to start (or can't start) the other workers.
+
+typedef struct {
+	// keep each worker's share on its own cache line
+	_Alignas(64) pthread_mutex_t lock;
+	size_t lo;
+	size_t hi;
+} Share;
+
+typedef struct Pool_s Pool;
+
+typedef struct {
+	Pool *pool;
+	size_t id;
+} Worker;
+
+struct Pool_s {
+	SDRangeFn fn;
+	void *data;
+	size_t nworkers;
+	Share *shares;
+	Worker *workers;
+};
+
+typedef struct Task_s Task;
+
+struct Task_s {
+	SDTaskFn fn;
+	void *data;
+	Task *next;
+	bool done;
+};
+
+// ThreadExecutor is the default SDExecutor, a fixed set of threads
+// taking tasks off a FIFO queue.
+typedef struct {
+	SDExecutor ex;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t finished;
+	Task *head;
+	Task *tail;
+	pthread_t *threads;
+	size_t nthreads;
+	Topology *topo; // if threads are pinned
+	bool quit;
+} ThreadExecutor;
+
+static void pool_task(void *data);
+static void pool_worker(Worker *w);
+static bool pool_take(Pool *pool, size_t id, size_t *i);
+static bool pool_steal(Pool *pool, size_t id);
+
+static SDExecutor *thread_executor_new(size_t nthreads, Topology *topo);
+static void *thread_executor_submit(void *data, SDTaskFn fn, void *fn_data);
+static void thread_executor_wait(void *data, void *task);
+static size_t thread_executor_concurrency(void *data);
+static void *thread_executor_main(void *data);
+static Task *thread_executor_pop(ThreadExecutor *te);
+static void thread_executor_run(ThreadExecutor *te, Task *t);
+static void default_executor_init(void);
+
+static const SDExecutorOps THREAD_EXECUTOR_OPS = {
+	.submit = thread_executor_submit,
+	.wait = thread_executor_wait,
+	.parallel_for = NULL, // the work-stealing loop below
+	.concurrency = thread_executor_concurrency,
+};
+
+static pthread_once_t default_executor_once = PTHREAD_ONCE_INIT;
+static SDExecutor *default_executor;
+
+
+size_t
+pool_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+}
+
+SDExecutor *
+sd_executor_default(void)
+{
+	pthread_once(&default_executor_once, default_executor_init);
+	return default_executor;
+}
+
+void
+default_executor_init(void)
+{
+	default_executor = sd_executor_new(0);
+}
+
+SDExecutor *
+executor_get(SDProject *p)
+{
+	if (p && p->executor)
+		return p->executor;
+	return sd_executor_default();
+}
+
+size_t
+sd_executor_concurrency(SDExecutor *ex)
+{
+	if (!ex)
+		return 1;
+	return ex->ops->concurrency(ex);
+}
+
+int
+sd_executor_parallel_for(SDExecutor *ex, size_t n, size_t nworkers, SDRangeFn fn, void *data)
+{
+	Pool pool;
+	void **tasks;
+	int err = 0;
+
+	if (!fn)
+		return SD_ERR_UNSPECIFIED;
+	if (!nworkers)
+		nworkers = sd_executor_concurrency(ex);
+	if (nworkers > n)
+		nworkers = n;
+	if (!ex || nworkers <= 1) {
+		for (size_t i = 0; i < n; i++)
+			fn(data, i, 0);
+		return 0;
+	}
+	if (ex->ops->parallel_for)
+		return ex->ops->parallel_for(ex, n, nworkers, fn, data);
+
+	pool.fn = fn;
+	pool.data = data;
+	pool.nworkers = nworkers;
+	pool.shares = aligned_alloc(64, nworkers*sizeof(Share));
+	pool.workers = calloc(nworkers, sizeof(Worker));
+	tasks = calloc(nworkers, sizeof(*tasks));
+	if (!pool.shares || !pool.workers || !tasks) {
+		err = SD_ERR_NOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&pool.shares[i].lock, NULL);
+		pool.shares[i].lo = i*n/nworkers;
+		pool.shares[i].hi = (i+1)*n/nworkers;
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+	}
+
+	// if a task can't be submitted, its share is stolen by the
+	// others.
+	for (size_t i = 1; i < nworkers; i++)
+		tasks[i] = ex->ops->submit(ex, pool_task, &pool.workers[i]);
+	pool_worker(&pool.workers[0]);
+	for (size_t i = 1; i < nworkers; i++) {
+		if (tasks[i])
+			ex->ops->wait(ex, tasks[i]);
+	}
+
+	for (size_t i = 0; i < nworkers; i++)
+		pthread_mutex_destroy(&pool.shares[i].lock);
+out:
+	free(pool.shares);
+	free(pool.workers);
+	free(tasks);
+	return err;
+}
+
+void
+pool_task(void *data)
+{
+	pool_worker(data);
+}
+
+void
+pool_worker(Worker *w)
+{
+	Pool *pool = w->pool;
+	size_t i;
+
+	for (;;) {
+		while (pool_take(pool, w->id, &i))
+			pool->fn(pool->data, i, w->id);
+		if (!pool_steal(pool, w->id))
+			break;
+	}
+}
+
+bool
+pool_take(Pool *pool, size_t id, size_t *i)
+{
+	Share *s = &pool->shares[id];
+	bool ok = false;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->lo < s->hi) {
+		*i = s->lo++;
+		ok = true;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ok;
+}
+
+bool
+pool_steal(Pool *pool, size_t id)
+{
+	Share *own = &pool->shares[id];
+
+	for (size_t k = 1; k < pool->nworkers; k++) {
+		Share *victim = &pool->shares[(id + k) % pool->nworkers];
+		size_t lo, hi, mid;
+
+		pthread_mutex_lock(&victim->lock);
+		lo = victim->lo;
+		hi = victim->hi;
+		if (lo >= hi) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		// leave the victim the front half, which it will get to
+		// first; a single remaining item is taken outright.
+		mid = lo + (hi - lo)/2;
+		victim->hi = mid;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&own->lock);
+		own->lo = mid;
+		own->hi = hi;
+		pthread_mutex_unlock(&own->lock);
+		return true;
+	}
+
+	return false;
+}
+
+SDExecutor *
+sd_executor_new(size_t nthreads)
+{
+	if (!nthreads)
+		nthreads = pool_default_threads();
+	return thread_executor_new(nthreads, NULL);
+}
+
+SDExecutor *
+sd_executor_new_pinned(size_t nthreads, const char *topology)
+{
+	Topology *topo;
+	SDExecutor *ex;
+	int err;
+
+	err = topology ? topology_parse(topology, &topo) : topology_detect(&topo);
+	if (err)
+		return NULL;
+	if (!nthreads)
+		nthreads = topology_ncpus(topo);
+#ifndef __linux__
+	// threads can only be pinned, and nodes told apart, on Linux
+	topology_free(topo);
+	topo = NULL;
+#endif
+
+	ex = thread_executor_new(nthreads, topo);
+	if (!ex)
+		topology_free(topo);
+	return ex;
+}
+
+Topology *
+executor_topology(SDExecutor *ex)
+{
+	if (!ex || ex->ops != &THREAD_EXECUTOR_OPS)
+		return NULL;
+	return ((ThreadExecutor *)ex)->topo;
+}
+
+// thread_executor_new starts nthreads threads, pinning each to a CPU
+// of topo if it isn't NULL.  The executor owns topo.
+SDExecutor *
+thread_executor_new(size_t nthreads, Topology *topo)
+{
+	ThreadExecutor *te;
+	size_t started;
+
+	te = calloc(1, sizeof(*te));
+	if (!te)
+		return NULL;
+	te->ex.ops = &THREAD_EXECUTOR_OPS;
+	te->threads = calloc(nthreads, sizeof(*te->threads));
+	if (!te->threads) {
+		free(te);
+		return NULL;
+	}
+	pthread_mutex_init(&te->lock, NULL);
+	pthread_cond_init(&te->queued, NULL);
+	pthread_cond_init(&te->finished, NULL);
+
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&te->threads[started], NULL, thread_executor_main, te))
+			break;
+		// a thread that can't be pinned still does its share
+		if (topo)
+			topology_pin(te->threads[started], topology_cpu(topo, started));
+	}
+	te->nthreads = started;
+	if (!started) {
+		sd_executor_free(&te->ex);
+		return NULL;
+	}
+	te->topo = topo;
+
+	return &te->ex;
+}
+
+void
+sd_executor_free(SDExecutor *ex)
+{
+	ThreadExecutor *te = (ThreadExecutor *)ex;
+
+	if (!ex || ex->ops != &THREAD_EXECUTOR_OPS || ex == default_executor)
+		return;
+
+	pthread_mutex_lock(&te->lock);
+	te->quit = true;
+	pthread_cond_broadcast(&te->queued);
+	pthread_mutex_unlock(&te->lock);
+	for (size_t i = 0; i < te->nthreads; i++)
+		pthread_join(te->threads[i], NULL);
+
+	pthread_mutex_destroy(&te->lock);
+	pthread_cond_destroy(&te->queued);
+	pthread_cond_destroy(&te->finished);
+	free(te->threads);
+	topology_free(te->topo);
+	free(te);
+}
+
+void *
+thread_executor_submit(void *data, SDTaskFn fn, void *fn_data)
+{
+	ThreadExecutor *te = data;
+	Task *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->fn = fn;
+	t->data = fn_data;
+
+	pthread_mutex_lock(&te->lock);
+	if (te->tail)
+		te->tail->next = t;
+	else
+		te->head = t;
+	te->tail = t;
+	pthread_cond_signal(&te->queued);
+	pthread_mutex_unlock(&te->lock);
+
+	return t;
+}
+
+// thread_executor_wait runs queued tasks while it waits, so that
+// tasks waiting on other tasks can't tie up every thread.
+void
+thread_executor_wait(void *data, void *task)
+{
+	ThreadExecutor *te = data;
+	Task *t = task;
+
+	pthread_mutex_lock(&te->lock);
+	while (!t->done) {
+		Task *other = thread_executor_pop(te);
+		if (other)
+			thread_executor_run(te, other);
+		else
+			pthread_cond_wait(&te->finished, &te->lock);
+	}
+	pthread_mutex_unlock(&te->lock);
+
+	free(t);
+}
+
+size_t
+thread_executor_concurrency(void *data)
+{
+	ThreadExecutor *te = data;
+	return te->nthreads;
+}
+
+void *
+thread_executor_main(void *data)
+{
+	ThreadExecutor *te = data;
+
+	pthread_mutex_lock(&te->lock);
+	while (!te->quit) {
+		Task *t = thread_executor_pop(te);
+		if (t)
+			thread_executor_run(te, t);
+		else
+			pthread_cond_wait(&te->queued, &te->lock);
+	}
+	pthread_mutex_unlock(&te->lock);
+
+	return NULL;
+}
+
+// called with te->lock held
+Task *
+thread_executor_pop(ThreadExecutor *te)
+{
+	Task *t = te->head;
+
+	if (t) {
+		te->head = t->next;
+		if (!te->head)
+			te->tail = NULL;
+	}
+	return t;
+}
+
+// called with te->lock held, which is dropped while t runs
+void
+thread_executor_run(ThreadExecutor *te, Task *t)
+{
+	pthread_mutex_unlock(&te->lock);
+	t->fn(t->data);
+	pthread_mutex_lock(&te->lock);
+	t->done = true;
+	pthread_cond_broadcast(&te->finished);
+}
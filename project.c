@@ -32,6 +32,9 @@ static const char *SD_ERROR_MSGS[] = {
 	"bad equation lex",  // SD_ERR_BAD_LEX
 	"EOF",               // SD_ERR_EOF
 	"circularity error", // SD_ERR_CIRCULAR
+	"non-finite value",  // SD_ERR_DIVERGED
+	"canceled",          // SD_ERR_CANCELED
+	"worker died",       // SD_ERR_WORKER
 };
 
 
@@ -110,6 +113,14 @@ sd_project_unref(SDProject *p)
 	}
 }
 
+void
+sd_project_set_executor(SDProject *p, SDExecutor *executor)
+{
+	if (!p)
+		return;
+	p->executor = executor;
+}
+
 SDModel *
 sd_project_get_model(SDProject *p, const char *n)
 {
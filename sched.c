@@ -0,0 +1,299 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// SDScheduler time-slices many sims on the calling thread using
+// stride scheduling.  Each sim has a pass value, and every turn goes
+// to the sim with the lowest pass, which then advances by a stride
+// inversely proportional to its weight.  Over time each sim gets
+// turns in proportion to its weight, and no sim waits more than a
+// bounded number of turns.  Sims are kept in a binary min-heap
+// ordered by pass.  Each entry knows its heap index and each queued
+// sim its entry, so that add, remove and set_weight are O(log n).
+//
+// A sim joining the queue starts at the lowest pass currently
+// queued, so it neither jumps ahead of everyone nor has to catch up
+// on turns it wasn't around for.
+
+// stride for a weight of 1; large enough that weights up to a few
+// thousand still get distinct strides.
+#define STRIDE1 (1<<20)
+
+struct SchedEntry_s {
+	SDScheduler *sched;
+	size_t index; // in sched->heap
+	SDSim *sim;
+	double end;
+	SDRunFn cb;
+	void *data;
+	uint64_t pass;
+	uint64_t stride;
+	size_t turns;
+};
+
+struct SDScheduler_s {
+	SchedEntry **heap;
+	size_t len;
+	size_t cap;
+	size_t budget;
+	int refcount;
+};
+
+static bool entry_less(SchedEntry *a, SchedEntry *b);
+static void heap_up(SDScheduler *sched, size_t i);
+static void heap_down(SDScheduler *sched, size_t i);
+static void heap_set(SDScheduler *sched, size_t i, SchedEntry *e);
+static SchedEntry *heap_remove(SDScheduler *sched, size_t i);
+static SchedEntry *sched_find(SDScheduler *sched, SDSim *sim);
+static void entry_free(SchedEntry *e);
+
+
+SDScheduler *
+sd_scheduler_new(size_t step_budget)
+{
+	SDScheduler *sched;
+
+	if (!step_budget)
+		return NULL;
+
+	sched = calloc(1, sizeof(*sched));
+	if (!sched)
+		return NULL;
+	sched->budget = step_budget;
+	sd_scheduler_ref(sched);
+
+	return sched;
+}
+
+void
+sd_scheduler_ref(SDScheduler *sched)
+{
+	if (!sched)
+		return;
+	__sync_fetch_and_add(&sched->refcount, 1);
+}
+
+void
+sd_scheduler_unref(SDScheduler *sched)
+{
+	if (!sched)
+		return;
+	if (__sync_sub_and_fetch(&sched->refcount, 1) == 0) {
+		// sims still queued are dropped without their callbacks
+		for (size_t i = 0; i < sched->len; i++)
+			entry_free(sched->heap[i]);
+		free(sched->heap);
+		free(sched);
+	}
+}
+
+int
+sd_scheduler_add(SDScheduler *sched, SDSim *sim, double end, int weight, SDRunFn cb, void *data)
+{
+	SchedEntry *e;
+
+	if (!sched || !sim || weight < 1 || weight > STRIDE1)
+		return SD_ERR_UNSPECIFIED;
+	// a second entry would step the sim twice as often and call
+	// its callback twice
+	if (sim->sched_entry)
+		return SD_ERR_UNSPECIFIED;
+
+	if (sched->len == sched->cap) {
+		size_t cap = sched->cap ? sched->cap*2 : 16;
+		SchedEntry **heap = realloc(sched->heap, cap*sizeof(*heap));
+		if (!heap)
+			return SD_ERR_NOMEM;
+		sched->heap = heap;
+		sched->cap = cap;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return SD_ERR_NOMEM;
+	sd_sim_ref(sim);
+	sim->sched_entry = e;
+	e->sched = sched;
+	e->sim = sim;
+	e->end = end;
+	e->cb = cb;
+	e->data = data;
+	e->stride = STRIDE1/weight;
+	e->pass = sched->len ? sched->heap[0]->pass : 0;
+
+	heap_set(sched, sched->len++, e);
+	heap_up(sched, sched->len - 1);
+
+	return 0;
+}
+
+int
+sd_scheduler_remove(SDScheduler *sched, SDSim *sim)
+{
+	SchedEntry *e;
+
+	if (!sched || !sim)
+		return SD_ERR_UNSPECIFIED;
+
+	e = sched_find(sched, sim);
+	if (!e)
+		return SD_ERR_UNSPECIFIED;
+
+	heap_remove(sched, e->index);
+	entry_free(e);
+
+	return 0;
+}
+
+int
+sd_scheduler_set_weight(SDScheduler *sched, SDSim *sim, int weight)
+{
+	SchedEntry *e;
+
+	if (!sched || !sim || weight < 1 || weight > STRIDE1)
+		return SD_ERR_UNSPECIFIED;
+
+	e = sched_find(sched, sim);
+	if (!e)
+		return SD_ERR_UNSPECIFIED;
+
+	// takes effect from the sim's next turn
+	e->stride = STRIDE1/weight;
+
+	return 0;
+}
+
+int
+sd_scheduler_len(SDScheduler *sched)
+{
+	if (!sched)
+		return -1;
+	return sched->len;
+}
+
+int
+sd_scheduler_run(SDScheduler *sched, size_t turns)
+{
+	if (!sched)
+		return -1;
+
+	for (size_t t = 0; sched->len && (!turns || t < turns); t++) {
+		SchedEntry *e = sched->heap[0];
+		bool done;
+		int err;
+
+		err = sim_run_steps(e->sim, e->end, sched->budget, &done);
+		e->turns++;
+
+		if (!done) {
+			e->pass += e->stride;
+			heap_down(sched, 0);
+			continue;
+		}
+
+		heap_remove(sched, 0);
+		// the callback may re-add the sim
+		e->sim->sched_entry = NULL;
+		if (e->cb)
+			e->cb(e->sim, err, e->data);
+		sd_sim_unref(e->sim);
+		free(e);
+	}
+
+	return sched->len;
+}
+
+SchedEntry *
+sched_find(SDScheduler *sched, SDSim *sim)
+{
+	SchedEntry *e = sim->sched_entry;
+
+	if (!e || e->sched != sched)
+		return NULL;
+	return e;
+}
+
+void
+entry_free(SchedEntry *e)
+{
+	e->sim->sched_entry = NULL;
+	sd_sim_unref(e->sim);
+	free(e);
+}
+
+// ties go to whoever has had fewer turns, so that sims added
+// together take turns rather than one running to completion.
+bool
+entry_less(SchedEntry *a, SchedEntry *b)
+{
+	if (a->pass != b->pass)
+		return a->pass < b->pass;
+	return a->turns < b->turns;
+}
+
+void
+heap_up(SDScheduler *sched, size_t i)
+{
+	SchedEntry **h = sched->heap;
+
+	while (i > 0) {
+		size_t parent = (i - 1)/2;
+		SchedEntry *tmp;
+		if (!entry_less(h[i], h[parent]))
+			break;
+		tmp = h[i];
+		heap_set(sched, i, h[parent]);
+		heap_set(sched, parent, tmp);
+		i = parent;
+	}
+}
+
+void
+heap_down(SDScheduler *sched, size_t i)
+{
+	SchedEntry **h = sched->heap;
+
+	for (;;) {
+		size_t l = 2*i + 1, r = 2*i + 2, min = i;
+		SchedEntry *tmp;
+		if (l < sched->len && entry_less(h[l], h[min]))
+			min = l;
+		if (r < sched->len && entry_less(h[r], h[min]))
+			min = r;
+		if (min == i)
+			break;
+		tmp = h[i];
+		heap_set(sched, i, h[min]);
+		heap_set(sched, min, tmp);
+		i = min;
+	}
+}
+
+void
+heap_set(SDScheduler *sched, size_t i, SchedEntry *e)
+{
+	sched->heap[i] = e;
+	e->index = i;
+}
+
+SchedEntry *
+heap_remove(SDScheduler *sched, size_t i)
+{
+	SchedEntry *e = sched->heap[i];
+
+	--sched->len;
+	if (i < sched->len) {
+		heap_set(sched, i, sched->heap[sched->len]);
+		heap_down(sched, i);
+		heap_up(sched, i);
+	}
+	return e;
+}
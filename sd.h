@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
 	SD_USES_ARRAYS    = 1<<1,
@@ -25,11 +26,51 @@ typedef enum {
 	SD_ERR_BAD_LEX     = -5,
 	SD_ERR_EOF         = -6,
 	SD_ERR_CIRCULAR    = -7,
-	SD_ERR_MIN         = -8
+	SD_ERR_DIVERGED    = -8,
+	SD_ERR_CANCELED    = -9,
+	SD_ERR_WORKER      = -10,
+	SD_ERR_MIN         = -11
 } SDErrorEnum;
 
 typedef struct SDProject_s SDProject;
 typedef struct SDSim_s SDSim;
+typedef struct SDCompiledModel_s SDCompiledModel;
+typedef struct SDEnsemble_s SDEnsemble;
+typedef struct SDRun_s SDRun;
+typedef struct SDScheduler_s SDScheduler;
+typedef struct SDResults_s SDResults;
+typedef struct SDSweep_s SDSweep;
+typedef struct SDSens_s SDSens;
+typedef struct SDAdjoint_s SDAdjoint;
+typedef struct SDExecutor_s SDExecutor;
+typedef struct SDExecutorOps_s SDExecutorOps;
+
+typedef void (*SDTaskFn)(void *data);
+typedef void (*SDRangeFn)(void *data, size_t i, size_t worker);
+
+/// SDExecutorOps lets applications that already manage threads run
+/// libsd's parallel work on them.  Implement the operations and
+/// embed an SDExecutor pointing to them as the first member of your
+/// executor's struct; each operation is passed that struct.
+struct SDExecutorOps_s {
+	/// submit arranges for fn(data) to be called on some thread,
+	/// returning a handle to pass to wait, or NULL if it couldn't.
+	void *(*submit)(void *data, SDTaskFn fn, void *fn_data);
+	/// wait blocks until the task has returned and releases the
+	/// handle.  Every submitted task is waited for exactly once.
+	void (*wait)(void *data, void *task);
+	/// parallel_for is optional, and calls fn(fn_data, i, worker)
+	/// for every i in [0, n) before returning, where worker is in
+	/// [0, nworkers) and unique among calls running at the same
+	/// time.  If NULL, libsd load-balances over submit and wait.
+	int (*parallel_for)(void *data, size_t n, size_t nworkers, SDRangeFn fn, void *fn_data);
+	/// concurrency returns the number of tasks that can run at once.
+	size_t (*concurrency)(void *data);
+};
+
+struct SDExecutor_s {
+	const SDExecutorOps *ops;
+};
 
 /// sd_error_str returns a string representation describing one of the
 /// errors enumerated above.  The returned string must not be freed or
@@ -45,6 +86,33 @@ const char *sd_error_str(int err);
 SDProject *sd_project_open(const char *path, int *err);
 void sd_project_ref(SDProject *project);
 void sd_project_unref(SDProject *project);
+/// sd_project_set_executor makes every parallel operation on sims
+/// and ensembles of the project run on executor, which must outlive
+/// them.  Passing NULL restores the default executor.
+void sd_project_set_executor(SDProject *project, SDExecutor *executor);
+
+/// sd_executor_new creates an executor backed by nthreads threads,
+/// or one per CPU if nthreads is 0.  This is also what the default
+/// executor, returned by sd_executor_default, is; it is created
+/// the first time libsd needs a thread.
+SDExecutor *sd_executor_new(size_t nthreads);
+void sd_executor_free(SDExecutor *executor);
+/// sd_executor_new_pinned is sd_executor_new, with each thread pinned
+/// to its own CPU and threads spread across the machine's memory
+/// nodes (sockets).  Batch runs on a pinned executor keep each
+/// worker's memory on its own node.  topology overrides the detected
+/// layout, listing the CPUs of each node separated by semicolons,
+/// e.g. "0-3,8;4-7"; if NULL, the SD_TOPOLOGY environment variable,
+/// then /sys, are consulted.  An nthreads of 0 means one per CPU.
+/// Threads are only pinned on Linux; elsewhere this returns an
+/// unpinned executor.
+SDExecutor *sd_executor_new_pinned(size_t nthreads, const char *topology);
+SDExecutor *sd_executor_default(void);
+size_t sd_executor_concurrency(SDExecutor *executor);
+/// sd_executor_parallel_for calls fn(data, i, worker) for every i in
+/// [0, n) on at most nworkers of executor's threads, one of which is
+/// the calling thread, with an nworkers of 0 meaning all of them.
+int sd_executor_parallel_for(SDExecutor *executor, size_t n, size_t nworkers, SDRangeFn fn, void *data);
 
 /// sd_sim_new creates a new simulation context for the named model.
 /// If model_name is NULL, the context is created for the default/root
@@ -53,6 +121,31 @@ SDSim *sd_sim_new(SDProject *project, const char *model_name);
 void sd_sim_ref(SDSim *sim);
 void sd_sim_unref(SDSim *sim);
 
+/// sd_compiled_model_new parses, resolves and sorts the named model
+/// (or the root model if model_name is NULL) once.  The result is
+/// never modified, so it can be shared between threads, and creating
+/// a sim from it with sd_sim_new_from is a single allocation.
+/// sd_sim_new is sd_sim_new_from on a freshly compiled model.
+SDCompiledModel *sd_compiled_model_new(SDProject *project, const char *model_name);
+void sd_compiled_model_ref(SDCompiledModel *cm);
+void sd_compiled_model_unref(SDCompiledModel *cm);
+SDSim *sd_sim_new_from(SDCompiledModel *cm);
+/// sd_sim_get_compiled_model returns the model sim simulates, without
+/// adding a reference to it.
+SDCompiledModel *sd_sim_get_compiled_model(SDSim *sim);
+
+typedef enum {
+	SD_CLONE_HISTORY = 1<<0,
+} SDCloneFlag;
+
+/// sd_sim_clone creates a copy of sim, sharing its compiled model,
+/// that continues from the same point: the same time step, values,
+/// overrides and steady state, divergence and thread settings.
+/// Callbacks aren't copied.  Save steps already taken are only
+/// copied with SD_CLONE_HISTORY, and otherwise read as zero.  sim
+/// must not be running.
+SDSim *sd_sim_clone(SDSim *sim, int flags);
+
 int sd_sim_run_to(SDSim *sim, double time);
 int sd_sim_run_to_end(SDSim *sim);
 int sd_sim_get_stepcount(SDSim *sim);
@@ -61,10 +154,472 @@ int sd_sim_get_varnames(SDSim *sim, const char **result, size_t max);
 
 int sd_sim_reset(SDSim *sim);
 
+typedef void (*SDRunFn)(SDSim *sim, int err, void *data);
+typedef void (*SDProgressFn)(SDSim *sim, int nsaved, void *data);
+
+/// sd_sim_run_async runs sim to time end on the project's executor,
+/// and calls cb (if non-NULL) with the result from the thread that
+/// ran it.  The sim must not be used until the run is waited for.
+/// Returns NULL if the run couldn't be started.
+SDRun *sd_sim_run_async(SDSim *sim, double end, SDRunFn cb, void *data);
+/// sd_run_cancel asks a run to stop.  It stops within a few dozen
+/// time steps, failing with SD_ERR_CANCELED, and the sim can be
+/// resumed from where it stopped with sd_sim_run_to.
+void sd_run_cancel(SDRun *run);
+/// sd_run_wait blocks until the run has finished and its callback
+/// has returned, releases the run and returns the run's result.
+/// Every run must be waited for exactly once, canceled or not.
+int sd_run_wait(SDRun *run);
+/// sd_sim_set_progress calls fn every `every` save steps during a
+/// run, from the thread running the sim, with the number of save
+/// steps whose values are final, and once more when a run stops
+/// without error if that number has changed, so a run to the end
+/// reports every save step.  These can be read, e.g. with
+/// sd_sim_get_series, while the run continues.  An every of 0
+/// turns this off.
+int sd_sim_set_progress(SDSim *sim, int every, SDProgressFn fn, void *data);
+
+typedef void (*SDRowFn)(SDSim *sim, int row, const double *values, void *data);
+
+/// sd_sim_set_row_callback calls fn with each save step's values,
+/// in order, as soon as they are final, from the thread running the
+/// sim.  values holds sd_sim_get_varcount() doubles, indexed by
+/// sd_sim_get_offset, and is only valid during the call.
+int sd_sim_set_row_callback(SDSim *sim, SDRowFn fn, void *data);
+/// sd_sim_set_history with keep set to 0 stops sim from keeping
+/// every save step, so that its memory use doesn't grow with the
+/// length of the run.  Results are then only available through a
+/// row callback and sd_sim_get_value, and sd_sim_get_series fails.
+/// Resets the sim.
+int sd_sim_set_history(SDSim *sim, int keep);
+/// sd_sim_get_offset returns the index of the named variable in the
+/// rows passed to row callbacks, or -1.
+int sd_sim_get_offset(SDSim *sim, const char *name);
+
+/// sd_sim_set_snapshot makes the thread running sim publish its
+/// current values every `every` time steps, and at the last step,
+/// for other threads to read with sd_sim_read_snapshot while the run
+/// continues.  Publishing never waits for readers.  An every of 0
+/// turns this off.  Must not be called during a run.
+int sd_sim_set_snapshot(SDSim *sim, int every);
+/// sd_sim_read_snapshot copies up to len of the latest published
+/// values, indexed by sd_sim_get_offset, into values, and stores the
+/// time step they're from in step if it isn't NULL.  The copy is
+/// always of a single time step; it can be called from any thread,
+/// and only spins, briefly, while a snapshot is being written.
+/// Returns the number of values copied, or -1 if nothing has been
+/// published yet.
+int sd_sim_read_snapshot(SDSim *sim, double *values, size_t len, size_t *step);
+/// sd_sim_set_snapshot_shm is sd_sim_set_snapshot, publishing into
+/// the POSIX shared memory object name (e.g. "/sd-run") for other
+/// processes to map and read.  Any existing object of that name is
+/// replaced, and the object is removed when snapshots are turned off
+/// or the sim is released, unless another snapshot has since replaced
+/// it; processes that have it mapped can still read the last values
+/// published.  The object is laid out as an SDSnapshotHeader,
+/// followed at the given offsets by the names of the nvars
+/// variables, in offset order, and their values.  Fails on Windows,
+/// which has no POSIX shared memory.
+int sd_sim_set_snapshot_shm(SDSim *sim, const char *name, int every);
+
+#define SD_SNAPSHOT_MAGIC "sdsnap1"
+
+/// SDSnapshotHeader starts a shared memory snapshot.  Readers follow
+/// the same protocol as sd_sim_read_snapshot: atomically load seq
+/// (with acquire semantics), retry while it is odd, copy step and
+/// the values, and retry if seq has changed since.  seq is 0 until
+/// the first row is published, and the other fields, which never
+/// change, are only valid once it isn't.
+typedef struct {
+	char magic[8];   // SD_SNAPSHOT_MAGIC
+	uint32_t seq;
+	uint32_t nvars;
+	uint64_t step;   // the time step of the values
+	uint64_t nsteps; // in a complete run
+	uint64_t names;  // offset of nvars NUL-terminated names
+	uint64_t values; // offset of nvars doubles, 8 byte aligned
+} SDSnapshotHeader;
+
+/// sd_sim_set_steady_state opts in to ending runs early once the
+/// model settles.  A run is considered settled when, for window
+/// units of simulated time, the net flow of every stock stays within
+/// tol*(1 + |stock|).  The remaining save steps are then filled with
+/// the settled values, so this is only appropriate for models without
+/// time-dependent inputs after they settle.  A tol of 0 disables the
+/// check.
+int sd_sim_set_steady_state(SDSim *sim, double tol, double window);
+/// sd_sim_set_finite_check makes sd_sim_run_to verify, every `every`
+/// steps, that all stocks hold finite values, stopping the run with
+/// SD_ERR_DIVERGED as soon as one becomes NaN or infinite.  An every
+/// of 0 (the default) disables the check.
+int sd_sim_set_finite_check(SDSim *sim, int every);
+/// sd_sim_set_threads spreads simulation over nthreads of the
+/// project's executor's threads, for
+/// very large models.  If the model is made up of sectors that don't
+/// reference each other (see sd_sim_get_component_count), each runs
+/// on its own thread for the whole run, except when steady state or
+/// finite checks, progress reports or snapshots are enabled, or when
+/// run with sd_sim_run_async.  Otherwise flows are grouped into
+/// levels that don't depend on each other, and wide levels are split
+/// between threads at every step.  Either way results are identical
+/// to a serial run.  An nthreads of 0 or 1 (the default) turns this
+/// off.  Not supported for backward Euler or for models with modules
+/// that set their own dt.
+int sd_sim_set_threads(SDSim *sim, int nthreads);
+/// sd_sim_get_component_count returns the number of independent
+/// sectors found in the model, which are connected components of
+/// its dependency graph.
+int sd_sim_get_component_count(SDSim *sim);
+/// sd_sim_get_divergence reports the first variable found to be
+/// non-finite by the check above, or the stock a backward Euler step
+/// couldn't solve for, and the simulated time it was found at,
+/// returning -1 if the last run didn't diverge.  The returned name
+/// must not be freed or modified.
+int sd_sim_get_divergence(SDSim *sim, const char **name, double *time);
+/// sd_sim_get_steady_time stores the simulated time at which the
+/// last run settled in time, returning -1 if it hasn't settled.
+int sd_sim_get_steady_time(SDSim *sim, double *time);
+
 int sd_sim_get_value(SDSim *sim, const char *name, double *result);
+/// sd_sim_set_value overrides the value of a constant.  Called before
+/// a run starts (right after sd_sim_new or sd_sim_reset) initial
+/// values depending on the constant are recalculated; mid-run the new
+/// value applies from the current time on.  Overrides persist across
+/// sd_sim_reset.  Only constants can be set.
 int sd_sim_set_value(SDSim *sim, const char *name, double val);
 int sd_sim_get_series(SDSim *sim, const char *name, double *results, size_t len);
 
+/// sd_ensemble_new creates a context that simulates nlanes copies of
+/// the named model in lockstep, each free to use different values for
+/// the model's constants.  The copies are advanced together, several
+/// per instruction on hardware with vector units, which makes this
+/// much faster than nlanes separate SDSims for parameter sweeps.
+/// Returns NULL for models using an implicit integration method or
+/// modules with their own dt.
+SDEnsemble *sd_ensemble_new(SDProject *project, const char *model_name, size_t nlanes);
+void sd_ensemble_ref(SDEnsemble *ensemble);
+void sd_ensemble_unref(SDEnsemble *ensemble);
+
+/// sd_ensemble_set_value overrides the value of a constant in a single
+/// lane, with the same semantics as sd_sim_set_value.
+int sd_ensemble_set_value(SDEnsemble *ensemble, size_t lane, const char *name, double val);
+int sd_ensemble_run_to(SDEnsemble *ensemble, double time);
+int sd_ensemble_run_to_end(SDEnsemble *ensemble);
+int sd_ensemble_reset(SDEnsemble *ensemble);
+int sd_ensemble_get_stepcount(SDEnsemble *ensemble);
+int sd_ensemble_get_lanecount(SDEnsemble *ensemble);
+int sd_ensemble_get_series(SDEnsemble *ensemble, size_t lane, const char *name, double *results, size_t len);
+
+/// sd_sens_new creates a context that simulates the named model once,
+/// carrying alongside every value its derivative with respect to
+/// each of the nparams constants named in params (forward-mode
+/// automatic differentiation).  A run gives d(variable)/d(param)
+/// series for every variable and param at once, exactly rather than
+/// by finite differences.  Derivatives are taken through the branch
+/// of IFs and comparisons that the run takes.  Returns NULL if a
+/// param can't be set with sd_sim_set_value, and for the models
+/// sd_ensemble_new can't simulate.
+SDSens *sd_sens_new(SDProject *project, const char *model_name, const char **params, size_t nparams);
+void sd_sens_ref(SDSens *sens);
+void sd_sens_unref(SDSens *sens);
+/// sd_sens_set_value overrides the value of a constant, with the same
+/// semantics as sd_sim_set_value.
+int sd_sens_set_value(SDSens *sens, const char *name, double val);
+int sd_sens_run_to(SDSens *sens, double time);
+int sd_sens_run_to_end(SDSens *sens);
+int sd_sens_reset(SDSens *sens);
+int sd_sens_get_stepcount(SDSens *sens);
+int sd_sens_get_paramcount(SDSens *sens);
+int sd_sens_get_series(SDSens *sens, const char *name, double *results, size_t len);
+/// sd_sens_get_sensitivity stores the derivative of the named variable
+/// with respect to the param'th of the constants sens was created
+/// with at each save step in results.
+int sd_sens_get_sensitivity(SDSens *sens, const char *name, int param, double *results, size_t len);
+
+/// sd_scheduler_new creates a run queue that advances many sims on
+/// a single thread, step_budget time steps per turn.  Turns are
+/// handed out in proportion to each sim's weight.  A scheduler and
+/// its sims must only be used from one thread at a time; for more
+/// cores, run one scheduler per thread.
+SDScheduler *sd_scheduler_new(size_t step_budget);
+void sd_scheduler_ref(SDScheduler *sched);
+void sd_scheduler_unref(SDScheduler *sched);
+/// sd_scheduler_add queues sim to be run to time end, with a weight
+/// of at least 1.  Once it gets there (or fails), cb is called with
+/// the result and the sim leaves the queue.  A sim can only be in one
+/// scheduler, once; adding a sim that is already queued fails.
+int sd_scheduler_add(SDScheduler *sched, SDSim *sim, double end, int weight, SDRunFn cb, void *data);
+/// sd_scheduler_remove takes sim out of the queue without calling
+/// its callback; it can be resumed with sd_sim_run_to or re-added.
+int sd_scheduler_remove(SDScheduler *sched, SDSim *sim);
+int sd_scheduler_set_weight(SDScheduler *sched, SDSim *sim, int weight);
+/// sd_scheduler_run gives out up to turns turns, or runs until the
+/// queue is empty if turns is 0, and returns the number of sims
+/// still queued.
+int sd_scheduler_run(SDScheduler *sched, size_t turns);
+int sd_scheduler_len(SDScheduler *sched);
+
+/// SDEnsembleRuns describes a batch of independent runs of a model
+/// for sd_ensemble_run.  Run i sets the constants named in params to
+/// values[i*nparams ... i*nparams+nparams-1], and stores the series
+/// of each variable named in outputs one after another in results[i],
+/// which must hold noutputs*sd_sim_get_stepcount() doubles.  If
+/// status is non-NULL, status[i] receives the outcome of run i.  The
+/// remaining fields are applied to every run as by
+/// sd_sim_set_steady_state and sd_sim_set_finite_check.
+typedef struct {
+	const char **params;
+	size_t nparams;
+	const double *values;
+	const char **outputs;
+	size_t noutputs;
+	double **results;
+	int *status;
+	double steady_tol;
+	double steady_window;
+	int finite_every;
+} SDEnsembleRuns;
+
+/// sd_ensemble_run simulates nruns runs of the named model described
+/// by runs on nthreads of the project's executor's threads, or all of
+/// them if nthreads is 0.  The
+/// model is compiled once and shared between threads, and runs are
+/// load-balanced so that runs ending early (or late) don't leave
+/// threads idle.  Returns an error if the batch couldn't be set up,
+/// and otherwise the status of the first run that failed, or 0.
+int sd_ensemble_run(SDProject *project, const char *model_name, const SDEnsembleRuns *runs, size_t nruns, int nthreads);
+
+typedef enum {
+	SD_SUMMARY_FINAL,     // value at the end of the run
+	SD_SUMMARY_MIN,
+	SD_SUMMARY_MAX,
+	SD_SUMMARY_PEAK_TIME, // time the maximum was first reached
+	SD_SUMMARY_LEN
+} SDSummary;
+
+/// SDSweep describes a parameter sweep: a set of points, each giving
+/// values for a few constants, and the summaries of the run at each
+/// point to report.  Points are either a grid, every combination of
+/// the values of each axis added with sd_sweep_add_axis, or an
+/// explicit list set with sd_sweep_set_list.  Grid points are
+/// numbered with the last axis varying fastest.  Summaries are taken
+/// over save steps.
+SDSweep *sd_sweep_new(void);
+/// sd_sweep_open reads a sweep from a CSV spec.  Each line is one of
+/// "grid,NAME,V1,V2,...", "range,NAME,LO,HI,N" (N evenly spaced
+/// values from LO to HI), "list,NAME1,NAME2,...", "point,V1,V2,..."
+/// and "output,VAR,SUMMARY,..." where SUMMARY is a name returned by
+/// sd_summary_name.  Blank lines and lines starting with # are
+/// skipped.  A spec has either grid and range lines or a list line
+/// followed by points, and at least one output.
+SDSweep *sd_sweep_open(const char *path, int *err);
+void sd_sweep_ref(SDSweep *sweep);
+void sd_sweep_unref(SDSweep *sweep);
+int sd_sweep_add_axis(SDSweep *sweep, const char *name, const double *values, size_t len);
+/// sd_sweep_set_list makes the sweep's points npoints rows of
+/// nparams values of the constants in names; values is copied.
+int sd_sweep_set_list(SDSweep *sweep, const char **names, size_t nparams, const double *values, size_t npoints);
+int sd_sweep_add_output(SDSweep *sweep, const char *name, SDSummary kind);
+/// sd_sweep_get_pointcount returns the number of points in the
+/// sweep, or 0 if it has none or too many to count.
+size_t sd_sweep_get_pointcount(SDSweep *sweep);
+int sd_sweep_get_paramcount(SDSweep *sweep);
+const char *sd_sweep_get_param(SDSweep *sweep, size_t i);
+/// sd_sweep_get_point stores the values of each constant at point i
+/// in values.
+int sd_sweep_get_point(SDSweep *sweep, size_t i, double *values);
+int sd_sweep_get_outputcount(SDSweep *sweep);
+int sd_sweep_get_output(SDSweep *sweep, size_t i, const char **name, SDSummary *kind);
+const char *sd_summary_name(SDSummary kind);
+/// sd_sweep_run simulates the named model at every point of sweep
+/// on nthreads of the project's executor's threads (all of them if
+/// 0), storing the outputs of point i in results[i*noutputs ...
+/// i*noutputs+noutputs-1].  The model is compiled once, and each
+/// thread reuses a single sim without history, so memory use doesn't
+/// grow with the length of runs.  Outputs of points that fail are
+/// NaN, and the first failure is returned.
+int sd_sweep_run(SDProject *project, const char *model_name, SDSweep *sweep, double *results, int nthreads);
+
+typedef enum {
+	SD_LOSS_SSE,      // sum of squared errors
+	SD_LOSS_WEIGHTED, // SSE with each term scaled by its weight
+	SD_LOSS_LOG,      // SSE of the logs; for positive series
+	SD_LOSS_LEN
+} SDLoss;
+
+typedef enum {
+	SD_CALIBRATE_NELDER_MEAD,
+	SD_CALIBRATE_POWELL,
+	SD_CALIBRATE_DE, // differential evolution
+	SD_CALIBRATE_LEN
+} SDCalibrateMethod;
+
+/// SDObserved is a series of len observations of the named variable,
+/// at ascending times within the run.  Simulated values between
+/// steps are interpolated linearly.  weights may be NULL unless the
+/// loss is SD_LOSS_WEIGHTED; SD_LOSS_LOG uses them if given.
+typedef struct {
+	const char *name;
+	const double *times;
+	const double *values;
+	const double *weights;
+	size_t len;
+} SDObserved;
+
+/// SDCalibration describes a fit of the constants named in params,
+/// each between lower[i] and upper[i], to observed series.  initial
+/// is where local methods start from (the middle of the bounds if
+/// NULL), and is a member of DE's first population.  Fields left 0
+/// get defaults: 500 evaluations per parameter, a tol of 1e-8, and a
+/// population of 10 per parameter.  tol is the relative spread of
+/// losses (over the simplex or population, or an iteration's
+/// improvement for Powell) at which the search has converged.  seed
+/// makes DE repeatable.
+typedef struct {
+	const char **params;
+	size_t nparams;
+	const double *lower;
+	const double *upper;
+	const double *initial;
+	const SDObserved *observed;
+	size_t nobserved;
+	SDLoss loss;
+	SDCalibrateMethod method;
+	size_t max_evals;
+	double tol;
+	int population;
+	uint64_t seed;
+} SDCalibration;
+
+/// SDCalibrationStats reports on a calibration.  If trace is
+/// non-NULL, the best loss after each iteration is stored in it, up
+/// to trace_cap entries.
+typedef struct {
+	double loss;
+	size_t nevals;
+	size_t niters;
+	size_t ndiverged; // runs stopped because a stock became NaN or infinite
+	int converged;
+	double *trace;
+	size_t trace_cap;
+	size_t trace_len;
+} SDCalibrationStats;
+
+/// sd_calibrate searches for the parameters of the named model that
+/// minimize the loss between simulated and observed series, storing
+/// them in best, which holds nparams doubles, and details in stats
+/// if non-NULL.  Batches of candidate parameters are run on nthreads
+/// of the project's executor's threads (all of them if 0): DE
+/// evaluates each generation at once, and the local methods the
+/// candidates of each step.  Runs only simulate what the observed
+/// variables depend on, up to the last observation, and are
+/// abandoned if they diverge or, when a candidate only needs to beat
+/// another, once their loss is larger.  Returns an error if the
+/// description is invalid; running out of evaluations is not one.
+int sd_calibrate(SDProject *project, const char *model_name, const SDCalibration *cal, double *best, SDCalibrationStats *stats, int nthreads);
+
+/// sd_adjoint_new prepares to compute the gradient of the loss
+/// between the named model and observed series, as sd_calibrate
+/// defines it, with respect to the nparams constants named in
+/// params.  Gradients come from a reverse (adjoint) sweep, whose
+/// cost doesn't depend on nparams, so this suits gradient-based
+/// calibration of many constants.  observed is copied.  Returns NULL
+/// for invalid observations, a param that can't be set with
+/// sd_sim_set_value, and the models sd_ensemble_new can't simulate.
+SDAdjoint *sd_adjoint_new(SDProject *project, const char *model_name, const char **params, size_t nparams, const SDObserved *observed, size_t nobserved, SDLoss loss);
+void sd_adjoint_ref(SDAdjoint *adjoint);
+void sd_adjoint_unref(SDAdjoint *adjoint);
+/// sd_adjoint_eval runs the model with the params set to values (or
+/// left as they are if NULL), storing the loss in objective and its
+/// derivative with respect to each param in gradient.  The run keeps
+/// checkpoints every sqrt(steps) steps and recomputes between them,
+/// for about four times the cost of a run.  Returns SD_ERR_DIVERGED
+/// if the loss isn't finite.
+int sd_adjoint_eval(SDAdjoint *adjoint, const double *values, double *objective, double *gradient);
+
+typedef enum {
+	SD_GSA_MORRIS,
+	SD_GSA_SOBOL,
+	SD_GSA_LEN
+} SDGsaMethod;
+
+typedef enum {
+	SD_GSA_MU,      // Morris: mean elementary effect
+	SD_GSA_MU_STAR, // Morris: mean absolute elementary effect
+	SD_GSA_SIGMA,   // Morris: standard deviation of elementary effects
+	SD_GSA_FIRST,   // Sobol: first-order index
+	SD_GSA_TOTAL,   // Sobol: total-order index
+	SD_GSA_STAT_LEN
+} SDGsaStat;
+
+typedef void (*SDGsaProgressFn)(void *data, size_t nsamples, const double *results);
+
+/// SDGsa describes a global sensitivity analysis of the outputs named
+/// in outputs, at each of the ascending times in times (interpolated
+/// between save steps), to the constants named in params, each
+/// varying between lower[i] and upper[i].  samples is the number of
+/// Morris trajectories, of nparams+1 runs each, or of Sobol base
+/// samples, of nparams+2 runs each.  levels is the number of levels
+/// of the Morris grid, which must be even, 4 if 0.  seed determines
+/// every point.  If progress is non-NULL, it is called after every
+/// chunk of samples with the number done so far and the estimates
+/// from them.
+typedef struct {
+	const char **params;
+	size_t nparams;
+	const double *lower;
+	const double *upper;
+	const char **outputs;
+	size_t noutputs;
+	const double *times;
+	size_t ntimes;
+	SDGsaMethod method;
+	size_t samples;
+	int levels;
+	uint64_t seed;
+	SDGsaProgressFn progress;
+	void *progress_data;
+} SDGsa;
+
+/// sd_gsa_run runs the analysis on nthreads of the project's
+/// executor's threads (all of them if 0), storing statistic s of
+/// param i, output j at time t in
+/// results[((i*noutputs + j)*ntimes + t)*SD_GSA_STAT_LEN + s].
+/// Statistics the method doesn't estimate are NaN, as are Sobol
+/// indices of outputs that don't vary.  Runs are handed out and
+/// folded into running sums a chunk at a time, so memory use doesn't
+/// grow with samples, and results don't depend on nthreads.  Samples
+/// with a failed run are left out, and the first failure returned.
+int sd_gsa_run(SDProject *project, const char *model_name, const SDGsa *gsa, double *results, int nthreads);
+
+/// sd_ensemble_fork runs a batch like sd_ensemble_run, but in nprocs
+/// forked worker processes (one per CPU if 0), so that a run that
+/// crashes takes down only its worker; its status is SD_ERR_WORKER,
+/// and a replacement worker carries on with the remaining runs.
+/// Workers share the parent's compiled model and write every saved
+/// row of every run into a shared memory segment, which the returned
+/// SDResults reads from without copying.  outputs and results are
+/// filled in too, if given.  err is set as sd_ensemble_run's return
+/// value would be, and NULL is returned if the batch couldn't be set
+/// up.  Must be called from a thread that can safely fork.  Fails
+/// with SD_ERR_WORKER where there is no fork (Windows).
+SDResults *sd_ensemble_fork(SDProject *project, const char *model_name, const SDEnsembleRuns *runs, size_t nruns, int nprocs, int *err);
+void sd_results_ref(SDResults *results);
+void sd_results_unref(SDResults *results);
+int sd_results_get_runcount(SDResults *results);
+int sd_results_get_stepcount(SDResults *results);
+int sd_results_get_varcount(SDResults *results);
+/// sd_results_get_status returns the outcome of run, as with
+/// SDEnsembleRuns.status.
+int sd_results_get_status(SDResults *results, size_t run);
+/// sd_results_get_offset returns the column of the named variable
+/// in the rows returned by sd_results_get_rows, or -1.
+int sd_results_get_offset(SDResults *results, const char *name);
+/// sd_results_get_rows returns run's saved rows, stepcount rows of
+/// varcount doubles each.  The memory belongs to results.
+const double *sd_results_get_rows(SDResults *results, size_t run);
+int sd_results_get_series(SDResults *results, size_t run, const char *name, double *out, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
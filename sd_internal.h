@@ -7,10 +7,12 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include "utf.h"
 #include "hash_table.h"
@@ -22,6 +24,9 @@ extern "C" {
 
 #define TIME 0
 
+// how often, in time steps, running sims check for cancellation
+#define CANCEL_CHECK_STEPS 64
+
 
 typedef enum {
 	VAR_UNKNOWN,
@@ -44,6 +49,11 @@ typedef enum {
 	N_IF,
 } NodeType;
 
+typedef enum {
+	SIM_EULER,
+	SIM_BACKWARD_EULER,
+} SimMethod;
+
 typedef enum {
 	TOK_TOKEN    = 1<<1,
 	TOK_IDENT    = 1<<2,
@@ -57,8 +67,18 @@ typedef struct SDModel_s SDModel;
 typedef struct AVar_s AVar;
 typedef struct Node_s Node;
 typedef struct WalkerOps_s WalkerOps;
+typedef struct Implicit_s Implicit;
+typedef struct Levels_s Levels;
+typedef struct Components_s Components;
+typedef struct Topology_s Topology;
+typedef struct Arena_s Arena;
+typedef struct Snapshot_s Snapshot;
+typedef struct SchedEntry_s SchedEntry;
 
 typedef double (*Fn)(SDSim *s, Node *n, double dt, double t, size_t len, double *args);
+// a DFn stores the partial derivative of its Fn with respect to each
+// argument in partials.
+typedef void (*DFn)(SDSim *s, Node *n, double dt, double t, size_t len, const double *args, double *partials);
 
 
 typedef struct {
@@ -98,6 +118,12 @@ typedef struct {
 	char *size;
 } Dim;
 
+// a constant's value, as set by sd_sim_set_value
+typedef struct {
+	AVar *av;
+	double val;
+} Override;
+
 typedef struct {
 	double *x;
 	double *y;
@@ -120,6 +146,7 @@ typedef struct {
 struct SDProject_s {
 	char *dir_path;
 	Slice files;
+	SDExecutor *executor; // NULL for the default
 	int refcount;
 };
 
@@ -137,6 +164,9 @@ struct SDModel_s {
 	File *file;
 	char *name;
 	Slice vars;
+	// a model's own sim_specs may request a finer dt when it is
+	// used as a module; 0 means it steps with its parent.
+	double dt;
 	int refcount;
 };
 
@@ -173,22 +203,75 @@ struct AVar_s {
 	Slice flows;
 	Slice stocks;
 	Slice avars;
+	// for modules, avars sorted by name, for resolve
+	AVar **by_name;
 	Var *time;
 
 	AVar *src; // for ref
 
 	int offset;
+	// for modules, the number of steps taken per step of the
+	// parent model.
+	int substeps;
 
 	bool is_const;
 	bool visited;
 	bool visiting;
 };
 
+struct SDRun_s {
+	SDSim *sim;
+	SDExecutor *executor;
+	void *task;
+	double end;
+	SDRunFn cb;
+	void *data;
+	int cancel;
+	int err;
+};
+
+// SDCompiledModel is everything about a model that's worked out once,
+// when it's compiled: the AVar tree with parsed and resolved
+// equations, offsets, sorted runlists and components.  Nothing in it
+// changes afterwards, so any number of sims on any threads can share
+// one.
+struct SDCompiledModel_s {
+	SDProject *project;
+	AVar *module;
+	// flat list of every VAR_STOCK AVar, across all modules
+	Slice stocks;
+	Components *components;
+	size_t nvars;
+	int substep_levels;
+	int refcount;
+};
+
+// the latest published values of a sim, see snapshot.c
+struct Snapshot_s {
+	size_t every;
+	SDSnapshotHeader *hdr;
+	double *values;
+	// set if hdr is the start of a shared memory segment
+	char *shm_name;
+	size_t shm_len;
+	// identify our object, which a later snapshot with the same
+	// name may have replaced
+	dev_t shm_dev;
+	ino_t shm_ino;
+};
+
 struct SDSim_s {
 	SDProject *project;
+	// the model being simulated; module, stocks, components,
+	// nvars and substep_levels are copied from it.
+	SDCompiledModel *compiled;
 	AVar *module;
 	SimSpec spec;
+	// the slab starts out in storage, and is only reallocated
+	// if a reset needs more than slab_len doubles.
 	double *slab;
+	size_t slab_len;
+	bool slab_borrowed; // see sim_use_slab
 	double *curr;
 	double *next;
 	size_t nvars;
@@ -198,11 +281,68 @@ struct SDSim_s {
 	size_t save_step;
 	size_t save_every;
 
+	SimMethod method;
+	// flat list of every VAR_STOCK AVar, across all modules
+	Slice stocks;
+	// lazily created state for the backward Euler integrator
+	Implicit *implicit;
+	// one scratch row per level of nested substepping modules
+	double *substep_rows;
+	int substep_levels;
+	int substep_depth;
+
+	// opt-in steady state detection, see sd_sim_set_steady_state
+	double steady_tol;
+	size_t steady_window;
+	size_t steady_count;
+	double steady_time;
+	bool is_steady;
+
+	Slice overrides; // []*Override
+
+	// threads to step with, see sd_sim_set_threads.  Models made
+	// of independent components run one component per thread,
+	// others evaluate flows level by level.
+	size_t nthreads;
+	Components *components;
+	Levels *levels;
+
+	// opt-in NaN/Inf detection, see sd_sim_set_finite_check
+	size_t finite_every;
+	AVar *diverged;
+	double diverged_time;
+
+	// set while running under sd_sim_run_async
+	int *cancel;
+	size_t progress_every;
+	SDProgressFn progress;
+	void *progress_data;
+	size_t progress_done; // the last nsaved reported
+
+	// opt-in streaming of save rows, see sd_sim_set_row_callback.
+	// Without history the slab holds only curr and next.
+	SDRowFn row_fn;
+	void *row_data;
+	size_t rows_done;
+	bool no_history;
+
+	// opt-in values published for other threads, see
+	// sd_sim_set_snapshot
+	Snapshot *snapshot;
+
+	// set while the sim is queued in an SDScheduler
+	SchedEntry *sched_entry;
+
 	Slice adj_avar; // adjacency_offset -> avar
 	// keep adj_list sorted by offset, worst case access is O(lg(max_degree))
 	Slice adj_list; // adjacency list representation of graph: [][]AdjOffset
 
 	int refcount;
+	// allocated from an Arena, which frees it
+	bool in_arena;
+
+	// the initial slab, followed by substep_rows
+	double storage[];
 };
 
 struct Node_s {
@@ -216,6 +356,7 @@ struct Node_s {
 	AVar *av;
 	Slice args;
 	Fn fn;
+	DFn dfn;
 };
 
 typedef struct {
@@ -246,19 +387,22 @@ typedef struct {
 	bool havetpeek;
 } Lexer;
 
-// someone who iterates over nodes
+// someone who iterates over nodes.  Walkers are usually embedded
+// at the start of a larger, stack-allocated struct holding their
+// state, which is passed back to each op as data.
 typedef struct {
 	const WalkerOps *ops;
-	int refcount;
 } Walker;
 
+// start is called for every node in pre-order, end after all of a
+// node's children have been walked.  start_child, end_child and end
+// are optional; start_child returning false skips walking that child
+// (and end_child isn't called for it).
 struct WalkerOps_s {
-	void (*ref)(void *data);
-	void (*unref)(void *data);
 	void (*start)(void *data, Node *n);
-	Walker *(*start_child)(void *data, Node *n); // returns w/ refcount of 1
-	void (*end_child)(void *data, Node *n);
-	void (*end)(void *data);
+	bool (*start_child)(void *data, Node *parent, Node *child);
+	void (*end_child)(void *data, Node *parent, Node *child);
+	void (*end)(void *data, Node *n);
 };
 
 /// given integer i, when divided by integer n, if there is a
@@ -302,6 +446,8 @@ Node *node(NodeType ty);
 // single, sole owner of a node (currently always an AVar), and that
 // if you want to mutate or free the node you must lock on the owner.
 void node_free(Node *n);
+// node_walk visits n and its descendants without recursing, using an
+// explicit stack that only touches the heap for very deep trees.
 bool node_walk(Walker *w, Node *n);
 
 AVar *avar(AVar *module, Var *v);
@@ -312,7 +458,111 @@ int avar_all_deps(AVar *av, Slice *all);
 
 AVar *resolve(AVar *module, const char *name);
 
+// runlist_flatten appends the entries of the flows (or stocks)
+// runlist l to out, replacing modules with their own runlists.
+int runlist_flatten(Slice *out, Slice *l, bool stocks);
+// svisit evaluates n against the variable values in data.
+double svisit(SDSim *s, const double *data, Node *n, double dt, double time);
+// stock_net_flow sums av's inflows less its outflows in data.
+double stock_net_flow(AVar *av, const double *data);
+
+// executor_get returns the executor sims of p run on.
+SDExecutor *executor_get(SDProject *p);
+// executor_topology returns the topology ex's threads are pinned
+// to, or NULL if they aren't.
+Topology *executor_topology(SDExecutor *ex);
+size_t pool_default_threads(void);
+
+// sim_publish copies the sim's current row into its snapshot.
+void sim_publish(SDSim *s);
+void snapshot_free(Snapshot *snap);
+
+// sim_new_in is sd_sim_new_from, allocating the sim from arena.
+SDSim *sim_new_in(SDCompiledModel *cm, Arena *arena);
+// sim_new_on is sd_sim_new_from, with its rows kept in slab, which
+// holds len doubles and belongs to the caller.  sim_use_slab moves s
+// to another such slab, after which s must be reset before it runs.
+SDSim *sim_new_on(SDCompiledModel *cm, double *slab, size_t len);
+void sim_use_slab(SDSim *s, double *slab, size_t len);
+
+int topology_parse(const char *spec, Topology **result);
+int topology_detect(Topology **result);
+void topology_free(Topology *t);
+size_t topology_len(Topology *t);
+size_t topology_ncpus(Topology *t);
+int topology_node_of(Topology *t, int cpu);
+int topology_cpu(Topology *t, size_t i);
+int topology_current_node(Topology *t);
+int topology_pin(pthread_t thread, int cpu);
+
+Arena *arena_new(void);
+void arena_free(Arena *a);
+void *arena_alloc(Arena *a, size_t len);
+
+int levels_new(SDSim *s, size_t nthreads, Levels **result);
+void levels_free(Levels *l);
+// levels_start starts the helpers a run's levels_calc and
+// levels_calc_stocks share, and levels_stop waits for them to exit.
+void levels_start(SDSim *s);
+void levels_stop(SDSim *s);
+void levels_calc(SDSim *s, double dt);
+void levels_calc_stocks(SDSim *s, double dt);
+
+int components_new(AVar *module, size_t nvars, Components **result);
+void components_free(Components *cs);
+size_t components_len(Components *cs);
+int components_run_to(SDSim *s, double end);
+
+int sim_run_steps(SDSim *s, double end, size_t max_steps, bool *done);
+
+// ensemble_runs_check validates runs against base's model.
+int ensemble_runs_check(SDSim *base, const SDEnsembleRuns *runs);
+// ensemble_runs_sim simulates run i of runs on s, from the start.
+int ensemble_runs_sim(SDSim *s, const SDEnsembleRuns *runs, size_t i);
+
+// WorkerSims holds one sim of cm per worker of a parallel_for, each
+// created by its worker the first time it's needed, so that the sim
+// is first touched by the thread that uses it, in the arena of that
+// thread's memory node.
+typedef struct {
+	SDCompiledModel *cm;
+	SDSim **sims; // one per worker
+	size_t nsims;
+	Topology *topo;
+	Arena **arenas; // one per node of topo
+	size_t narenas;
+} WorkerSims;
+
+int worker_sims_init(WorkerSims *ws, SDCompiledModel *cm, SDExecutor *ex, size_t nworkers);
+void worker_sims_free(WorkerSims *ws);
+// worker_sim returns worker's sim, calling setup on it, if not NULL,
+// when it's created.  If setup fails the sim is dropped.
+SDSim *worker_sim(WorkerSims *ws, size_t worker, int (*setup)(SDSim *s, void *data), void *data);
+// sim_set_point sets n constants and recomputes initial values, and
+// sim_run_point then runs s to the end.
+int sim_set_point(SDSim *s, const char *const *names, const double *values, size_t n);
+int sim_run_point(SDSim *s, const char *const *names, const double *values, size_t n);
+
+// observed_offset returns the offset in s of obs's variable, or -1 if
+// obs isn't a valid series for loss within s's run.
+int observed_offset(SDSim *s, const SDObserved *obs, SDLoss loss);
+
+// sim_canceled reports whether s is running asynchronously and
+// has been asked to stop.
+bool sim_canceled(SDSim *s);
+
+double *sim_curr(SDSim *s);
+double *sim_next(SDSim *s);
+
 double lookup(Table *t, double index);
+// lookup_slope is the derivative of lookup at index: the slope of the
+// segment index falls in, or 0 outside the table.
+double lookup_slope(Table *t, double index);
+
+// rng_next steps the splitmix64 generator at state, and rng_uniform
+// turns its next value into a double in [0, 1).
+uint64_t rng_next(uint64_t *state);
+double rng_uniform(uint64_t *state);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,557 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// A sensitivity run simulates a model once with forward-mode
+// automatic differentiation: every slot in the slab holds a dual
+// number, a value followed by its derivative (tangent) with respect
+// to each of the chosen constants.  Each constant's own tangent is
+// seeded with 1, and dvisit applies the chain rule at every node,
+// so the tangents of every variable are exact derivatives of the
+// Euler-integrated run, with no finite-difference step to choose.
+//
+// The slab is laid out as [save step][variable][value, tangents],
+// and each operation is a loop over the width of a slot, which the
+// compiler vectorizes; the cost of adding a parameter is a few more
+// lanes of arithmetic rather than two more runs.
+
+// the most arguments a builtin is called with, as in svisit
+#define MAX_ARGS 6
+
+struct SDSens_s {
+	SDSim *sim; // owns the compiled model: runlists and offsets
+	SimSpec spec;
+	AVar **params;
+	size_t nparams;
+	size_t width; // 1 + nparams, the stride between variables
+	double *slab;
+	double *curr;
+	double *next;
+	double *override;  // [variable]
+	bool *is_override; // [variable]
+	// dvisit's temporaries: MAX_ARGS slots per level of the
+	// deepest equation
+	double *scratch;
+	size_t nvars;
+	size_t nsaves;
+	size_t nsteps;
+	size_t step;
+	size_t save_step;
+	size_t save_every;
+	int refcount;
+};
+
+static double *sens_curr(SDSens *d);
+static double *sens_next(SDSens *d);
+
+static size_t module_depth(AVar *module);
+static size_t node_depth(Node *n);
+
+static void sens_calc(SDSens *d, double *data, Slice *l, bool initial);
+static void sens_calc_stocks(SDSens *d, double *data, Slice *l);
+static void dvisit(SDSens *d, const double *data, Node *n, double *out, double *tmp);
+
+
+SDSens *
+sd_sens_new(SDProject *p, const char *model_name, const char **params, size_t nparams)
+{
+	SDSens *d;
+	size_t n;
+
+	if (!p || !params || !nparams)
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	sd_sens_ref(d);
+
+	d->sim = sd_sim_new(p, model_name);
+	if (!d->sim)
+		goto error;
+	// tangents are integrated with explicit Euler at the model's dt
+	if (d->sim->method != SIM_EULER || d->sim->substep_levels)
+		goto error;
+
+	d->nparams = nparams;
+	d->width = 1 + nparams;
+	d->nvars = d->sim->nvars;
+	d->params = calloc(nparams, sizeof(*d->params));
+	if (!d->params)
+		goto error;
+	for (size_t i = 0; i < nparams; i++) {
+		AVar *av = params[i] ? resolve(d->sim->module, params[i]) : NULL;
+		while (av && av->src)
+			av = av->src;
+		if (!av || !av->is_const)
+			goto error;
+		d->params[i] = av;
+	}
+
+	n = d->nvars ? d->nvars : 1;
+	d->override = calloc(n, sizeof(*d->override));
+	d->is_override = calloc(n, sizeof(*d->is_override));
+	d->scratch = calloc((module_depth(d->sim->module) + 1)*MAX_ARGS*d->width, sizeof(*d->scratch));
+	if (!d->override || !d->is_override || !d->scratch)
+		goto error;
+
+	if (sd_sens_reset(d))
+		goto error;
+
+	return d;
+error:
+	sd_sens_unref(d);
+	return NULL;
+}
+
+void
+sd_sens_ref(SDSens *d)
+{
+	if (!d)
+		return;
+	__sync_fetch_and_add(&d->refcount, 1);
+}
+
+void
+sd_sens_unref(SDSens *d)
+{
+	if (!d)
+		return;
+	if (__sync_sub_and_fetch(&d->refcount, 1) == 0) {
+		sd_sim_unref(d->sim);
+		free(d->params);
+		free(d->override);
+		free(d->is_override);
+		free(d->scratch);
+		free(d->slab);
+		free(d);
+	}
+}
+
+int
+sd_sens_reset(SDSens *d)
+{
+	size_t nvars;
+
+	if (!d)
+		return SD_ERR_UNSPECIFIED;
+
+	d->spec = d->sim->spec;
+	d->step = 0;
+	d->save_step = 0;
+	d->nsteps = d->sim->nsteps;
+	d->save_every = d->sim->save_every;
+	d->nsaves = d->sim->nsaves;
+
+	free(d->slab);
+	nvars = d->nvars ? d->nvars : 1;
+	// XXX: 1 extra step to simplify run_to, as in sd_sim_reset
+	d->slab = calloc(nvars*d->width*(d->nsaves + 1), sizeof(double));
+	if (!d->slab)
+		return SD_ERR_NOMEM;
+	d->curr = d->slab;
+	d->next = NULL;
+
+	d->curr[TIME*d->width] = d->spec.start;
+	sens_calc(d, d->curr, &d->sim->module->initials, true);
+
+	return 0;
+}
+
+int
+sd_sens_set_value(SDSens *d, const char *name, double val)
+{
+	AVar *av;
+
+	if (!d || !name)
+		return SD_ERR_UNSPECIFIED;
+
+	av = resolve(d->sim->module, name);
+	while (av && av->src)
+		av = av->src;
+	if (!av || !av->is_const)
+		return SD_ERR_UNSPECIFIED;
+
+	d->override[av->offset] = val;
+	d->is_override[av->offset] = true;
+
+	// as with sd_sim_set_value, recalculate initial values if the
+	// run hasn't started.
+	if (d->step == 0 && d->save_step == 0)
+		sens_calc(d, d->curr, &d->sim->module->initials, true);
+	else
+		d->curr[av->offset*d->width] = val;
+
+	return 0;
+}
+
+double *
+sens_curr(SDSens *d)
+{
+	return &d->slab[d->save_step*d->nvars*d->width];
+}
+
+double *
+sens_next(SDSens *d)
+{
+	return &d->slab[(d->save_step+1)*d->nvars*d->width];
+}
+
+int
+sd_sens_run_to(SDSens *d, double end)
+{
+	double dt;
+	Slice *flows, *stocks;
+
+	if (!d)
+		return SD_ERR_UNSPECIFIED;
+
+	dt = d->spec.dt;
+	flows = &d->sim->module->flows;
+	stocks = &d->sim->module->stocks;
+	d->curr = sens_curr(d);
+	d->next = sens_next(d);
+
+	while (d->step < d->nsteps && d->curr[TIME*d->width] <= end) {
+		sens_calc(d, d->curr, flows, false);
+		sens_calc_stocks(d, d->next, stocks);
+
+		if (d->step + 1 == d->nsteps)
+			break;
+
+		// time doesn't depend on any parameter
+		d->next[TIME*d->width] = d->spec.start + (d->step+1)*dt;
+
+		if (d->step++ % d->save_every != 0) {
+			memcpy(d->curr, d->next, d->nvars*d->width*sizeof(double));
+		} else {
+			d->save_step++;
+			d->curr = sens_curr(d);
+			d->next = sens_next(d);
+		}
+	}
+
+	return 0;
+}
+
+int
+sd_sens_run_to_end(SDSens *d)
+{
+	if (!d)
+		return SD_ERR_UNSPECIFIED;
+	return sd_sens_run_to(d, d->spec.stop + 1);
+}
+
+int
+sd_sens_get_stepcount(SDSens *d)
+{
+	if (!d)
+		return -1;
+	return d->nsaves;
+}
+
+int
+sd_sens_get_paramcount(SDSens *d)
+{
+	if (!d)
+		return -1;
+	return d->nparams;
+}
+
+int
+sd_sens_get_series(SDSens *d, const char *name, double *results, size_t len)
+{
+	return sd_sens_get_sensitivity(d, name, -1, results, len);
+}
+
+// a param of -1 reads values rather than a tangent.
+int
+sd_sens_get_sensitivity(SDSens *d, const char *name, int param, double *results, size_t len)
+{
+	size_t i, off, row;
+
+	if (!d || !name || !results || param < -1 || param >= (int)d->nparams)
+		return -1;
+
+	if (strcmp(name, "time") == 0) {
+		off = TIME;
+	} else {
+		AVar *av = resolve(d->sim->module, name);
+		if (!av)
+			return -1;
+		while (av->src)
+			av = av->src;
+		off = av->offset;
+	}
+
+	row = d->nvars*d->width;
+	for (i = 0; i <= d->nsaves && i < len; i++)
+		results[i] = d->slab[i*row + off*d->width + 1 + param];
+
+	return i;
+}
+
+size_t
+module_depth(AVar *module)
+{
+	size_t depth = 0;
+
+	for (size_t i = 0; i < module->avars.len; i++) {
+		AVar *av = module->avars.elems[i];
+		size_t n = av->model ? module_depth(av) : av->node ? node_depth(av->node) : 0;
+		if (n > depth)
+			depth = n;
+	}
+	return depth;
+}
+
+size_t
+node_depth(Node *n)
+{
+	size_t depth = 0, d;
+
+	if (!n)
+		return 0;
+	depth = node_depth(n->left);
+	if ((d = node_depth(n->right)) > depth)
+		depth = d;
+	if ((d = node_depth(n->cond)) > depth)
+		depth = d;
+	for (size_t i = 0; i < n->args.len; i++) {
+		if ((d = node_depth(n->args.elems[i])) > depth)
+			depth = d;
+	}
+	return depth + 1;
+}
+
+void
+sens_calc(SDSens *d, double *data, Slice *l, bool initial)
+{
+	const size_t w = d->width;
+
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		double *out;
+		if (!av->node) {
+			if (initial)
+				sens_calc(d, data, &av->initials, true);
+			else
+				sens_calc(d, data, &av->flows, false);
+			continue;
+		}
+		out = data + av->offset*w;
+		dvisit(d, data, av->node, out, d->scratch);
+		if (av->v->gf) {
+			double slope = lookup_slope(av->v->gf, out[0]);
+			out[0] = lookup(av->v->gf, out[0]);
+			for (size_t k = 1; k < w; k++)
+				out[k] *= slope;
+		}
+		if (initial && av->is_const) {
+			if (d->is_override[av->offset])
+				out[0] = d->override[av->offset];
+			// seed each parameter's own tangent
+			for (size_t j = 0; j < d->nparams; j++)
+				out[1 + j] = d->params[j] == av ? 1 : 0;
+		}
+	}
+}
+
+void
+sens_calc_stocks(SDSens *d, double *data, Slice *l)
+{
+	const size_t w = d->width;
+	const double dt = d->spec.dt;
+	const double *curr = d->curr;
+
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		double *out = data + av->offset*w;
+		const double *prev = curr + av->offset*w;
+
+		switch (av->v->type) {
+		case VAR_STOCK:
+			memcpy(out, prev, w*sizeof(double));
+			for (size_t j = 0; j < av->inflows.len; j++) {
+				AVar *in = av->inflows.elems[j];
+				const double *flow = curr + in->offset*w;
+				for (size_t k = 0; k < w; k++)
+					out[k] += flow[k]*dt;
+			}
+			for (size_t j = 0; j < av->outflows.len; j++) {
+				AVar *o = av->outflows.elems[j];
+				const double *flow = curr + o->offset*w;
+				for (size_t k = 0; k < w; k++)
+					out[k] -= flow[k]*dt;
+			}
+			break;
+		case VAR_MODULE:
+			sens_calc_stocks(d, data, &av->stocks);
+			break;
+		default:
+			memcpy(out, prev, w*sizeof(double));
+			break;
+		}
+	}
+}
+
+// dvisit is the dual-number counterpart of svisit: it evaluates n
+// and its tangents against the slots in data, writing a slot to out.
+// tmp holds MAX_ARGS slots for this node's operands, followed by
+// the scratch space of its children.
+void
+dvisit(SDSens *d, const double *data, Node *n, double *out, double *tmp)
+{
+	const size_t w = d->width;
+	const double time = data[TIME*w];
+	const double dt = d->spec.dt;
+	double *l = tmp, *r = tmp + w, *child = tmp + MAX_ARGS*w;
+	double args[MAX_ARGS], partials[MAX_ARGS];
+	double a, b;
+	size_t nargs;
+	int off;
+
+	switch (n->type) {
+	case N_PAREN:
+		dvisit(d, data, n->left, out, tmp);
+		break;
+	case N_FLOATLIT:
+		out[0] = n->fval;
+		memset(out + 1, 0, (w - 1)*sizeof(double));
+		break;
+	case N_IDENT:
+		if (n->av->src)
+			off = n->av->src->offset;
+		else
+			off = n->av->offset;
+		memcpy(out, data + off*w, w*sizeof(double));
+		break;
+	case N_CALL:
+		memset(args, 0, sizeof(args));
+		nargs = n->args.len < MAX_ARGS ? n->args.len : MAX_ARGS;
+		for (size_t i = 0; i < nargs; i++) {
+			dvisit(d, data, n->args.elems[i], tmp + i*w, child);
+			args[i] = tmp[i*w];
+		}
+		out[0] = n->fn(d->sim, n, dt, time, n->args.len, args);
+		memset(out + 1, 0, (w - 1)*sizeof(double));
+		if (!n->dfn)
+			break;
+		n->dfn(d->sim, n, dt, time, nargs, args, partials);
+		for (size_t i = 0; i < nargs; i++) {
+			const double *arg = tmp + i*w;
+			if (partials[i] == 0)
+				continue;
+			for (size_t k = 1; k < w; k++)
+				out[k] += partials[i]*arg[k];
+		}
+		break;
+	case N_IF:
+		// the branch taken is piecewise constant in the parameters
+		dvisit(d, data, n->cond, l, child);
+		if (l[0] != 0)
+			dvisit(d, data, n->left, out, tmp);
+		else
+			dvisit(d, data, n->right, out, tmp);
+		break;
+	case N_UNARY:
+		dvisit(d, data, n->left, l, child);
+		switch (n->op) {
+		case '+':
+			memcpy(out, l, w*sizeof(double));
+			break;
+		case '-':
+			for (size_t k = 0; k < w; k++)
+				out[k] = -l[k];
+			break;
+		case '!':
+			out[0] = l[0] == 0 ? 1 : 0;
+			memset(out + 1, 0, (w - 1)*sizeof(double));
+			break;
+		}
+		break;
+	case N_BINARY:
+		dvisit(d, data, n->left, l, child);
+		dvisit(d, data, n->right, r, child);
+		switch (n->op) {
+		case '+':
+			for (size_t k = 0; k < w; k++)
+				out[k] = l[k] + r[k];
+			break;
+		case '-':
+			for (size_t k = 0; k < w; k++)
+				out[k] = l[k] - r[k];
+			break;
+		case '*':
+			a = l[0];
+			b = r[0];
+			for (size_t k = 1; k < w; k++)
+				out[k] = l[k]*b + a*r[k];
+			out[0] = a*b;
+			break;
+		case '/':
+			a = l[0]/r[0];
+			b = r[0];
+			for (size_t k = 1; k < w; k++)
+				out[k] = (l[k] - a*r[k])/b;
+			out[0] = a;
+			break;
+		case '^':
+			// d(l^r) = r*l^(r-1) dl + l^r ln(l) dr
+			out[0] = pow(l[0], r[0]);
+			a = r[0] == 0 ? 0 : r[0]*pow(l[0], r[0] - 1);
+			b = l[0] > 0 ? out[0]*log(l[0]) : 0;
+			for (size_t k = 1; k < w; k++)
+				out[k] = a*l[k] + b*r[k];
+			break;
+		default:
+			// comparisons and logic are piecewise constant
+			switch (n->op) {
+			case '<':
+				out[0] = l[0] < r[0] ? 1 : 0;
+				break;
+			case '>':
+				out[0] = l[0] > r[0] ? 1 : 0;
+				break;
+			case '&':
+				out[0] = l[0] == 1 && r[0] == 1 ? 1 : 0;
+				break;
+			case '|':
+				out[0] = l[0] == 1 || r[0] == 1 ? 1 : 0;
+				break;
+			case '=':
+				out[0] = l[0] == r[0];
+				break;
+			case u'≠':
+				out[0] = l[0] != r[0];
+				break;
+			case u'≤':
+				out[0] = l[0] <= r[0] ? 1 : 0;
+				break;
+			case u'≥':
+				out[0] = l[0] >= r[0] ? 1 : 0;
+				break;
+			default:
+				printf("unknown binary op (%c) encountered\n", n->op);
+				out[0] = NAN;
+			}
+			memset(out + 1, 0, (w - 1)*sizeof(double));
+		}
+		break;
+	case N_UNKNOWN:
+	default:
+		printf("unknown node encountered\n");
+		for (size_t k = 0; k < w; k++)
+			out[k] = NAN;
+		break;
+	}
+}
@@ -2,7 +2,9 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <float.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -15,56 +17,143 @@ typedef struct {
 	Walker w;
 	AVar *module;
 	AVar *av;
-	Node *curr;
 } AVarWalker;
 
 typedef struct {
 	const char *const name;
 	Fn fn;
+	DFn dfn;
 } FnDef;
 
+// variables are parsed and resolved in parallel, this many to a task
+#define COMPILE_CHUNK 256
+
+typedef struct {
+	AVar **avars;
+	size_t n;
+	int failed;
+} CompileJob;
+
+// Newton iterations solve the backward Euler step
+//
+//     y = x + dt*f(y, t+dt)
+//
+// for the stock values y, where x holds the stocks at the start of
+// the step and f returns their net flows.  The Jacobian of f is
+// approximated by finite differences, perturbing groups of stocks
+// that never feed the same net flow (taken from the direct_deps
+// graph) together so that a sparse model needs only a handful of
+// extra flow evaluations per step.  I - dt*df/dy is factored
+// sparsely, without pivoting, into L and U patterns (fill included)
+// worked out once from that graph, and the factorization is kept
+// across steps for as long as Newton keeps converging with it.
+struct Implicit_s {
+	size_t n;
+	int *off;       // slab offset of each stock
+	size_t *colptr; // CSC sparsity pattern of d(net flow)/d(stock)
+	size_t *rows;
+	double *jval;   // -dt*df/dy over that pattern
+	int *color;     // column -> perturbation group
+	int ncolors;
+	size_t *lp;     // CSC strictly lower L, unit diagonal implied
+	size_t *li;
+	double *lx;
+	size_t *up;     // CSC strictly upper U, rows ascending
+	size_t *ui;
+	double *ux;
+	double *diag;   // diagonal of U
+	double *work;   // dense column, all zero between uses
+	bool factored;
+	double *scratch; // row flows are evaluated in for trial states
+	double *x;
+	double *y;
+	double *yp;
+	double *f;
+	double *fp;
+	double *delta;
+};
+
+#define NEWTON_MAX_ITER 8
+#define NEWTON_MAX_REFRESH 2
+#define NEWTON_TOL      1e-10
+
 static double rt_min(SDSim *s, Node *n, double dt, double t, size_t len, double *args);
 static double rt_max(SDSim *s, Node *n, double dt, double t, size_t len, double *args);
 static double rt_pulse(SDSim *s, Node *n, double dt, double t, size_t len, double *args);
+static bool pulse_on(double dt, double time, size_t len, const double *args);
+static void rt_dmin(SDSim *s, Node *n, double dt, double t, size_t len, const double *args, double *partials);
+static void rt_dmax(SDSim *s, Node *n, double dt, double t, size_t len, const double *args, double *partials);
+static void rt_dpulse(SDSim *s, Node *n, double dt, double t, size_t len, const double *args, double *partials);
+
+
+static void sim_run_task(void *data);
+static void calc(SDSim *s, double *data, Slice *l, double dt, bool initial);
+static void calc_stocks(SDSim *s, double *data, Slice *l, double dt);
+static void sim_override(SDSim *s, AVar *av, double *v);
+
+static SimMethod sim_method(const char *method);
+static int implicit_init(SDSim *s);
+static int implicit_symbolic(Implicit *im);
+static int index_cmp(const void *a, const void *b);
+static void implicit_free(Implicit *im);
+static void implicit_eval(SDSim *s, Implicit *im, const double *y, double *f);
+static int implicit_step(SDSim *s, double *next);
+static int implicit_jacobian(SDSim *s, Implicit *im);
+static int implicit_factor(Implicit *im);
+static void implicit_solve(Implicit *im, double *b);
+static int implicit_newton(SDSim *s, Implicit *im);
+
+static bool sim_check_steady(SDSim *s);
+static void sim_fill_steady(SDSim *s);
+static bool row_is_finite(const double *row, size_t n);
+static void sim_find_divergence(SDSim *s, const double *row);
+static void sim_rows_done(SDSim *s, size_t upto);
+static void sim_progress(SDSim *s, size_t nsaved);
+static double *sim_row(SDSim *s, size_t i);
 
-static double *sim_curr(SDSim *s);
-static double *sim_next(SDSim *s);
-
-static void calc(SDSim *s, double *data, Slice *l, bool initial);
-static void calc_stocks(SDSim *s, double *data, Slice *l);
-
-static double svisit(SDSim *s, Node *n, double dt, double time);
 
 static AVar *module(SDProject *p, AVar *parent, SDModel *model, Var *module);
 static int module_compile(AVar *module);
+static int compiled_model_compile(SDCompiledModel *cm);
+static SDSim *sim_alloc(SDCompiledModel *cm, size_t nrows, Arena *arena);
+static void sim_layout(const SimSpec *spec, size_t *nsteps, size_t *save_every, size_t *nsaves);
+static int module_collect_avars(AVar *module, Slice *avars);
+static void avar_compile_chunk(void *data, size_t i, size_t worker);
+static int module_qual_names(AVar *module);
+static AVar *module_find(AVar *module, const char *name, size_t len);
+static int avar_name_cmp(const void *a, const void *b);
+static int avar_parse(AVar *av);
 static int module_assign_offsets(AVar *module, int *offset);
 static int module_get_varnames(AVar *module, const char **result, size_t max);
 static void module_clear_visited(AVar *module);
 static int module_sort_runlists(AVar *module);
 static int module_add_to_runlists(AVar *module, AVar *av);
+static void module_collect_stocks(AVar *module, Slice *stocks);
+static int module_assign_substeps(AVar *module, double dt);
+static double module_dt(AVar *module, double dt);
+static void module_substep(SDSim *s, double *next, AVar *module, double dt);
+static void module_copy_stocks(AVar *module, double *dst, const double *src);
+static AVar *module_find_offset(AVar *module, int off);
+
+static void avar_stock_deps(AVar *av, unsigned *mark, unsigned gen, Slice *deps);
 
 static const char *avar_qual_name(AVar *av);
 
-static AVarWalker *avar_walker_new(AVar *module, AVar *av);
-static void avar_walker_ref(void *data);
-static void avar_walker_unref(void *data);
+static void avar_walker_init(AVarWalker *w, AVar *module, AVar *av);
 static void avar_walker_start(void *data, Node *n);
-static Walker *avar_walker_start_child(void *data, Node *n);
-static void avar_walker_end_child(void *data, Node *);
+static bool avar_walker_start_child(void *data, Node *parent, Node *child);
 
 static const WalkerOps AVAR_WALKER_OPS = {
-	.ref = avar_walker_ref,
-	.unref = avar_walker_unref,
 	.start = avar_walker_start,
 	.start_child = avar_walker_start_child,
-	.end_child = avar_walker_end_child,
+	.end_child = NULL,
 	.end = NULL,
 };
 
 static const FnDef RT_FNS[] = {
-	{"pulse", rt_pulse},
-	{"min", rt_min},
-	{"max", rt_max},
+	{"pulse", rt_pulse, rt_dpulse},
+	{"min", rt_min, rt_dmin},
+	{"max", rt_max, rt_dmax},
 };
 static const size_t RT_FNS_LEN = sizeof(RT_FNS)/sizeof(RT_FNS[0]);
 
@@ -73,10 +162,8 @@ avar(AVar *parent, Var *v)
 {
 	SDModel *model;
 	AVar *av;
-	int err;
 
 	av = NULL;
-	err = 0;
 
 	if (v->type == VAR_MODULE) {
 		model = sd_project_get_model(parent->model->file->project, v->name);
@@ -88,26 +175,36 @@ avar(AVar *parent, Var *v)
 		return av;
 	}
 
+	// equations are parsed later, by compiled_model_compile
 	av = calloc(1, sizeof(*av));
 	if (!av)
 		goto error;
 	av->v = v;
 	av->parent = parent;
 
-	if (v->eqn)
-		err = avar_eqn_parse(av);
-
-	if (err)
-		goto error;
-	av->is_const = av->node && av->node->type == N_FLOATLIT;
-
 	return av;
 error:
-	printf("eqn parse failed for %s\n", v->name);
-	free(av);
 	return NULL;
 }
 
+int
+avar_parse(AVar *av)
+{
+	int err = 0;
+
+	if (av->v->eqn)
+		err = avar_eqn_parse(av);
+	if (err) {
+		printf("eqn parse failed for %s\n", av->v->name);
+		return err;
+	}
+	av->is_const = av->node && av->node->type == N_FLOATLIT;
+
+	return 0;
+}
+
+// avar_qual_name returns av's name qualified by its modules'.
+// compiled_model_compile builds them all, after which this only reads.
 const char *
 avar_qual_name(AVar *av)
 {
@@ -146,38 +243,13 @@ avar_qual_name(AVar *av)
 	return av->qual_name;
 }
 
-AVarWalker *
-avar_walker_new(AVar *module, AVar *av)
+void
+avar_walker_init(AVarWalker *w, AVar *module, AVar *av)
 {
-	AVarWalker *w = calloc(1, sizeof(*w));
-
-	if (!w)
-		return NULL;
-
+	memset(w, 0, sizeof(*w));
 	w->w.ops = &AVAR_WALKER_OPS;
-	avar_walker_ref(w);
 	w->av = av;
 	w->module = module;
-
-	return w;
-}
-
-void
-avar_walker_ref(void *data)
-{
-	AVarWalker *w = data;
-	__sync_fetch_and_add(&w->w.refcount, 1);
-}
-
-void
-avar_walker_unref(void *data)
-{
-	AVarWalker *w = data;
-
-	if (!w || __sync_sub_and_fetch(&w->w.refcount, 1) != 0)
-		return;
-
-	free(w);
 }
 
 void
@@ -186,8 +258,6 @@ avar_walker_start(void *data, Node *n)
 	AVarWalker *avw = data;
 	AVar *dep;
 
-	avw->curr = n;
-
 	switch (n->type) {
 	case N_IDENT:
 		dep = resolve(avw->module, n->sval);
@@ -206,6 +276,7 @@ avar_walker_start(void *data, Node *n)
 		for (size_t i = 0; i < RT_FNS_LEN; i++) {
 			if (strcmp(n->left->sval, RT_FNS[i].name) == 0) {
 				n->fn = RT_FNS[i].fn;
+				n->dfn = RT_FNS[i].dfn;
 				break;
 			}
 		}
@@ -217,34 +288,20 @@ avar_walker_start(void *data, Node *n)
 	}
 }
 
-Walker *
-avar_walker_start_child(void *data, Node *n)
+bool
+avar_walker_start_child(void *data, Node *parent, Node *child)
 {
-	AVarWalker *avw = data;
-	Node *curr = avw->curr;
-
 	// skip trying to resolve function name identifiers for calls
 	// a second time - already handled in avar_walker_start above
-	if (curr->type == N_CALL && n == curr->left)
-		return NULL;
-
-	avw->w.ops->ref(&avw->w);
-	return &avw->w;
-}
-
-void
-avar_walker_end_child(void *data, Node *n)
-{
+	return !(parent->type == N_CALL && child == parent->left);
 }
 
 int
 avar_init(AVar *av, AVar *module)
 {
-	AVarWalker *w;
+	AVarWalker w;
 	bool ok;
 
-	w = NULL;
-
 	// is amodule if we have a model pointer
 	if (av->model) {
 		return module_compile(av);
@@ -259,9 +316,9 @@ avar_init(AVar *av, AVar *module)
 		return 0;
 	}
 
-	w = avar_walker_new(module, av);
+	avar_walker_init(&w, module, av);
 
-	ok = node_walk(&w->w, av->node);
+	ok = node_walk(&w.w, av->node);
 	if (!ok)
 		goto error;
 
@@ -280,11 +337,8 @@ avar_init(AVar *av, AVar *module)
 		slice_append(&av->outflows, out);
 	}
 
-	avar_walker_unref(w);
-
 	return SD_ERR_NO_ERROR;
 error:
-	avar_walker_unref(w);
 	return SD_ERR_UNSPECIFIED;
 }
 
@@ -300,6 +354,7 @@ avar_free(AVar *av)
 		avar_free(child);
 	}
 	free(av->avars.elems);
+	free(av->by_name);
 	free(av->qual_name);
 	node_free(av->node);
 	free(av->direct_deps.elems);
@@ -366,6 +421,12 @@ module(SDProject *p, AVar *parent, SDModel *model, Var *vmodule)
 		slice_append(&module->avars, av);
 	}
 
+	module->by_name = malloc((module->avars.len + 1)*sizeof(*module->by_name));
+	if (!module->by_name)
+		goto error;
+	memcpy(module->by_name, module->avars.elems, module->avars.len*sizeof(*module->by_name));
+	qsort(module->by_name, module->avars.len, sizeof(*module->by_name), avar_name_cmp);
+
 	return module;
 error:
 	avar_free(module);
@@ -377,6 +438,7 @@ resolve(AVar *module, const char *name)
 {
 	size_t len;
 	const char *subvar;
+	AVar *av;
 
 	len = 0;
 
@@ -391,29 +453,56 @@ resolve(AVar *module, const char *name)
 	if (subvar) {
 		len = subvar - name;
 		subvar++;
-	}
-
-	for (size_t i = 0; i < module->avars.len; i++) {
-		AVar *av = module->avars.elems[i];
-		if (subvar && av->v->type == VAR_MODULE && strncmp(av->v->name, name, len) == 0) {
+		av = module_find(module, name, len);
+		if (av && av->v->type == VAR_MODULE)
 			return resolve(av, subvar);
-		}
-		else if (strcmp(av->v->name, name) == 0)
-			return av;
 	}
 
+	return module_find(module, name, strlen(name));
+}
+
+// module_find returns the variable in module named by the first len
+// bytes of name, by binary search of by_name.
+AVar *
+module_find(AVar *module, const char *name, size_t len)
+{
+	size_t lo = 0, hi = module->avars.len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		const char *n = module->by_name[mid]->v->name;
+		int c = strncmp(n, name, len);
+		if (c == 0 && n[len])
+			c = 1;
+		if (c < 0)
+			lo = mid + 1;
+		else if (c > 0)
+			hi = mid;
+		else
+			return module->by_name[mid];
+	}
 	return NULL;
 }
 
+int
+avar_name_cmp(const void *a, const void *b)
+{
+	const AVar *const *x = a, *const *y = b;
+	return strcmp((*x)->v->name, (*y)->v->name);
+}
+
 int
 module_compile(AVar *module)
 {
 	AVar *av;
 	int err, failed;
 
+	// other variables have been initialized by compiled_model_compile
 	failed = 0;
 	for (size_t i = 0; i < module->avars.len; i++) {
 		av = module->avars.elems[i];
+		if (!av->model)
+			continue;
 		err = avar_init(av, module);
 		if (err)
 			failed++;
@@ -434,55 +523,365 @@ module_compile(AVar *module)
 	return SD_ERR_NO_ERROR;
 }
 
-SDSim *
-sd_sim_new(SDProject *p, const char *model_name)
+// compiled_model_compile parses and resolves the equation of every
+// variable in the model, then finishes compiling modules.  Each variable's
+// equation only touches its own AVar, and reads nothing but the names
+// of its module's variables, so these are done in parallel on the
+// project's executor.
+int
+compiled_model_compile(SDCompiledModel *cm)
 {
-	SDSim *sim;
+	CompileJob job;
+	Slice avars;
+	size_t nchunks;
+	int err;
+
+	memset(&avars, 0, sizeof(avars));
+	err = module_collect_avars(cm->module, &avars);
+	if (err) {
+		free(avars.elems);
+		return err;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.avars = (AVar **)avars.elems;
+	job.n = avars.len;
+	nchunks = (job.n + COMPILE_CHUNK - 1)/COMPILE_CHUNK;
+
+	// small models don't need, and shouldn't start, the executor
+	if (nchunks > 1)
+		err = sd_executor_parallel_for(executor_get(cm->project), nchunks, 0, avar_compile_chunk, &job);
+	else if (nchunks)
+		avar_compile_chunk(&job, 0, 0);
+	free(avars.elems);
+	if (!err && job.failed)
+		err = SD_ERR_UNSPECIFIED;
+	if (!err)
+		err = avar_init(cm->module, NULL);
+	// names are built now rather than on first use, which would
+	// write to AVars shared by every sim of the model
+	if (!err)
+		err = module_qual_names(cm->module);
+
+	return err;
+}
+
+int
+module_qual_names(AVar *module)
+{
+	int err = 0;
+
+	for (size_t i = 0; i < module->avars.len && !err; i++) {
+		AVar *av = module->avars.elems[i];
+		if (!avar_qual_name(av))
+			err = SD_ERR_NOMEM;
+		else if (av->model)
+			err = module_qual_names(av);
+	}
+	return err;
+}
+
+int
+module_collect_avars(AVar *module, Slice *avars)
+{
+	int err = 0;
+
+	for (size_t i = 0; i < module->avars.len && !err; i++) {
+		AVar *av = module->avars.elems[i];
+		if (av->model)
+			err = module_collect_avars(av, avars);
+		else
+			err = slice_append(avars, av);
+	}
+	return err;
+}
+
+void
+avar_compile_chunk(void *data, size_t i, size_t worker)
+{
+	CompileJob *job = data;
+	size_t end = (i + 1)*COMPILE_CHUNK;
+
+	if (end > job->n)
+		end = job->n;
+	for (size_t k = i*COMPILE_CHUNK; k < end; k++) {
+		AVar *av = job->avars[k];
+		if (avar_parse(av) || avar_init(av, av->parent))
+			__sync_fetch_and_add(&job->failed, 1);
+	}
+}
+
+SDCompiledModel *
+sd_compiled_model_new(SDProject *p, const char *model_name)
+{
+	SDCompiledModel *cm;
 	SDModel *model;
-	int err, offset;
+	SimSpec *spec;
+	int err, offset, depth;
 
 	offset = 0;
 	model = NULL;
-	sim = calloc(1, sizeof(*sim));
-	if (!sim)
+	cm = calloc(1, sizeof(*cm));
+	if (!cm)
 		goto error;
-	sd_sim_ref(sim);
+	sd_compiled_model_ref(cm);
 
 	// FIXME: check refcounting
 	model = sd_project_get_model(p, model_name);
 	if (!model)
 		goto error;
 
-	sim->module = module(p, NULL, model, NULL);
-	if (!sim->module)
+	cm->module = module(p, NULL, model, NULL);
+	if (!cm->module)
 		goto error;
 
 	sd_project_ref(p);
-	sim->project = p;
+	cm->project = p;
 
-	err = avar_init(sim->module, NULL);
+	err = compiled_model_compile(cm);
 	if (err)
 		goto error;
 
-	err = module_assign_offsets(sim->module, &offset);
+	err = module_assign_offsets(cm->module, &offset);
 	if (err)
 		goto error;
 
-	err = module_sort_runlists(sim->module);
+	err = module_sort_runlists(cm->module);
 	if (err)
 		goto error;
 
-	sim->nvars = offset;
-	err = sd_sim_reset(sim);
+	module_collect_stocks(cm->module, &cm->stocks);
+
+	cm->nvars = offset;
+
+	err = components_new(cm->module, cm->nvars, &cm->components);
 	if (err)
 		goto error;
 
+	// the implicit integrator is stable at the model's dt, so
+	// per-module time steps only apply to explicit Euler.
+	spec = &model->file->sim_specs;
+	if (sim_method(spec->method) == SIM_EULER) {
+		depth = module_assign_substeps(cm->module, spec->dt);
+		cm->substep_levels = depth;
+	}
+
+	return cm;
+error:
+	sd_compiled_model_unref(cm);
+	return NULL;
+}
+
+void
+sd_compiled_model_ref(SDCompiledModel *cm)
+{
+	if (!cm)
+		return;
+	__sync_fetch_and_add(&cm->refcount, 1);
+}
+
+void
+sd_compiled_model_unref(SDCompiledModel *cm)
+{
+	if (!cm)
+		return;
+	if (__sync_sub_and_fetch(&cm->refcount, 1) == 0) {
+		avar_free(cm->module);
+		free(cm->stocks.elems);
+		components_free(cm->components);
+		sd_project_unref(cm->project);
+		free(cm);
+	}
+}
+
+SDSim *
+sd_sim_new(SDProject *p, const char *model_name)
+{
+	SDCompiledModel *cm;
+	SDSim *sim;
+
+	cm = sd_compiled_model_new(p, model_name);
+	if (!cm)
+		return NULL;
+	sim = sd_sim_new_from(cm);
+	sd_compiled_model_unref(cm);
+
+	return sim;
+}
+
+SDSim *
+sd_sim_new_from(SDCompiledModel *cm)
+{
+	return sim_new_in(cm, NULL);
+}
+
+SDSim *
+sim_new_in(SDCompiledModel *cm, Arena *arena)
+{
+	SDSim *sim;
+	size_t nsteps, save_every, nsaves;
+
+	if (!cm)
+		return NULL;
+
+	sim_layout(&cm->module->model->file->sim_specs, &nsteps, &save_every, &nsaves);
+	// XXX: 1 extra step to simplify run_to
+	sim = sim_alloc(cm, nsaves + 1, arena);
+	if (!sim)
+		return NULL;
+
+	// overrides are per-sim, as is the rest of the run state.
+	if (sd_sim_reset(sim))
+		goto error;
+
 	return sim;
 error:
 	sd_sim_unref(sim);
 	return NULL;
 }
 
+SDSim *
+sim_new_on(SDCompiledModel *cm, double *slab, size_t len)
+{
+	SDSim *sim;
+
+	if (!cm)
+		return NULL;
+
+	sim = sim_alloc(cm, 0, NULL);
+	if (!sim)
+		return NULL;
+	sim_use_slab(sim, slab, len);
+	if (sd_sim_reset(sim)) {
+		sd_sim_unref(sim);
+		return NULL;
+	}
+	return sim;
+}
+
+void
+sim_use_slab(SDSim *s, double *slab, size_t len)
+{
+	if (s->slab != s->storage && !s->slab_borrowed)
+		free(s->slab);
+	s->slab = slab;
+	s->slab_len = len;
+	s->slab_borrowed = true;
+	// nothing may write to the last slab once it's handed back
+	s->curr = slab;
+	s->next = NULL;
+}
+
+// sim_alloc allocates a sim for cm, its slab of nrows rows and its
+// substep rows as a single block, from arena if it isn't NULL.
+// sd_sim_reset only allocates if the slab needs to grow.
+SDSim *
+sim_alloc(SDCompiledModel *cm, size_t nrows, Arena *arena)
+{
+	SDSim *sim;
+	size_t nslab, nsubstep, len;
+
+	// ensure we don't ask calloc to allocate 0 elements
+	nslab = (cm->nvars ? cm->nvars : 1)*nrows;
+	nsubstep = cm->substep_levels*cm->nvars;
+	len = sizeof(*sim) + (nslab + nsubstep)*sizeof(double);
+
+	sim = arena ? arena_alloc(arena, len) : calloc(1, len);
+	if (!sim)
+		return NULL;
+	sim->in_arena = arena != NULL;
+	sd_sim_ref(sim);
+
+	sd_compiled_model_ref(cm);
+	sim->compiled = cm;
+	sd_project_ref(cm->project);
+	sim->project = cm->project;
+	sim->module = cm->module;
+	sim->stocks = cm->stocks;
+	sim->components = cm->components;
+	sim->nvars = cm->nvars;
+	sim->substep_levels = cm->substep_levels;
+
+	sim->slab = sim->storage;
+	sim->slab_len = nslab;
+	if (nsubstep)
+		sim->substep_rows = &sim->storage[nslab];
+
+	return sim;
+}
+
+SDSim *
+sd_sim_clone(SDSim *s, int flags)
+{
+	SDSim *c;
+	size_t nrows, first;
+
+	if (!s)
+		return NULL;
+
+	nrows = s->no_history ? 2 : s->nsaves + 1;
+	c = sim_alloc(s->compiled, nrows, NULL);
+	if (!c)
+		return NULL;
+
+	c->spec = s->spec;
+	c->method = s->method;
+	c->nsteps = s->nsteps;
+	c->nsaves = s->nsaves;
+	c->save_every = s->save_every;
+	c->step = s->step;
+	c->save_step = s->save_step;
+	c->no_history = s->no_history;
+	// a row callback set on the clone starts from here
+	c->rows_done = s->save_step;
+
+	c->steady_tol = s->steady_tol;
+	c->steady_window = s->steady_window;
+	c->steady_count = s->steady_count;
+	c->steady_time = s->steady_time;
+	c->is_steady = s->is_steady;
+	c->finite_every = s->finite_every;
+	c->diverged = s->diverged;
+	c->diverged_time = s->diverged_time;
+
+	for (size_t i = 0; i < s->overrides.len; i++) {
+		Override *o = malloc(sizeof(*o));
+		if (!o)
+			goto error;
+		*o = *(Override *)s->overrides.elems[i];
+		if (slice_append(&c->overrides, o)) {
+			free(o);
+			goto error;
+		}
+	}
+
+	// the current and next rows are all a run needs to continue;
+	// without history the rest of the slab stays zeroed.
+	first = flags & SD_CLONE_HISTORY && !s->no_history ? 0 : s->save_step;
+	for (size_t i = first; i <= s->save_step + 1 && i < s->nsaves + 1; i++)
+		memcpy(sim_row(c, i), sim_row(s, i), s->nvars*sizeof(double));
+	c->curr = sim_curr(c);
+	c->next = sim_next(c);
+
+	if (c->method == SIM_BACKWARD_EULER && implicit_init(c))
+		goto error;
+	if (s->nthreads > 1 && sd_sim_set_threads(c, s->nthreads))
+		goto error;
+
+	return c;
+error:
+	sd_sim_unref(c);
+	return NULL;
+}
+
+SDCompiledModel *
+sd_sim_get_compiled_model(SDSim *sim)
+{
+	if (!sim)
+		return NULL;
+	return sim->compiled;
+}
+
 int
 module_assign_offsets(AVar *module, int *offset)
 {
@@ -588,74 +987,151 @@ module_sort_runlists(AVar *module)
 	return 0;
 }
 
+int
+runlist_flatten(Slice *out, Slice *l, bool stocks)
+{
+	for (size_t i = 0; i < l->len; i++) {
+		AVar *av = l->elems[i];
+		int err;
+		if (av->v->type == VAR_MODULE)
+			err = runlist_flatten(out, stocks ? &av->stocks : &av->flows, stocks);
+		else if (av->node)
+			err = slice_append(out, av);
+		else
+			err = 0; // time ends up on runlists when referenced
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+void
+module_collect_stocks(AVar *module, Slice *stocks)
+{
+	for (size_t i = 0; i < module->stocks.len; i++) {
+		AVar *av = module->stocks.elems[i];
+		if (av->v->type == VAR_MODULE)
+			module_collect_stocks(av, stocks);
+		else if (av->v->type == VAR_STOCK)
+			slice_append(stocks, av);
+	}
+}
+
 int
 sd_sim_reset(SDSim *s)
 {
 	int err = 0;
-	size_t save_every, nvars;
+	size_t nvars, nrows;
 
 	s->spec = s->module->model->file->sim_specs;
+	s->method = sim_method(s->spec.method);
 	s->step = 0;
 	s->save_step = 0;
-	s->nsteps = (s->spec.stop - s->spec.start)/s->spec.dt + 1;
+	s->steady_count = 0;
+	s->is_steady = false;
+	s->diverged = NULL;
+	sim_layout(&s->spec, &s->nsteps, &s->save_every, &s->nsaves);
 
-	save_every = s->spec.savestep/s->spec.dt+.5;
-	s->save_every = save_every > 1 ? save_every : 1;
-	s->nsaves = s->nsteps/s->save_every;
-	if (s->nsteps % s->save_every)
-		s->nsaves++;
+	s->rows_done = 0;
+	s->progress_done = 0;
+	// so a rerun takes the same Newton iterates as the first run
+	if (s->implicit)
+		s->implicit->factored = false;
 
-	free(s->slab);
 	nvars = s->nvars;
 	// ensure we don't ask calloc to allocate 0 elements
 	if (!nvars)
 		nvars = 1;
 	// XXX: 1 extra step to simplify run_to
-	s->slab = calloc(nvars*(s->nsaves + 1), sizeof(double));
-	if (!s->slab) {
-		err = SD_ERR_NOMEM;
-		goto error;
+	nrows = s->no_history ? 2 : s->nsaves + 1;
+	if (nvars*nrows <= s->slab_len) {
+		memset(s->slab, 0, nvars*nrows*sizeof(double));
+	} else {
+		double *slab = calloc(nvars*nrows, sizeof(double));
+		if (!slab) {
+			err = SD_ERR_NOMEM;
+			goto error;
+		}
+		if (s->slab != s->storage && !s->slab_borrowed)
+			free(s->slab);
+		s->slab = slab;
+		s->slab_len = nvars*nrows;
+		s->slab_borrowed = false;
 	}
 	s->curr = s->slab;
 	s->next = NULL;
 
 	s->curr[TIME] = s->spec.start;
 
-	calc(s, s->curr, &s->module->initials, true);
+	calc(s, s->curr, &s->module->initials, s->spec.dt, true);
+
+	if (s->method == SIM_BACKWARD_EULER && !s->implicit)
+		err = implicit_init(s);
 error:
 	return err;
 }
 
+// sim_layout works out the number of time steps a run of spec takes,
+// how many steps apart results are saved, and how many are saved.
 void
-calc(SDSim *s, double *data, Slice *l, bool initial)
+sim_layout(const SimSpec *spec, size_t *nsteps, size_t *save_every, size_t *nsaves)
 {
-	double dt;
+	size_t every;
 
-	dt = s->spec.dt;
+	*nsteps = (spec->stop - spec->start)/spec->dt + 1;
+
+	every = spec->savestep/spec->dt+.5;
+	*save_every = every > 1 ? every : 1;
+	*nsaves = *nsteps / *save_every;
+	if (*nsteps % *save_every)
+		(*nsaves)++;
+}
+
+SimMethod
+sim_method(const char *method)
+{
+	SimMethod m = SIM_EULER;
+	char *name;
+
+	if (!method)
+		return m;
+
+	name = canonicalize(method);
+	if (!name)
+		return m;
+	if (strcmp(name, "backward_euler") == 0 || strcmp(name, "bdf1") == 0)
+		m = SIM_BACKWARD_EULER;
+	free(name);
 
+	return m;
+}
+
+void
+calc(SDSim *s, double *data, Slice *l, double dt, bool initial)
+{
 	//printf("CALC\n");
 	for (size_t i = 0; i < l->len; i++) {
 		AVar *av = l->elems[i];
 		if (!av->node) {
 			if (initial)
-				calc(s, data, &av->initials, true);
+				calc(s, data, &av->initials, module_dt(av, dt), true);
 			else
-				calc(s, data, &av->flows, false);
+				calc(s, data, &av->flows, module_dt(av, dt), false);
 			continue;
 		}
-		double v = svisit(s, av->node, dt, data[0]);
+		double v = svisit(s, s->curr, av->node, dt, data[0]);
 		if (av->v->gf)
 			v = lookup(av->v->gf, v);
+		if (initial && av->is_const && s->overrides.len)
+			sim_override(s, av, &v);
 		data[av->offset] = v;
 	}
 }
 
 void
-calc_stocks(SDSim *s, double *data, Slice *l)
+calc_stocks(SDSim *s, double *data, Slice *l, double dt)
 {
-	double prev, v, dt;
-
-	dt = s->spec.dt;
+	double prev, v;
 
 	//printf("CALC STOCKS\n");
 	for (size_t i = 0; i < l->len; i++) {
@@ -666,60 +1142,978 @@ calc_stocks(SDSim *s, double *data, Slice *l)
 		switch (av->v->type) {
 		case VAR_STOCK:
 			prev = s->curr[av->offset];
-			v = 0;
-			for (size_t i = 0; i < av->inflows.len; i++) {
-				AVar *in = av->inflows.elems[i];
-				v += s->curr[in->offset];
-			}
-			for (size_t i = 0; i < av->outflows.len; i++) {
-				AVar *out = av->outflows.elems[i];
-				v -= s->curr[out->offset];
-			}
+			v = stock_net_flow(av, s->curr);
 			data[av->offset] = prev + v*dt;
 			break;
 		case VAR_MODULE:
-			calc_stocks(s, data, &av->stocks);
+			if (av->substeps > 1)
+				module_substep(s, data, av, dt);
+			else
+				calc_stocks(s, data, &av->stocks, dt);
 			break;
 		default:
-			v = svisit(s, av->node, dt, s->curr[0]);
-			data[av->offset] = v;
+			// constants: carry forward, so values set with
+			// sd_sim_set_value stick.
+			data[av->offset] = s->curr[av->offset];
 			break;
 		}
 	}
 }
 
+// module_substep advances the stocks of a module that declared a
+// finer dt than its parent across one parent step, taking
+// module->substeps steps of its own.  Everything outside the module
+// is held at its value from the start of the parent step.
+void
+module_substep(SDSim *s, double *next, AVar *module, double dt)
+{
+	double *curr, *scratch;
+	double h;
+	int k;
+
+	k = module->substeps;
+	h = dt/k;
+	curr = s->curr;
+	scratch = &s->substep_rows[s->substep_depth++*s->nvars];
+
+	memcpy(scratch, curr, s->nvars*sizeof(double));
+	s->curr = scratch;
+	for (int j = 0; j < k; j++) {
+		// the flows for the first substep were calculated
+		// along with the rest of the model.
+		if (j > 0) {
+			scratch[TIME] = curr[TIME] + j*h;
+			calc(s, scratch, &module->flows, h, false);
+		}
+		calc_stocks(s, next, &module->stocks, h);
+		if (j < k - 1)
+			module_copy_stocks(module, scratch, next);
+	}
+	s->curr = curr;
+	s->substep_depth--;
+}
+
+void
+module_copy_stocks(AVar *module, double *dst, const double *src)
+{
+	for (size_t i = 0; i < module->stocks.len; i++) {
+		AVar *av = module->stocks.elems[i];
+		if (av->v->type == VAR_MODULE)
+			module_copy_stocks(av, dst, src);
+		else
+			dst[av->offset] = src[av->offset];
+	}
+}
+
+AVar *
+module_find_offset(AVar *module, int off)
+{
+	for (size_t i = 0; i < module->avars.len; i++) {
+		AVar *av = module->avars.elems[i];
+		if (av->model) {
+			AVar *found = module_find_offset(av, off);
+			if (found)
+				return found;
+		} else if (!av->src && av->offset == off) {
+			return av;
+		}
+	}
+
+	return NULL;
+}
+
+double
+module_dt(AVar *module, double dt)
+{
+	return module->substeps > 1 ? dt/module->substeps : dt;
+}
+
+// module_assign_substeps records, for every module that declares
+// its own dt, how many of its steps fit in one step of its parent.
+// Modules can only step faster than their parent; a coarser dt is
+// ignored.  Returns the deepest nesting of substepping modules.
 int
-sd_sim_run_to(SDSim *s, double end)
+module_assign_substeps(AVar *module, double dt)
 {
-	double dt;
+	int depth = 0;
+
+	for (size_t i = 0; i < module->avars.len; i++) {
+		AVar *av = module->avars.elems[i];
+		double sub_dt = dt;
+		int d;
+
+		if (!av->model)
+			continue;
+		av->substeps = 1;
+		if (av->model->dt > 0 && av->model->dt < dt) {
+			av->substeps = dt/av->model->dt + .5;
+			sub_dt = dt/av->substeps;
+		}
+		d = module_assign_substeps(av, sub_dt);
+		if (av->substeps > 1)
+			d++;
+		if (d > depth)
+			depth = d;
+	}
+
+	return depth;
+}
+
+double
+stock_net_flow(AVar *av, const double *data)
+{
+	double v = 0;
+
+	for (size_t i = 0; i < av->inflows.len; i++) {
+		AVar *in = av->inflows.elems[i];
+		v += data[in->offset];
+	}
+	for (size_t i = 0; i < av->outflows.len; i++) {
+		AVar *out = av->outflows.elems[i];
+		v -= data[out->offset];
+	}
+
+	return v;
+}
+
+// avar_stock_deps appends to deps every stock whose value av's
+// equation reads, either directly or through the auxiliaries and
+// flows it depends on.  mark is indexed by slab offset; entries
+// equal to gen have already been visited.
+void
+avar_stock_deps(AVar *av, unsigned *mark, unsigned gen, Slice *deps)
+{
+	for (size_t i = 0; i < av->direct_deps.len; i++) {
+		AVar *dep = av->direct_deps.elems[i];
+		while (dep->src)
+			dep = dep->src;
+		if (mark[dep->offset] == gen)
+			continue;
+		mark[dep->offset] = gen;
+		if (dep->v->type == VAR_STOCK)
+			slice_append(deps, dep);
+		else
+			avar_stock_deps(dep, mark, gen, deps);
+	}
+}
+
+int
+implicit_init(SDSim *s)
+{
+	Implicit *im;
+	unsigned *mark = NULL;
+	int *stock_of = NULL;
+	size_t *rowptr = NULL, *cols = NULL, *fill = NULL;
+	size_t *forbid = NULL;
+	Slice deps;
+	size_t n, nnz;
+	int err = SD_ERR_NOMEM;
+
+	memset(&deps, 0, sizeof(deps));
+
+	im = calloc(1, sizeof(*im));
+	if (!im)
+		return SD_ERR_NOMEM;
+	n = im->n = s->stocks.len;
+
+	im->off = calloc(n + 1, sizeof(*im->off));
+	im->colptr = calloc(n + 1, sizeof(*im->colptr));
+	im->color = calloc(n + 1, sizeof(*im->color));
+	im->scratch = calloc(s->nvars, sizeof(*im->scratch));
+	im->x = calloc(n + 1, sizeof(double));
+	im->y = calloc(n + 1, sizeof(double));
+	im->yp = calloc(n + 1, sizeof(double));
+	im->f = calloc(n + 1, sizeof(double));
+	im->fp = calloc(n + 1, sizeof(double));
+	im->delta = calloc(n + 1, sizeof(double));
+	mark = calloc(s->nvars, sizeof(*mark));
+	stock_of = calloc(s->nvars, sizeof(*stock_of));
+	rowptr = calloc(n + 1, sizeof(*rowptr));
+	fill = calloc(n + 1, sizeof(*fill));
+	forbid = calloc(n + 1, sizeof(*forbid));
+	if (!im->off || !im->colptr || !im->color || !im->scratch ||
+	    !im->x || !im->y || !im->yp || !im->f || !im->fp ||
+	    !im->delta || !mark || !stock_of ||
+	    !rowptr || !fill || !forbid)
+		goto error;
+
+	for (size_t i = 0; i < s->nvars; i++)
+		stock_of[i] = -1;
+	for (size_t i = 0; i < n; i++) {
+		AVar *av = s->stocks.elems[i];
+		im->off[i] = av->offset;
+		stock_of[av->offset] = i;
+	}
+
+	// row i of the Jacobian lists the stocks that stock i's net
+	// flow depends on.  Build it in CSR form first, then
+	// transpose into the CSC form the column-wise finite
+	// differences want.
+	for (size_t i = 0; i < n; i++) {
+		AVar *av = s->stocks.elems[i];
+		unsigned gen = i + 1;
+		for (size_t j = 0; j < av->inflows.len; j++)
+			avar_stock_deps(av->inflows.elems[j], mark, gen, &deps);
+		for (size_t j = 0; j < av->outflows.len; j++)
+			avar_stock_deps(av->outflows.elems[j], mark, gen, &deps);
+		rowptr[i+1] = deps.len;
+	}
+	nnz = deps.len;
+	cols = calloc(nnz + 1, sizeof(*cols));
+	im->rows = calloc(nnz + 1, sizeof(*im->rows));
+	im->jval = calloc(nnz + 1, sizeof(*im->jval));
+	if (!cols || !im->rows || !im->jval)
+		goto error;
+	for (size_t k = 0; k < nnz; k++) {
+		AVar *dep = deps.elems[k];
+		cols[k] = stock_of[dep->offset];
+		im->colptr[cols[k]+1]++;
+	}
+	for (size_t j = 0; j < n; j++)
+		im->colptr[j+1] += im->colptr[j];
+	for (size_t i = 0; i < n; i++) {
+		for (size_t k = rowptr[i]; k < rowptr[i+1]; k++) {
+			size_t j = cols[k];
+			im->rows[im->colptr[j] + fill[j]++] = i;
+		}
+	}
+
+	// greedy coloring: columns sharing a row must be perturbed
+	// separately, everything else can share an evaluation.
+	for (size_t j = 0; j < n; j++)
+		im->color[j] = -1;
+	im->ncolors = 0;
+	for (size_t j = 0; j < n; j++) {
+		int c;
+		for (size_t k = im->colptr[j]; k < im->colptr[j+1]; k++) {
+			size_t r = im->rows[k];
+			for (size_t l = rowptr[r]; l < rowptr[r+1]; l++) {
+				int other = im->color[cols[l]];
+				if (other >= 0)
+					forbid[other] = j + 1;
+			}
+		}
+		for (c = 0; c < im->ncolors && forbid[c] == j + 1; c++)
+			;
+		im->color[j] = c;
+		if (c == im->ncolors)
+			im->ncolors++;
+	}
+
+	err = implicit_symbolic(im);
+	if (err)
+		goto error;
+
+	s->implicit = im;
+	im = NULL;
+	err = SD_ERR_NO_ERROR;
+error:
+	implicit_free(im);
+	free(deps.elems);
+	free(mark);
+	free(stock_of);
+	free(rowptr);
+	free(cols);
+	free(fill);
+	free(forbid);
+	return err;
+}
+
+// implicit_symbolic works out the patterns of L and U from the
+// Jacobian's, plus the diagonal.  Without pivoting, column j of
+// either holds the rows of column j of the matrix and every row
+// reachable from those through the columns of L before j.
+int
+implicit_symbolic(Implicit *im)
+{
+	const size_t n = im->n;
+	size_t *mark = NULL, *stack = NULL, *reach = NULL;
+	size_t nl = 0, nu = 0, lcap = n + 1, ucap = n + 1;
+	int err = SD_ERR_NOMEM;
+
+	mark = calloc(n + 1, sizeof(*mark));
+	stack = calloc(n + 1, sizeof(*stack));
+	reach = calloc(n + 1, sizeof(*reach));
+	im->lp = calloc(n + 1, sizeof(*im->lp));
+	im->up = calloc(n + 1, sizeof(*im->up));
+	im->li = calloc(lcap, sizeof(*im->li));
+	im->ui = calloc(ucap, sizeof(*im->ui));
+	im->diag = calloc(n + 1, sizeof(*im->diag));
+	im->work = calloc(n + 1, sizeof(*im->work));
+	if (!mark || !stack || !reach || !im->lp || !im->up ||
+	    !im->li || !im->ui || !im->diag || !im->work)
+		goto error;
+
+	for (size_t j = 0; j < n; j++) {
+		size_t nreach = 0, top = 0;
+
+		mark[j] = j + 1;
+		reach[nreach++] = j;
+		for (size_t k = im->colptr[j]; k < im->colptr[j+1]; k++) {
+			size_t r = im->rows[k];
+			if (mark[r] == j + 1)
+				continue;
+			mark[r] = j + 1;
+			reach[nreach++] = r;
+			if (r < j)
+				stack[top++] = r;
+		}
+		while (top) {
+			size_t i = stack[--top];
+			for (size_t k = im->lp[i]; k < im->lp[i+1]; k++) {
+				size_t r = im->li[k];
+				if (mark[r] == j + 1)
+					continue;
+				mark[r] = j + 1;
+				reach[nreach++] = r;
+				if (r < j)
+					stack[top++] = r;
+			}
+		}
+		// implicit_factor eliminates U's rows in ascending order
+		qsort(reach, nreach, sizeof(*reach), index_cmp);
+
+		for (size_t k = 0; k < nreach; k++) {
+			size_t r = reach[k], **idx, *len, *cap;
+			if (r == j)
+				continue;
+			if (r < j) {
+				idx = &im->ui;
+				len = &nu;
+				cap = &ucap;
+			} else {
+				idx = &im->li;
+				len = &nl;
+				cap = &lcap;
+			}
+			if (*len == *cap) {
+				size_t *grown = realloc(*idx, 2*(*cap)*sizeof(**idx));
+				if (!grown)
+					goto error;
+				*idx = grown;
+				*cap *= 2;
+			}
+			(*idx)[(*len)++] = r;
+		}
+		im->lp[j+1] = nl;
+		im->up[j+1] = nu;
+	}
+
+	im->lx = calloc(nl + 1, sizeof(*im->lx));
+	im->ux = calloc(nu + 1, sizeof(*im->ux));
+	if (!im->lx || !im->ux)
+		goto error;
+
+	err = SD_ERR_NO_ERROR;
+error:
+	free(mark);
+	free(stack);
+	free(reach);
+	return err;
+}
+
+int
+index_cmp(const void *a, const void *b)
+{
+	const size_t *x = a, *y = b;
+	return (*x > *y) - (*x < *y);
+}
+
+void
+implicit_free(Implicit *im)
+{
+	if (!im)
+		return;
+
+	free(im->off);
+	free(im->colptr);
+	free(im->rows);
+	free(im->jval);
+	free(im->color);
+	free(im->lp);
+	free(im->li);
+	free(im->lx);
+	free(im->up);
+	free(im->ui);
+	free(im->ux);
+	free(im->diag);
+	free(im->work);
+	free(im->scratch);
+	free(im->x);
+	free(im->y);
+	free(im->yp);
+	free(im->f);
+	free(im->fp);
+	free(im->delta);
+	free(im);
+}
+
+// implicit_eval computes the net flows f of every stock when the
+// stocks take the values in y.  im->scratch must already hold the
+// row for the end of the step.
+void
+implicit_eval(SDSim *s, Implicit *im, const double *y, double *f)
+{
+	double *curr;
+
+	for (size_t i = 0; i < im->n; i++)
+		im->scratch[im->off[i]] = y[i];
+
+	curr = s->curr;
+	s->curr = im->scratch;
+	calc(s, im->scratch, &s->module->flows, s->spec.dt, false);
+	s->curr = curr;
+
+	for (size_t i = 0; i < im->n; i++)
+		f[i] = stock_net_flow(s->stocks.elems[i], im->scratch);
+}
+
+// implicit_step replaces the explicit Euler stock values calc_stocks
+// left in next with the backward Euler solution, using them as the
+// starting guess for a modified Newton iteration.  A factorization
+// left over from an earlier step gets the first try; if Newton
+// doesn't converge with it, the step starts over with the Jacobian
+// refreshed, and again at the latest iterate up to
+// NEWTON_MAX_REFRESH times, before it fails with SD_ERR_DIVERGED.
+int
+implicit_step(SDSim *s, double *next)
+{
+	Implicit *im = s->implicit;
+	const size_t n = im->n;
+	int err, worst = -1;
+
+	if (!n)
+		return 0;
+
+	memcpy(im->scratch, s->curr, s->nvars*sizeof(double));
+	im->scratch[TIME] = next[TIME];
+	for (size_t i = 0; i < n; i++) {
+		im->x[i] = s->curr[im->off[i]];
+		im->y[i] = next[im->off[i]];
+	}
+
+	implicit_eval(s, im, im->y, im->f);
+
+	for (int refresh = im->factored ? -1 : 0; refresh <= NEWTON_MAX_REFRESH; refresh++) {
+		if (refresh == 0 && im->factored) {
+			// the stale factorization didn't converge, and
+			// may have left y anywhere
+			for (size_t i = 0; i < n; i++)
+				im->y[i] = next[im->off[i]];
+			implicit_eval(s, im, im->y, im->f);
+		}
+		if (refresh >= 0) {
+			err = implicit_jacobian(s, im);
+			if (err)
+				return err;
+		}
+		worst = implicit_newton(s, im);
+		if (worst < 0)
+			break;
+	}
+	if (worst >= 0) {
+		s->diverged = s->stocks.elems[worst];
+		s->diverged_time = next[TIME];
+		return SD_ERR_DIVERGED;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		next[im->off[i]] = im->y[i];
+
+	return 0;
+}
+
+// implicit_jacobian factors I - dt*df/dy at im->y, where im->f
+// already holds the net flows.
+int
+implicit_jacobian(SDSim *s, Implicit *im)
+{
+	const size_t n = im->n;
+	const double dt = s->spec.dt;
+
+	im->factored = false;
+	for (int c = 0; c < im->ncolors; c++) {
+		memcpy(im->yp, im->y, n*sizeof(double));
+		for (size_t j = 0; j < n; j++) {
+			if (im->color[j] == c)
+				im->yp[j] += sqrt(DBL_EPSILON)*fmax(fabs(im->y[j]), 1);
+		}
+		implicit_eval(s, im, im->yp, im->fp);
+		for (size_t j = 0; j < n; j++) {
+			double h;
+			if (im->color[j] != c)
+				continue;
+			h = im->yp[j] - im->y[j];
+			for (size_t k = im->colptr[j]; k < im->colptr[j+1]; k++) {
+				size_t r = im->rows[k];
+				im->jval[k] = -dt*(im->fp[r] - im->f[r])/h;
+			}
+		}
+	}
+
+	return implicit_factor(im);
+}
+
+// implicit_factor is a left-looking LU of I + jval over the patterns
+// implicit_symbolic worked out, one column at a time.  It fails on
+// a zero (or NaN) pivot.
+int
+implicit_factor(Implicit *im)
+{
+	double *x = im->work;
+	double d;
+
+	for (size_t j = 0; j < im->n; j++) {
+		for (size_t k = im->colptr[j]; k < im->colptr[j+1]; k++)
+			x[im->rows[k]] = im->jval[k];
+		x[j] += 1;
+		for (size_t k = im->up[j]; k < im->up[j+1]; k++) {
+			size_t i = im->ui[k];
+			double xi = x[i];
+			im->ux[k] = xi;
+			x[i] = 0;
+			for (size_t l = im->lp[i]; l < im->lp[i+1]; l++)
+				x[im->li[l]] -= im->lx[l]*xi;
+		}
+		d = x[j];
+		x[j] = 0;
+		im->diag[j] = d;
+		for (size_t k = im->lp[j]; k < im->lp[j+1]; k++) {
+			im->lx[k] = x[im->li[k]]/d;
+			x[im->li[k]] = 0;
+		}
+		if (!(fabs(d) > 0))
+			return SD_ERR_UNSPECIFIED;
+	}
+	im->factored = true;
+
+	return SD_ERR_NO_ERROR;
+}
+
+// implicit_solve overwrites b with the solution of LU*x = b.
+void
+implicit_solve(Implicit *im, double *b)
+{
+	for (size_t j = 0; j < im->n; j++) {
+		for (size_t k = im->lp[j]; k < im->lp[j+1]; k++)
+			b[im->li[k]] -= im->lx[k]*b[j];
+	}
+	for (size_t j = im->n; j-- > 0;) {
+		b[j] /= im->diag[j];
+		for (size_t k = im->up[j]; k < im->up[j+1]; k++)
+			b[im->ui[k]] -= im->ux[k]*b[j];
+	}
+}
+
+// implicit_newton runs up to NEWTON_MAX_ITER iterations with the
+// current factorization, returning -1 once they converge, or else
+// the index of a stock that hasn't, with im->f evaluated at the last
+// iterate.
+int
+implicit_newton(SDSim *s, Implicit *im)
+{
+	const size_t n = im->n;
+	const double dt = s->spec.dt;
+	int worst = -1;
+
+	for (int iter = 0; iter < NEWTON_MAX_ITER; iter++) {
+		worst = -1;
+		for (size_t i = 0; i < n; i++)
+			im->delta[i] = im->x[i] + dt*im->f[i] - im->y[i];
+		implicit_solve(im, im->delta);
+		for (size_t i = 0; i < n; i++) {
+			im->y[i] += im->delta[i];
+			// written so that NaN fails
+			if (worst < 0 && !(fabs(im->delta[i]) <= NEWTON_TOL*(1 + fabs(im->y[i]))))
+				worst = i;
+		}
+		if (worst < 0)
+			break;
+		implicit_eval(s, im, im->y, im->f);
+	}
+
+	return worst;
+}
+
+// sim_check_steady returns true once every stock's net flow,
+// calculated into the current row, has stayed within tolerance for
+// the configured window of steps.
+bool
+sim_check_steady(SDSim *s)
+{
+	for (size_t i = 0; i < s->stocks.len; i++) {
+		AVar *av = s->stocks.elems[i];
+		double v = s->curr[av->offset];
+		if (!(fabs(stock_net_flow(av, s->curr)) <= s->steady_tol*(1 + fabs(v)))) {
+			s->steady_count = 0;
+			return false;
+		}
+	}
+
+	return ++s->steady_count >= s->steady_window;
+}
+
+// sim_fill_steady finishes a converged run, holding the current
+// row's values through every remaining save step.
+void
+sim_fill_steady(SDSim *s)
+{
+	double *row;
+	size_t last, step;
+
+	s->is_steady = true;
+	s->steady_time = s->curr[TIME];
+
+	// the row the final step of a full run would be left in
+	last = (s->nsteps - 1 + s->save_every - 1)/s->save_every;
+	for (size_t i = s->save_step; i <= last; i++) {
+		row = sim_row(s, i);
+		if (row != s->curr)
+			memcpy(row, s->curr, s->nvars*sizeof(double));
+		step = i*s->save_every;
+		if (step > s->nsteps - 1)
+			step = s->nsteps - 1;
+		row[TIME] = s->spec.start + step*s->spec.dt;
+		// without history, the row is overwritten two rows on
+		sim_rows_done(s, i + 1);
+	}
+
+	s->step = s->nsteps - 1;
+	s->save_step = last;
+	s->curr = sim_curr(s);
+	s->next = sim_next(s);
+}
+
+int
+sd_sim_set_steady_state(SDSim *s, double tol, double window)
+{
+	size_t steps;
+
+	if (!s || tol < 0 || window < 0)
+		return SD_ERR_UNSPECIFIED;
+
+	steps = ceil(window/s->spec.dt);
+	s->steady_tol = tol;
+	s->steady_window = steps > 1 ? steps : 1;
+	s->steady_count = 0;
+
+	return 0;
+}
+
+int
+sd_sim_get_steady_time(SDSim *s, double *time)
+{
+	if (!s || !time || !s->is_steady)
+		return -1;
+
+	*time = s->steady_time;
+	return 0;
+}
+
+// row_is_finite returns false if any of the n values in row is NaN
+// or infinite, which is exactly when all of a double's exponent bits
+// are set.  Testing the bits rather than calling isfinite() on each
+// value lets the compiler vectorize the loop.
+bool
+row_is_finite(const double *row, size_t n)
+{
+	const uint64_t exp = 0x7ff0000000000000;
+	uint64_t bad = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t bits;
+		memcpy(&bits, &row[i], sizeof(bits));
+		bad |= (bits & exp) == exp;
+	}
+
+	return !bad;
+}
+
+void
+sim_find_divergence(SDSim *s, const double *row)
+{
+	s->diverged_time = row[TIME];
+	s->diverged = NULL;
+
+	for (size_t i = 0; i < s->stocks.len; i++) {
+		AVar *av = s->stocks.elems[i];
+		if (!isfinite(row[av->offset])) {
+			s->diverged = av;
+			return;
+		}
+	}
+	for (size_t i = 0; i < s->nvars; i++) {
+		if (!isfinite(row[i])) {
+			s->diverged = module_find_offset(s->module, i);
+			return;
+		}
+	}
+}
+
+int
+sd_sim_set_threads(SDSim *s, int nthreads)
+{
+	if (!s || nthreads < 0)
+		return SD_ERR_UNSPECIFIED;
+
+	levels_free(s->levels);
+	s->levels = NULL;
+	s->nthreads = 0;
+	if (nthreads <= 1)
+		return 0;
+	// stepping modules with their own dt and solving for the
+	// next step implicitly are both inherently serial.
+	if (s->method != SIM_EULER || s->substep_levels)
+		return SD_ERR_UNSPECIFIED;
+
+	s->nthreads = nthreads;
+	// independent components don't need to synchronize at every
+	// step, so are preferred to splitting levels.
+	if (components_len(s->components) > 1)
+		return 0;
+
+	return levels_new(s, nthreads, &s->levels);
+}
+
+int
+sd_sim_get_component_count(SDSim *s)
+{
+	if (!s)
+		return -1;
+	return components_len(s->components);
+}
 
+int
+sd_sim_set_finite_check(SDSim *s, int every)
+{
+	if (!s || every < 0)
+		return SD_ERR_UNSPECIFIED;
+
+	s->finite_every = every;
+	return 0;
+}
+
+int
+sd_sim_get_divergence(SDSim *s, const char **name, double *time)
+{
+	if (!s || !s->diverged)
+		return -1;
+
+	if (name)
+		*name = avar_qual_name(s->diverged);
+	if (time)
+		*time = s->diverged_time;
+	return 0;
+}
+
+int
+sd_sim_run_to(SDSim *s, double end)
+{
 	if (!s)
 		return -1;
 
+	return sim_run_steps(s, end, SIZE_MAX, NULL);
+}
+
+// sim_run_steps is sd_sim_run_to, stopping early once max_steps time
+// steps have been taken.  If done is non-NULL, it is set to whether
+// the run got as far as it could (or failed) rather than stopping
+// early, and so there's nothing left to do before end.
+int
+sim_run_steps(SDSim *s, double end, size_t max_steps, bool *done)
+{
+	double dt;
+	size_t limit;
+	bool complete = false;
+	int err;
+
+	if (done)
+		*done = true;
+
+	// components can't see each other's stocks to check them,
+	// report progress or publish rows in order, or agree on where
+	// to stop when canceled or out of steps
+	if (s->nthreads > 1 && components_len(s->components) > 1 &&
+	    !s->steady_tol && !s->finite_every && !s->progress &&
+	    !s->row_fn && !s->no_history && !s->snapshot &&
+	    !s->cancel && max_steps == SIZE_MAX)
+		return components_run_to(s, end);
+
+	limit = max_steps < SIZE_MAX - s->step ? s->step + max_steps : SIZE_MAX;
 	dt = s->spec.dt;
 	s->curr = sim_curr(s);
 	s->next = sim_next(s);
+	err = 0;
+	if (s->levels)
+		levels_start(s);
 
 	while (s->step < s->nsteps && s->curr[TIME] <= end) {
-		calc(s, s->curr, &s->module->flows, false);
-		calc_stocks(s, s->next, &s->module->stocks);
+		if (s->step >= limit) {
+			if (done)
+				*done = false;
+			break;
+		}
+
+		if (s->cancel && s->step % CANCEL_CHECK_STEPS == 0 &&
+		    unlikely(sim_canceled(s))) {
+			err = SD_ERR_CANCELED;
+			break;
+		}
+
+		if (s->levels)
+			levels_calc(s, dt);
+		else
+			calc(s, s->curr, &s->module->flows, dt, false);
+
+		// curr is now complete: stocks from the last step, flows
+		// and auxes from this one
+		if (s->snapshot && (s->step % s->snapshot->every == 0 ||
+		    s->step + 1 == s->nsteps))
+			sim_publish(s);
+
+		if (s->steady_tol > 0 && sim_check_steady(s)) {
+			sim_fill_steady(s);
+			complete = true;
+			break;
+		}
+
+		if (s->levels)
+			levels_calc_stocks(s, dt);
+		else
+			calc_stocks(s, s->next, &s->module->stocks, dt);
 
-		if (s->step + 1 == s->nsteps)
+		if (s->step + 1 == s->nsteps) {
+			sim_rows_done(s, s->save_step + 1);
+			complete = true;
 			break;
+		}
 
 		// calculate this way instead of += dt to minimize
 		// cumulative floating point errors.
 		s->next[TIME] = s->spec.start + (s->step+1)*dt;
 
+		if (s->method == SIM_BACKWARD_EULER) {
+			err = implicit_step(s, s->next);
+			if (err)
+				break;
+		}
+
+		// only stocks, constants and time have been written to
+		// next, the rest of the row is still zeroed.
+		if (s->finite_every && s->step % s->finite_every == 0 &&
+		    unlikely(!row_is_finite(s->next, s->nvars))) {
+			sim_find_divergence(s, s->next);
+			err = SD_ERR_DIVERGED;
+			break;
+		}
+
 		if (s->step++ % s->save_every != 0) {
 			memcpy(s->curr, s->next, s->nvars*sizeof(double));
 		} else {
 			s->save_step++;
 			s->curr = sim_curr(s);
 			s->next = sim_next(s);
+			sim_rows_done(s, s->save_step);
+			// next is about to get the row before last, which
+			// the finite check expects to be zeroed
+			if (s->no_history)
+				memset(s->next, 0, s->nvars*sizeof(double));
+			if (s->progress && s->save_step % s->progress_every == 0)
+				sim_progress(s, s->save_step);
 		}
 	}
 
+	if (s->levels)
+		levels_stop(s);
+	// the last report of a run is rarely on a multiple of
+	// progress_every, so make sure it ends on the rows it finished
+	if (s->progress && !err && (!done || *done))
+		sim_progress(s, complete ? s->save_step + 1 : s->save_step);
+	return err;
+}
+
+bool
+sim_canceled(SDSim *s)
+{
+	return s->cancel && __atomic_load_n(s->cancel, __ATOMIC_RELAXED);
+}
+
+void
+sim_run_task(void *data)
+{
+	SDRun *run = data;
+	SDSim *s = run->sim;
+
+	s->cancel = &run->cancel;
+	run->err = sd_sim_run_to(s, run->end);
+	s->cancel = NULL;
+
+	if (run->cb)
+		run->cb(s, run->err, run->data);
+}
+
+SDRun *
+sd_sim_run_async(SDSim *s, double end, SDRunFn cb, void *data)
+{
+	SDRun *run;
+
+	if (!s)
+		return NULL;
+
+	run = calloc(1, sizeof(*run));
+	if (!run)
+		return NULL;
+	sd_sim_ref(s);
+	run->sim = s;
+	run->end = end;
+	run->cb = cb;
+	run->data = data;
+	run->executor = executor_get(s->project);
+
+	run->task = run->executor->ops->submit(run->executor, sim_run_task, run);
+	if (!run->task) {
+		sd_sim_unref(s);
+		free(run);
+		return NULL;
+	}
+
+	return run;
+}
+
+void
+sd_run_cancel(SDRun *run)
+{
+	if (!run)
+		return;
+	__atomic_store_n(&run->cancel, 1, __ATOMIC_RELAXED);
+}
+
+int
+sd_run_wait(SDRun *run)
+{
+	int err;
+
+	if (!run)
+		return SD_ERR_UNSPECIFIED;
+
+	run->executor->ops->wait(run->executor, run->task);
+	err = run->err;
+	sd_sim_unref(run->sim);
+	free(run);
+
+	return err;
+}
+
+int
+sd_sim_set_progress(SDSim *s, int every, SDProgressFn fn, void *data)
+{
+	if (!s || every < 0 || (every && !fn))
+		return SD_ERR_UNSPECIFIED;
+
+	s->progress_every = every;
+	s->progress = every ? fn : NULL;
+	s->progress_data = data;
+
 	return 0;
 }
 
@@ -731,16 +2125,88 @@ sd_sim_run_to_end(SDSim *s)
 	return sd_sim_run_to(s, s->spec.stop + 1);
 }
 
+int
+sd_sim_set_row_callback(SDSim *s, SDRowFn fn, void *data)
+{
+	if (!s)
+		return SD_ERR_UNSPECIFIED;
+
+	s->row_fn = fn;
+	s->row_data = data;
+
+	return 0;
+}
+
+int
+sd_sim_set_history(SDSim *s, int keep)
+{
+	if (!s)
+		return SD_ERR_UNSPECIFIED;
+
+	s->no_history = !keep;
+
+	return sd_sim_reset(s);
+}
+
+int
+sd_sim_get_offset(SDSim *s, const char *name)
+{
+	AVar *av;
+
+	if (!s || !name)
+		return -1;
+	if (strcmp(name, "time") == 0)
+		return TIME;
+	av = resolve(s->module, name);
+	if (!av)
+		return -1;
+	return av->offset;
+}
+
+// sim_rows_done passes the save rows before upto that it hasn't
+// already to the row callback.
+void
+sim_rows_done(SDSim *s, size_t upto)
+{
+	if (!s->row_fn)
+		return;
+	if (upto > s->nsaves)
+		upto = s->nsaves;
+	for (; s->rows_done < upto; s->rows_done++)
+		s->row_fn(s, s->rows_done, sim_row(s, s->rows_done), s->row_data);
+}
+
+// sim_progress reports nsaved final save rows, unless they've
+// already been reported.
+void
+sim_progress(SDSim *s, size_t nsaved)
+{
+	if (nsaved > s->nsaves)
+		nsaved = s->nsaves;
+	if (nsaved <= s->progress_done)
+		return;
+	s->progress_done = nsaved;
+	s->progress(s, nsaved, s->progress_data);
+}
+
+double *
+sim_row(SDSim *s, size_t i)
+{
+	if (s->no_history)
+		i &= 1;
+	return &s->slab[i*s->nvars];
+}
+
 double *
 sim_curr(SDSim *s)
 {
-	return &s->slab[s->save_step*s->nvars];
+	return sim_row(s, s->save_step);
 }
 
 double *
 sim_next(SDSim *s)
 {
-	return &s->slab[(s->save_step+1)*s->nvars];
+	return sim_row(s, s->save_step + 1);
 }
 
 void
@@ -772,21 +2238,85 @@ sd_sim_get_value(SDSim *s, const char *name, double *result)
 	return 0;
 }
 
+int
+sd_sim_set_value(SDSim *s, const char *name, double val)
+{
+	Override *o = NULL;
+	AVar *av;
+
+	if (!s || !name)
+		return SD_ERR_UNSPECIFIED;
+
+	av = resolve(s->module, name);
+	while (av && av->src)
+		av = av->src;
+	if (!av || !av->is_const)
+		return SD_ERR_UNSPECIFIED;
+
+	for (size_t i = 0; i < s->overrides.len; i++) {
+		Override *existing = s->overrides.elems[i];
+		if (existing->av == av) {
+			o = existing;
+			break;
+		}
+	}
+	if (!o) {
+		o = calloc(1, sizeof(*o));
+		if (!o)
+			return SD_ERR_NOMEM;
+		o->av = av;
+		if (slice_append(&s->overrides, o)) {
+			free(o);
+			return SD_ERR_NOMEM;
+		}
+	}
+	o->val = val;
+
+	// before the run starts, initial values that depend on the
+	// constant need to be recalculated too.
+	if (s->step == 0 && s->save_step == 0)
+		calc(s, s->curr, &s->module->initials, s->spec.dt, true);
+	else
+		s->curr[av->offset] = val;
+
+	return 0;
+}
+
+void
+sim_override(SDSim *s, AVar *av, double *v)
+{
+	for (size_t i = 0; i < s->overrides.len; i++) {
+		Override *o = s->overrides.elems[i];
+		if (o->av == av) {
+			*v = o->val;
+			return;
+		}
+	}
+}
+
 void
 sd_sim_unref(SDSim *sim)
 {
 	if (!sim)
 		return;
 	if (__sync_sub_and_fetch(&sim->refcount, 1) == 0) {
-		avar_free(sim->module);
+		sd_compiled_model_unref(sim->compiled);
 		sd_project_unref(sim->project);
-		free(sim->slab);
-		free(sim);
+		implicit_free(sim->implicit);
+		levels_free(sim->levels);
+		for (size_t i = 0; i < sim->overrides.len; i++)
+			free(sim->overrides.elems[i]);
+		free(sim->overrides.elems);
+		snapshot_free(sim->snapshot);
+		if (sim->slab != sim->storage && !sim->slab_borrowed)
+			free(sim->slab);
+		if (!sim->in_arena)
+			free(sim);
 	}
 }
 
 double
-svisit(SDSim *s, Node *n, double dt, double time)
+svisit(SDSim *s, const double *data, Node *n, double dt, double time)
 {
 	double v = NAN;
 	double cond, l, r;
@@ -795,7 +2325,7 @@ svisit(SDSim *s, Node *n, double dt, double time)
 
 	switch (n->type) {
 	case N_PAREN:
-		v = svisit(s, n->left, dt, time);
+		v = svisit(s, data, n->left, dt, time);
 		break;
 	case N_FLOATLIT:
 		v = n->fval;
@@ -805,26 +2335,26 @@ svisit(SDSim *s, Node *n, double dt, double time)
 			off = n->av->src->offset;
 		else
 			off = n->av->offset;
-		v = s->curr[off];
+		v = data[off];
 		break;
 	case N_CALL:
 		memset(args, 0, 6*sizeof(*args));
 		(void)n->left->sval;
 		for (size_t i = 0; i < n->args.len; i++) {
 			Node *arg = n->args.elems[i];
-			args[i] = svisit(s, arg, dt, time);
+			args[i] = svisit(s, data, arg, dt, time);
 		}
 		v = n->fn(s, n, dt, time, n->args.len, args);
 		break;
 	case N_IF:
-		cond = svisit(s, n->cond, dt, time);
+		cond = svisit(s, data, n->cond, dt, time);
 		if (cond != 0)
-			v = svisit(s, n->left, dt, time);
+			v = svisit(s, data, n->left, dt, time);
 		else
-			v = svisit(s, n->right, dt, time);
+			v = svisit(s, data, n->right, dt, time);
 		break;
 	case N_UNARY:
-		l = svisit(s, n->left, dt, time);
+		l = svisit(s, data, n->left, dt, time);
 		switch (n->op) {
 		case '+':
 			v = l;
@@ -838,8 +2368,8 @@ svisit(SDSim *s, Node *n, double dt, double time)
 		}
 		break;
 	case N_BINARY:
-		l = svisit(s, n->left, dt, time);
-		r = svisit(s, n->right, dt, time);
+		l = svisit(s, data, n->left, dt, time);
+		r = svisit(s, data, n->right, dt, time);
 		switch (n->op) {
 		case '+':
 			v = l + r;
@@ -964,7 +2494,7 @@ sd_sim_get_series(SDSim *s, const char *name, double *results, size_t len)
 	int off;
 	size_t i;
 
-	if (!s || !name || !results)
+	if (!s || !name || !results || s->no_history)
 		return -1;
 
 	if (strcmp(name, "time") == 0) {
@@ -985,9 +2515,16 @@ sd_sim_get_series(SDSim *s, const char *name, double *results, size_t len)
 double
 rt_pulse(SDSim *s, Node *n, double dt, double time, size_t len, double *args)
 {
-	double magnitude, first_pulse, next_pulse, interval;
+	return pulse_on(dt, time, len, args) ? args[0]/dt : 0;
+}
+
+// pulse_on returns whether a pulse with the given arguments fires in
+// the time step starting at time, whatever its magnitude.
+bool
+pulse_on(double dt, double time, size_t len, const double *args)
+{
+	double first_pulse, next_pulse, interval;
 
-	magnitude = args[0];
 	first_pulse = args[1];
 	if (len > 2)
 		interval = args[2];
@@ -995,19 +2532,19 @@ rt_pulse(SDSim *s, Node *n, double dt, double time, size_t len, double *args)
 		interval = 0;
 
 	if (time < first_pulse)
-		return 0;
+		return false;
 
 	next_pulse = first_pulse;
 
 	while (time >= next_pulse) {
 		if (time < next_pulse + dt)
-			return magnitude/dt;
+			return true;
 		else if (interval <= 0)
 			break;
 		else
 			next_pulse += interval;
 	}
-	return 0;
+	return false;
 }
 
 double
@@ -1037,3 +2574,31 @@ rt_max(SDSim *s, Node *n, double dt, double time, size_t len, double *args)
 
 	return a > b ? a : b;
 }
+
+// the pulse's height is magnitude/dt while it's on; when and how
+// often it fires don't change continuously.
+void
+rt_dpulse(SDSim *s, Node *n, double dt, double time, size_t len, const double *args, double *partials)
+{
+	memset(partials, 0, len*sizeof(*partials));
+	if (pulse_on(dt, time, len, args))
+		partials[0] = 1/dt;
+}
+
+void
+rt_dmin(SDSim *s, Node *n, double dt, double time, size_t len, const double *args, double *partials)
+{
+	memset(partials, 0, len*sizeof(*partials));
+	if (len != 2)
+		return;
+	partials[args[0] < args[1] ? 0 : 1] = 1;
+}
+
+void
+rt_dmax(SDSim *s, Node *n, double dt, double time, size_t len, const double *args, double *partials)
+{
+	memset(partials, 0, len*sizeof(*partials));
+	if (len != 2)
+		return;
+	partials[args[0] > args[1] ? 0 : 1] = 1;
+}
@@ -0,0 +1,315 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// Snapshots are published with a sequence lock: the sim's thread
+// makes seq odd, writes the values and makes it even again, and a
+// reader that saw the same even seq before and after its copy knows
+// nothing was written in between.  The writer never waits on readers.
+// The values are written with release and read with acquire atomics
+// (plain moves on x86): a reader that sees any value from a write in
+// progress is then guaranteed to see that write's odd seq, so torn
+// copies are discarded rather than returned.
+//
+// The same layout, an SDSnapshotHeader followed by the values, is
+// used in process memory and in shared memory, where it also holds
+// the variable names for readers in other processes.  There's no
+// POSIX shared memory on Windows, so there sd_sim_set_snapshot_shm
+// fails.
+
+static Snapshot *snapshot_new(SDSim *s, int every, const char *shm_name);
+static size_t snapshot_names(SDSim *s, const char **names);
+static void snapshot_set(SDSim *s, Snapshot *snap);
+static SDSnapshotHeader *shm_create(Snapshot *snap, size_t len);
+static void shm_release(Snapshot *snap);
+
+
+int
+sd_sim_set_snapshot(SDSim *s, int every)
+{
+	Snapshot *snap;
+
+	if (!s || every < 0)
+		return SD_ERR_UNSPECIFIED;
+
+	if (!every) {
+		snapshot_set(s, NULL);
+		return 0;
+	}
+	if (s->snapshot) {
+		s->snapshot->every = every;
+		return 0;
+	}
+
+	snap = snapshot_new(s, every, NULL);
+	if (!snap)
+		return SD_ERR_NOMEM;
+	snapshot_set(s, snap);
+
+	return 0;
+}
+
+int
+sd_sim_set_snapshot_shm(SDSim *s, const char *name, int every)
+{
+	Snapshot *snap;
+
+	if (!s || !name || every < 1)
+		return SD_ERR_UNSPECIFIED;
+
+	// the new object replaces ours under the same name, which
+	// freeing the old snapshot afterwards would unlink
+	if (s->snapshot && s->snapshot->shm_name &&
+	    strcmp(s->snapshot->shm_name, name) == 0)
+		snapshot_set(s, NULL);
+
+	snap = snapshot_new(s, every, name);
+	if (!snap)
+		return SD_ERR_UNSPECIFIED;
+	snapshot_set(s, snap);
+
+	return 0;
+}
+
+void
+snapshot_set(SDSim *s, Snapshot *snap)
+{
+	snapshot_free(s->snapshot);
+	s->snapshot = snap;
+}
+
+// snapshot_names fills names, if non-NULL, with the name of the
+// variable at each offset, returning the space they take up.
+size_t
+snapshot_names(SDSim *s, const char **names)
+{
+	const char **all;
+	size_t len = 0;
+	int n;
+
+	all = calloc(s->nvars, sizeof(*all));
+	if (!all)
+		return 0;
+	n = sd_sim_get_varnames(s, all, s->nvars);
+	for (int i = 0; i < n; i++) {
+		int off = sd_sim_get_offset(s, all[i]);
+		if (off < 0 || (size_t)off >= s->nvars)
+			continue;
+		if (names && !names[off])
+			names[off] = all[i];
+		len += strlen(all[i]);
+	}
+	free(all);
+
+	// and a NUL after each, including unnamed offsets
+	return len + s->nvars;
+}
+
+Snapshot *
+snapshot_new(SDSim *s, int every, const char *shm_name)
+{
+	Snapshot *snap;
+	SDSnapshotHeader *hdr;
+	const char **names = NULL;
+	size_t names_off, values_off, len;
+	char *p;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+	snap->every = every;
+
+	names_off = sizeof(*hdr);
+	values_off = sizeof(*hdr);
+	if (shm_name) {
+		values_off = round_up(names_off + snapshot_names(s, NULL), 64);
+		names = calloc(s->nvars, sizeof(*names));
+		snap->shm_name = strdup(shm_name);
+		if (!names || !snap->shm_name)
+			goto error;
+	}
+	len = values_off + s->nvars*sizeof(double);
+
+	if (!shm_name) {
+		hdr = calloc(1, len);
+		if (!hdr)
+			goto error;
+	} else {
+		hdr = shm_create(snap, len);
+		if (!hdr)
+			goto error;
+
+		snapshot_names(s, names);
+		p = (char *)hdr + names_off;
+		for (size_t i = 0; i < s->nvars; i++) {
+			size_t n = names[i] ? strlen(names[i]) : 0;
+			if (n)
+				memcpy(p, names[i], n);
+			p += n + 1;
+		}
+		free(names);
+		names = NULL;
+	}
+
+	snap->hdr = hdr;
+	snap->values = (double *)((char *)hdr + values_off);
+	// readers wait for the first publish, whose release store
+	// of seq makes these visible
+	memcpy(hdr->magic, SD_SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->nvars = s->nvars;
+	hdr->nsteps = s->nsteps;
+	hdr->names = shm_name ? names_off : 0;
+	hdr->values = values_off;
+
+	return snap;
+error:
+	free(names);
+	snapshot_free(snap);
+	return NULL;
+}
+
+void
+snapshot_free(Snapshot *snap)
+{
+	if (!snap)
+		return;
+	if (snap->shm_name) {
+		if (snap->hdr)
+			shm_release(snap);
+		free(snap->shm_name);
+	} else {
+		free(snap->hdr);
+	}
+	free(snap);
+}
+
+#ifndef _WIN32
+// shm_create maps a new shared memory object of len bytes under
+// snap's name.
+SDSnapshotHeader *
+shm_create(Snapshot *snap, size_t len)
+{
+	SDSnapshotHeader *hdr;
+	struct stat st;
+	int fd;
+
+	// a new object rather than a resized old one, which would
+	// pull pages out from under its readers
+	shm_unlink(snap->shm_name);
+	fd = shm_open(snap->shm_name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || ftruncate(fd, len) < 0) {
+		close(fd);
+		shm_unlink(snap->shm_name);
+		return NULL;
+	}
+	hdr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		shm_unlink(snap->shm_name);
+		return NULL;
+	}
+	snap->shm_len = len;
+	snap->shm_dev = st.st_dev;
+	snap->shm_ino = st.st_ino;
+	return hdr;
+}
+
+// shm_release unmaps snap's object, and removes it if its name still
+// refers to it, rather than to one another snapshot has since created
+// in its place.
+void
+shm_release(Snapshot *snap)
+{
+	struct stat st;
+	int fd, err;
+
+	munmap(snap->hdr, snap->shm_len);
+	fd = shm_open(snap->shm_name, O_RDONLY, 0);
+	if (fd < 0)
+		return;
+	err = fstat(fd, &st);
+	close(fd);
+	if (!err && st.st_dev == snap->shm_dev && st.st_ino == snap->shm_ino)
+		shm_unlink(snap->shm_name);
+}
+#else
+SDSnapshotHeader *
+shm_create(Snapshot *snap, size_t len)
+{
+	return NULL;
+}
+
+void
+shm_release(Snapshot *snap)
+{
+}
+#endif
+
+void
+sim_publish(SDSim *s)
+{
+	SDSnapshotHeader *hdr = s->snapshot->hdr;
+	double *values = s->snapshot->values;
+	uint32_t seq = hdr->seq;
+
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->step, s->step, __ATOMIC_RELEASE);
+	for (size_t i = 0; i < s->nvars; i++)
+		__atomic_store(&values[i], &s->curr[i], __ATOMIC_RELEASE);
+	// 0 is reserved for never having been written
+	if (seq + 2 == 0)
+		seq += 2;
+	__atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int
+sd_sim_read_snapshot(SDSim *s, double *values, size_t len, size_t *step)
+{
+	SDSnapshotHeader *hdr;
+	const double *src;
+	uint32_t seq;
+	size_t n, at;
+
+	if (!s || !s->snapshot || (len && !values))
+		return -1;
+	hdr = s->snapshot->hdr;
+	src = s->snapshot->values;
+	n = len < s->nvars ? len : s->nvars;
+
+	for (;;) {
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (!seq)
+			return -1;
+		if (seq & 1) {
+			// the writer is mid-copy; on a busy machine it
+			// may need our CPU to finish
+			sched_yield();
+			continue;
+		}
+		at = __atomic_load_n(&hdr->step, __ATOMIC_ACQUIRE);
+		for (size_t i = 0; i < n; i++)
+			__atomic_load(&src[i], &values[i], __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	if (step)
+		*step = at;
+	return n;
+}
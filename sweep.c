@@ -0,0 +1,679 @@
+// Copyright 2014 Bobby Powers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf.h"
+#include "sd.h"
+#include "sd_internal.h"
+
+// A sweep simulates a model at many points in the space of a few
+// constants, keeping only a handful of summary numbers per point.
+// Points come either from a grid, every combination of the values
+// listed for each constant, or from an explicit list.  The model is
+// compiled once; each worker thread simulates its points on one sim
+// without history, so its slab is two rows however long the run,
+// and summaries are accumulated from the row callback as it goes.
+
+typedef struct {
+	char *name;
+	double *values; // of a grid axis; NULL in a list
+	size_t len;
+} Param;
+
+typedef struct {
+	char *name;
+	SDSummary kind;
+} Output;
+
+struct SDSweep_s {
+	Slice params;  // []*Param
+	Slice outputs; // []*Output
+	// a list's points, [point][param]
+	double *points;
+	size_t npoints;
+	bool is_list;
+	int refcount;
+};
+
+// per-variable running summaries, updated as rows are simulated
+typedef struct {
+	double min;
+	double max;
+	double peak_time;
+	double final;
+} Acc;
+
+typedef struct SweepRun_s SweepRun;
+
+typedef struct {
+	SweepRun *run;
+	SDSim *s; // from run's sims
+	Acc *accs; // one per output
+	double *point;
+} SweepWorker;
+
+struct SweepRun_s {
+	SDSweep *sweep;
+	WorkerSims sims;
+	SweepWorker *workers;
+	const char **names; // of each param
+	int *offsets; // of each output
+	double *results;
+	int err;
+};
+
+static const char *SUMMARY_NAMES[] = {
+	[SD_SUMMARY_FINAL] = "final",
+	[SD_SUMMARY_MIN] = "min",
+	[SD_SUMMARY_MAX] = "max",
+	[SD_SUMMARY_PEAK_TIME] = "peak_time",
+};
+
+static int sweep_add_param(SDSweep *sweep, const char *name, const double *values, size_t len);
+static void sweep_point(void *data, size_t i, size_t worker);
+static void sweep_row(SDSim *s, int row, const double *values, void *data);
+static SweepWorker *sweep_worker(SweepRun *run, size_t worker);
+static int sweep_setup(SDSim *s, void *data);
+
+static int spec_line(SDSweep *sweep, char *line, Slice *list);
+static size_t spec_fields(char *line, char **fields, size_t max);
+static int spec_number(const char *field, double *result);
+
+
+SDSweep *
+sd_sweep_new(void)
+{
+	SDSweep *sweep = calloc(1, sizeof(*sweep));
+
+	if (!sweep)
+		return NULL;
+	sd_sweep_ref(sweep);
+	return sweep;
+}
+
+void
+sd_sweep_ref(SDSweep *sweep)
+{
+	if (!sweep)
+		return;
+	__sync_fetch_and_add(&sweep->refcount, 1);
+}
+
+void
+sd_sweep_unref(SDSweep *sweep)
+{
+	if (!sweep)
+		return;
+	if (__sync_sub_and_fetch(&sweep->refcount, 1) == 0) {
+		for (size_t i = 0; i < sweep->params.len; i++) {
+			Param *param = sweep->params.elems[i];
+			free(param->name);
+			free(param->values);
+			free(param);
+		}
+		free(sweep->params.elems);
+		for (size_t i = 0; i < sweep->outputs.len; i++) {
+			Output *out = sweep->outputs.elems[i];
+			free(out->name);
+			free(out);
+		}
+		free(sweep->outputs.elems);
+		free(sweep->points);
+		free(sweep);
+	}
+}
+
+int
+sd_sweep_add_axis(SDSweep *sweep, const char *name, const double *values, size_t len)
+{
+	if (!sweep || !name || !values || !len || sweep->is_list)
+		return SD_ERR_UNSPECIFIED;
+	return sweep_add_param(sweep, name, values, len);
+}
+
+int
+sd_sweep_set_list(SDSweep *sweep, const char **names, size_t nparams, const double *values, size_t npoints)
+{
+	double *points;
+	int err;
+
+	if (!sweep || !nparams || !names || (npoints && !values) ||
+	    sweep->params.len || npoints > SIZE_MAX/sizeof(double)/nparams)
+		return SD_ERR_UNSPECIFIED;
+
+	points = malloc((npoints ? npoints : 1)*nparams*sizeof(double));
+	if (!points)
+		return SD_ERR_NOMEM;
+	if (npoints)
+		memcpy(points, values, npoints*nparams*sizeof(double));
+
+	for (size_t i = 0; i < nparams; i++) {
+		err = sweep_add_param(sweep, names[i], NULL, 0);
+		if (err) {
+			free(points);
+			return err;
+		}
+	}
+	sweep->points = points;
+	sweep->npoints = npoints;
+	sweep->is_list = true;
+
+	return 0;
+}
+
+int
+sweep_add_param(SDSweep *sweep, const char *name, const double *values, size_t len)
+{
+	Param *param;
+
+	if (!name)
+		return SD_ERR_UNSPECIFIED;
+	param = calloc(1, sizeof(*param));
+	if (!param)
+		return SD_ERR_NOMEM;
+	param->name = strdup(name);
+	param->len = len;
+	if (values) {
+		param->values = malloc(len*sizeof(double));
+		if (param->values)
+			memcpy(param->values, values, len*sizeof(double));
+	}
+	if (!param->name || (values && !param->values) ||
+	    slice_append(&sweep->params, param)) {
+		free(param->name);
+		free(param->values);
+		free(param);
+		return SD_ERR_NOMEM;
+	}
+	return 0;
+}
+
+int
+sd_sweep_add_output(SDSweep *sweep, const char *name, SDSummary kind)
+{
+	Output *out;
+
+	if (!sweep || !name || kind < 0 || kind >= SD_SUMMARY_LEN)
+		return SD_ERR_UNSPECIFIED;
+
+	out = calloc(1, sizeof(*out));
+	if (!out)
+		return SD_ERR_NOMEM;
+	out->name = strdup(name);
+	out->kind = kind;
+	if (!out->name || slice_append(&sweep->outputs, out)) {
+		free(out->name);
+		free(out);
+		return SD_ERR_NOMEM;
+	}
+	return 0;
+}
+
+size_t
+sd_sweep_get_pointcount(SDSweep *sweep)
+{
+	size_t n = 1;
+
+	if (!sweep || !sweep->params.len)
+		return 0;
+	if (sweep->is_list)
+		return sweep->npoints;
+	for (size_t i = 0; i < sweep->params.len; i++) {
+		Param *param = sweep->params.elems[i];
+		if (n > SIZE_MAX/param->len)
+			return 0;
+		n *= param->len;
+	}
+	return n;
+}
+
+int
+sd_sweep_get_paramcount(SDSweep *sweep)
+{
+	if (!sweep)
+		return -1;
+	return sweep->params.len;
+}
+
+const char *
+sd_sweep_get_param(SDSweep *sweep, size_t i)
+{
+	if (!sweep || i >= sweep->params.len)
+		return NULL;
+	return ((Param *)sweep->params.elems[i])->name;
+}
+
+int
+sd_sweep_get_outputcount(SDSweep *sweep)
+{
+	if (!sweep)
+		return -1;
+	return sweep->outputs.len;
+}
+
+int
+sd_sweep_get_output(SDSweep *sweep, size_t i, const char **name, SDSummary *kind)
+{
+	Output *out;
+
+	if (!sweep || i >= sweep->outputs.len)
+		return SD_ERR_UNSPECIFIED;
+	out = sweep->outputs.elems[i];
+	if (name)
+		*name = out->name;
+	if (kind)
+		*kind = out->kind;
+	return 0;
+}
+
+// grid points are numbered with the last axis varying fastest, like
+// nested loops over the axes in the order they were added.
+int
+sd_sweep_get_point(SDSweep *sweep, size_t i, double *values)
+{
+	if (!sweep || !values || i >= sd_sweep_get_pointcount(sweep))
+		return SD_ERR_UNSPECIFIED;
+
+	if (sweep->is_list) {
+		memcpy(values, &sweep->points[i*sweep->params.len], sweep->params.len*sizeof(double));
+		return 0;
+	}
+	for (size_t k = sweep->params.len; k-- > 0;) {
+		Param *param = sweep->params.elems[k];
+		values[k] = param->values[i % param->len];
+		i /= param->len;
+	}
+	return 0;
+}
+
+const char *
+sd_summary_name(SDSummary kind)
+{
+	if (kind < 0 || kind >= SD_SUMMARY_LEN)
+		return NULL;
+	return SUMMARY_NAMES[kind];
+}
+
+int
+sd_sweep_run(SDProject *p, const char *model_name, SDSweep *sweep, double *results, int nthreads)
+{
+	SweepRun run;
+	SDSim *base;
+	SDExecutor *ex;
+	size_t npoints, nworkers = 0;
+	int err;
+
+	if (!p || !sweep || !results || nthreads < 0 || !sweep->outputs.len)
+		return SD_ERR_UNSPECIFIED;
+	npoints = sd_sweep_get_pointcount(sweep);
+	if (!npoints)
+		return SD_ERR_UNSPECIFIED;
+
+	base = sd_sim_new(p, model_name);
+	if (!base)
+		return SD_ERR_UNSPECIFIED;
+
+	memset(&run, 0, sizeof(run));
+	run.sweep = sweep;
+	run.results = results;
+
+	run.names = calloc(sweep->params.len, sizeof(*run.names));
+	run.offsets = calloc(sweep->outputs.len, sizeof(*run.offsets));
+	if (!run.names || !run.offsets) {
+		err = SD_ERR_NOMEM;
+		goto out;
+	}
+	err = SD_ERR_UNSPECIFIED;
+	for (size_t i = 0; i < sweep->params.len; i++) {
+		Param *param = sweep->params.elems[i];
+		run.names[i] = param->name;
+		if (sd_sim_set_value(base, param->name, 0))
+			goto out;
+	}
+	for (size_t i = 0; i < sweep->outputs.len; i++) {
+		Output *o = sweep->outputs.elems[i];
+		run.offsets[i] = sd_sim_get_offset(base, o->name);
+		if (run.offsets[i] < 0)
+			goto out;
+	}
+
+	ex = executor_get(p);
+	nworkers = nthreads ? (size_t)nthreads : sd_executor_concurrency(ex);
+	if (nworkers > npoints)
+		nworkers = npoints;
+	run.workers = calloc(nworkers, sizeof(*run.workers));
+	err = run.workers ? worker_sims_init(&run.sims, base->compiled, ex, nworkers) : SD_ERR_NOMEM;
+	if (err)
+		goto out;
+
+	err = sd_executor_parallel_for(ex, npoints, nworkers, sweep_point, &run);
+	if (!err)
+		err = run.err;
+out:
+	for (size_t i = 0; run.workers && i < nworkers; i++) {
+		free(run.workers[i].accs);
+		free(run.workers[i].point);
+	}
+	free(run.workers);
+	worker_sims_free(&run.sims);
+	free(run.names);
+	free(run.offsets);
+	sd_sim_unref(base);
+	return err;
+}
+
+// sweep_worker returns the worker's state, creating it on first use
+// so that its memory is touched first by the thread that uses it.
+SweepWorker *
+sweep_worker(SweepRun *run, size_t worker)
+{
+	SweepWorker *w = &run->workers[worker];
+
+	if (w->s)
+		return w;
+	w->run = run;
+	if (!w->accs)
+		w->accs = calloc(run->sweep->outputs.len, sizeof(*w->accs));
+	if (!w->point)
+		w->point = calloc(run->sweep->params.len, sizeof(*w->point));
+	if (!w->accs || !w->point)
+		return NULL;
+	w->s = worker_sim(&run->sims, worker, sweep_setup, w);
+	return w->s ? w : NULL;
+}
+
+int
+sweep_setup(SDSim *s, void *data)
+{
+	int err;
+
+	err = sd_sim_set_history(s, 0);
+	if (!err)
+		err = sd_sim_set_row_callback(s, sweep_row, data);
+	return err;
+}
+
+void
+sweep_point(void *data, size_t i, size_t worker)
+{
+	SweepRun *run = data;
+	SDSweep *sweep = run->sweep;
+	double *result = &run->results[i*sweep->outputs.len];
+	SweepWorker *w;
+	int err = SD_ERR_NOMEM;
+
+	w = sweep_worker(run, worker);
+	if (w) {
+		sd_sweep_get_point(sweep, i, w->point);
+		err = sim_run_point(w->s, run->names, w->point, sweep->params.len);
+	}
+
+	for (size_t j = 0; j < sweep->outputs.len; j++) {
+		Output *o = sweep->outputs.elems[j];
+		Acc *acc;
+		if (err) {
+			result[j] = NAN;
+			continue;
+		}
+		acc = &w->accs[j];
+		switch (o->kind) {
+		case SD_SUMMARY_FINAL:
+			result[j] = acc->final;
+			break;
+		case SD_SUMMARY_MIN:
+			result[j] = acc->min;
+			break;
+		case SD_SUMMARY_MAX:
+			result[j] = acc->max;
+			break;
+		case SD_SUMMARY_PEAK_TIME:
+			result[j] = acc->peak_time;
+			break;
+		default:
+			result[j] = NAN;
+		}
+	}
+	if (err)
+		__sync_val_compare_and_swap(&run->err, 0, err);
+}
+
+void
+sweep_row(SDSim *s, int row, const double *values, void *data)
+{
+	SweepWorker *w = data;
+	SweepRun *run = w->run;
+
+	for (size_t i = 0; i < run->sweep->outputs.len; i++) {
+		Acc *acc = &w->accs[i];
+		double v = values[run->offsets[i]];
+		if (row == 0 || v < acc->min)
+			acc->min = v;
+		// the first time the peak is reached
+		if (row == 0 || v > acc->max) {
+			acc->max = v;
+			acc->peak_time = values[TIME];
+		}
+		acc->final = v;
+	}
+}
+
+SDSweep *
+sd_sweep_open(const char *path, int *err)
+{
+	SDSweep *sweep = NULL;
+	Slice list;
+	FILE *f;
+	char *line = NULL;
+	size_t cap = 0, nparams;
+	double *values = NULL;
+	int ret = SD_ERR_BAD_FILE;
+
+	memset(&list, 0, sizeof(list));
+
+	f = fopen(path, "r");
+	if (!f)
+		goto error;
+	sweep = sd_sweep_new();
+	if (!sweep) {
+		ret = SD_ERR_NOMEM;
+		goto error;
+	}
+
+	// a list's points are collected as they're read, in list, and
+	// handed over at the end
+	while (getline(&line, &cap, f) > 0) {
+		ret = spec_line(sweep, line, &list);
+		if (ret)
+			goto error;
+	}
+
+	if (list.len) {
+		const char **names = list.elems[0];
+		for (nparams = 0; names[nparams]; nparams++)
+			;
+		ret = SD_ERR_NOMEM;
+		values = malloc(list.len*nparams*sizeof(double));
+		if (!values)
+			goto error;
+		for (size_t i = 1; i < list.len; i++)
+			memcpy(&values[(i-1)*nparams], list.elems[i], nparams*sizeof(double));
+		ret = sd_sweep_set_list(sweep, names, nparams, values, list.len - 1);
+		if (ret)
+			goto error;
+	}
+	ret = SD_ERR_BAD_FILE;
+	if (!sd_sweep_get_pointcount(sweep) || !sweep->outputs.len)
+		goto error;
+
+	ret = 0;
+error:
+	if (list.len) {
+		char **names = list.elems[0];
+		for (size_t i = 0; names[i]; i++)
+			free(names[i]);
+	}
+	for (size_t i = 0; i < list.len; i++)
+		free(list.elems[i]);
+	free(list.elems);
+	free(values);
+	free(line);
+	if (f)
+		fclose(f);
+	if (ret) {
+		sd_sweep_unref(sweep);
+		sweep = NULL;
+	}
+	if (err)
+		*err = ret;
+	return sweep;
+}
+
+// spec_line handles one line of a sweep spec, which is one of
+//
+//	grid,NAME,V1,V2,...	a grid axis with the given values
+//	range,NAME,LO,HI,N	a grid axis of N values from LO to HI
+//	list,NAME1,NAME2,...	the constants set by each point
+//	point,V1,V2,...		a point of the list
+//	output,VAR,SUMMARY...	summaries of VAR to report
+//
+// Blank lines and lines starting with # are skipped.  The first
+// element of list is a NULL-terminated array of the list's names, and
+// the rest are its points.
+int
+spec_line(SDSweep *sweep, char *line, Slice *list)
+{
+	char *fields[1024] = {NULL};
+	double *values = NULL;
+	size_t n;
+	int err = SD_ERR_BAD_FILE;
+
+	n = spec_fields(line, fields, sizeof(fields)/sizeof(*fields));
+	if ((n == 1 && !fields[0][0]) || fields[0][0] == '#')
+		return 0;
+	// longer axes can be given as ranges
+	if (n < 2 || n > sizeof(fields)/sizeof(*fields))
+		return SD_ERR_BAD_FILE;
+
+	if (strcmp(fields[0], "grid") == 0 || strcmp(fields[0], "range") == 0) {
+		double lo = 0, hi = 0, count;
+		bool range = fields[0][0] == 'r';
+		size_t len = range ? 0 : n - 2;
+		if (list->len || (range && n != 5))
+			return SD_ERR_BAD_FILE;
+		if (range) {
+			if (spec_number(fields[2], &lo) || spec_number(fields[3], &hi) ||
+			    spec_number(fields[4], &count) || count < 1 ||
+			    count != floor(count) || count > 1e9 ||
+			    (count == 1 && lo != hi))
+				return SD_ERR_BAD_FILE;
+			len = count;
+		}
+		values = malloc((len ? len : 1)*sizeof(double));
+		if (!values)
+			return SD_ERR_NOMEM;
+		for (size_t i = 0; i < len; i++) {
+			if (range)
+				values[i] = len > 1 ? lo + (hi - lo)*i/(len - 1) : lo;
+			else if (spec_number(fields[i + 2], &values[i]))
+				goto out;
+		}
+		err = sd_sweep_add_axis(sweep, fields[1], values, len);
+		if (err == SD_ERR_UNSPECIFIED)
+			err = SD_ERR_BAD_FILE;
+	} else if (strcmp(fields[0], "list") == 0) {
+		char **names;
+		if (list->len || sweep->params.len)
+			return SD_ERR_BAD_FILE;
+		names = calloc(n, sizeof(*names));
+		if (!names || slice_append(list, names)) {
+			free(names);
+			return SD_ERR_NOMEM;
+		}
+		for (size_t i = 1; i < n; i++) {
+			names[i - 1] = strdup(fields[i]);
+			if (!names[i - 1])
+				return SD_ERR_NOMEM;
+		}
+		err = 0;
+	} else if (strcmp(fields[0], "point") == 0) {
+		char **names = list->len ? list->elems[0] : NULL;
+		size_t nparams = 0;
+		while (names && names[nparams])
+			nparams++;
+		if (!names || n - 1 != nparams)
+			return SD_ERR_BAD_FILE;
+		values = malloc(nparams*sizeof(double));
+		if (!values)
+			return SD_ERR_NOMEM;
+		for (size_t i = 0; i < nparams; i++) {
+			if (spec_number(fields[i + 1], &values[i]))
+				goto out;
+		}
+		if (slice_append(list, values)) {
+			err = SD_ERR_NOMEM;
+			goto out;
+		}
+		return 0;
+	} else if (strcmp(fields[0], "output") == 0) {
+		if (n < 3)
+			return SD_ERR_BAD_FILE;
+		for (size_t i = 2; i < n; i++) {
+			SDSummary kind;
+			for (kind = 0; kind < SD_SUMMARY_LEN; kind++) {
+				if (strcmp(fields[i], SUMMARY_NAMES[kind]) == 0)
+					break;
+			}
+			err = sd_sweep_add_output(sweep, fields[1], kind);
+			if (err == SD_ERR_UNSPECIFIED)
+				err = SD_ERR_BAD_FILE;
+			if (err)
+				break;
+		}
+	}
+out:
+	free(values);
+	return err;
+}
+
+// spec_fields splits line at commas, in place, into fields with
+// surrounding whitespace removed, returning how many there were.
+// Only the first max are stored.
+size_t
+spec_fields(char *line, char **fields, size_t max)
+{
+	size_t n = 0;
+
+	for (char *s = line; s; n++) {
+		char *comma = strchr(s, ',');
+		char *end;
+		if (comma)
+			*comma = '\0';
+		while (isspace((unsigned char)*s))
+			s++;
+		end = s + strlen(s);
+		while (end > s && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		if (n < max)
+			fields[n] = s;
+		s = comma ? comma + 1 : NULL;
+	}
+	return n;
+}
+
+int
+spec_number(const char *field, double *result)
+{
+	char *end;
+
+	*result = strtod(field, &end);
+	if (end == field || *end || !isfinite(*result))
+		return SD_ERR_BAD_FILE;
+	return 0;
+}
@@ -4,10 +4,13 @@
 
 #undef NDEBUG
 #include <assert.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h> // intptr_t
 
 #include "sd.h"
@@ -29,6 +32,32 @@ static void test_table(void);
 static void test_parse2(void);
 static void test_normalize_quoted(void);
 static void test_hash_table(void);
+static void test_backward_euler(void);
+static void test_multirate(void);
+static void test_steady_state(void);
+static void test_divergence(void);
+static void test_ensemble(void);
+static void test_ensemble_run(void);
+static void test_threads(void);
+static void test_components(void);
+static void test_executor(void);
+static void test_run_async(void);
+static void test_scheduler(void);
+static void test_ensemble_fork(void);
+static void test_row_callback(void);
+static void test_parallel_compile(void);
+static void test_compiled_model(void);
+static void test_sim_clone(void);
+static void test_numa(void);
+static void test_snapshot(void);
+static void test_snapshot_shm(void);
+static void test_sweep(void);
+static void test_calibrate(void);
+static void test_sens(void);
+static void test_adjoint(void);
+static void test_gsa(void);
+static double sse_at(SDProject *p, const char *model, const char **params, const double *values, size_t n, const SDObserved *obs);
+static void gsa_progress(void *data, size_t nsamples, const double *results);
 
 typedef void (*test_f)(void);
 
@@ -46,6 +75,30 @@ static test_f TESTS[] = {
 	test_parse2,
 	test_normalize_quoted,
 	test_hash_table,
+	test_backward_euler,
+	test_multirate,
+	test_steady_state,
+	test_divergence,
+	test_ensemble,
+	test_ensemble_run,
+	test_threads,
+	test_components,
+	test_executor,
+	test_run_async,
+	test_scheduler,
+	test_ensemble_fork,
+	test_row_callback,
+	test_parallel_compile,
+	test_compiled_model,
+	test_sim_clone,
+	test_numa,
+	test_snapshot,
+	test_snapshot_shm,
+	test_sweep,
+	test_calibrate,
+	test_sens,
+	test_adjoint,
+	test_gsa,
 };
 
 int
@@ -972,58 +1025,35 @@ typedef struct {
 	Slice s;
 } VerifyWalker;
 
-static VerifyWalker *verify_walker_new(void);
-static void verify_walker_ref(void *data);
-static void verify_walker_unref(void *data);
+static void verify_walker_init(VerifyWalker *w);
+static void verify_walker_free(VerifyWalker *w);
 static void verify_walker_start(void *data, Node *n);
-static Walker *verify_walker_start_child(void *data, Node *n);
-static void verify_walker_end_child(void *data, Node *n);
+static bool verify_walker_start_child(void *data, Node *parent, Node *child);
+static void verify_walker_end_child(void *data, Node *parent, Node *child);
 
 static const WalkerOps VERIFY_WALKER_OPS = {
-	.ref = verify_walker_ref,
-	.unref = verify_walker_unref,
 	.start = verify_walker_start,
 	.start_child = verify_walker_start_child,
 	.end_child = verify_walker_end_child,
 	.end = NULL,
 };
 
-VerifyWalker *
-verify_walker_new(void)
-{
-	VerifyWalker *w = calloc(1, sizeof(*w));
-
-	if (!w)
-		return NULL;
-
-	w->w.ops = &VERIFY_WALKER_OPS;
-	verify_walker_ref(w);
-
-	return w;
-}
-
 void
-verify_walker_ref(void *data)
+verify_walker_init(VerifyWalker *w)
 {
-	VerifyWalker *w = data;
-	__sync_fetch_and_add(&w->w.refcount, 1);
+	memset(w, 0, sizeof(*w));
+	w->w.ops = &VERIFY_WALKER_OPS;
 }
 
 void
-verify_walker_unref(void *data)
+verify_walker_free(VerifyWalker *w)
 {
-	VerifyWalker *w = data;
-
-	if (!w || __sync_sub_and_fetch(&w->w.refcount, 1) != 0)
-		return;
-
 	for (size_t i = 0; i < w->s.len; i++) {
 		NodeInfo *ni = w->s.elems[i];
 		free((void *)(intptr_t)ni->sval);
 		free(ni);
 	}
 	free(w->s.elems);
-	free(w);
 }
 
 void
@@ -1039,18 +1069,50 @@ verify_walker_start(void *data, Node *n)
 	slice_append(&vw->s, ni);
 }
 
-Walker *
-verify_walker_start_child(void *data, Node *n)
+bool
+verify_walker_start_child(void *data, Node *parent, Node *child)
+{
+	return true;
+}
+
+void
+verify_walker_end_child(void *data, Node *parent, Node *child)
 {
-	Walker *w = data;
-	w->ops->ref(w);
+}
 
-	return w;
+typedef struct {
+	Walker w;
+	size_t starts;
+	size_t ends;
+	size_t depth;
+	size_t max_depth;
+} CountWalker;
+
+static void count_walker_start(void *data, Node *n);
+static void count_walker_end(void *data, Node *n);
+
+static const WalkerOps COUNT_WALKER_OPS = {
+	.start = count_walker_start,
+	.start_child = NULL,
+	.end_child = NULL,
+	.end = count_walker_end,
+};
+
+void
+count_walker_start(void *data, Node *n)
+{
+	CountWalker *cw = data;
+	cw->starts++;
+	if (++cw->depth > cw->max_depth)
+		cw->max_depth = cw->depth;
 }
 
 void
-verify_walker_end_child(void *data, Node *n)
+count_walker_end(void *data, Node *n)
 {
+	CountWalker *cw = data;
+	cw->ends++;
+	cw->depth--;
 }
 
 void
@@ -1094,8 +1156,6 @@ test_parse2(void)
 		var.eqn = NULL;
 		expr.node = NULL;
 	}
-	(void)verify_walker_new;
-
 	for (size_t i = 0; i < sizeof(PARSE_TESTS2)/sizeof(*PARSE_TESTS2); i++) {
 		const ParseTestData2 *test = &PARSE_TESTS2[i];
 
@@ -1106,13 +1166,15 @@ test_parse2(void)
 		if (!expr.node)
 			die("no parse tree returned for '%s'\n", test->in);
 
-		VerifyWalker *w = verify_walker_new();
+		VerifyWalker w;
+		verify_walker_init(&w);
 
-		node_walk(&w->w, expr.node);
+		if (!node_walk(&w.w, expr.node))
+			die("walk failed for '%s'\n", test->in);
 
-		for (size_t j = 0; j < w->s.len; j++) {
+		for (size_t j = 0; j < w.s.len; j++) {
 			const NodeInfo *ni1 = &test->nodes[j];
-			NodeInfo *ni2 = w->s.elems[j];
+			NodeInfo *ni2 = w.s.elems[j];
 
 			if (ni1->type != ni2->type)
 				die("%s j%d type mismatch %d != %d\n", test->in, j, ni1->type, ni2->type);
@@ -1126,7 +1188,7 @@ test_parse2(void)
 			}
 		}
 
-		w->w.ops->unref(w);
+		verify_walker_free(&w);
 
 		node_free(expr.node);
 		var.eqn = NULL;
@@ -1135,6 +1197,31 @@ test_parse2(void)
 
 	// dont segfault
 	node_walk(NULL, NULL);
+
+	// generated models can nest far deeper than the C stack
+	// would allow a recursive walk to go.
+	const size_t depth = 1000000;
+	Node *root = node(N_FLOATLIT);
+	for (size_t i = 1; i < depth; i++) {
+		Node *n = node(N_UNARY);
+		n->op = '-';
+		n->left = root;
+		root = n;
+	}
+	CountWalker cw;
+	memset(&cw, 0, sizeof(cw));
+	cw.w.ops = &COUNT_WALKER_OPS;
+	if (!node_walk(&cw.w, root))
+		die("deep walk failed\n");
+	if (cw.starts != depth || cw.ends != depth || cw.max_depth != depth)
+		die("deep walk saw %zu/%zu nodes, depth %zu\n",
+		    cw.starts, cw.ends, cw.max_depth);
+	while (root) {
+		Node *n = root->left;
+		root->left = NULL;
+		node_free(root);
+		root = n;
+	}
 }
 
 void
@@ -1235,3 +1322,2396 @@ test_hash_table(void)
 
 	sd_hash_table_unref(ht);
 }
+
+void
+test_backward_euler(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	double *slow, *fast;
+	double slow_want, fast_want, t;
+	const char *name;
+	size_t len;
+
+	err = 0;
+	p = sd_project_open("models/stiff.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/stiff.xmile': %s\n",
+		    sd_error_str(err));
+
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("stiff sim_new failed\n");
+	if (s->method != SIM_BACKWARD_EULER)
+		die("expected backward euler method\n");
+
+	// explicit Euler is unstable for fast_time/dt = 1/500, the
+	// implicit step should track the linear system exactly.
+	err = sd_sim_run_to_end(s);
+	if (err)
+		die("stiff run_to_end failed: %d\n", err);
+
+	len = sd_sim_get_stepcount(s);
+	if (len != 101)
+		die("stiff stepcount %zu not 101\n", len);
+	slow = calloc(len, sizeof(double));
+	fast = calloc(len, sizeof(double));
+	sd_sim_get_series(s, "slow", slow, len);
+	sd_sim_get_series(s, "fast", fast, len);
+
+	slow_want = 100;
+	fast_want = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (fabs(slow[i] - slow_want) > 1e-9*slow_want)
+			die("slow off at %zu: %f vs %f\n", i, slow[i], slow_want);
+		if (fabs(fast[i] - fast_want) > 1e-9*slow_want)
+			die("fast off at %zu: %f vs %f\n", i, fast[i], fast_want);
+		slow_want = slow_want/(1 + .5/10);
+		fast_want = (fast_want + .5/.001*slow_want)/(1 + .5/.001);
+	}
+
+	free(slow);
+	free(fast);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+
+	// each stock feeds the next round a ring, so factoring the
+	// step's Jacobian fills in entries the Jacobian doesn't have.
+	// every saved step should satisfy y = x + dt*f(y).
+	p = sd_project_open("models/ring.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/ring.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("ring sim_new failed\n");
+	err = sd_sim_run_to_end(s);
+	if (err)
+		die("ring run_to_end failed: %d\n", err);
+	len = sd_sim_get_stepcount(s);
+	{
+		double *a = calloc(len, sizeof(double));
+		double *b = calloc(len, sizeof(double));
+		double *c = calloc(len, sizeof(double));
+		sd_sim_get_series(s, "a", a, len);
+		sd_sim_get_series(s, "b", b, len);
+		sd_sim_get_series(s, "c", c, len);
+		for (size_t i = 0; i + 1 < len; i++) {
+			double ra = a[i+1] - a[i] - .5*(c[i+1] - a[i+1])/0.001;
+			double rb = b[i+1] - b[i] - .5*(a[i+1] - b[i+1])/2;
+			double rc = c[i+1] - c[i] - .5*(b[i+1] - 3*c[i+1])/5;
+			if (fabs(ra) > 1e-9 || fabs(rb) > 1e-9 || fabs(rc) > 1e-9)
+				die("ring step %zu residuals %g %g %g\n", i, ra, rb, rc);
+		}
+		free(a);
+		free(b);
+		free(c);
+	}
+	sd_sim_unref(s);
+	sd_project_unref(p);
+
+	// level = 1 + level^2 has no real solution for the first
+	// step, so Newton can't converge however often it restarts.
+	p = sd_project_open("models/runaway.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/runaway.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("runaway sim_new failed\n");
+	err = sd_sim_run_to_end(s);
+	if (err != SD_ERR_DIVERGED)
+		die("runaway run: expected divergence, not %d\n", err);
+	if (sd_sim_get_divergence(s, &name, &t) || strcmp(name, "level") != 0 || t != 1)
+		die("runaway diverged at %f\n", t);
+
+	// but level = 0.1 + level^2 does
+	sd_sim_reset(s);
+	if (sd_sim_set_value(s, "level", 0.1))
+		die("set_value failed\n");
+	if (sd_sim_run_to(s, 1))
+		die("runaway from 0.1 failed\n");
+	len = sd_sim_get_stepcount(s);
+	slow = calloc(len, sizeof(double));
+	sd_sim_get_series(s, "level", slow, len);
+	slow_want = (1 - sqrt(1 - 4*0.1))/2;
+	if (fabs(slow[1] - slow_want) > 1e-9)
+		die("runaway level %f, not %f\n", slow[1], slow_want);
+	free(slow);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+void
+test_multirate(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	double *level, *backlog;
+	double want;
+	size_t len;
+
+	err = 0;
+	p = sd_project_open("models/multirate.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/multirate.xmile': %s\n",
+		    sd_error_str(err));
+
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("multirate sim_new failed\n");
+
+	err = sd_sim_run_to_end(s);
+	if (err)
+		die("multirate run_to_end failed: %d\n", err);
+
+	len = sd_sim_get_stepcount(s);
+	if (len != 9)
+		die("multirate stepcount %zu not 9\n", len);
+	level = calloc(len, sizeof(double));
+	backlog = calloc(len, sizeof(double));
+	sd_sim_get_series(s, "controller.level", level, len);
+	sd_sim_get_series(s, "backlog", backlog, len);
+
+	// the controller takes 4 steps of dt=1/4 for every step of
+	// the root model.  At the root's dt of 1 it would reach the
+	// target in a single step.
+	want = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (!same(level[i], want))
+			die("level off at %zu: %f vs %f\n", i, level[i], want);
+		if (!same(backlog[i], i))
+			die("backlog off at %zu: %f\n", i, backlog[i]);
+		want = 10 - (10 - want)*pow(.75, 4);
+	}
+
+	free(level);
+	free(backlog);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+void
+test_steady_state(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	double *time, *level, *full;
+	double t, v;
+	size_t len;
+
+	err = 0;
+	p = sd_project_open("models/settle.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/settle.xmile': %s\n",
+		    sd_error_str(err));
+
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("settle sim_new failed\n");
+	len = sd_sim_get_stepcount(s);
+	time = calloc(len, sizeof(double));
+	level = calloc(len, sizeof(double));
+	full = calloc(len, sizeof(double));
+
+	// a full-length run for reference
+	if (sd_sim_run_to_end(s))
+		die("settle run_to_end failed\n");
+	if (sd_sim_get_steady_time(s, &t) == 0)
+		die("steady time reported without opting in\n");
+	sd_sim_get_series(s, "level", full, len);
+
+	if (sd_sim_set_steady_state(NULL, 1e-6, 1) == 0)
+		die("set_steady_state NULL should fail\n");
+	if (sd_sim_set_steady_state(s, -1, 1) == 0)
+		die("set_steady_state negative tol should fail\n");
+	if (sd_sim_set_steady_state(s, 1e-6, 1))
+		die("set_steady_state failed\n");
+	sd_sim_reset(s);
+	if (sd_sim_run_to_end(s))
+		die("settle run_to_end failed\n");
+
+	if (sd_sim_get_steady_time(s, &t))
+		die("settle run didn't reach steady state\n");
+	if (t < 30 || t > 50)
+		die("unexpected steady time %f\n", t);
+
+	sd_sim_get_series(s, "time", time, len);
+	sd_sim_get_series(s, "level", level, len);
+	for (size_t i = 0; i < len; i++) {
+		if (time[i] != i)
+			die("time off at %zu: %f\n", i, time[i]);
+		if (time[i] <= t && level[i] != full[i])
+			die("level before steady %zu: %f vs %f\n", i, level[i], full[i]);
+		if (fabs(level[i] - full[i]) > 1e-4)
+			die("level off at %zu: %f vs %f\n", i, level[i], full[i]);
+	}
+	if (level[len-1] != level[(size_t)t + 1])
+		die("level not held after steady state\n");
+
+	err = sd_sim_get_value(s, "time", &v);
+	if (err || v != 200)
+		die("final time %f not 200\n", v);
+
+	// resetting clears the result, but keeps the setting
+	sd_sim_reset(s);
+	if (sd_sim_get_steady_time(s, &t) == 0)
+		die("steady time survived reset\n");
+
+	free(time);
+	free(level);
+	free(full);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+void
+test_divergence(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	const char *name;
+	double t;
+
+	err = 0;
+	p = sd_project_open("models/diverge.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/diverge.xmile': %s\n",
+		    sd_error_str(err));
+
+	s = sd_sim_new(p, NULL);
+	if (!s)
+		die("diverge sim_new failed\n");
+
+	// without the check, NaN and Inf silently propagate
+	if (sd_sim_run_to_end(s))
+		die("unchecked run failed\n");
+	if (sd_sim_get_divergence(s, &name, &t) == 0)
+		die("divergence reported without opting in\n");
+
+	if (sd_sim_set_finite_check(s, -1) == 0)
+		die("negative check interval should fail\n");
+	if (sd_sim_set_finite_check(s, 1))
+		die("set_finite_check failed\n");
+	sd_sim_reset(s);
+	err = sd_sim_run_to_end(s);
+	if (err != SD_ERR_DIVERGED)
+		die("expected divergence, not %d\n", err);
+	if (strcmp(sd_error_str(err), "non-finite value") != 0)
+		die("bad error string '%s'\n", sd_error_str(err));
+	if (sd_sim_get_divergence(s, &name, &t))
+		die("get_divergence failed\n");
+	if (strcmp(name, "population") != 0)
+		die("diverged var '%s' not population\n", name);
+	// 1001^t overflows a double just after t=102
+	if (t != 103)
+		die("diverged at %f, not 103\n", t);
+
+	// checking every 16 steps finds it by the next multiple
+	sd_sim_set_finite_check(s, 16);
+	sd_sim_reset(s);
+	if (sd_sim_get_divergence(s, &name, &t) == 0)
+		die("divergence survived reset\n");
+	if (sd_sim_run_to_end(s) != SD_ERR_DIVERGED)
+		die("expected divergence\n");
+	if (sd_sim_get_divergence(s, NULL, &t) || t != 113)
+		die("diverged at %f, not 113\n", t);
+
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+void
+test_ensemble(void)
+{
+	int err, n;
+	size_t nlanes, len;
+	SDProject *p;
+	SDSim *s;
+	SDEnsemble *e;
+	double *want, *got;
+	const char *names[] = {"time", "hares.hares", "lynxes.lynxes", "lynxes.harvest"};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	// not a multiple of the lane width, so the last block is partial
+	nlanes = 11;
+	e = sd_ensemble_new(p, NULL, nlanes);
+	if (!e)
+		die("ensemble_new failed\n");
+	if (sd_ensemble_get_lanecount(e) != (int)nlanes)
+		die("bad lane count\n");
+	if (sd_ensemble_set_value(e, nlanes, "area", 1) == 0)
+		die("set_value on out of range lane should fail\n");
+	if (sd_ensemble_set_value(e, 0, "hares.hare_density", 1) == 0)
+		die("set_value on a computed aux should fail\n");
+
+	// lane 0 keeps the model's own area
+	for (size_t i = 1; i < nlanes; i++) {
+		if (sd_ensemble_set_value(e, i, "area", 500 + 100*i))
+			die("ensemble set_value failed\n");
+	}
+	if (sd_ensemble_run_to_end(e))
+		die("ensemble run failed\n");
+
+	len = sd_ensemble_get_stepcount(e);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+
+	for (size_t i = 0; i < nlanes; i++) {
+		s = sd_sim_new(p, NULL);
+		if (!s)
+			die("sim_new failed\n");
+		if (i > 0 && sd_sim_set_value(s, "area", 500 + 100*i))
+			die("sim set_value failed\n");
+		if (sd_sim_run_to_end(s))
+			die("sim run failed\n");
+		if (sd_sim_get_stepcount(s) != (int)len)
+			die("step count mismatch\n");
+
+		for (size_t j = 0; j < sizeof(names)/sizeof(*names); j++) {
+			n = sd_sim_get_series(s, names[j], want, len);
+			if (n != (int)len)
+				die("sim get_series(%s) failed\n", names[j]);
+			n = sd_ensemble_get_series(e, i, names[j], got, len);
+			if (n != (int)len)
+				die("ensemble get_series(%s) failed\n", names[j]);
+			for (size_t k = 0; k < len; k++) {
+				if (!same(want[k], got[k]))
+					die("lane %zu %s[%zu]: %f != %f\n",
+					    i, names[j], k, got[k], want[k]);
+			}
+		}
+		sd_sim_unref(s);
+	}
+
+	// overrides persist across reset, like sd_sim_set_value
+	sd_ensemble_reset(e);
+	sd_ensemble_run_to_end(e);
+	sd_ensemble_get_series(e, nlanes-1, "hares.hares", got, len);
+	s = sd_sim_new(p, NULL);
+	sd_sim_set_value(s, "area", 500 + 100*(nlanes-1));
+	sd_sim_run_to_end(s);
+	sd_sim_get_series(s, "hares.hares", want, len);
+	if (!same(want[len-1], got[len-1]))
+		die("override lost across reset\n");
+	sd_ensemble_get_series(e, 0, "hares.hares", want, len);
+	if (same(want[len-1], got[len-1]))
+		die("lanes with different areas ended up the same\n");
+
+	sd_sim_unref(s);
+	free(want);
+	free(got);
+	sd_ensemble_unref(e);
+	sd_project_unref(p);
+}
+
+void
+test_ensemble_run(void)
+{
+	int err, status[3];
+	size_t nruns, len;
+	SDProject *p;
+	SDSim *s;
+	SDEnsembleRuns runs;
+	double *values, **results, *want;
+	const char *params[] = {"area", "hares.birth_fraction"};
+	const char *outputs[] = {"hares.hares", "lynxes.lynxes"};
+	const char *bad[] = {"hares.hare_density"};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	len = sd_sim_get_stepcount(s);
+	sd_sim_unref(s);
+
+	nruns = 37;
+	values = calloc(nruns*2, sizeof(*values));
+	results = calloc(nruns, sizeof(*results));
+	want = calloc(len, sizeof(*want));
+	for (size_t i = 0; i < nruns; i++) {
+		values[i*2] = 500 + 25*i;
+		values[i*2+1] = 1 + .01*i;
+		results[i] = calloc(2*len, sizeof(double));
+	}
+
+	memset(&runs, 0, sizeof(runs));
+	runs.params = params;
+	runs.nparams = 2;
+	runs.values = values;
+	runs.outputs = outputs;
+	runs.noutputs = 2;
+	runs.results = results;
+
+	if (sd_ensemble_run(p, NULL, &runs, nruns, -1) == 0)
+		die("negative thread count should fail\n");
+	runs.params = bad;
+	runs.nparams = 1;
+	if (sd_ensemble_run(p, NULL, &runs, nruns, 4) == 0)
+		die("non-constant param should fail\n");
+	runs.params = params;
+	runs.nparams = 2;
+
+	if (sd_ensemble_run(p, NULL, &runs, nruns, 4))
+		die("ensemble_run failed\n");
+
+	for (size_t i = 0; i < nruns; i++) {
+		s = sd_sim_new(p, NULL);
+		sd_sim_set_value(s, "area", values[i*2]);
+		sd_sim_set_value(s, "hares.birth_fraction", values[i*2+1]);
+		if (sd_sim_run_to_end(s))
+			die("sim run failed\n");
+		for (size_t j = 0; j < 2; j++) {
+			sd_sim_get_series(s, outputs[j], want, len);
+			for (size_t k = 0; k < len; k++) {
+				if (!same(want[k], results[i][j*len + k]))
+					die("run %zu %s[%zu]: %f != %f\n", i, outputs[j],
+					    k, results[i][j*len + k], want[k]);
+			}
+		}
+		sd_sim_unref(s);
+	}
+	for (size_t i = 0; i < nruns; i++)
+		free(results[i]);
+	sd_project_unref(p);
+
+	// per-run status reports runs that blew up
+	p = sd_project_open("models/diverge.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/diverge.xmile': %s\n",
+		    sd_error_str(err));
+	memset(&runs, 0, sizeof(runs));
+	runs.status = status;
+	runs.finite_every = 1;
+	err = sd_ensemble_run(p, NULL, &runs, 3, 2);
+	if (err != SD_ERR_DIVERGED)
+		die("expected divergence, not %d\n", err);
+	for (size_t i = 0; i < 3; i++) {
+		if (status[i] != SD_ERR_DIVERGED)
+			die("run %zu status %d\n", i, status[i]);
+	}
+	sd_project_unref(p);
+
+	free(values);
+	free(results);
+	free(want);
+}
+
+void
+test_threads(void)
+{
+	int err, len, n;
+	SDProject *p;
+	SDSim *serial, *parallel;
+	double *want, *got;
+	const char *names[] = {"time", "total", "s1", "s64", "g32", "a17"};
+	const char *hl_names[] = {"hares.hares", "lynxes.lynxes", "lynxes.harvest"};
+	const char *files[] = {"models/wide.xmile", "models/hares_and_lynxes.xmile"};
+
+	for (size_t f = 0; f < sizeof(files)/sizeof(*files); f++) {
+		const char **vars = f == 0 ? names : hl_names;
+		size_t nvars = f == 0 ? sizeof(names)/sizeof(*names) : sizeof(hl_names)/sizeof(*hl_names);
+
+		err = 0;
+		p = sd_project_open(files[f], &err);
+		if (p == NULL)
+			die("couldn't open '%s': %s\n", files[f], sd_error_str(err));
+
+		serial = sd_sim_new(p, NULL);
+		parallel = sd_sim_new(p, NULL);
+		if (!serial || !parallel)
+			die("sim_new failed\n");
+		if (sd_sim_set_threads(parallel, -1) == 0)
+			die("negative thread count should fail\n");
+		if (sd_sim_set_threads(parallel, 4))
+			die("set_threads failed\n");
+		// and again, replacing the first levels
+		if (sd_sim_set_threads(parallel, 3))
+			die("set_threads failed\n");
+
+		if (sd_sim_run_to_end(serial) || sd_sim_run_to_end(parallel))
+			die("run failed\n");
+
+		len = sd_sim_get_stepcount(serial);
+		want = calloc(len, sizeof(*want));
+		got = calloc(len, sizeof(*got));
+		for (size_t i = 0; i < nvars; i++) {
+			n = sd_sim_get_series(serial, vars[i], want, len);
+			if (n != len || sd_sim_get_series(parallel, vars[i], got, len) != len)
+				die("get_series(%s) failed\n", vars[i]);
+			// the same operations in the same order per variable
+			for (int j = 0; j < len; j++) {
+				if (want[j] != got[j])
+					die("%s %s[%d]: %f != %f\n", files[f], vars[i], j, got[j], want[j]);
+			}
+		}
+
+		// resetting keeps the levels
+		sd_sim_reset(parallel);
+		sd_sim_run_to_end(parallel);
+		sd_sim_get_series(parallel, vars[1], got, len);
+		sd_sim_get_series(serial, vars[1], want, len);
+		if (want[len-1] != got[len-1])
+			die("reset run differs\n");
+
+		free(want);
+		free(got);
+		sd_sim_unref(serial);
+		sd_sim_unref(parallel);
+		sd_project_unref(p);
+	}
+
+	p = sd_project_open("models/stiff.xmile", &err);
+	serial = sd_sim_new(p, NULL);
+	if (sd_sim_set_threads(serial, 2) == 0)
+		die("threads with backward Euler should fail\n");
+	sd_sim_unref(serial);
+	sd_project_unref(p);
+}
+
+void
+test_components(void)
+{
+	int err, len;
+	SDProject *p;
+	SDSim *serial, *parallel;
+	double *want, *got, v, w;
+	const char *names[] = {
+		"time", "population", "births", "inventory",
+		"shipments", "account", "deposits", "unused_constant",
+	};
+
+	err = 0;
+	p = sd_project_open("models/sectors.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/sectors.xmile': %s\n",
+		    sd_error_str(err));
+
+	serial = sd_sim_new(p, NULL);
+	parallel = sd_sim_new(p, NULL);
+	if (!serial || !parallel)
+		die("sim_new failed\n");
+	// the unused constant doesn't count as a sector of its own
+	if (sd_sim_get_component_count(parallel) != 3)
+		die("found %d components, not 3\n", sd_sim_get_component_count(parallel));
+	if (sd_sim_set_threads(parallel, 3))
+		die("set_threads failed\n");
+
+	// stop part way, change a constant and carry on
+	sd_sim_run_to(serial, 42.5);
+	if (sd_sim_run_to(parallel, 42.5))
+		die("parallel run_to failed\n");
+	sd_sim_get_value(serial, "time", &w);
+	if (sd_sim_get_value(parallel, "time", &v) || v != w)
+		die("parallel stopped at %f, not %f\n", v, w);
+	sd_sim_get_value(serial, "account", &w);
+	if (sd_sim_get_value(parallel, "account", &v) || v != w)
+		die("parallel account %f, not %f\n", v, w);
+	sd_sim_set_value(serial, "lifetime", 30);
+	sd_sim_set_value(parallel, "lifetime", 30);
+	sd_sim_run_to_end(serial);
+	if (sd_sim_run_to_end(parallel))
+		die("parallel run failed\n");
+
+	len = sd_sim_get_stepcount(serial);
+	if (sd_sim_get_stepcount(parallel) != len)
+		die("stepcount mismatch\n");
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	for (size_t i = 0; i < sizeof(names)/sizeof(*names); i++) {
+		if (sd_sim_get_series(serial, names[i], want, len) != len ||
+		    sd_sim_get_series(parallel, names[i], got, len) != len)
+			die("get_series(%s) failed\n", names[i]);
+		for (int j = 0; j < len; j++) {
+			if (want[j] != got[j])
+				die("%s[%d]: %f != %f\n", names[i], j, got[j], want[j]);
+		}
+	}
+	free(want);
+	free(got);
+	sd_sim_unref(serial);
+	sd_sim_unref(parallel);
+	sd_project_unref(p);
+
+	// a single sector is a single component
+	p = sd_project_open("models/wide.xmile", &err);
+	serial = sd_sim_new(p, NULL);
+	if (sd_sim_get_component_count(serial) != 1)
+		die("wide model should be one component\n");
+	sd_sim_unref(serial);
+	sd_project_unref(p);
+}
+
+// CountingExecutor forwards to another executor, counting the tasks
+// libsd hands it.
+typedef struct {
+	SDExecutor ex;
+	SDExecutor *inner;
+	int submitted;
+} CountingExecutor;
+
+static void *
+counting_submit(void *data, SDTaskFn fn, void *fn_data)
+{
+	CountingExecutor *ce = data;
+	__sync_fetch_and_add(&ce->submitted, 1);
+	return ce->inner->ops->submit(ce->inner, fn, fn_data);
+}
+
+static void
+counting_wait(void *data, void *task)
+{
+	CountingExecutor *ce = data;
+	ce->inner->ops->wait(ce->inner, task);
+}
+
+static size_t
+counting_concurrency(void *data)
+{
+	CountingExecutor *ce = data;
+	return ce->inner->ops->concurrency(ce->inner);
+}
+
+static const SDExecutorOps COUNTING_OPS = {
+	.submit = counting_submit,
+	.wait = counting_wait,
+	.concurrency = counting_concurrency,
+};
+
+typedef struct {
+	size_t nworkers;
+	int sum;
+	int bad_worker;
+} SumJob;
+
+static void
+sum_indices(void *data, size_t i, size_t worker)
+{
+	SumJob *job = data;
+	if (worker >= job->nworkers)
+		__sync_fetch_and_add(&job->bad_worker, 1);
+	__sync_fetch_and_add(&job->sum, (int)i);
+}
+
+void
+test_executor(void)
+{
+	int err, len;
+	SDProject *p;
+	SDSim *serial, *parallel;
+	CountingExecutor ce;
+	SumJob job;
+	double *want, *got;
+
+	ce.ex.ops = &COUNTING_OPS;
+	ce.inner = sd_executor_new(3);
+	ce.submitted = 0;
+	if (!ce.inner)
+		die("executor_new failed\n");
+	if (sd_executor_concurrency(ce.inner) != 3)
+		die("bad concurrency\n");
+
+	memset(&job, 0, sizeof(job));
+	job.nworkers = 3;
+	if (sd_executor_parallel_for(&ce.ex, 1000, 3, sum_indices, &job))
+		die("parallel_for failed\n");
+	if (job.sum != 999*1000/2 || job.bad_worker)
+		die("parallel_for sum %d, %d bad workers\n", job.sum, job.bad_worker);
+	if (ce.submitted != 2)
+		die("expected 2 tasks for 3 workers, not %d\n", ce.submitted);
+
+	// everything parallel on a project goes through its executor
+	err = 0;
+	p = sd_project_open("models/sectors.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/sectors.xmile': %s\n",
+		    sd_error_str(err));
+	sd_project_set_executor(p, &ce.ex);
+
+	serial = sd_sim_new(p, NULL);
+	parallel = sd_sim_new(p, NULL);
+	ce.submitted = 0;
+	sd_sim_set_threads(parallel, 3);
+	sd_sim_run_to_end(serial);
+	if (sd_sim_run_to_end(parallel))
+		die("parallel run failed\n");
+	if (ce.submitted == 0)
+		die("component run didn't use the project's executor\n");
+
+	len = sd_sim_get_stepcount(serial);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	sd_sim_get_series(serial, "account", want, len);
+	sd_sim_get_series(parallel, "account", got, len);
+	for (int i = 0; i < len; i++) {
+		if (want[i] != got[i])
+			die("account[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+	free(want);
+	free(got);
+	sd_sim_unref(serial);
+	sd_sim_unref(parallel);
+	sd_project_unref(p);
+
+	sd_executor_free(ce.inner);
+	// the default executor lives as long as the process
+	sd_executor_free(sd_executor_default());
+	if (sd_executor_concurrency(sd_executor_default()) < 1)
+		die("default executor has no threads\n");
+}
+
+typedef struct {
+	int done;
+	int err;
+	int progress;
+	int last_saved;
+	// for cancellation: the first progress report blocks until
+	// the test has canceled the run
+	bool block;
+	int blocked;
+	int released;
+} AsyncState;
+
+static void
+async_done(SDSim *s, int err, void *data)
+{
+	AsyncState *st = data;
+	st->done++;
+	st->err = err;
+}
+
+static void
+async_progress(SDSim *s, int nsaved, void *data)
+{
+	AsyncState *st = data;
+	st->progress++;
+	st->last_saved = nsaved;
+	if (st->block && st->progress == 1) {
+		__atomic_store_n(&st->blocked, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&st->released, __ATOMIC_SEQ_CST))
+			;
+	}
+}
+
+void
+test_run_async(void)
+{
+	int err, len;
+	SDProject *p;
+	SDSim *s, *ref;
+	SDRun *run;
+	AsyncState st;
+	double *want, *got, t;
+
+	err = 0;
+	p = sd_project_open("models/settle.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/settle.xmile': %s\n",
+		    sd_error_str(err));
+
+	ref = sd_sim_new(p, NULL);
+	sd_sim_run_to_end(ref);
+	len = sd_sim_get_stepcount(ref);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	sd_sim_get_series(ref, "level", want, len);
+
+	s = sd_sim_new(p, NULL);
+	memset(&st, 0, sizeof(st));
+	if (sd_sim_set_progress(s, 10, NULL, NULL) == 0)
+		die("progress without a callback should fail\n");
+	if (sd_sim_set_progress(s, 10, async_progress, &st))
+		die("set_progress failed\n");
+	run = sd_sim_run_async(s, 1e9, async_done, &st);
+	if (!run)
+		die("run_async failed\n");
+	err = sd_run_wait(run);
+	if (err || st.done != 1 || st.err)
+		die("async run: %d, done %d, cb err %d\n", err, st.done, st.err);
+	// 800 steps saved every 4 steps, and the final row once the
+	// run finishes
+	if (st.progress != 21 || st.last_saved != len)
+		die("%d progress reports up to %d\n", st.progress, st.last_saved);
+	sd_sim_get_series(s, "level", got, len);
+	for (int i = 0; i < len; i++) {
+		if (want[i] != got[i])
+			die("level[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+
+	// cancel a run part way through, then finish it
+	sd_sim_reset(s);
+	memset(&st, 0, sizeof(st));
+	st.block = true;
+	sd_sim_set_progress(s, 1, async_progress, &st);
+	run = sd_sim_run_async(s, 1e9, async_done, &st);
+	while (!__atomic_load_n(&st.blocked, __ATOMIC_SEQ_CST))
+		;
+	sd_run_cancel(run);
+	__atomic_store_n(&st.released, 1, __ATOMIC_SEQ_CST);
+	err = sd_run_wait(run);
+	if (err != SD_ERR_CANCELED || st.err != SD_ERR_CANCELED)
+		die("expected cancellation, not %d\n", err);
+	if (strcmp(sd_error_str(err), "canceled") != 0)
+		die("bad error string '%s'\n", sd_error_str(err));
+	sd_sim_get_value(s, "time", &t);
+	if (t >= 20)
+		die("canceled run carried on to %f\n", t);
+
+	// a run stopped part way reports the rows it finished, up to
+	// time 100, and a run to the end reports them all, however
+	// rarely it reports
+	memset(&st, 0, sizeof(st));
+	sd_sim_set_progress(s, 1000, async_progress, &st);
+	if (sd_sim_run_to(s, 100))
+		die("resuming canceled run failed\n");
+	if (st.progress != 1 || st.last_saved != 101)
+		die("run to 100: %d progress reports up to %d\n", st.progress, st.last_saved);
+	if (sd_sim_run_to_end(s) || sd_sim_run_to_end(s))
+		die("finishing canceled run failed\n");
+	if (st.progress != 2 || st.last_saved != len)
+		die("run to end: %d progress reports up to %d\n", st.progress, st.last_saved);
+	sd_sim_set_progress(s, 0, NULL, NULL);
+	sd_sim_get_series(s, "level", got, len);
+	for (int i = 0; i < len; i++) {
+		if (want[i] != got[i])
+			die("resumed level[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+
+	free(want);
+	free(got);
+	sd_sim_unref(s);
+	sd_sim_unref(ref);
+	sd_project_unref(p);
+}
+
+typedef struct {
+	SDSim *order[4];
+	int n;
+	int err;
+} SchedState;
+
+static void
+sched_done(SDSim *s, int err, void *data)
+{
+	SchedState *st = data;
+	if (st->n < 4)
+		st->order[st->n] = s;
+	st->n++;
+	if (err)
+		st->err = err;
+}
+
+void
+test_scheduler(void)
+{
+	int err, len;
+	SDProject *settle, *hl;
+	SDSim *ref, *fast, *slow, *other, *removed;
+	SDScheduler *sched, *sched2;
+	SchedState st;
+	double *want, *got, tfast, tslow;
+
+	err = 0;
+	settle = sd_project_open("models/settle.xmile", &err);
+	hl = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!settle || !hl)
+		die("couldn't open models: %s\n", sd_error_str(err));
+
+	if (sd_scheduler_new(0))
+		die("zero step budget should fail\n");
+	sched = sd_scheduler_new(10);
+	if (!sched)
+		die("scheduler_new failed\n");
+
+	memset(&st, 0, sizeof(st));
+	fast = sd_sim_new(settle, NULL);
+	slow = sd_sim_new(settle, NULL);
+	other = sd_sim_new(hl, NULL);
+	removed = sd_sim_new(hl, NULL);
+	if (sd_scheduler_add(sched, fast, 1e9, 0, sched_done, &st) == 0)
+		die("zero weight should fail\n");
+	sd_scheduler_add(sched, fast, 1e9, 3, sched_done, &st);
+	sd_scheduler_add(sched, slow, 1e9, 1, sched_done, &st);
+	sd_scheduler_add(sched, other, 1e9, 1, sched_done, &st);
+	sd_scheduler_add(sched, removed, 1e9, 1, sched_done, &st);
+	if (sd_scheduler_add(sched, other, 1e9, 1, sched_done, &st) == 0)
+		die("adding a sim twice should fail\n");
+	if (sd_scheduler_len(sched) != 4)
+		die("expected 4 queued sims\n");
+	if (sd_scheduler_remove(sched, removed) || sd_scheduler_len(sched) != 3)
+		die("remove failed\n");
+	if (sd_scheduler_remove(sched, removed) == 0)
+		die("removing twice should fail\n");
+
+	// the queued sims belong to sched alone
+	sched2 = sd_scheduler_new(10);
+	if (sd_scheduler_add(sched2, other, 1e9, 1, sched_done, &st) == 0)
+		die("adding a sim queued elsewhere should fail\n");
+	if (sd_scheduler_remove(sched2, other) == 0 || sd_scheduler_set_weight(sched2, other, 2) == 0)
+		die("another scheduler's sim shouldn't be found\n");
+	if (sd_scheduler_add(sched2, removed, 1e9, 1, sched_done, &st) || sd_scheduler_remove(sched2, removed))
+		die("a removed sim should be free to queue elsewhere\n");
+	sd_scheduler_unref(sched2);
+
+	// hares and lynxes is done in 3 turns of 10 steps; the two
+	// settle runs need 80 each, and split their turns 3:1.
+	if (sd_scheduler_run(sched, 60) != 2)
+		die("expected only the settle sims still queued\n");
+	sd_sim_get_value(fast, "time", &tfast);
+	sd_sim_get_value(slow, "time", &tslow);
+	if (tslow <= 0 || tfast/tslow < 2.5 || tfast/tslow > 3.5)
+		die("fast at %f, slow at %f\n", tfast, tslow);
+
+	if (sd_scheduler_run(sched, 0) != 0)
+		die("scheduler didn't drain\n");
+	if (st.n != 3 || st.err)
+		die("%d callbacks, err %d\n", st.n, st.err);
+	if (st.order[0] != other || st.order[1] != fast || st.order[2] != slow)
+		die("sims finished out of order\n");
+
+	ref = sd_sim_new(settle, NULL);
+	sd_sim_run_to_end(ref);
+	len = sd_sim_get_stepcount(ref);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	sd_sim_get_series(ref, "level", want, len);
+	sd_sim_get_series(slow, "level", got, len);
+	for (int i = 0; i < len; i++) {
+		if (want[i] != got[i])
+			die("level[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+	sd_sim_unref(ref);
+
+	ref = sd_sim_new(hl, NULL);
+	sd_sim_run_to_end(ref);
+	sd_sim_get_series(ref, "hares.hares", want, len);
+	sd_sim_get_series(other, "hares.hares", got, len);
+	for (int i = 0; i < len && i < sd_sim_get_stepcount(ref); i++) {
+		if (want[i] != got[i])
+			die("hares[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+	sd_sim_unref(ref);
+
+	free(want);
+	free(got);
+	sd_scheduler_unref(sched);
+	sd_sim_unref(fast);
+	sd_sim_unref(slow);
+	sd_sim_unref(other);
+	sd_sim_unref(removed);
+	sd_project_unref(settle);
+	sd_project_unref(hl);
+}
+
+void
+test_ensemble_fork(void)
+{
+	int err, off, status[3];
+	size_t nruns, len;
+	SDProject *p;
+	SDResults *r;
+	SDEnsembleRuns runs;
+	double *values, **results, *want;
+	const double *rows;
+	const char *params[] = {"area", "hares.birth_fraction"};
+	const char *outputs[] = {"hares.hares"};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	nruns = 23;
+	values = calloc(nruns*2, sizeof(*values));
+	results = calloc(nruns, sizeof(*results));
+	for (size_t i = 0; i < nruns; i++) {
+		values[i*2] = 500 + 25*i;
+		values[i*2+1] = 1 + .01*i;
+	}
+
+	memset(&runs, 0, sizeof(runs));
+	runs.params = params;
+	runs.nparams = 2;
+	runs.values = values;
+	if (sd_ensemble_fork(p, NULL, &runs, nruns, -1, &err) || !err)
+		die("negative process count should fail\n");
+
+	r = sd_ensemble_fork(p, NULL, &runs, nruns, 3, &err);
+	if (!r || err)
+		die("ensemble_fork failed: %s\n", sd_error_str(err));
+	len = sd_results_get_stepcount(r);
+	if (sd_results_get_runcount(r) != (int)nruns || !len)
+		die("bad result dimensions\n");
+	for (size_t i = 0; i < nruns; i++)
+		results[i] = calloc(len, sizeof(double));
+	want = calloc(len, sizeof(*want));
+
+	// the forked runs match a threaded batch of the same runs
+	runs.outputs = outputs;
+	runs.noutputs = 1;
+	runs.results = results;
+	if (sd_ensemble_run(p, NULL, &runs, nruns, 2))
+		die("ensemble_run failed\n");
+	off = sd_results_get_offset(r, "hares.hares");
+	if (off < 0 || sd_results_get_offset(r, "time") != 0 ||
+	    sd_results_get_offset(r, "nonexistent") != -1)
+		die("bad offsets\n");
+	for (size_t i = 0; i < nruns; i++) {
+		if (sd_results_get_status(r, i))
+			die("run %zu failed\n", i);
+		rows = sd_results_get_rows(r, i);
+		if (sd_results_get_series(r, i, "hares.hares", want, len) != (int)len)
+			die("short series\n");
+		for (size_t k = 0; k < len; k++) {
+			if (!same(want[k], results[i][k]) ||
+			    !same(rows[k*sd_results_get_varcount(r) + off], results[i][k]))
+				die("run %zu hares[%zu]: %f != %f\n", i, k, want[k], results[i][k]);
+		}
+	}
+	sd_results_unref(r);
+	for (size_t i = 0; i < nruns; i++)
+		free(results[i]);
+	sd_project_unref(p);
+
+	p = sd_project_open("models/diverge.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/diverge.xmile': %s\n",
+		    sd_error_str(err));
+	memset(&runs, 0, sizeof(runs));
+	runs.status = status;
+	runs.finite_every = 1;
+	r = sd_ensemble_fork(p, NULL, &runs, 3, 2, &err);
+	if (!r || err != SD_ERR_DIVERGED)
+		die("expected divergence, not %d\n", err);
+	for (size_t i = 0; i < 3; i++) {
+		if (status[i] != SD_ERR_DIVERGED || sd_results_get_status(r, i) != SD_ERR_DIVERGED)
+			die("run %zu status %d\n", i, status[i]);
+	}
+	sd_results_unref(r);
+	sd_project_unref(p);
+
+	free(values);
+	free(results);
+	free(want);
+}
+
+typedef struct {
+	double *rows;
+	int nrows;
+	int nvars;
+	int maxrows;
+} RowLog;
+
+static void
+log_row(SDSim *s, int row, const double *values, void *data)
+{
+	RowLog *log = data;
+	if (row != log->nrows || row >= log->maxrows)
+		die("row %d out of order (expected %d)\n", row, log->nrows);
+	memcpy(&log->rows[row*log->nvars], values, log->nvars*sizeof(double));
+	log->nrows++;
+}
+
+// check_rows runs path's model with and without history, with a row
+// callback, and checks the rows against sd_sim_get_series.
+static void
+check_rows(const char *path, double steady_tol, int finite_every)
+{
+	int err, len, nvars, n;
+	SDProject *p;
+	SDSim *s;
+	RowLog log;
+	const char **names;
+	double *want, *hist;
+
+	err = 0;
+	p = sd_project_open(path, &err);
+	if (!p)
+		die("couldn't open '%s': %s\n", path, sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	len = sd_sim_get_stepcount(s);
+	nvars = sd_sim_get_varcount(s);
+	names = calloc(nvars, sizeof(*names));
+	want = calloc(len + 1, sizeof(*want));
+	hist = calloc(len*nvars, sizeof(*hist));
+	memset(&log, 0, sizeof(log));
+	log.nvars = nvars;
+	log.maxrows = len;
+	log.rows = calloc(len*nvars, sizeof(double));
+	sd_sim_get_varnames(s, names, nvars);
+
+	for (int keep = 1; keep >= 0; keep--) {
+		log.nrows = 0;
+		memset(log.rows, 0, len*nvars*sizeof(double));
+		if (sd_sim_set_history(s, keep))
+			die("set_history failed\n");
+		sd_sim_set_steady_state(s, steady_tol, 5);
+		sd_sim_set_finite_check(s, finite_every);
+		sd_sim_set_row_callback(s, log_row, &log);
+		// stopping part way through doesn't repeat or skip rows
+		if (sd_sim_run_to(s, 10) || sd_sim_run_to_end(s))
+			die("run failed\n");
+		if (log.nrows != len)
+			die("%s: %d rows, not %d\n", path, log.nrows, len);
+		if (keep) {
+			for (int v = 0; v < nvars; v++) {
+				int off = sd_sim_get_offset(s, names[v]);
+				if (off < 0)
+					die("no offset for %s\n", names[v]);
+				n = sd_sim_get_series(s, names[v], want, len);
+				if (n < len)
+					die("short series\n");
+				for (int i = 0; i < len; i++) {
+					if (!same(want[i], log.rows[i*nvars + off]))
+						die("%s[%d]: %f != %f\n", names[v], i,
+						    log.rows[i*nvars + off], want[i]);
+				}
+			}
+			memcpy(hist, log.rows, len*nvars*sizeof(double));
+		} else {
+			if (sd_sim_get_series(s, names[0], want, len) != -1)
+				die("get_series should fail without history\n");
+			for (int i = 0; i < len*nvars; i++) {
+				if (!same(hist[i], log.rows[i]))
+					die("%s: no-history row %d differs\n", path, i/nvars);
+			}
+		}
+		sd_sim_set_row_callback(s, NULL, NULL);
+	}
+
+	free(names);
+	free(want);
+	free(hist);
+	free(log.rows);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+void
+test_row_callback(void)
+{
+	check_rows("models/hares_and_lynxes.xmile", 0, 0);
+	check_rows("models/sectors.xmile", 0, 1);
+	check_rows("models/settle.xmile", 1e-9, 0);
+}
+
+void
+test_parallel_compile(void)
+{
+	int err, len;
+	SDProject *p;
+	SDExecutor *ex;
+	SDSim *serial, *parallel;
+	double *want, *got;
+
+	err = 0;
+	p = sd_project_open("models/wide.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/wide.xmile': %s\n", sd_error_str(err));
+
+	ex = sd_executor_new(1);
+	sd_project_set_executor(p, ex);
+	serial = sd_sim_new(p, NULL);
+	sd_project_set_executor(p, NULL);
+	sd_executor_free(ex);
+
+	// several chunks of variables compiled at once
+	ex = sd_executor_new(4);
+	sd_project_set_executor(p, ex);
+	parallel = sd_sim_new(p, NULL);
+	if (!serial || !parallel)
+		die("sd_sim_new failed\n");
+	if (sd_sim_get_varcount(parallel) != sd_sim_get_varcount(serial))
+		die("varcount differs\n");
+
+	sd_sim_run_to_end(serial);
+	sd_sim_run_to_end(parallel);
+	len = sd_sim_get_stepcount(serial);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	sd_sim_get_series(serial, "total", want, len);
+	sd_sim_get_series(parallel, "total", got, len);
+	for (int i = 0; i < len; i++) {
+		if (!same(want[i], got[i]))
+			die("total[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+
+	free(want);
+	free(got);
+	sd_sim_unref(serial);
+	sd_sim_unref(parallel);
+	sd_project_set_executor(p, NULL);
+	sd_executor_free(ex);
+	sd_project_unref(p);
+}
+
+typedef struct {
+	SDCompiledModel *cm;
+	double *hares; // [run][step]
+	size_t len;
+	int failed;
+} CompiledJob;
+
+static void
+compiled_run(void *data, size_t i, size_t worker)
+{
+	CompiledJob *job = data;
+	SDSim *s = sd_sim_new_from(job->cm);
+
+	if (!s || sd_sim_set_value(s, "area", 500 + 100*i) || sd_sim_run_to_end(s) ||
+	    sd_sim_get_series(s, "hares.hares", &job->hares[i*job->len], job->len) != (int)job->len)
+		__sync_fetch_and_add(&job->failed, 1);
+	sd_sim_unref(s);
+}
+
+void
+test_compiled_model(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	SDExecutor *ex;
+	CompiledJob job;
+	double *want;
+	const size_t nruns = 16;
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	if (sd_compiled_model_new(p, "nonexistent"))
+		die("compiling a missing model should fail\n");
+	if (sd_sim_new_from(NULL))
+		die("sd_sim_new_from(NULL) should fail\n");
+
+	memset(&job, 0, sizeof(job));
+	job.cm = sd_compiled_model_new(p, NULL);
+	if (!job.cm)
+		die("compile failed\n");
+
+	// a sim keeps its model alive
+	s = sd_sim_new_from(job.cm);
+	if (sd_sim_get_compiled_model(s) != job.cm)
+		die("wrong compiled model\n");
+	job.len = sd_sim_get_stepcount(s);
+	job.hares = calloc(nruns*job.len, sizeof(double));
+	want = calloc(job.len, sizeof(double));
+
+	// one compiled model, many sims on many threads
+	ex = sd_executor_new(4);
+	if (sd_executor_parallel_for(ex, nruns, 4, compiled_run, &job) || job.failed)
+		die("parallel runs failed\n");
+	sd_executor_free(ex);
+	sd_compiled_model_unref(job.cm);
+
+	for (size_t i = 0; i < nruns; i++) {
+		SDSim *ref = sd_sim_new(p, NULL);
+		sd_sim_set_value(ref, "area", 500 + 100*i);
+		sd_sim_run_to_end(ref);
+		sd_sim_get_series(ref, "hares.hares", want, job.len);
+		for (size_t k = 0; k < job.len; k++) {
+			if (!same(want[k], job.hares[i*job.len + k]))
+				die("run %zu hares[%zu]: %f != %f\n", i, k,
+				    job.hares[i*job.len + k], want[k]);
+		}
+		sd_sim_unref(ref);
+	}
+
+	// the slab is reused as history is turned off and on again
+	sd_sim_set_value(s, "area", 500);
+	if (sd_sim_set_history(s, 0) || sd_sim_run_to_end(s))
+		die("no-history run failed\n");
+	if (sd_sim_set_history(s, 1) || sd_sim_run_to_end(s))
+		die("history run failed\n");
+	sd_sim_get_series(s, "hares.hares", want, job.len);
+	for (size_t k = 0; k < job.len; k++) {
+		if (!same(want[k], job.hares[k]))
+			die("hares[%zu] after reset: %f != %f\n", k, want[k], job.hares[k]);
+	}
+	sd_sim_unref(s);
+
+	free(job.hares);
+	free(want);
+	sd_project_unref(p);
+}
+
+void
+test_sim_clone(void)
+{
+	int err, len;
+	SDProject *p;
+	SDSim *s, *full, *bare, *branch;
+	double *want, *got, t, v;
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	s = sd_sim_new(p, NULL);
+	sd_sim_set_value(s, "area", 800);
+	sd_sim_set_finite_check(s, 1);
+	if (sd_sim_run_to(s, 6))
+		die("run_to failed\n");
+
+	full = sd_sim_clone(s, SD_CLONE_HISTORY);
+	bare = sd_sim_clone(s, 0);
+	if (!full || !bare)
+		die("clone failed\n");
+	sd_sim_get_value(bare, "time", &t);
+	sd_sim_get_value(s, "time", &v);
+	if (t != v)
+		die("clone at time %f, not %f\n", t, v);
+
+	// a branch from the clone point with a different parameter
+	branch = sd_sim_clone(s, 0);
+	sd_sim_set_value(branch, "hares.birth_fraction", 2);
+
+	if (sd_sim_run_to_end(s) || sd_sim_run_to_end(full) ||
+	    sd_sim_run_to_end(bare) || sd_sim_run_to_end(branch))
+		die("run failed\n");
+
+	len = sd_sim_get_stepcount(s);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	sd_sim_get_series(s, "hares.hares", want, len);
+	sd_sim_get_series(full, "hares.hares", got, len);
+	for (int i = 0; i < len; i++) {
+		if (!same(want[i], got[i]))
+			die("full clone hares[%d]: %f != %f\n", i, got[i], want[i]);
+	}
+	sd_sim_get_series(bare, "hares.hares", got, len);
+	sd_sim_get_series(bare, "time", want, len);
+	if (got[0] != 0 || want[len-1] != 12)
+		die("bare clone has history or didn't finish\n");
+	sd_sim_get_series(s, "hares.hares", want, len);
+	if (!same(want[len-1], got[len-1]))
+		die("bare clone ended at %f, not %f\n", got[len-1], want[len-1]);
+	sd_sim_get_series(branch, "hares.hares", got, len);
+	if (same(want[len-1], got[len-1]))
+		die("branch didn't diverge from the original\n");
+
+	sd_sim_unref(s);
+	sd_sim_unref(full);
+	sd_sim_unref(bare);
+	sd_sim_unref(branch);
+	free(want);
+	free(got);
+	sd_project_unref(p);
+}
+
+void
+test_numa(void)
+{
+	int err;
+	size_t nruns, len;
+	Topology *t;
+	Arena *a;
+	double *x, **pinned, **plain;
+	SDProject *p;
+	SDSim *s;
+	SDExecutor *ex;
+	SDEnsembleRuns runs;
+	const char *bad[] = {"", ";", "3-1", "a", "0,,1", "0-99999"};
+	const char *params[] = {"area"};
+	const char *outputs[] = {"hares.hares"};
+	const int order[] = {0, 2, 1, 3, 0};
+	double values[8];
+
+	err = topology_parse("0-1; 2-3", &t);
+	if (err)
+		die("topology_parse failed: %d\n", err);
+	if (topology_len(t) != 2 || topology_ncpus(t) != 4)
+		die("topology has %zu nodes, %zu cpus\n", topology_len(t), topology_ncpus(t));
+	if (topology_node_of(t, 2) != 1 || topology_node_of(t, 1) != 0)
+		die("cpus on the wrong nodes\n");
+	for (size_t i = 0; i < sizeof(order)/sizeof(*order); i++) {
+		if (topology_cpu(t, i) != order[i])
+			die("thread %zu on cpu %d, not %d\n", i, topology_cpu(t, i), order[i]);
+	}
+	topology_free(t);
+	for (size_t i = 0; i < sizeof(bad)/sizeof(*bad); i++) {
+		if (topology_parse(bad[i], &t) == 0)
+			die("topology '%s' should fail\n", bad[i]);
+	}
+
+	a = arena_new();
+	for (size_t i = 0; i < 100; i++) {
+		size_t n = 1000 + i*997;
+		x = arena_alloc(a, n*sizeof(*x));
+		if (!x || (uintptr_t)x % 64)
+			die("arena_alloc %zu: %p\n", i, (void *)x);
+		for (size_t j = 0; j < n; j++) {
+			if (x[j] != 0)
+				die("arena memory not zeroed\n");
+			x[j] = i;
+		}
+	}
+	arena_free(a);
+
+	// a pinned executor gives the same results as the default one
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (p == NULL)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+	ex = sd_executor_new_pinned(2, "0");
+	if (!ex)
+		die("sd_executor_new_pinned failed\n");
+	if (sd_executor_new_pinned(2, "x"))
+		die("bad topology should fail\n");
+
+	s = sd_sim_new(p, NULL);
+	len = sd_sim_get_stepcount(s);
+	sd_sim_unref(s);
+	nruns = sizeof(values)/sizeof(*values);
+	pinned = calloc(nruns, sizeof(*pinned));
+	plain = calloc(nruns, sizeof(*plain));
+	for (size_t i = 0; i < nruns; i++) {
+		values[i] = 600 + 50*i;
+		pinned[i] = calloc(len, sizeof(double));
+		plain[i] = calloc(len, sizeof(double));
+	}
+	memset(&runs, 0, sizeof(runs));
+	runs.params = params;
+	runs.nparams = 1;
+	runs.values = values;
+	runs.outputs = outputs;
+	runs.noutputs = 1;
+
+	runs.results = plain;
+	if (sd_ensemble_run(p, NULL, &runs, nruns, 2))
+		die("ensemble_run failed\n");
+	sd_project_set_executor(p, ex);
+	runs.results = pinned;
+	if (sd_ensemble_run(p, NULL, &runs, nruns, 2))
+		die("pinned ensemble_run failed\n");
+	sd_project_set_executor(p, NULL);
+
+	for (size_t i = 0; i < nruns; i++) {
+		for (size_t k = 0; k < len; k++) {
+			if (!same(plain[i][k], pinned[i][k]))
+				die("run %zu hares[%zu]: %f != %f\n", i, k, pinned[i][k], plain[i][k]);
+		}
+		free(pinned[i]);
+		free(plain[i]);
+	}
+	free(pinned);
+	free(plain);
+	sd_executor_free(ex);
+	sd_project_unref(p);
+}
+
+static void
+snapshot_done(SDSim *s, int err, void *data)
+{
+	__atomic_store_n((int *)data, 1, __ATOMIC_RELEASE);
+}
+
+void
+test_snapshot(void)
+{
+	int err, done, time, hares, density, area, nreads;
+	size_t step, last, nvars;
+	SDProject *p;
+	SDSim *s;
+	SDRun *run;
+	double *row, v;
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	nvars = sd_sim_get_varcount(s);
+	row = calloc(nvars, sizeof(*row));
+	time = sd_sim_get_offset(s, "time");
+	hares = sd_sim_get_offset(s, "hares.hares");
+	density = sd_sim_get_offset(s, "hares.hare_density");
+	area = sd_sim_get_offset(s, "area");
+
+	if (sd_sim_read_snapshot(s, row, nvars, &step) != -1)
+		die("snapshot before any was published\n");
+	if (sd_sim_set_snapshot(s, -1) == 0)
+		die("negative snapshot interval should fail\n");
+	if (sd_sim_set_snapshot(s, 1))
+		die("set_snapshot failed\n");
+
+	// every snapshot read during the run is of a single step
+	done = 0;
+	nreads = 0;
+	last = 0;
+	run = sd_sim_run_async(s, 1e9, snapshot_done, &done);
+	if (!run)
+		die("run_async failed\n");
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		if (sd_sim_read_snapshot(s, row, nvars, &step) < 0)
+			continue;
+		if (step < last)
+			die("snapshot went back from step %zu to %zu\n", last, step);
+		last = step;
+		if (!same(row[time], 1 + step*.5))
+			die("step %zu snapshot at time %f\n", step, row[time]);
+		if (!same(row[density], row[hares]/row[area]))
+			die("step %zu snapshot is torn\n", step);
+		nreads++;
+	}
+	if (sd_run_wait(run))
+		die("run failed\n");
+
+	if (sd_sim_read_snapshot(s, row, nvars, &step) != (int)nvars)
+		die("read_snapshot failed\n");
+	if (step != (size_t)sd_sim_get_stepcount(s) - 1)
+		die("last snapshot from step %zu\n", step);
+	sd_sim_get_value(s, "hares.hares", &v);
+	if (!same(row[hares], v))
+		die("last snapshot hares %f, not %f\n", row[hares], v);
+
+	sd_sim_set_snapshot(s, 0);
+	if (sd_sim_read_snapshot(s, row, nvars, &step) != -1)
+		die("snapshot still published after being turned off\n");
+
+	free(row);
+	sd_sim_unref(s);
+	sd_project_unref(p);
+}
+
+// read_shm copies the values out of a snapshot the way another
+// process would, returning the step they're from or -1.
+static long
+read_shm(const SDSnapshotHeader *hdr, double *values)
+{
+	const double *src;
+	uint32_t seq;
+	uint64_t step;
+
+	for (;;) {
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (!seq)
+			return -1;
+		if (seq & 1)
+			continue;
+		src = (const double *)((const char *)hdr + hdr->values);
+		step = __atomic_load_n(&hdr->step, __ATOMIC_ACQUIRE);
+		for (size_t i = 0; i < hdr->nvars; i++)
+			__atomic_load(&src[i], &values[i], __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+			return step;
+	}
+}
+
+void
+test_snapshot_shm(void)
+{
+	int err, fd, done, nvars, hares, density, area;
+	char name[64];
+	const char *names[32], *shm_name;
+	struct stat st;
+	SDProject *p;
+	SDSim *s, *s2;
+	SDRun *run;
+	SDSnapshotHeader *hdr;
+	double row[32], v;
+	long step;
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	nvars = sd_sim_get_varcount(s);
+	hares = sd_sim_get_offset(s, "hares.hares");
+	density = sd_sim_get_offset(s, "hares.hare_density");
+	area = sd_sim_get_offset(s, "area");
+
+	snprintf(name, sizeof(name), "/sd-test-%d", (int)getpid());
+	if (sd_sim_set_snapshot_shm(s, name, 0) == 0)
+		die("snapshot interval of 0 should fail\n");
+	if (sd_sim_set_snapshot_shm(s, name, 1))
+		die("set_snapshot_shm failed\n");
+
+	// map it the way an external monitor would
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		die("couldn't open '%s'\n", name);
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		die("couldn't map '%s'\n", name);
+	if (read_shm(hdr, row) != -1)
+		die("snapshot before any was published\n");
+
+	done = 0;
+	run = sd_sim_run_async(s, 1e9, snapshot_done, &done);
+	if (!run)
+		die("run_async failed\n");
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		step = read_shm(hdr, row);
+		if (step >= 0 && !same(row[density], row[hares]/row[area]))
+			die("step %ld snapshot is torn\n", step);
+	}
+	if (sd_run_wait(run))
+		die("run failed\n");
+
+	if (memcmp(hdr->magic, SD_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0)
+		die("bad magic\n");
+	if ((int)hdr->nvars != nvars || (int)hdr->nsteps != sd_sim_get_stepcount(s))
+		die("header has %u vars, %llu steps\n", hdr->nvars, (unsigned long long)hdr->nsteps);
+	if ((size_t)st.st_size < hdr->values + nvars*sizeof(double) || hdr->values % 8)
+		die("values at bad offset %llu\n", (unsigned long long)hdr->values);
+	step = read_shm(hdr, row);
+	if (step != sd_sim_get_stepcount(s) - 1)
+		die("last snapshot from step %ld\n", step);
+	sd_sim_get_value(s, "hares.hares", &v);
+	if (!same(row[hares], v))
+		die("last snapshot hares %f, not %f\n", row[hares], v);
+
+	// names are in offset order
+	sd_sim_get_varnames(s, names, nvars);
+	shm_name = (const char *)hdr + hdr->names;
+	for (int i = 0; i < nvars; i++) {
+		int off = sd_sim_get_offset(s, names[i]);
+		const char *n = shm_name;
+		for (int j = 0; j < off; j++)
+			n += strlen(n) + 1;
+		if (strcmp(n, names[i]) != 0)
+			die("name at offset %d is '%s', not '%s'\n", off, n, names[i]);
+	}
+
+	// the object goes away with the snapshot, but our mapping
+	// still holds the last values
+	sd_sim_set_snapshot(s, 0);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd >= 0)
+		die("'%s' still exists\n", name);
+	if (read_shm(hdr, row) != sd_sim_get_stepcount(s) - 1)
+		die("mapping lost its values\n");
+	munmap(hdr, st.st_size);
+
+	// setting the same name again, here or from another sim,
+	// leaves the newest object in place
+	if (sd_sim_set_snapshot_shm(s, name, 1) || sd_sim_set_snapshot_shm(s, name, 2))
+		die("set_snapshot_shm twice failed\n");
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		die("'%s' gone after setting it twice\n", name);
+	close(fd);
+	s2 = sd_sim_new(p, NULL);
+	if (sd_sim_set_snapshot_shm(s2, name, 1))
+		die("set_snapshot_shm on a second sim failed\n");
+	sd_sim_unref(s);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		die("'%s' gone after the first sim was freed\n", name);
+	close(fd);
+	sd_sim_unref(s2);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd >= 0)
+		die("'%s' outlived its sim\n", name);
+
+	sd_project_unref(p);
+}
+
+void
+test_sweep(void)
+{
+	int err, len;
+	size_t npoints;
+	SDProject *p;
+	SDSweep *sw;
+	SDSim *s;
+	double *results, *series, *times, point[2], want[4];
+	const double areas[] = {600, 1000, 1400};
+	const double fractions[] = {1.1, 1.25};
+	const double list[] = {800, 1.3, 1200, 1.2};
+	const char *names[] = {"area", "hares.birth_fraction"};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	len = sd_sim_get_stepcount(s);
+	sd_sim_unref(s);
+	series = calloc(len, sizeof(*series));
+	times = calloc(len, sizeof(*times));
+	results = calloc(6*4, sizeof(*results));
+
+	sw = sd_sweep_new();
+	sd_sweep_add_axis(sw, "area", areas, 3);
+	sd_sweep_add_axis(sw, "hares.birth_fraction", fractions, 2);
+	sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_FINAL);
+	sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_MAX);
+	sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_PEAK_TIME);
+	sd_sweep_add_output(sw, "lynxes.lynxes", SD_SUMMARY_MIN);
+	if (sd_sweep_set_list(sw, names, 2, list, 2) == 0)
+		die("list on a grid should fail\n");
+	if (sd_sweep_get_pointcount(sw) != 6)
+		die("grid of %zu points\n", sd_sweep_get_pointcount(sw));
+	sd_sweep_get_point(sw, 3, point);
+	if (point[0] != 1000 || point[1] != 1.25)
+		die("point 3 is (%f, %f)\n", point[0], point[1]);
+
+	if (sd_sweep_run(p, NULL, sw, results, 2))
+		die("sweep_run failed\n");
+
+	// every point matches a run of its own
+	for (size_t i = 0; i < 6; i++) {
+		sd_sweep_get_point(sw, i, point);
+		s = sd_sim_new(p, NULL);
+		sd_sim_set_value(s, "area", point[0]);
+		sd_sim_set_value(s, "hares.birth_fraction", point[1]);
+		sd_sim_run_to_end(s);
+		sd_sim_get_series(s, "time", times, len);
+		sd_sim_get_series(s, "hares.hares", series, len);
+		want[0] = series[len-1];
+		want[1] = series[0];
+		want[2] = times[0];
+		for (int j = 1; j < len; j++) {
+			if (series[j] > want[1]) {
+				want[1] = series[j];
+				want[2] = times[j];
+			}
+		}
+		sd_sim_get_series(s, "lynxes.lynxes", series, len);
+		want[3] = series[0];
+		for (int j = 1; j < len; j++)
+			want[3] = fmin(want[3], series[j]);
+		for (size_t j = 0; j < 4; j++) {
+			if (!same(results[i*4 + j], want[j]))
+				die("point %zu output %zu: %f != %f\n", i, j, results[i*4 + j], want[j]);
+		}
+		sd_sim_unref(s);
+	}
+	sd_sweep_unref(sw);
+
+	sw = sd_sweep_new();
+	sd_sweep_set_list(sw, names, 2, list, 2);
+	sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_FINAL);
+	if (sd_sweep_add_axis(sw, "area", areas, 3) == 0)
+		die("grid axis on a list should fail\n");
+	if (sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_LEN) == 0)
+		die("bad summary should fail\n");
+	if (sd_sweep_run(p, NULL, sw, results, 0))
+		die("list sweep_run failed\n");
+	s = sd_sim_new(p, NULL);
+	sd_sim_set_value(s, "area", 1200);
+	sd_sim_set_value(s, "hares.birth_fraction", 1.2);
+	sd_sim_run_to_end(s);
+	sd_sim_get_value(s, "hares.hares", &want[0]);
+	if (!same(results[1], want[0]))
+		die("list point 1: %f != %f\n", results[1], want[0]);
+	sd_sim_unref(s);
+
+	// outputs and params are checked before anything runs
+	sd_sweep_add_output(sw, "no_such_var", SD_SUMMARY_MIN);
+	if (sd_sweep_run(p, NULL, sw, results, 0) == 0)
+		die("unknown output should fail\n");
+	sd_sweep_unref(sw);
+	sw = sd_sweep_new();
+	sd_sweep_add_axis(sw, "hares.hare_density", areas, 3);
+	sd_sweep_add_output(sw, "hares.hares", SD_SUMMARY_FINAL);
+	if (sd_sweep_run(p, NULL, sw, results, 0) == 0)
+		die("sweeping a non-constant should fail\n");
+	sd_sweep_unref(sw);
+
+	sw = sd_sweep_open("models/hares_sweep.csv", &err);
+	if (!sw)
+		die("couldn't open 'models/hares_sweep.csv': %s\n", sd_error_str(err));
+	npoints = sd_sweep_get_pointcount(sw);
+	if (npoints != 12 || sd_sweep_get_paramcount(sw) != 2 ||
+	    sd_sweep_get_outputcount(sw) != 4)
+		die("spec has %zu points\n", npoints);
+	sd_sweep_get_point(sw, 5, point);
+	if (point[0] != 1000 || point[1] != 1.25)
+		die("spec point 5 is (%f, %f)\n", point[0], point[1]);
+	sd_sweep_unref(sw);
+	if (sd_sweep_open("models/hares_and_lynxes.xmile", &err) || err != SD_ERR_BAD_FILE)
+		die("a model isn't a sweep spec\n");
+
+	free(series);
+	free(times);
+	free(results);
+	sd_project_unref(p);
+}
+
+void
+test_calibrate(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	SDCalibration cal;
+	SDCalibrationStats stats;
+	SDObserved obs;
+	double series[23], times[12], values[12], weights[12], best[2], trace[64];
+	const char *params[] = {"hares.birth_fraction", "area"};
+	const double lower[] = {1, 500}, upper[] = {2, 2000}, initial[] = {1.6, 1500};
+	const double truth[] = {1.25, 1000};
+	const SDCalibrateMethod methods[] = {SD_CALIBRATE_NELDER_MEAD, SD_CALIBRATE_POWELL, SD_CALIBRATE_DE};
+	const double point[] = {1.5, 1200};
+	const char *stiff_params[] = {"slow_time"};
+	const double stiff_lower[] = {5}, stiff_upper[] = {20}, stiff_point[] = {7};
+	const char *diverge_params[] = {"birth_rate"};
+	const double diverge_lower[] = {0}, diverge_upper[] = {100};
+	double want;
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	// observe hares once a time unit, from a run at known values
+	s = sd_sim_new(p, NULL);
+	sd_sim_run_to_end(s);
+	sd_sim_get_series(s, "hares.hares", series, 23);
+	for (size_t i = 0; i < 12; i++) {
+		times[i] = 1 + i;
+		values[i] = series[2*i];
+		weights[i] = 1 + i%3;
+	}
+	sd_sim_unref(s);
+
+	memset(&obs, 0, sizeof(obs));
+	obs.name = "hares.hares";
+	obs.times = times;
+	obs.values = values;
+	obs.len = 12;
+
+	memset(&cal, 0, sizeof(cal));
+	cal.params = params;
+	cal.nparams = 2;
+	cal.lower = lower;
+	cal.upper = upper;
+	cal.initial = initial;
+	cal.observed = &obs;
+	cal.nobserved = 1;
+	cal.tol = 1e-12;
+	cal.max_evals = 4000;
+	cal.seed = 7;
+
+	for (size_t m = 0; m < 3; m++) {
+		memset(&stats, 0, sizeof(stats));
+		stats.trace = trace;
+		stats.trace_cap = 64;
+		cal.method = methods[m];
+		cal.loss = m == 1 ? SD_LOSS_LOG : SD_LOSS_SSE;
+		if (sd_calibrate(p, NULL, &cal, best, &stats, 2))
+			die("calibrate with method %zu failed\n", m);
+		for (size_t i = 0; i < 2; i++) {
+			if (fabs(best[i] - truth[i]) > 1e-2*truth[i])
+				die("method %zu: %s is %f, not %f\n", m, params[i], best[i], truth[i]);
+		}
+		if (!stats.nevals || !stats.niters || !stats.trace_len || stats.trace_len > 64)
+			die("method %zu: stats not filled in\n", m);
+		if (stats.trace[stats.trace_len-1] < stats.loss)
+			die("method %zu: trace ends at %f, below %f\n", m, stats.trace[stats.trace_len-1], stats.loss);
+		for (size_t i = 1; i < stats.trace_len; i++) {
+			if (stats.trace[i] > stats.trace[i-1])
+				die("method %zu: best loss went up\n", m);
+		}
+	}
+
+	// the loss at the truth is 0, however the run is weighted
+	cal.lower = truth;
+	cal.upper = truth;
+	cal.initial = NULL;
+	cal.loss = SD_LOSS_WEIGHTED;
+	cal.method = SD_CALIBRATE_NELDER_MEAD;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 0) == 0)
+		die("weighted loss without weights should fail\n");
+	obs.weights = weights;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 0))
+		die("calibrate with fixed params failed\n");
+	if (stats.loss != 0 || !stats.converged)
+		die("loss at the truth is %f\n", stats.loss);
+
+	// descriptions are checked before anything runs
+	params[1] = "no_such_var";
+	if (sd_calibrate(p, NULL, &cal, best, NULL, 0) == 0)
+		die("unknown param should fail\n");
+	params[1] = "area";
+	times[11] = 13;
+	if (sd_calibrate(p, NULL, &cal, best, NULL, 0) == 0)
+		die("observation after the run should fail\n");
+	times[11] = 12;
+	values[0] = 0;
+	cal.loss = SD_LOSS_LOG;
+	if (sd_calibrate(p, NULL, &cal, best, NULL, 0) == 0)
+		die("log loss of a zero observation should fail\n");
+	values[0] = series[0];
+
+	// pruned runs give the loss of a full run at the same point
+	cal.loss = SD_LOSS_SSE;
+	cal.lower = cal.upper = point;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 0))
+		die("calibrate at a point failed\n");
+	want = sse_at(p, NULL, params, point, 2, &obs);
+	if (!(want > 0) || fabs(stats.loss - want) > 1e-9*want)
+		die("pruned loss %g, full run's %g\n", stats.loss, want);
+
+	sd_project_unref(p);
+
+	// backward Euler models are run in full, and sampled at save
+	// steps
+	p = sd_project_open("models/stiff.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/stiff.xmile': %s\n", sd_error_str(err));
+	s = sd_sim_new(p, NULL);
+	sd_sim_run_to_end(s);
+	sd_sim_get_series(s, "slow", series, 23);
+	for (size_t i = 0; i < 10; i++) {
+		times[i] = 2 + i;
+		values[i] = series[4 + 2*i];
+	}
+	sd_sim_unref(s);
+	obs.name = "slow";
+	obs.weights = NULL;
+	obs.len = 10;
+	cal.params = stiff_params;
+	cal.nparams = 1;
+	cal.lower = stiff_lower;
+	cal.upper = stiff_upper;
+	cal.method = SD_CALIBRATE_NELDER_MEAD;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 2))
+		die("calibrate backward Euler failed\n");
+	if (fabs(best[0] - 10) > 1e-3)
+		die("slow_time is %f, not 10\n", best[0]);
+	cal.lower = cal.upper = stiff_point;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 0))
+		die("calibrate backward Euler at a point failed\n");
+	want = sse_at(p, NULL, stiff_params, stiff_point, 1, &obs);
+	if (!(want > 0) || fabs(stats.loss - want) > 1e-9*want)
+		die("backward Euler loss %g, full run's %g\n", stats.loss, want);
+	sd_project_unref(p);
+
+	// runs that diverge are counted and lose.  Past the first
+	// generation DE stops trials once they're worse than their
+	// parents; if a stopped trial could win, the fit would be off.
+	p = sd_project_open("models/diverge.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/diverge.xmile': %s\n", sd_error_str(err));
+	for (size_t i = 0; i < 10; i++) {
+		times[i] = i < 9 ? i + 1 : 200;
+		values[i] = pow(1.01, times[i]);
+	}
+	obs.name = "population";
+	cal.params = diverge_params;
+	cal.lower = diverge_lower;
+	cal.upper = diverge_upper;
+	cal.initial = NULL;
+	cal.method = SD_CALIBRATE_DE;
+	cal.population = 20;
+	cal.max_evals = 2000;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 2))
+		die("calibrate with diverging runs failed\n");
+	if (fabs(best[0] - .01) > 1e-6)
+		die("birth_rate is %f, not .01\n", best[0]);
+	if (!stats.ndiverged || stats.ndiverged >= stats.nevals/2)
+		die("%zu of %zu runs diverged\n", stats.ndiverged, stats.nevals);
+	cal.lower = cal.upper = diverge_upper;
+	cal.method = SD_CALIBRATE_NELDER_MEAD;
+	if (sd_calibrate(p, NULL, &cal, best, &stats, 0))
+		die("calibrate at a diverging point failed\n");
+	if (stats.loss != INFINITY || !stats.nevals || stats.ndiverged != stats.nevals)
+		die("%zu of %zu runs at a diverging point diverged\n", stats.ndiverged, stats.nevals);
+	sd_project_unref(p);
+}
+
+// sse_at simulates model with params set to values, and returns the
+// sum of squared errors between it and obs, which must be observed at
+// save steps.
+double
+sse_at(SDProject *p, const char *model, const char **params, const double *values, size_t n, const SDObserved *obs)
+{
+	SDSim *s = sd_sim_new(p, model);
+	double *t, *v, sse = 0;
+	int len;
+
+	for (size_t i = 0; i < n; i++)
+		sd_sim_set_value(s, params[i], values[i]);
+	sd_sim_run_to_end(s);
+	len = sd_sim_get_stepcount(s);
+	t = calloc(len, sizeof(*t));
+	v = calloc(len, sizeof(*v));
+	sd_sim_get_series(s, "time", t, len);
+	sd_sim_get_series(s, obs->name, v, len);
+	for (size_t k = 0; k < obs->len; k++) {
+		int i;
+		for (i = 0; i < len && !same(t[i], obs->times[k]); i++)
+			;
+		if (i == len)
+			die("%f isn't a save step\n", obs->times[k]);
+		sse += (v[i] - obs->values[k])*(v[i] - obs->values[k]);
+	}
+	free(t);
+	free(v);
+	sd_sim_unref(s);
+	return sse;
+}
+
+void
+test_sens(void)
+{
+	int err, len;
+	SDProject *p;
+	SDSens *d;
+	SDSim *s;
+	double *want, *got, *lo, *hi;
+	const char *params[] = {"hares.birth_fraction", "area"};
+	const char *outputs[] = {"hares.hares", "lynxes.lynxes", "hares.hares_killed_per_lynx"};
+	const double values[] = {1.1, 900};
+	const char *bad[] = {"hares.births"};
+	const char *harvest[] = {"size_of_one_time_lynx_harvest"};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	if (sd_sens_new(p, NULL, bad, 1))
+		die("sensitivity to a flow should fail\n");
+	d = sd_sens_new(p, NULL, params, 2);
+	if (!d)
+		die("sens_new failed\n");
+	if (sd_sens_get_paramcount(d) != 2)
+		die("paramcount %d\n", sd_sens_get_paramcount(d));
+	for (size_t i = 0; i < 2; i++)
+		sd_sens_set_value(d, params[i], values[i]);
+	sd_sens_run_to_end(d);
+
+	len = sd_sens_get_stepcount(d);
+	want = calloc(len, sizeof(*want));
+	got = calloc(len, sizeof(*got));
+	lo = calloc(len, sizeof(*lo));
+	hi = calloc(len, sizeof(*hi));
+
+	// values match a plain run
+	s = sd_sim_new(p, NULL);
+	for (size_t i = 0; i < 2; i++)
+		sd_sim_set_value(s, params[i], values[i]);
+	sd_sim_run_to_end(s);
+	for (size_t j = 0; j < 3; j++) {
+		sd_sim_get_series(s, outputs[j], want, len);
+		if (sd_sens_get_series(d, outputs[j], got, len) != len)
+			die("get_series %s failed\n", outputs[j]);
+		for (int k = 0; k < len; k++) {
+			if (!same(got[k], want[k]))
+				die("%s[%d]: %f != %f\n", outputs[j], k, got[k], want[k]);
+		}
+	}
+	sd_sim_unref(s);
+
+	// tangents match central differences
+	for (size_t i = 0; i < 2; i++) {
+		double h = 1e-6*values[i];
+		for (size_t j = 0; j < 3; j++) {
+			for (int dir = 0; dir < 2; dir++) {
+				s = sd_sim_new(p, NULL);
+				for (size_t k = 0; k < 2; k++)
+					sd_sim_set_value(s, params[k], values[k] + (k == i ? (dir ? h : -h) : 0));
+				sd_sim_run_to_end(s);
+				sd_sim_get_series(s, outputs[j], dir ? hi : lo, len);
+				sd_sim_unref(s);
+			}
+			sd_sens_get_sensitivity(d, outputs[j], i, got, len);
+			for (int k = 0; k < len; k++) {
+				double fd = (hi[k] - lo[k])/(2*h);
+				if (fabs(got[k] - fd) > 1e-4*(fabs(fd) + 1))
+					die("d%s/d%s[%d]: %f != %f\n", outputs[j], params[i], k, got[k], fd);
+			}
+		}
+	}
+	sd_sens_get_sensitivity(d, "area", 1, got, len);
+	if (got[0] != 1 || got[len-1] != 1)
+		die("d area/d area is %f\n", got[len-1]);
+	if (sd_sens_get_sensitivity(d, "area", 2, got, len) >= 0)
+		die("out of range param should fail\n");
+	sd_sens_unref(d);
+
+	// the lynx harvest is a pulse, which moves with its magnitude
+	// while it fires, even when that magnitude is 0
+	d = sd_sens_new(p, NULL, harvest, 1);
+	if (!d)
+		die("sens_new(harvest) failed\n");
+	sd_sens_set_value(d, harvest[0], 0);
+	sd_sens_run_to_end(d);
+	sd_sens_get_sensitivity(d, "lynxes.lynxes", 0, got, len);
+	for (int dir = 0; dir < 2; dir++) {
+		s = sd_sim_new(p, NULL);
+		sd_sim_set_value(s, harvest[0], dir ? 1 : -1);
+		sd_sim_run_to_end(s);
+		sd_sim_get_series(s, "lynxes.lynxes", dir ? hi : lo, len);
+		sd_sim_unref(s);
+	}
+	for (int k = 0; k < len; k++) {
+		double fd = (hi[k] - lo[k])/2;
+		if (fabs(got[k] - fd) > 1e-4*(fabs(fd) + 1))
+			die("dlynxes/dharvest[%d]: %f != %f\n", k, got[k], fd);
+	}
+	if (got[len-1] == 0)
+		die("the harvest doesn't move lynxes\n");
+
+	free(want);
+	free(got);
+	free(lo);
+	free(hi);
+	sd_sens_unref(d);
+	sd_project_unref(p);
+}
+
+void
+test_adjoint(void)
+{
+	int err;
+	SDProject *p;
+	SDSim *s;
+	SDAdjoint *a;
+	SDCalibration cal;
+	SDCalibrationStats stats;
+	SDObserved obs[2];
+	double series[23], times[8], hares[8], lynxes[8], weights[8];
+	double values[5], grad[5], best[5], lo, hi, obj, f;
+	const char *params[] = {"hares.birth_fraction", "area", "lynxes.birth_fraction", "hares.hares", "size_of_one_time_lynx_harvest"};
+	const SDLoss losses[] = {SD_LOSS_SSE, SD_LOSS_WEIGHTED, SD_LOSS_LOG};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	// observations off the model's own, some between time steps
+	s = sd_sim_new(p, NULL);
+	sd_sim_run_to_end(s);
+	sd_sim_get_series(s, "hares.hares", series, 23);
+	for (size_t i = 0; i < 8; i++) {
+		times[i] = 1 + i*1.5 + (i%2)*.25;
+		hares[i] = 1.1*series[(size_t)((times[i] - 1)/.5)];
+		weights[i] = 1 + i%3;
+	}
+	sd_sim_get_series(s, "lynxes.lynxes", series, 23);
+	for (size_t i = 0; i < 8; i++)
+		lynxes[i] = .9*series[(size_t)((times[i] - 1)/.5)];
+	for (size_t i = 0; i < 5; i++)
+		sd_sim_get_value(s, params[i], &values[i]);
+	sd_sim_unref(s);
+
+	memset(obs, 0, sizeof(obs));
+	obs[0].name = "hares.hares";
+	obs[0].times = times;
+	obs[0].values = hares;
+	obs[0].weights = weights;
+	obs[0].len = 8;
+	obs[1].name = "lynxes.lynxes";
+	obs[1].times = times;
+	obs[1].values = lynxes;
+	obs[1].len = 8;
+
+	if (sd_adjoint_new(p, NULL, params, 5, obs, 2, SD_LOSS_LEN))
+		die("bad loss should fail\n");
+	params[0] = "hares.births";
+	if (sd_adjoint_new(p, NULL, params, 5, obs, 2, SD_LOSS_SSE))
+		die("a flow as a param should fail\n");
+	params[0] = "hares.birth_fraction";
+
+	for (size_t m = 0; m < 3; m++) {
+		obs[1].weights = losses[m] == SD_LOSS_WEIGHTED ? weights : NULL;
+		a = sd_adjoint_new(p, NULL, params, 5, obs, 2, losses[m]);
+		if (!a)
+			die("adjoint_new failed\n");
+		values[0] = 1.2;
+		if (sd_adjoint_eval(a, values, &obj, grad))
+			die("adjoint_eval failed\n");
+
+		// the objective is the calibration loss
+		memset(&cal, 0, sizeof(cal));
+		cal.params = params;
+		cal.nparams = 5;
+		cal.lower = values;
+		cal.upper = values;
+		cal.observed = obs;
+		cal.nobserved = 2;
+		cal.loss = losses[m];
+		if (sd_calibrate(p, NULL, &cal, best, &stats, 1))
+			die("calibrate failed\n");
+		if (!same(obj, stats.loss))
+			die("loss %zu: objective %f != %f\n", m, obj, stats.loss);
+
+		// the gradient matches central differences
+		for (size_t i = 0; i < 5; i++) {
+			double h = 1e-6*values[i], v = values[i];
+			values[i] = v + h;
+			sd_adjoint_eval(a, values, &hi, best);
+			values[i] = v - h;
+			sd_adjoint_eval(a, values, &lo, best);
+			values[i] = v;
+			f = (hi - lo)/(2*h);
+			if (fabs(grad[i] - f) > 1e-4*fabs(f) + 1e-8*fabs(obj))
+				die("loss %zu: d/d%s is %g, not %g\n", m, params[i], grad[i], f);
+		}
+
+		// the harvest pulse still fires at a magnitude of 0
+		f = values[4];
+		values[4] = 0;
+		sd_adjoint_eval(a, values, &obj, grad);
+		values[4] = 1;
+		sd_adjoint_eval(a, values, &hi, best);
+		values[4] = -1;
+		sd_adjoint_eval(a, values, &lo, best);
+		values[4] = f;
+		f = (hi - lo)/2;
+		if (f == 0 || fabs(grad[4] - f) > 1e-4*fabs(f) + 1e-8*fabs(obj))
+			die("loss %zu: d/dharvest at 0 is %g, not %g\n", m, grad[4], f);
+		sd_adjoint_unref(a);
+	}
+
+	sd_project_unref(p);
+}
+
+void
+gsa_progress(void *data, size_t nsamples, const double *results)
+{
+	size_t *done = data;
+
+	if (nsamples <= *done)
+		die("progress went from %zu to %zu samples\n", *done, nsamples);
+	*done = nsamples;
+}
+
+void
+test_gsa(void)
+{
+	int err;
+	size_t nresults, done;
+	SDProject *p;
+	SDGsa gsa;
+	double *results, *again, *r;
+	const char *params[] = {"hares.hares", "hares.birth_fraction", "size_of_one_time_lynx_harvest"};
+	const char *outputs[] = {"hares.hares", "lynxes.lynxes"};
+	const double lower[] = {40000, 1, 0}, upper[] = {60000, 1.5, 200};
+	double times[] = {1, 3, 10};
+
+	err = 0;
+	p = sd_project_open("models/hares_and_lynxes.xmile", &err);
+	if (!p)
+		die("couldn't open 'models/hares_and_lynxes.xmile': %s\n",
+		    sd_error_str(err));
+
+	nresults = 3*2*3*SD_GSA_STAT_LEN;
+	results = calloc(nresults, sizeof(*results));
+	again = calloc(nresults, sizeof(*again));
+
+	memset(&gsa, 0, sizeof(gsa));
+	gsa.params = params;
+	gsa.nparams = 3;
+	gsa.lower = lower;
+	gsa.upper = upper;
+	gsa.outputs = outputs;
+	gsa.noutputs = 2;
+	gsa.times = times;
+	gsa.ntimes = 3;
+	gsa.seed = 42;
+
+	// at time 1, hares.hares is its initial value, so moving it by
+	// a step of the grid moves the output by as much.
+	gsa.method = SD_GSA_MORRIS;
+	gsa.samples = 40;
+	if (sd_gsa_run(p, NULL, &gsa, results, 2))
+		die("morris failed\n");
+	r = &results[((0*2 + 0)*3 + 0)*SD_GSA_STAT_LEN];
+	if (!same(r[SD_GSA_MU_STAR], 20000) || fabs(r[SD_GSA_SIGMA]) > 1e-6 || !isnan(r[SD_GSA_FIRST]))
+		die("morris hares at time 1: mu* %f sigma %f\n", r[SD_GSA_MU_STAR], r[SD_GSA_SIGMA]);
+	for (size_t i = 1; i < 3; i++) {
+		r = &results[((i*2 + 0)*3 + 0)*SD_GSA_STAT_LEN];
+		if (r[SD_GSA_MU_STAR] != 0)
+			die("morris %s moves hares at time 1\n", params[i]);
+	}
+	// the harvest happens at time 4
+	for (size_t j = 0; j < 2; j++) {
+		r = &results[((2*2 + j)*3 + 1)*SD_GSA_STAT_LEN];
+		if (r[SD_GSA_MU_STAR] != 0)
+			die("morris harvest moves %s at time 3\n", outputs[j]);
+	}
+	r = &results[((2*2 + 1)*3 + 2)*SD_GSA_STAT_LEN];
+	if (!(r[SD_GSA_MU_STAR] > 0))
+		die("morris harvest doesn't move lynxes at time 10\n");
+
+	// a step on an odd grid would leave the unit cube
+	gsa.levels = 3;
+	if (sd_gsa_run(p, NULL, &gsa, results, 2) == 0)
+		die("morris with 3 levels should fail\n");
+	gsa.levels = 6;
+	if (sd_gsa_run(p, NULL, &gsa, results, 2))
+		die("morris with 6 levels failed\n");
+	r = &results[((0*2 + 0)*3 + 0)*SD_GSA_STAT_LEN];
+	if (!same(r[SD_GSA_MU_STAR], 20000) || fabs(r[SD_GSA_SIGMA]) > 1e-6)
+		die("morris hares with 6 levels: mu* %f sigma %f\n", r[SD_GSA_MU_STAR], r[SD_GSA_SIGMA]);
+	gsa.levels = 0;
+
+	gsa.method = SD_GSA_SOBOL;
+	gsa.samples = 600;
+	gsa.progress = gsa_progress;
+	gsa.progress_data = &done;
+	done = 0;
+	if (sd_gsa_run(p, NULL, &gsa, results, 0))
+		die("sobol failed\n");
+	if (done != 600)
+		die("progress ended at %zu samples\n", done);
+	r = &results[((0*2 + 0)*3 + 0)*SD_GSA_STAT_LEN];
+	if (fabs(r[SD_GSA_FIRST] - 1) > .15 || fabs(r[SD_GSA_TOTAL] - 1) > .15 || !isnan(r[SD_GSA_MU]))
+		die("sobol hares at time 1: %f %f\n", r[SD_GSA_FIRST], r[SD_GSA_TOTAL]);
+	for (size_t i = 1; i < 3; i++) {
+		r = &results[((i*2 + 0)*3 + 0)*SD_GSA_STAT_LEN];
+		if (r[SD_GSA_FIRST] != 0 || r[SD_GSA_TOTAL] != 0)
+			die("sobol %s moves hares at time 1\n", params[i]);
+	}
+	r = &results[((2*2 + 0)*3 + 1)*SD_GSA_STAT_LEN];
+	if (r[SD_GSA_TOTAL] != 0)
+		die("sobol harvest moves hares at time 3\n");
+	for (size_t i = 0; i < nresults; i += SD_GSA_STAT_LEN) {
+		if (results[i + SD_GSA_TOTAL] < 0 || results[i + SD_GSA_TOTAL] > 1.5)
+			die("sobol total index %f\n", results[i + SD_GSA_TOTAL]);
+	}
+
+	// points come from the seed, not the thread that runs them
+	gsa.progress = NULL;
+	if (sd_gsa_run(p, NULL, &gsa, again, 1))
+		die("single-threaded sobol failed\n");
+	for (size_t i = 0; i < nresults; i++) {
+		if (!(results[i] == again[i] || (isnan(results[i]) && isnan(again[i]))))
+			die("result %zu differs between runs: %f != %f\n", i, results[i], again[i]);
+	}
+
+	times[1] = 0;
+	if (sd_gsa_run(p, NULL, &gsa, results, 0) == 0)
+		die("times out of order should fail\n");
+	times[1] = 3;
+	params[1] = "hares.births";
+	if (sd_gsa_run(p, NULL, &gsa, results, 0) == 0)
+		die("a flow as a param should fail\n");
+
+	free(results);
+	free(again);
+	sd_project_unref(p);
+}
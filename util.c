@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <math.h>
 
 #include "utf.h"
 #include "sd.h"
@@ -207,6 +208,34 @@ lookup(Table *t, double index)
 	return 0;
 }
 
+double
+lookup_slope(Table *t, double index)
+{
+	size_t len = t->len;
+	double *x = t->x;
+	double *y = t->y;
+	size_t low = 1, high, mid;
+
+	if (len < 2 || index < x[0] || index > x[len-1])
+		return 0;
+
+	// find the first point past index, as lookup does; at a point
+	// this takes the segment to its right, except at the end.
+	high = len - 1;
+	while (low < high) {
+		mid = low + (high-low)/2;
+		if (x[mid] <= index)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	size_t i = low;
+	if (x[i] == x[i-1])
+		return 0;
+	return (y[i] - y[i-1])/(x[i] - x[i-1]);
+}
+
 char *
 canonicalize(const char *n)
 {
@@ -233,3 +262,22 @@ canonicalize(const char *n)
 	// FIXME: nbsp - 00A0 / C2A0
 	return result;
 }
+
+
+// rng_next returns the next value of a splitmix64 sequence, so that
+// runs with the same seed are repeatable.
+uint64_t
+rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+double
+rng_uniform(uint64_t *state)
+{
+	return (rng_next(state) >> 11)*0x1.0p-53;
+}
@@ -543,6 +543,17 @@ model_from_node_builder(NodeBuilder *nb)
 	if (val)
 		m->name = strdup(val);
 
+	NodeBuilder *nbspecs = node_builder_get_first_child(nb, "sim_specs");
+	if (nbspecs) {
+		NodeBuilder *nbdt = node_builder_get_first_child(nbspecs, "dt");
+		if (nbdt && nbdt->content) {
+			m->dt = strtod(nbdt->content, NULL);
+			val = node_builder_get_attr(nbdt, "reciprocal");
+			if (val && strcmp(val, "true") == 0)
+				m->dt = 1/m->dt;
+		}
+	}
+
 	NodeBuilder *nbvars = node_builder_get_first_child(nb, "variables");;
 	if (nbvars) {
 		for (size_t i = 0; i < nbvars->children.len; i++) {